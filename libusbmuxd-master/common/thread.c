@@ -22,6 +22,10 @@
 #ifdef HAVE_CONFIG_H
 #include <config.h>
 #endif
+#include <errno.h>
+#ifndef WIN32
+#include <sys/time.h>
+#endif
 #include "thread.h"
 
 int thread_new(THREAD_T *thread, thread_func_t thread_func, void* data)
@@ -123,6 +127,55 @@ void mutex_unlock(mutex_t* mutex)
 #endif
 }
 
+void cond_init(cond_t* cond)
+{
+#ifdef WIN32
+	InitializeConditionVariable(cond);
+#else
+	pthread_cond_init(cond, NULL);
+#endif
+}
+
+void cond_destroy(cond_t* cond)
+{
+#ifdef WIN32
+	/* nothing to do */
+#else
+	pthread_cond_destroy(cond);
+#endif
+}
+
+void cond_broadcast(cond_t* cond)
+{
+#ifdef WIN32
+	WakeAllConditionVariable(cond);
+#else
+	pthread_cond_broadcast(cond);
+#endif
+}
+
+int cond_wait_timeout(cond_t* cond, mutex_t* mutex, unsigned int timeout_ms)
+{
+#ifdef WIN32
+	if (!SleepConditionVariableCS(cond, mutex, timeout_ms)) {
+		return (GetLastError() == ERROR_TIMEOUT) ? -ETIMEDOUT : -1;
+	}
+	return 0;
+#else
+	struct timeval now;
+	struct timespec to;
+	gettimeofday(&now, NULL);
+	to.tv_sec = now.tv_sec + timeout_ms / 1000;
+	to.tv_nsec = (now.tv_usec + (timeout_ms % 1000) * 1000) * 1000;
+	if (to.tv_nsec >= 1000000000) {
+		to.tv_sec++;
+		to.tv_nsec -= 1000000000;
+	}
+	int res = pthread_cond_timedwait(cond, mutex, &to);
+	return (res == ETIMEDOUT) ? -ETIMEDOUT : -res;
+#endif
+}
+
 void thread_once(thread_once_t *once_control, void (*init_routine)(void))
 {
 #ifdef WIN32
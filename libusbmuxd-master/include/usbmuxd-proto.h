@@ -26,6 +26,9 @@
 #include <stdint.h>
 #define USBMUXD_PROTOCOL_VERSION 0
 
+/* Set in plist requests to tell usbmuxd2 that binary plists and plain result packets may be sent to us */
+#define USBMUXD_BPLIST_CAPABILITY "kUSBMuxBinaryPlist"
+
 #if defined(WIN32) || defined(__CYGWIN__)
 #define USBMUXD_SOCKET_PORT 27015
 #else
@@ -322,6 +322,17 @@ int usbmuxd_delete_pair_record(const char* record_id);
  */
 void libusbmuxd_set_use_inotify(int set);
 
+/**
+ * Enable or disable the persistent control connection. Disabled by default.
+ * When enabled, requests like reading pair records share a single long-lived
+ * connection to usbmuxd and usbmuxd_get_device_list() is answered from a
+ * device list kept up to date by device events, without contacting usbmuxd.
+ * Falls back to one connection per request if usbmuxd doesn't support it.
+ * usbmuxd_connect() always uses a connection of its own, since that
+ * connection becomes the device connection.
+ */
+void libusbmuxd_set_use_control_channel(int set);
+
 void libusbmuxd_set_debug_level(int level);
 
 #ifdef __cplusplus
@@ -323,7 +323,8 @@ static usbmuxd_device_info_t *device_info_from_device_record(struct usbmuxd_devi
 	return devinfo;
 }
 
-static int receive_packet(int sfd, struct usbmuxd_header *header, void **payload, int timeout)
+/* is_bplist (optional) is set to whether a plist reply was binary, and to -1 for other replies */
+static int receive_packet(int sfd, struct usbmuxd_header *header, void **payload, int timeout, int *is_bplist)
 {
 	int recv_len;
 	struct usbmuxd_header hdr;
@@ -333,6 +334,9 @@ static int receive_packet(int sfd, struct usbmuxd_header *header, void **payload
 	header->version = 0;
 	header->message = 0;
 	header->tag = 0;
+	if (is_bplist) {
+		*is_bplist = -1;
+	}
 
 	recv_len = socket_receive_timeout(sfd, &hdr, sizeof(hdr), 0, timeout);
 	if (recv_len < 0) {
@@ -368,7 +372,10 @@ static int receive_packet(int sfd, struct usbmuxd_header *header, void **payload
 	if (hdr.message == MESSAGE_PLIST) {
 		char *message = NULL;
 		plist_t plist = NULL;
-		plist_from_xml(payload_loc, payload_size, &plist);
+		if (is_bplist) {
+			*is_bplist = plist_is_binary(payload_loc, payload_size) ? 1 : 0;
+		}
+		plist_from_memory(payload_loc, payload_size, &plist);
 		free(payload_loc);
 
 		if (!plist) {
@@ -469,32 +476,22 @@ static int receive_packet(int sfd, struct usbmuxd_header *header, void **payload
 }
 
 /**
- * Retrieves the result code to a previously sent request.
+ * Extracts the result code from a received reply to a previously sent request.
+ * Takes ownership of payload.
  */
-static int usbmuxd_get_result(int sfd, uint32_t tag, uint32_t *result, void **result_plist)
+static int parse_result(struct usbmuxd_header *hdr, int recv_len, void *payload, uint32_t tag, uint32_t *result, void **result_plist)
 {
-	struct usbmuxd_header hdr;
-	int recv_len;
-	uint32_t *res = NULL;
-
-	if (!result) {
-		return -EINVAL;
-	}
-	*result = -1;
-	if (result_plist) {
-		*result_plist = NULL;
-	}
+	uint32_t *res = (uint32_t*)payload;
 
-	recv_len = receive_packet(sfd, &hdr, (void**)&res, 5000);
-	if (recv_len < 0 || (size_t)recv_len < sizeof(hdr)) {
+	if (recv_len < 0 || (size_t)recv_len < sizeof(*hdr)) {
 		free(res);
 		return (recv_len < 0 ? recv_len : -EPROTO);
 	}
 
-	if (hdr.message == MESSAGE_RESULT) {
+	if (hdr->message == MESSAGE_RESULT) {
 		int ret = 0;
-		if (hdr.tag != tag) {
-			LIBUSBMUXD_DEBUG(1, "%s: WARNING: tag mismatch (%d != %d). Proceeding anyway.\n", __func__, hdr.tag, tag);
+		if (hdr->tag != tag) {
+			LIBUSBMUXD_DEBUG(1, "%s: WARNING: tag mismatch (%d != %d). Proceeding anyway.\n", __func__, hdr->tag, tag);
 		}
 		if (res) {
 			memcpy(result, res, sizeof(uint32_t));
@@ -504,9 +501,10 @@ static int usbmuxd_get_result(int sfd, uint32_t tag, uint32_t *result, void **re
 		return ret;
 	}
 
-	if (hdr.message == MESSAGE_PLIST) {
+	if (hdr->message == MESSAGE_PLIST) {
 		if (!result_plist) {
 			LIBUSBMUXD_DEBUG(1, "%s: MESSAGE_PLIST result but result_plist pointer is NULL!\n", __func__);
+			plist_free((plist_t)res);
 			return -1;
 		}
 		*result_plist = (plist_t)res;
@@ -514,11 +512,32 @@ static int usbmuxd_get_result(int sfd, uint32_t tag, uint32_t *result, void **re
 		return 1;
 	}
 
-	LIBUSBMUXD_DEBUG(1, "%s: Unexpected message of type %d received!\n", __func__, hdr.message);
+	LIBUSBMUXD_DEBUG(1, "%s: Unexpected message of type %d received!\n", __func__, hdr->message);
 	free(res);
 	return -EPROTO;
 }
 
+/**
+ * Retrieves the result code to a previously sent request.
+ */
+static int usbmuxd_get_result(int sfd, uint32_t tag, uint32_t *result, void **result_plist)
+{
+	struct usbmuxd_header hdr;
+	int recv_len;
+	void *res = NULL;
+
+	if (!result) {
+		return -EINVAL;
+	}
+	*result = -1;
+	if (result_plist) {
+		*result_plist = NULL;
+	}
+
+	recv_len = receive_packet(sfd, &hdr, &res, 5000, NULL);
+	return parse_result(&hdr, recv_len, res, tag, result, result_plist);
+}
+
 static int send_packet(int sfd, uint32_t message, uint32_t tag, void *payload, uint32_t payload_size)
 {
 	struct usbmuxd_header header;
@@ -548,19 +567,24 @@ static int send_packet(int sfd, uint32_t message, uint32_t tag, void *payload, u
 	}
 	if (sent != (int)header.length) {
 		LIBUSBMUXD_DEBUG(1, "%s: ERROR: could not send whole packet (sent %d of %d)\n", __func__, sent, header.length);
-		socket_close(sfd);
+		/* the caller closes the socket, it might still be in use by other threads */
 		return -1;
 	}
 	return sent;
 }
 
-static int send_plist_packet(int sfd, uint32_t tag, plist_t message)
+/* bplist: usbmuxd answered with binary plists on this connection, so it understands them as well */
+static int send_plist_packet(int sfd, uint32_t tag, plist_t message, int bplist)
 {
 	int res;
 	char *payload = NULL;
 	uint32_t payload_size = 0;
 
-	plist_to_xml(message, &payload, &payload_size);
+	if (bplist) {
+		plist_to_bin(message, &payload, &payload_size);
+	} else {
+		plist_to_xml(message, &payload, &payload_size);
+	}
 	res = send_packet(sfd, MESSAGE_PLIST, tag, payload, payload_size);
 	free(payload);
 
@@ -725,6 +749,8 @@ static plist_t create_plist_message(const char* message_type)
 		plist_dict_set_item(plist, "ProgName", plist_new_string(prog_name));
 	}
 	plist_dict_set_item(plist, "kLibUSBMuxVersion", plist_new_uint(PLIST_LIBUSBMUX_VERSION));
+	/* daemons which don't know this key ignore it */
+	plist_dict_set_item(plist, USBMUXD_BPLIST_CAPABILITY, plist_new_bool(1));
 	return plist;
 }
 
@@ -735,7 +761,7 @@ static int send_listen_packet(int sfd, uint32_t tag)
 		/* construct message plist */
 		plist_t plist = create_plist_message("Listen");
 
-		res = send_plist_packet(sfd, tag, plist);
+		res = send_plist_packet(sfd, tag, plist, 0);
 		plist_free(plist);
 	} else {
 		/* binary packet */
@@ -753,7 +779,7 @@ static int send_connect_packet(int sfd, uint32_t tag, uint32_t device_id, uint16
 		plist_dict_set_item(plist, "DeviceID", plist_new_uint(device_id));
 		plist_dict_set_item(plist, "PortNumber", plist_new_uint(htons(port)));
 
-		res = send_plist_packet(sfd, tag, plist);
+		res = send_plist_packet(sfd, tag, plist, 0);
 		plist_free(plist);
 	} else {
 		/* binary packet */
@@ -779,29 +805,14 @@ static int send_list_devices_packet(int sfd, uint32_t tag)
 	/* construct message plist */
 	plist_t plist = create_plist_message("ListDevices");
 
-	res = send_plist_packet(sfd, tag, plist);
-	plist_free(plist);
-
-	return res;
-}
-
-static int send_read_buid_packet(int sfd, uint32_t tag)
-{
-	int res = -1;
-
-	/* construct message plist */
-	plist_t plist = create_plist_message("ReadBUID");
-
-	res = send_plist_packet(sfd, tag, plist);
+	res = send_plist_packet(sfd, tag, plist, 0);
 	plist_free(plist);
 
 	return res;
 }
 
-static int send_pair_record_packet(int sfd, uint32_t tag, const char* msgtype, const char* pair_record_id, uint32_t device_id, plist_t data)
+static plist_t create_pair_record_message(const char* msgtype, const char* pair_record_id, uint32_t device_id, plist_t data)
 {
-	int res = -1;
-
 	/* construct message plist */
 	plist_t plist = create_plist_message(msgtype);
 	plist_dict_set_item(plist, "PairRecordID", plist_new_string(pair_record_id));
@@ -811,11 +822,353 @@ static int send_pair_record_packet(int sfd, uint32_t tag, const char* msgtype, c
 	if (device_id > 0) {
 		plist_dict_set_item(plist, "DeviceID", plist_new_uint(device_id));
 	}
+	return plist;
+}
 
-	res = send_plist_packet(sfd, tag, plist);
-	plist_free(plist);
+/*
+ * Persistent control connection.
+ * A single listening connection to usbmuxd which carries pipelined requests
+ * (replies are matched by tag) and keeps ctrl_devices up to date from the
+ * Attached/Detached events, so listing devices needs no roundtrip.
+ * Daemons which don't accept requests on a listening connection close it,
+ * in that case we fall back to one connection per request.
+ */
+struct ctrl_request {
+	uint32_t tag;
+	int done;
+	int recv_len; /* return value of receive_packet() */
+	struct usbmuxd_header hdr;
+	void *payload;
+};
 
-	return res;
+static int use_ctrl = 0;
+static thread_once_t ctrl_init_once = THREAD_ONCE_INIT;
+static mutex_t ctrl_mutex; /* protects all ctrl_ state */
+static mutex_t ctrl_send_mutex; /* keeps packets on ctrlfd from interleaving */
+static cond_t ctrl_cond;
+static int ctrlfd = -1;
+static int ctrl_users = 0; /* threads currently sending on ctrlfd */
+static int ctrl_unsupported = 0;
+static int ctrl_has_list = 0; /* ctrl_devices is complete */
+static int ctrl_bplist = 0; /* the last plist usbmuxd sent on ctrlfd was binary, send it binary plists too */
+static uint32_t ctrl_tag = 0;
+static uint32_t ctrl_listen_tag = 0;
+static uint32_t ctrl_list_tag = 0;
+static struct collection ctrl_devices;
+static struct collection ctrl_requests;
+
+#define CTRL_TIMEOUT 5000
+
+static void ctrl_init(void)
+{
+	mutex_init(&ctrl_mutex);
+	mutex_init(&ctrl_send_mutex);
+	cond_init(&ctrl_cond);
+	collection_init(&ctrl_devices);
+	collection_init(&ctrl_requests);
+}
+
+/* needs ctrl_mutex */
+static void ctrl_handle_event(struct usbmuxd_header *hdr, void *payload)
+{
+	if (hdr->message == MESSAGE_DEVICE_ADD) {
+		usbmuxd_device_info_t *devinfo = (usbmuxd_device_info_t*)payload;
+		FOREACH(usbmuxd_device_info_t *dev, &ctrl_devices) {
+			if (dev->handle == devinfo->handle) {
+				collection_remove(&ctrl_devices, dev);
+				free(dev);
+			}
+		} ENDFOREACH
+		collection_add(&ctrl_devices, devinfo);
+		return;
+	} else if (hdr->message == MESSAGE_DEVICE_REMOVE && payload) {
+		uint32_t handle;
+		memcpy(&handle, payload, sizeof(uint32_t));
+		FOREACH(usbmuxd_device_info_t *dev, &ctrl_devices) {
+			if (dev->handle == handle) {
+				collection_remove(&ctrl_devices, dev);
+				free(dev);
+			}
+		} ENDFOREACH
+	}
+	free(payload);
+}
+
+static void *ctrl_reader(void *data)
+{
+	int sfd = (int)(intptr_t)data;
+
+	while (1) {
+		struct usbmuxd_header hdr;
+		void *payload = NULL;
+		int is_bplist = -1;
+		int recv_len = receive_packet(sfd, &hdr, &payload, 0, &is_bplist);
+		if (recv_len < 0 || (size_t)recv_len < sizeof(hdr)) {
+			free(payload);
+			break;
+		}
+		mutex_lock(&ctrl_mutex);
+		if (is_bplist >= 0) {
+			/* follows the daemon, so a restarted one which only speaks XML gets XML again */
+			ctrl_bplist = is_bplist;
+		}
+		if (hdr.tag == 0) {
+			ctrl_handle_event(&hdr, payload);
+		} else if (hdr.tag == ctrl_listen_tag || hdr.tag == ctrl_list_tag) {
+			uint32_t res = -1;
+			plist_t pl = NULL;
+			int ok = (parse_result(&hdr, recv_len, payload, hdr.tag, &res, &pl) == 1) && (res == 0);
+			plist_free(pl);
+			if (!ok) {
+				LIBUSBMUXD_DEBUG(1, "%s: usbmuxd refused the control connection, falling back to one connection per request\n", __func__);
+				ctrl_unsupported = 1;
+				mutex_unlock(&ctrl_mutex);
+				break;
+			}
+			if (hdr.tag == ctrl_list_tag) {
+				/* the daemon replies in order, so all Attached events of the Listen request came before this */
+				ctrl_has_list = 1;
+				cond_broadcast(&ctrl_cond);
+			}
+		} else {
+			struct ctrl_request *found = NULL;
+			FOREACH(struct ctrl_request *req, &ctrl_requests) {
+				if (req->tag == hdr.tag) {
+					found = req;
+					break;
+				}
+			} ENDFOREACH
+			if (found) {
+				memcpy(&found->hdr, &hdr, sizeof(hdr));
+				found->payload = payload;
+				found->recv_len = recv_len;
+				found->done = 1;
+				cond_broadcast(&ctrl_cond);
+			} else {
+				LIBUSBMUXD_DEBUG(1, "%s: WARNING: dropping reply with unknown tag %d\n", __func__, hdr.tag);
+				free(payload);
+			}
+		}
+		mutex_unlock(&ctrl_mutex);
+	}
+
+	mutex_lock(&ctrl_mutex);
+	if (!ctrl_has_list) {
+		/* daemon closed the connection instead of answering ListDevices */
+		ctrl_unsupported = 1;
+	}
+	ctrlfd = -1;
+	ctrl_has_list = 0;
+	FOREACH(usbmuxd_device_info_t *dev, &ctrl_devices) {
+		collection_remove(&ctrl_devices, dev);
+		free(dev);
+	} ENDFOREACH
+	FOREACH(struct ctrl_request *req, &ctrl_requests) {
+		if (!req->done) {
+			req->recv_len = -ECONNRESET;
+			req->done = 1;
+		}
+	} ENDFOREACH
+	cond_broadcast(&ctrl_cond);
+	/* don't close the socket while somebody is still sending on it */
+	socket_shutdown(sfd, SHUT_RDWR);
+	while (ctrl_users > 0) {
+		cond_wait_timeout(&ctrl_cond, &ctrl_mutex, CTRL_TIMEOUT);
+	}
+	mutex_unlock(&ctrl_mutex);
+	socket_close(sfd);
+
+	return NULL;
+}
+
+/**
+ * Opens the control connection if it isn't open yet.
+ * Needs ctrl_mutex. Returns the socket or -ENOTCONN if it is not available.
+ */
+static int ctrl_connect()
+{
+	THREAD_T reader = THREAD_T_NULL;
+	int sfd;
+
+	if (ctrlfd >= 0) {
+		return ctrlfd;
+	}
+	if (!use_ctrl || ctrl_unsupported || proto_version != 1) {
+		return -ENOTCONN;
+	}
+
+	sfd = connect_usbmuxd_socket();
+	if (sfd < 0) {
+		return -ENOTCONN;
+	}
+	ctrl_has_list = 0;
+	ctrl_bplist = 0;
+	ctrl_listen_tag = ++ctrl_tag;
+	ctrl_list_tag = ++ctrl_tag;
+
+	mutex_lock(&ctrl_send_mutex);
+	int res = send_listen_packet(sfd, ctrl_listen_tag);
+	if (res > 0) {
+		plist_t plist = create_plist_message("ListDevices");
+		res = send_plist_packet(sfd, ctrl_list_tag, plist, 0);
+		plist_free(plist);
+	}
+	mutex_unlock(&ctrl_send_mutex);
+
+	if (res <= 0 || thread_new(&reader, ctrl_reader, (void*)(intptr_t)sfd) != 0) {
+		LIBUSBMUXD_DEBUG(1, "%s: ERROR: could not set up control connection\n", __func__);
+		socket_close(sfd);
+		return -ENOTCONN;
+	}
+	thread_detach(reader);
+	ctrlfd = sfd;
+
+	return ctrlfd;
+}
+
+/**
+ * Sends a request over the control connection and waits for its result.
+ * Returns the same values as usbmuxd_get_result(), or -ENOTCONN if the
+ * control connection is not available.
+ */
+static int ctrl_get_result(plist_t message, uint32_t *result, plist_t *result_plist)
+{
+	struct ctrl_request req;
+	int sfd;
+	int res;
+	int bplist;
+
+	if (!use_ctrl) {
+		return -ENOTCONN;
+	}
+	thread_once(&ctrl_init_once, ctrl_init);
+
+	*result = -1;
+	if (result_plist) {
+		*result_plist = NULL;
+	}
+	memset(&req, 0, sizeof(req));
+
+	mutex_lock(&ctrl_mutex);
+	sfd = ctrl_connect();
+	if (sfd < 0) {
+		mutex_unlock(&ctrl_mutex);
+		return sfd;
+	}
+	req.tag = ++ctrl_tag;
+	bplist = ctrl_bplist;
+	collection_add(&ctrl_requests, &req);
+	ctrl_users++;
+	mutex_unlock(&ctrl_mutex);
+
+	mutex_lock(&ctrl_send_mutex);
+	res = send_plist_packet(sfd, req.tag, message, bplist);
+	mutex_unlock(&ctrl_send_mutex);
+
+	mutex_lock(&ctrl_mutex);
+	ctrl_users--;
+	cond_broadcast(&ctrl_cond);
+	if (res <= 0) {
+		socket_shutdown(sfd, SHUT_RDWR);
+	}
+	while (res > 0 && !req.done) {
+		if (cond_wait_timeout(&ctrl_cond, &ctrl_mutex, CTRL_TIMEOUT) == -ETIMEDOUT) {
+			break;
+		}
+	}
+	collection_remove(&ctrl_requests, &req);
+	if (req.done && req.recv_len == -ECONNRESET && ctrl_unsupported) {
+		/* sent before we knew the daemon doesn't support the control connection, retry on a connection of its own */
+		mutex_unlock(&ctrl_mutex);
+		return -ENOTCONN;
+	}
+	mutex_unlock(&ctrl_mutex);
+
+	if (res <= 0) {
+		/* the request didn't make it to the daemon, so it is safe to retry on a connection of its own */
+		LIBUSBMUXD_DEBUG(1, "%s: Error sending request over the control connection!\n", __func__);
+		return -ENOTCONN;
+	}
+	if (!req.done) {
+		LIBUSBMUXD_DEBUG(1, "%s: Timed out waiting for reply to tag %d\n", __func__, req.tag);
+		return -ETIMEDOUT;
+	}
+	return parse_result(&req.hdr, req.recv_len, req.payload, req.tag, result, result_plist);
+}
+
+/**
+ * Copies the device list which is kept up to date by the control connection.
+ * Returns the number of devices, or -ENOTCONN if the control connection is not available.
+ */
+static int ctrl_get_device_list(usbmuxd_device_info_t **device_list)
+{
+	usbmuxd_device_info_t *newlist = NULL;
+	int dev_cnt = 0;
+
+	if (!use_ctrl) {
+		return -ENOTCONN;
+	}
+	thread_once(&ctrl_init_once, ctrl_init);
+
+	mutex_lock(&ctrl_mutex);
+	if (ctrl_connect() < 0) {
+		mutex_unlock(&ctrl_mutex);
+		return -ENOTCONN;
+	}
+	while (ctrlfd >= 0 && !ctrl_has_list) {
+		if (cond_wait_timeout(&ctrl_cond, &ctrl_mutex, CTRL_TIMEOUT) == -ETIMEDOUT) {
+			break;
+		}
+	}
+	if (!ctrl_has_list) {
+		mutex_unlock(&ctrl_mutex);
+		return -ENOTCONN;
+	}
+
+	newlist = (usbmuxd_device_info_t*)malloc(sizeof(usbmuxd_device_info_t) * (collection_count(&ctrl_devices) + 1));
+	FOREACH(usbmuxd_device_info_t *di, &ctrl_devices) {
+		memcpy(&newlist[dev_cnt], di, sizeof(usbmuxd_device_info_t));
+		dev_cnt++;
+	} ENDFOREACH
+	mutex_unlock(&ctrl_mutex);
+
+	memset(&newlist[dev_cnt], 0, sizeof(usbmuxd_device_info_t));
+	*device_list = newlist;
+
+	return dev_cnt;
+}
+
+/**
+ * Sends a request and retrieves its result, over the control connection if
+ * it is enabled and otherwise over a connection of its own.
+ */
+static int usbmuxd_request(plist_t message, uint32_t *result, plist_t *result_plist)
+{
+	int sfd;
+	int ret;
+
+	proto_version = 1;
+	ret = ctrl_get_result(message, result, result_plist);
+	if (ret != -ENOTCONN) {
+		return ret;
+	}
+
+	sfd = connect_usbmuxd_socket();
+	if (sfd < 0) {
+		LIBUSBMUXD_DEBUG(1, "%s: Error: Connection to usbmuxd failed: %s\n", __func__, strerror(errno));
+		return sfd;
+	}
+
+	int tag = ++use_tag;
+	if (send_plist_packet(sfd, tag, message, 0) <= 0) {
+		LIBUSBMUXD_DEBUG(1, "%s: Error sending request!\n", __func__);
+		ret = -1;
+	} else {
+		ret = usbmuxd_get_result(sfd, tag, result, result_plist);
+	}
+	socket_close(sfd);
+
+	return ret;
 }
 
 /**
@@ -1024,7 +1377,7 @@ static int get_next_event(int sfd)
 	void *payload = NULL;
 
 	/* block until we receive something */
-	if (receive_packet(sfd, &hdr, &payload, 0) < 0) {
+	if (receive_packet(sfd, &hdr, &payload, 0, NULL) < 0) {
 		if (!cancelling) {
 			LIBUSBMUXD_DEBUG(1, "%s: Error in usbmuxd connection, disconnecting all devices!\n", __func__);
 		}
@@ -1269,6 +1622,12 @@ USBMUXD_API int usbmuxd_get_device_list(usbmuxd_device_info_t **device_list)
 
 	*device_list = NULL;
 
+	dev_cnt = ctrl_get_device_list(device_list);
+	if (dev_cnt != -ENOTCONN) {
+		return dev_cnt;
+	}
+	dev_cnt = 0;
+
 retry:
 	sfd = connect_usbmuxd_socket();
 	if (sfd < 0) {
@@ -1341,7 +1700,7 @@ retry:
 
 	// receive device list
 	while (1) {
-		if (receive_packet(sfd, &hdr, &payload, 100) > 0) {
+		if (receive_packet(sfd, &hdr, &payload, 100, NULL) > 0) {
 			if (hdr.message == MESSAGE_DEVICE_ADD) {
 				usbmuxd_device_info_t *devinfo = payload;
 				collection_add(&tmpdevs, devinfo);
@@ -1615,50 +1974,37 @@ USBMUXD_API int usbmuxd_recv(int sfd, char *data, uint32_t len, uint32_t *recv_b
 
 USBMUXD_API int usbmuxd_read_buid(char **buid)
 {
-	int sfd;
-	int tag;
 	int ret = -1;
+	uint32_t rc = 0;
+	plist_t pl = NULL;
 
 	if (!buid) {
 		return -EINVAL;
 	}
 	*buid = NULL;
 
-	sfd = connect_usbmuxd_socket();
-	if (sfd < 0) {
-		LIBUSBMUXD_DEBUG(1, "%s: Error: Connection to usbmuxd failed: %s\n", __func__, strerror(errno));
-		return sfd;
-	}
-
-	proto_version = 1;
-	tag = ++use_tag;
-	if (send_read_buid_packet(sfd, tag) <= 0) {
-		LIBUSBMUXD_DEBUG(1, "%s: Error sending ReadBUID message!\n", __func__);
-	} else {
-		uint32_t rc = 0;
-		plist_t pl = NULL;
-		ret = usbmuxd_get_result(sfd, tag, &rc, &pl);
-		if ((ret == 1) && (rc == 0)) {
-			plist_t node = plist_dict_get_item(pl, "BUID");
-			if (node && plist_get_node_type(node) == PLIST_STRING) {
-				plist_get_string_val(node, buid);
-			}
-			ret = 0;
-		} else if (ret == 1) {
-			ret = -(int)rc;
+	plist_t msg = create_plist_message("ReadBUID");
+	ret = usbmuxd_request(msg, &rc, &pl);
+	plist_free(msg);
+	if ((ret == 1) && (rc == 0)) {
+		plist_t node = plist_dict_get_item(pl, "BUID");
+		if (node && plist_get_node_type(node) == PLIST_STRING) {
+			plist_get_string_val(node, buid);
 		}
-		plist_free(pl);
+		ret = 0;
+	} else if (ret == 1) {
+		ret = -(int)rc;
 	}
-	socket_close(sfd);
+	plist_free(pl);
 
 	return ret;
 }
 
 USBMUXD_API int usbmuxd_read_pair_record(const char* record_id, char **record_data, uint32_t *record_size)
 {
-	int sfd;
-	int tag;
 	int ret = -1;
+	uint32_t rc = 0;
+	plist_t pl = NULL;
 
 	if (!record_id || !record_data || !record_size) {
 		return -EINVAL;
@@ -1666,77 +2012,47 @@ USBMUXD_API int usbmuxd_read_pair_record(const char* record_id, char **record_da
 	*record_data = NULL;
 	*record_size = 0;
 
-	sfd = connect_usbmuxd_socket();
-	if (sfd < 0) {
-		LIBUSBMUXD_DEBUG(1, "%s: Error: Connection to usbmuxd failed: %s\n",
-				__func__, strerror(errno));
-		return sfd;
-	}
-
-	proto_version = 1;
-	tag = ++use_tag;
-
-	if (send_pair_record_packet(sfd, tag, "ReadPairRecord", record_id, 0, NULL) <= 0) {
-		LIBUSBMUXD_DEBUG(1, "%s: Error sending ReadPairRecord message!\n", __func__);
-	} else {
-		uint32_t rc = 0;
-		plist_t pl = NULL;
-		ret = usbmuxd_get_result(sfd, tag, &rc, &pl);
-		if ((ret == 1) && (rc == 0)) {
-			plist_t node = plist_dict_get_item(pl, "PairRecordData");
-			if (node && plist_get_node_type(node) == PLIST_DATA) {
-				uint64_t int64val = 0;
-				plist_get_data_val(node, record_data, &int64val);
-				if (*record_data && int64val > 0) {
-					*record_size = (uint32_t)int64val;
-					ret = 0;
-				}
+	plist_t msg = create_pair_record_message("ReadPairRecord", record_id, 0, NULL);
+	ret = usbmuxd_request(msg, &rc, &pl);
+	plist_free(msg);
+	if ((ret == 1) && (rc == 0)) {
+		plist_t node = plist_dict_get_item(pl, "PairRecordData");
+		if (node && plist_get_node_type(node) == PLIST_DATA) {
+			uint64_t int64val = 0;
+			plist_get_data_val(node, record_data, &int64val);
+			if (*record_data && int64val > 0) {
+				*record_size = (uint32_t)int64val;
+				ret = 0;
 			}
-		} else if (ret == 1) {
-			ret = -(int)rc;
 		}
-		plist_free(pl);
+	} else if (ret == 1) {
+		ret = -(int)rc;
 	}
-	socket_close(sfd);
+	plist_free(pl);
 
 	return ret;
 }
 
 USBMUXD_API int usbmuxd_save_pair_record_with_device_id(const char* record_id, uint32_t device_id, const char *record_data, uint32_t record_size)
 {
-	int sfd;
-	int tag;
 	int ret = -1;
+	uint32_t rc = 0;
 
 	if (!record_id || !record_data || !record_size) {
 		return -EINVAL;
 	}
 
-	sfd = connect_usbmuxd_socket();
-	if (sfd < 0) {
-		LIBUSBMUXD_DEBUG(1, "%s: Error: Connection to usbmuxd failed: %s\n",
-				__func__, strerror(errno));
-		return sfd;
-	}
-
-	proto_version = 1;
-	tag = ++use_tag;
-
 	plist_t data = plist_new_data(record_data, record_size);
-	if (send_pair_record_packet(sfd, tag, "SavePairRecord", record_id, device_id, data) <= 0) {
-		LIBUSBMUXD_DEBUG(1, "%s: Error sending SavePairRecord message!\n", __func__);
-	} else {
-		uint32_t rc = 0;
-		ret = usbmuxd_get_result(sfd, tag, &rc, NULL);
-		if ((ret == 1) && (rc == 0)) {
-			ret = 0;
-		} else if (ret == 1) {
-			ret = -(int)rc;
-			LIBUSBMUXD_DEBUG(1, "%s: Error: saving pair record failed: %d\n", __func__, ret);
-		}
-	}
+	plist_t msg = create_pair_record_message("SavePairRecord", record_id, device_id, data);
+	ret = usbmuxd_request(msg, &rc, NULL);
+	plist_free(msg);
 	plist_free(data);
-	socket_close(sfd);
+	if ((ret == 1) && (rc == 0)) {
+		ret = 0;
+	} else if (ret == 1) {
+		ret = -(int)rc;
+		LIBUSBMUXD_DEBUG(1, "%s: Error: saving pair record failed: %d\n", __func__, ret);
+	}
 
 	return ret;
 }
@@ -1748,38 +2064,23 @@ USBMUXD_API int usbmuxd_save_pair_record(const char* record_id, const char *reco
 
 USBMUXD_API int usbmuxd_delete_pair_record(const char* record_id)
 {
-	int sfd;
-	int tag;
 	int ret = -1;
+	uint32_t rc = 0;
 
 	if (!record_id) {
 		return -EINVAL;
 	}
 
-	sfd = connect_usbmuxd_socket();
-	if (sfd < 0) {
-		LIBUSBMUXD_DEBUG(1, "%s: Error: Connection to usbmuxd failed: %s\n",
-				__func__, strerror(errno));
-		return sfd;
+	plist_t msg = create_pair_record_message("DeletePairRecord", record_id, 0, NULL);
+	ret = usbmuxd_request(msg, &rc, NULL);
+	plist_free(msg);
+	if ((ret == 1) && (rc == 0)) {
+		ret = 0;
+	} else if (ret == 1) {
+		ret = -(int)rc;
+		LIBUSBMUXD_DEBUG(1, "%s: Error: deleting pair record failed: %d\n", __func__, ret);
 	}
 
-	proto_version = 1;
-	tag = ++use_tag;
-
-	if (send_pair_record_packet(sfd, tag, "DeletePairRecord", record_id, 0, NULL) <= 0) {
-		LIBUSBMUXD_DEBUG(1, "%s: Error sending DeletePairRecord message!\n", __func__);
-	} else {
-		uint32_t rc = 0;
-		ret = usbmuxd_get_result(sfd, tag, &rc, NULL);
-		if ((ret == 1) && (rc == 0)) {
-			ret = 0;
-		} else if (ret == 1) {
-			ret = -(int)rc;
-			LIBUSBMUXD_DEBUG(1, "%s: Error: deleting pair record failed: %d\n", __func__, ret);
-		}
-	}
-	socket_close(sfd);
-
 	return ret;
 }
 
@@ -1790,6 +2091,18 @@ USBMUXD_API void libusbmuxd_set_use_inotify(int set)
 #endif
 }
 
+USBMUXD_API void libusbmuxd_set_use_control_channel(int set)
+{
+	thread_once(&ctrl_init_once, ctrl_init);
+	mutex_lock(&ctrl_mutex);
+	use_ctrl = set;
+	if (!use_ctrl && ctrlfd >= 0) {
+		/* reader thread notices and cleans up */
+		socket_shutdown(ctrlfd, SHUT_RDWR);
+	}
+	mutex_unlock(&ctrl_mutex);
+}
+
 USBMUXD_API void libusbmuxd_set_debug_level(int level)
 {
 	libusbmuxd_debug = level;
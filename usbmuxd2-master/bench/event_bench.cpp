@@ -0,0 +1,75 @@
+//
+//  event_bench.cpp
+//  usbmuxd2
+//
+//  Created by tihmstar on 01.12.20.
+//  Copyright © 2020 tihmstar. All rights reserved.
+//
+
+#include <Event.hpp>
+#include <lck_container.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <set>
+#include <vector>
+#include <thread>
+#include <chrono>
+
+/*
+ Cost of the uncontended paths of Event and lck_contrainer, which every device and connection lookup takes,
+ and the time it takes to wake up a group of waiters.
+ usage: event_bench [iterations]
+ */
+
+using namespace std::chrono;
+
+template <typename _f>
+static double nsPerOp(uint64_t iterations, _f f){
+    auto start = steady_clock::now();
+    for (uint64_t i=0; i<iterations; i++) {
+        f();
+    }
+    return (double)duration_cast<nanoseconds>(steady_clock::now() - start).count() / iterations;
+}
+
+int main(int argc, const char * argv[]) {
+    uint64_t iterations = (argc > 1) ? strtoull(argv[1], NULL, 0) : 10000000;
+    lck_contrainer<std::set<int>> cont;
+    Event ev;
+
+    printf("iterations: %llu\n",(unsigned long long)iterations);
+    printf("Event::notifyAll (no waiters)           %7.1f ns\n", nsPerOp(iterations, [&]{ev.notifyAll();}));
+    printf("addMember+delMember (uncontended read)  %7.1f ns\n", nsPerOp(iterations, [&]{cont.addMember(); cont.delMember();}));
+    printf("lockMember+unlockMember (uncontended)   %7.1f ns\n", nsPerOp(iterations, [&]{cont.lockMember(); cont.unlockMember();}));
+
+    //every waiter needs to come back from a single notifyAll()
+    for (int waiters : {1, 4, 16}) {
+        const int rounds = 200;
+        uint64_t usec = 0;
+        for (int r=0; r<rounds; r++) {
+            Event wake;
+            std::atomic<int> returned{0};
+            std::vector<std::thread> threads;
+            for (int i=0; i<waiters; i++) {
+                threads.emplace_back([&]{
+                    wake.wait();
+                    returned++;
+                });
+            }
+            while (wake.members() < (uint64_t)waiters) std::this_thread::yield();
+            auto start = steady_clock::now();
+            wake.notifyAll();
+            while (returned < waiters) {
+                if (steady_clock::now() - start > seconds(5)) {
+                    printf("wakeup of %d waiters: only %d returned, lost wakeup!\n",waiters,returned.load());
+                    exit(1);
+                }
+                std::this_thread::yield();
+            }
+            usec += duration_cast<microseconds>(steady_clock::now() - start).count();
+            for (auto &t : threads) t.join();
+        }
+        printf("notifyAll -> %2d waiters returned         %7.1f us\n", waiters, (double)usec / rounds);
+    }
+    return 0;
+}
@@ -0,0 +1,125 @@
+//
+//  rcu_bench.cpp
+//  usbmuxd2
+//
+//  Created by tihmstar on 02.12.20.
+//  Copyright © 2020 tihmstar. All rights reserved.
+//
+
+#include <rcu_container.h>
+#include <lck_container.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include <thread>
+#include <chrono>
+
+/*
+ Lookups per second in the device/client/connection registries, rcu_container against lck_contrainer,
+ with a growing number of reader threads while a writer keeps adding and removing an element.
+ A lookup searches a vector of REGISTRY_SIZE elements, like finding a device by id.
+ usage: rcu_bench [seconds] [writes per second]
+ */
+
+#define REGISTRY_SIZE 16
+
+using namespace std::chrono;
+
+struct result{
+    double lookups; //per second, all readers
+    double writes;  //per second
+};
+
+/*
+ Runs that many reader threads calling lookup() and a writer calling write() every writeInterval (none if 0) for a while.
+ */
+template <typename _lookup, typename _write>
+static result run(int readers, int seconds, microseconds writeInterval, _lookup lookup, _write write){
+    std::atomic_bool stop{false};
+    std::atomic<uint64_t> lookups{0};
+    uint64_t writes = 0;
+    std::vector<std::thread> threads;
+
+    for (int i=0; i<readers; i++) {
+        threads.emplace_back([&, i]{
+            uint64_t cnt = 0;
+            while (!stop) {
+                for (int j=0; j<64; j++) {
+                    lookup(i + j);
+                }
+                cnt += 64;
+            }
+            lookups += cnt;
+        });
+    }
+    if (writeInterval.count()) {
+        threads.emplace_back([&]{
+            auto next = steady_clock::now();
+            while (!stop) {
+                write(writes++);
+                next += writeInterval;
+                std::this_thread::sleep_until(next);
+            }
+        });
+    }
+
+    std::this_thread::sleep_for(std::chrono::seconds(seconds));
+    stop = true;
+    for (auto &t : threads) t.join();
+    return {(double)lookups / seconds, (double)writes / seconds};
+}
+
+int main(int argc, const char * argv[]) {
+    int seconds = (argc > 1) ? atoi(argv[1]) : 2;
+    int writeRate = (argc > 2) ? atoi(argv[2]) : 1000;
+    microseconds writeInterval(writeRate > 0 ? 1000000 / writeRate : 0);
+    int maxReaders = std::max(4u, std::thread::hardware_concurrency());
+
+    rcu_container<std::vector<int>> rcu;
+    lck_contrainer<std::vector<int>> lck;
+    rcu.update([](std::vector<int> &elems){
+        for (int i=0; i<REGISTRY_SIZE; i++) elems.push_back(i);
+    });
+    for (int i=0; i<REGISTRY_SIZE; i++) lck._elems.push_back(i);
+
+    //the element a writer adds or removes is never looked up, so both find the same
+    auto rcuLookup = [&](int key){
+        auto elems = rcu.read();
+        return std::find(elems->begin(), elems->end(), key % REGISTRY_SIZE) != elems->end();
+    };
+    auto rcuWrite = [&](uint64_t i){
+        rcu.update([i](std::vector<int> &elems){
+            if (i & 1) {
+                elems.pop_back();
+            } else {
+                elems.push_back(REGISTRY_SIZE);
+            }
+        });
+    };
+    auto lckLookup = [&](int key){
+        lck.addMember();
+        bool found = std::find(lck._elems.begin(), lck._elems.end(), key % REGISTRY_SIZE) != lck._elems.end();
+        lck.delMember();
+        return found;
+    };
+    auto lckWrite = [&](uint64_t i){
+        lck.lockMember();
+        if (i & 1) {
+            lck._elems.pop_back();
+        } else {
+            lck._elems.push_back(REGISTRY_SIZE);
+        }
+        lck.unlockMember();
+    };
+
+    printf("seconds per run: %d  writes: %d/s  registry size: %d\n", seconds, writeRate > 0 ? writeRate : 0, REGISTRY_SIZE);
+    printf("readers   rcu_container lookups/s  writes/s   lck_contrainer lookups/s  writes/s\n");
+    for (int readers = 1; readers <= maxReaders; readers *= 2) {
+        result r = run(readers, seconds, writeInterval, rcuLookup, rcuWrite);
+        result l = run(readers, seconds, writeInterval, lckLookup, lckWrite);
+        printf("%7d   %23.3gM  %8.0f   %24.3gM  %8.0f\n", readers, r.lookups / 1e6, r.writes, l.lookups / 1e6, l.writes);
+    }
+    return 0;
+}
@@ -0,0 +1,535 @@
+//
+//  simbench.cpp
+//  usbmuxd2
+//
+//  Created by tihmstar on 02.12.20.
+//  Copyright © 2020 tihmstar. All rights reserved.
+//
+
+#include <usbmuxd2-proto.h>
+#include <libgeneral/macros.h>
+#include <plist/plist.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <vector>
+#include <algorithm>
+#include <numeric>
+#include <chrono>
+
+/*
+ Talks to a running usbmuxd like libusbmuxd clients do. Meant to be used against "usbmuxd --simulate-devices=N",
+ whose devices offer the services below, so the whole data path can be measured without hardware.
+ Reports the latency of ListDevices and connection setup with XML and binary plists, the throughput of N parallel
+ connections per connection and in total, the syscalls usbmuxd needs to write replies and device segments to
+ clients, and the thread count and cpu usage of the daemon, also while connections sit idle or stalled.
+ */
+
+//services of simulated devices, see SimDeviceManager.hpp
+#define SIM_PORT_ECHO 7
+#define SIM_PORT_SINK 9
+#define SIM_PORT_SOURCE 19
+
+#define BENCH_CHUNK 0x10000
+
+using namespace std::chrono;
+
+static const char *gSocketPath = "/var/run/usbmuxd";
+static const char *gPidFile = "/var/run/usbmuxd.pid";
+static int gDaemonPid = 0;
+static bool gBinary = false; //speak binary plists, like clients announcing USBMUXD_BPLIST_CAPABILITY
+
+static double msSince(steady_clock::time_point start){
+    return duration_cast<nanoseconds>(steady_clock::now() - start).count() / 1e6;
+}
+
+static double percentile(std::vector<double> v, double p){
+    if (!v.size()) return 0;
+    std::sort(v.begin(), v.end());
+    return v[std::min(v.size()-1, (size_t)(p * v.size()))];
+}
+
+/*
+ Thread count and consumed cpu time (in clock ticks) of the daemon, read from procfs.
+ Both are -1 when that isn't available.
+ */
+struct daemonSample{
+    int threads;
+    long long ticks;
+};
+
+static daemonSample daemon_sample(){
+    daemonSample ret = {-1, -1};
+    char path[64] = {};
+    char line[256] = {};
+    FILE *f = NULL;
+    if (gDaemonPid <= 0) return ret;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", gDaemonPid);
+    if ((f = fopen(path, "r"))) {
+        while (fgets(line, sizeof(line), f)) {
+            if (sscanf(line, "Threads: %d", &ret.threads) == 1) break;
+        }
+        fclose(f);
+    }
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", gDaemonPid);
+    if ((f = fopen(path, "r"))) {
+        unsigned long long utime = 0, stime = 0;
+        //comm may contain spaces, the fields after it start behind the last ')'
+        if (fgets(line, sizeof(line), f) && strrchr(line, ')')
+            && sscanf(strrchr(line, ')') + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime) == 2) {
+            ret.ticks = utime + stime;
+        }
+        fclose(f);
+    }
+    return ret;
+}
+
+//daemon cpu usage in percent of one core between two samples
+static double daemon_cpu(daemonSample before, daemonSample after, double seconds){
+    if (before.ticks < 0 || after.ticks < 0) return -1;
+    return (after.ticks - before.ticks) * 100.0 / sysconf(_SC_CLK_TCK) / seconds;
+}
+
+static int mux_open(){
+    int fd = -1;
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, gSocketPath, sizeof(addr.sun_path)-1);
+    retassure((fd = socket(AF_UNIX, SOCK_STREAM, 0)) != -1, "failed to create socket");
+    if (::connect(fd, (struct sockaddr*)&addr, sizeof(addr))) {
+        close(fd);
+        reterror("failed to connect to %s errno=%d(%s)",gSocketPath,errno,strerror(errno));
+    }
+    return fd;
+}
+
+static void readAll(int fd, void *buf, size_t len){
+    for (size_t got = 0; got < len;) {
+        ssize_t cnt = read(fd, (char*)buf + got, len - got);
+        retassure(cnt > 0, "usbmuxd closed the connection");
+        got += cnt;
+    }
+}
+
+static void mux_send(int fd, plist_t p, uint32_t tag){
+    char *buf = NULL;
+    uint32_t bufsize = 0;
+    cleanup([&]{
+        safeFree(buf);
+    });
+    usbmuxd_header hdr = {};
+    if (gBinary) {
+        plist_to_bin(p, &buf, &bufsize);
+    } else {
+        plist_to_xml(p, &buf, &bufsize);
+    }
+    assure(buf);
+    hdr.length = sizeof(hdr) + bufsize;
+    hdr.version = 1;
+    hdr.message = MESSAGE_PLIST;
+    hdr.tag = tag;
+    std::vector<char> pkt(hdr.length);
+    memcpy(pkt.data(), &hdr, sizeof(hdr));
+    memcpy(pkt.data() + sizeof(hdr), buf, bufsize);
+    retassure(write(fd, pkt.data(), pkt.size()) == (ssize_t)pkt.size(), "failed to send request");
+}
+
+static plist_t mux_recv(int fd){
+    usbmuxd_header hdr = {};
+    plist_t ret = NULL;
+    readAll(fd, &hdr, sizeof(hdr));
+    retassure(hdr.length >= sizeof(hdr) && hdr.length < 0x1000000, "bad packet length %u",hdr.length);
+    std::vector<char> payload(hdr.length - sizeof(hdr));
+    readAll(fd, payload.data(), payload.size());
+    if (hdr.message == MESSAGE_RESULT) {
+        //plain result packet, which usbmuxd sends to binary plist clients
+        uint32_t result = 0;
+        retassure(payload.size() == sizeof(result), "bad result packet");
+        memcpy(&result, payload.data(), sizeof(result));
+        ret = plist_new_dict();
+        plist_dict_set_item(ret, "MessageType", plist_new_string("Result"));
+        plist_dict_set_item(ret, "Number", plist_new_uint(result));
+        return ret;
+    }
+    retassure(hdr.message == MESSAGE_PLIST, "unexpected message %u",hdr.message);
+    plist_from_memory(payload.data(), (uint32_t)payload.size(), &ret);
+    retassure(ret, "failed to parse response");
+    return ret;
+}
+
+static plist_t mux_request(const char *messageType){
+    plist_t p = plist_new_dict();
+    plist_dict_set_item(p, "MessageType", plist_new_string(messageType));
+    plist_dict_set_item(p, "ClientVersionString", plist_new_string("simbench"));
+    plist_dict_set_item(p, "ProgName", plist_new_string("simbench"));
+    plist_dict_set_item(p, "kLibUSBMuxVersion", plist_new_uint(3));
+    if (gBinary) {
+        plist_dict_set_item(p, USBMUXD_BPLIST_CAPABILITY, plist_new_bool(1));
+    }
+    return p;
+}
+
+static std::vector<uint32_t> list_devices(){
+    int fd = -1;
+    plist_t req = NULL;
+    plist_t rsp = NULL;
+    cleanup([&]{
+        safeFreeCustom(req, plist_free);
+        safeFreeCustom(rsp, plist_free);
+        if (fd != -1) close(fd);
+    });
+    std::vector<uint32_t> ret;
+    plist_t list = NULL;
+
+    fd = mux_open();
+    req = mux_request("ListDevices");
+    mux_send(fd, req, 1);
+    rsp = mux_recv(fd);
+    retassure(list = plist_dict_get_item(rsp, "DeviceList"), "response has no DeviceList");
+    for (uint32_t i=0; i<plist_array_get_size(list); i++) {
+        uint64_t id = 0;
+        plist_t p_id = plist_dict_get_item(plist_array_get_item(list, i), "DeviceID");
+        if (!p_id) continue;
+        plist_get_uint_val(p_id, &id);
+        ret.push_back((uint32_t)id);
+    }
+    return ret;
+}
+
+//usbmuxd takes the ProgName of every request as the client's name
+static plist_t mux_statistics(int fd, const char *progName){
+    plist_t req = NULL;
+    cleanup([&]{
+        safeFreeCustom(req, plist_free);
+    });
+    req = mux_request("GetStatistics");
+    plist_dict_set_item(req, "ProgName", plist_new_string(progName));
+    mux_send(fd, req, 2);
+    return mux_recv(fd);
+}
+
+static uint64_t stats_uint(plist_t dict, const char *key){
+    uint64_t ret = 0;
+    plist_t node = plist_dict_get_item(dict, key);
+    if (node) plist_get_uint_val(node, &ret);
+    return ret;
+}
+
+static int mux_connect(uint32_t deviceID, uint16_t port){
+    int fd = -1;
+    plist_t req = NULL;
+    plist_t rsp = NULL;
+    cleanup([&]{
+        safeFreeCustom(req, plist_free);
+        safeFreeCustom(rsp, plist_free);
+        if (fd != -1) close(fd);
+    });
+    plist_t p_num = NULL;
+    uint64_t result = 0;
+
+    fd = mux_open();
+    req = mux_request("Connect");
+    plist_dict_set_item(req, "DeviceID", plist_new_uint(deviceID));
+    plist_dict_set_item(req, "PortNumber", plist_new_uint(htons(port)));
+    mux_send(fd, req, 1);
+    rsp = mux_recv(fd);
+    retassure(p_num = plist_dict_get_item(rsp, "Number"), "response has no result");
+    plist_get_uint_val(p_num, &result);
+    retassure(result == RESULT_OK, "connecting to device %u port %u failed with result %llu",deviceID,port,(unsigned long long)result);
+    int ret = fd; fd = -1;
+    return ret;
+}
+
+static void printLatency(const char *what, const std::vector<double> &lat){
+    printf("%-24s avg %.3f ms  p50 %.3f ms  p99 %.3f ms\n", what,
+           std::accumulate(lat.begin(), lat.end(), 0.0) / lat.size(), percentile(lat, 0.5), percentile(lat, 0.99));
+}
+
+/*
+ Sequential ListDevices and Connect requests, each on a new socket like libusbmuxd sends them,
+ once with XML and once with binary plists.
+ */
+static void bench_setup(const std::vector<uint32_t> &devices, int count){
+    for (bool binary : {false, true}) {
+        std::vector<double> listLat;
+        std::vector<double> connLat;
+        char what[64] = {};
+        gBinary = binary;
+        for (int i=0; i<count; i++) {
+            auto start = steady_clock::now();
+            list_devices();
+            listLat.push_back(msSince(start));
+        }
+        for (int i=0; i<count; i++) {
+            auto start = steady_clock::now();
+            int fd = mux_connect(devices[i % devices.size()], SIM_PORT_SINK);
+            connLat.push_back(msSince(start));
+            close(fd);
+        }
+        snprintf(what, sizeof(what), "ListDevices (%s)", binary ? "binary" : "XML");
+        printLatency(what, listLat);
+        snprintf(what, sizeof(what), "Connect (%s)", binary ? "binary" : "XML");
+        printLatency(what, connLat);
+    }
+    gBinary = false;
+}
+
+/*
+ Syscalls usbmuxd needs to write control replies, taken from the statistics of a client which asked for the device list repeatedly.
+ */
+#define REPLY_BENCH_PROGNAME "simbench-replies"
+static void bench_reply_writes(int count){
+    int fd = -1;
+    plist_t req = NULL;
+    plist_t rsp = NULL;
+    cleanup([&]{
+        safeFreeCustom(req, plist_free);
+        safeFreeCustom(rsp, plist_free);
+        if (fd != -1) close(fd);
+    });
+    plist_t clients = NULL;
+
+    fd = mux_open();
+    req = mux_request("ListDevices");
+    plist_dict_set_item(req, "ProgName", plist_new_string(REPLY_BENCH_PROGNAME));
+    for (int i=0; i<count; i++) {
+        mux_send(fd, req, 1);
+        plist_free(mux_recv(fd));
+    }
+    rsp = mux_statistics(fd, REPLY_BENCH_PROGNAME);
+    retassure(clients = plist_dict_get_item(rsp, "Clients"), "statistics have no Clients");
+    for (uint32_t i=0; i<plist_array_get_size(clients); i++) {
+        plist_t cli = plist_array_get_item(clients, i);
+        plist_t p_name = plist_dict_get_item(cli, "ProgName");
+        const char *name = p_name ? plist_get_string_ptr(p_name, NULL) : NULL;
+        uint64_t pkts = stats_uint(cli, "pktsOut"); //the statistics reply itself isn't counted yet
+        if (!name || strcmp(name, REPLY_BENCH_PROGNAME)) continue;
+        printf("control replies: %llu packets written with %llu syscalls\n",
+               (unsigned long long)pkts, (unsigned long long)stats_uint(cli, "sendCalls"));
+    }
+}
+
+/*
+ Reads from (SOURCE) or writes to (SINK) all connections at once from a single thread, like a busy client process would.
+ */
+static void bench_throughput(const std::vector<uint32_t> &devices, int conns, int seconds, bool upload){
+    std::vector<int> fds;
+    std::vector<uint64_t> bytes(conns);
+    std::vector<struct pollfd> pfds;
+    cleanup([&]{
+        for (int fd : fds) close(fd);
+    });
+    static char buf[BENCH_CHUNK];
+    uint64_t segments = 0;
+    uint64_t writes = 0;
+
+    for (int i=0; i<conns; i++) {
+        int fd = mux_connect(devices[i % devices.size()], upload ? SIM_PORT_SINK : SIM_PORT_SOURCE);
+        fds.push_back(fd);
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+        pfds.push_back({fd, (short)(upload ? POLLOUT : POLLIN), 0});
+    }
+
+    daemonSample before = daemon_sample();
+    auto start = steady_clock::now();
+    while (msSince(start) < seconds * 1000.0) {
+        retassure(poll(pfds.data(), pfds.size(), 100) >= 0, "poll failed");
+        for (int i=0; i<conns; i++) {
+            ssize_t cnt = 0;
+            if (!pfds[i].revents) continue;
+            retassure(!(pfds[i].revents & (POLLERR | POLLNVAL)), "connection %d failed",i);
+            cnt = upload ? send(fds[i], buf, sizeof(buf), MSG_NOSIGNAL) : recv(fds[i], buf, sizeof(buf), 0);
+            if (cnt < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) continue;
+            retassure(cnt > 0, "connection %d closed",i);
+            bytes[i] += cnt;
+        }
+    }
+    double elapsed = msSince(start) / 1000;
+    daemonSample after = daemon_sample();
+    if (!upload) {
+        //the connections are ours only, so their counters cover just this run
+        int fd = -1;
+        plist_t stats = NULL;
+        cleanup([&]{
+            safeFreeCustom(stats, plist_free);
+            if (fd != -1) close(fd);
+        });
+        plist_t devs = NULL;
+        fd = mux_open();
+        stats = mux_statistics(fd, "simbench");
+        if ((devs = plist_dict_get_item(stats, "Devices"))) {
+            for (uint32_t i=0; i<plist_array_get_size(devs); i++) {
+                plist_t cs = plist_dict_get_item(plist_array_get_item(devs, i), "Connections");
+                for (uint32_t j=0; cs && j<plist_array_get_size(cs); j++) {
+                    segments += stats_uint(plist_array_get_item(cs, j), "segmentsIn");
+                    writes += stats_uint(plist_array_get_item(cs, j), "clientWrites");
+                }
+            }
+        }
+    }
+
+    std::vector<double> mbps;
+    for (uint64_t b : bytes) {
+        mbps.push_back(b / elapsed / 1e6);
+    }
+    printf("%-6s %4d connections  total %8.1f MB/s  per connection min %7.2f  p50 %7.2f  max %7.2f MB/s  daemon threads %d  cpu %.0f%%\n",
+           upload ? "sink" : "source", conns, std::accumulate(mbps.begin(), mbps.end(), 0.0),
+           *std::min_element(mbps.begin(), mbps.end()), percentile(mbps, 0.5), *std::max_element(mbps.begin(), mbps.end()),
+           after.threads, daemon_cpu(before, after, elapsed));
+    if (segments) {
+        printf("%-6s %4d connections  %llu segments written to the client with %llu syscalls (%.2f per segment)\n", "", conns,
+               (unsigned long long)segments, (unsigned long long)writes, (double)writes / segments);
+    }
+}
+
+/*
+ Daemon cpu usage while N connections are open but don't move any data. They are either idle, or stalled:
+ their echo service has nothing to send to because we never read, so every buffer on the way is full.
+ Neither should cost any cpu, since nothing waits by spinning. Returns the cpu usage, baseline is the usage without connections.
+ */
+static double bench_idle(const std::vector<uint32_t> &devices, int conns, int seconds, bool stalled, double baseline){
+    std::vector<int> fds;
+    cleanup([&]{
+        for (int fd : fds) close(fd);
+    });
+    static char buf[BENCH_CHUNK];
+
+    for (int i=0; i<conns; i++) {
+        int fd = mux_connect(devices[i % devices.size()], stalled ? SIM_PORT_ECHO : SIM_PORT_SINK);
+        fds.push_back(fd);
+        if (!stalled) continue;
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    }
+    if (stalled) {
+        //keep writing until nothing moved for a while, the daemon forwards whatever the device still accepts
+        for (auto last = steady_clock::now(); msSince(last) < 500;) {
+            for (int fd : fds) {
+                if (send(fd, buf, sizeof(buf), MSG_NOSIGNAL) > 0) last = steady_clock::now();
+            }
+            usleep(10000);
+        }
+    }
+
+    daemonSample before = daemon_sample();
+    sleep(seconds);
+    daemonSample after = daemon_sample();
+    double cpu = daemon_cpu(before, after, seconds);
+    printf("%-7s %4d connections  daemon threads %d  cpu %.2f%%", stalled ? "stalled" : "idle", conns, after.threads, cpu);
+    if (conns && cpu >= 0 && baseline >= 0) {
+        printf("  (%.1f us cpu per connection and second above baseline)", std::max(cpu - baseline, 0.0) * 1e4 / conns);
+    }
+    printf("\n");
+    return cpu;
+}
+
+static std::vector<int> parseList(const char *str){
+    std::vector<int> ret;
+    for (const char *s = str; *s;) {
+        ret.push_back(atoi(s));
+        if (!(s = strchr(s, ','))) break;
+        s++;
+    }
+    return ret;
+}
+
+static void usage(const char *name){
+    printf("Usage: %s [OPTIONS]\n", name);
+    printf("Benchmarks a running usbmuxd, which simulates devices (--simulate-devices).\n\n");
+    printf("  -h, --help\t\t\tPrints usage information\n");
+    printf("  -s, --socket=PATH\t\tusbmuxd socket (default: %s)\n", gSocketPath);
+    printf("  -p, --pid=PID\t\t\tusbmuxd process, for thread and cpu figures (default: read from %s)\n", gPidFile);
+    printf("  -c, --connections=N[,N..]\tParallel connections for the throughput runs (default: 1,16)\n");
+    printf("  -i, --idle=N[,N..]\t\tOpen connections for the idle and stalled cpu runs, 0 skips them (default: 64)\n");
+    printf("  -t, --time=SECONDS\t\tDuration of every throughput run (default: 3)\n");
+    printf("  -n, --setups=N\t\tSequential ListDevices and Connect requests to measure latency (default: 200)\n");
+}
+
+int main(int argc, const char * argv[]) {
+    static struct option longopts[] = {
+        {"help",        no_argument,       NULL, 'h'},
+        {"socket",      required_argument, NULL, 's'},
+        {"pid",         required_argument, NULL, 'p'},
+        {"connections", required_argument, NULL, 'c'},
+        {"idle",        required_argument, NULL, 'i'},
+        {"time",        required_argument, NULL, 't'},
+        {"setups",      required_argument, NULL, 'n'},
+        {NULL, 0, NULL, 0}
+    };
+    std::vector<int> conns = {1, 16};
+    std::vector<int> idle = {64};
+    int seconds = 3;
+    int setups = 200;
+    int c = 0;
+
+    while ((c = getopt_long(argc, (char* const *)argv, "hs:p:c:i:t:n:", longopts, NULL)) != -1) {
+        switch (c) {
+            case 's':
+                gSocketPath = optarg;
+                break;
+            case 'p':
+                gDaemonPid = atoi(optarg);
+                break;
+            case 'c':
+                conns = parseList(optarg);
+                break;
+            case 'i':
+                idle = parseList(optarg);
+                idle.erase(std::remove_if(idle.begin(), idle.end(), [](int n){return n <= 0;}), idle.end());
+                break;
+            case 't':
+                seconds = atoi(optarg);
+                break;
+            case 'n':
+                setups = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return c == 'h' ? 0 : 1;
+        }
+    }
+
+    if (!gDaemonPid) {
+        FILE *f = fopen(gPidFile, "r");
+        if (f) {
+            if (fscanf(f, "%d", &gDaemonPid) != 1) gDaemonPid = 0;
+            fclose(f);
+        }
+    }
+
+    try {
+        std::vector<uint32_t> devices = list_devices();
+        retassure(devices.size(), "usbmuxd has no devices, start it with --simulate-devices");
+        printf("devices: %zu  daemon threads: %d\n", devices.size(), daemon_sample().threads);
+        if (setups > 0) {
+            bench_setup(devices, setups);
+            bench_reply_writes(setups);
+        }
+        for (int n : conns) {
+            if (n <= 0) continue;
+            bench_throughput(devices, n, seconds, false);
+            bench_throughput(devices, n, seconds, true);
+        }
+        if (idle.size()) {
+            double baseline = bench_idle(devices, 0, seconds, false, -1);
+            for (int n : idle) {
+                if (n <= 0) continue;
+                bench_idle(devices, n, seconds, false, baseline);
+                bench_idle(devices, n, seconds, true, baseline);
+            }
+        }
+    } catch (tihmstar::exception &e) {
+        printf("benchmark failed: %s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
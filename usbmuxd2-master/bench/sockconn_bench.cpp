@@ -0,0 +1,141 @@
+//
+//  sockconn_bench.cpp
+//  usbmuxd2
+//
+//  Created by tihmstar on 02.12.20.
+//  Copyright © 2020 tihmstar. All rights reserved.
+//
+
+#include <SockConn.hpp>
+#include <Reaper.hpp>
+#include <log.h>
+#include <libgeneral/macros.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+
+/*
+ Throughput of the WiFi relay. A loopback TCP server stands in for the device and a unix socketpair for the client,
+ SockConn moves the data in between exactly like it does in usbmuxd (with splice() on linux).
+ For comparison the same transfer is also measured over a plain loopback TCP connection without a relay.
+ usage: sockconn_bench [seconds] [connections]
+ */
+
+#define BENCH_CHUNK 0x10000
+
+using namespace std::chrono;
+
+static std::atomic_bool gStop{false};
+static Client::connection *gConnected = NULL;
+
+/*
+ SockConn hands itself to its client once connected. There is no client (nor Muxer) in here,
+ so this takes its place and the bench calls takeover() itself.
+ */
+void Client::connect_begin(connection *conn, uint32_t timeoutMs) noexcept{
+    gConnected = conn;
+}
+
+static void pump(int fd, bool produce, std::atomic<uint64_t> *bytes){
+    static char buf[BENCH_CHUNK];
+    while (!gStop) {
+        ssize_t cnt = produce ? send(fd, buf, sizeof(buf), MSG_NOSIGNAL) : recv(fd, buf, sizeof(buf), 0);
+        if (cnt <= 0) break;
+        if (bytes) *bytes += cnt;
+    }
+}
+
+//the "device", run() produces or discards data on every connection it accepts
+static int device_listen(uint16_t &port){
+    int fd = -1;
+    struct sockaddr_in addr = {};
+    socklen_t addrlen = sizeof(addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    assure((fd = socket(AF_INET, SOCK_STREAM, 0)) != -1);
+    assure(!bind(fd, (struct sockaddr*)&addr, sizeof(addr)));
+    assure(!listen(fd, 128));
+    assure(!getsockname(fd, (struct sockaddr*)&addr, &addrlen));
+    port = ntohs(addr.sin_port);
+    return fd;
+}
+
+static double run(int conns, int seconds, bool download, bool relay){
+    std::vector<std::thread> threads;
+    std::vector<int> fds;
+    std::atomic<uint64_t> bytes{0};
+    uint16_t port = 0;
+    int lfd = device_listen(port);
+
+    gStop = false;
+    for (int i=0; i<conns; i++) {
+        int sfd = -1;
+        if (relay) {
+            int sp[2] = {-1,-1};
+            SockConn *conn = new SockConn("127.0.0.1", port, NULL);
+            assure(!socketpair(AF_UNIX, SOCK_STREAM, 0, sp));
+            conn->connect();
+            gConnected->takeover(sp[1]);
+            sfd = sp[0];
+        } else {
+            struct sockaddr_in addr = {};
+            addr.sin_family = AF_INET;
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            addr.sin_port = htons(port);
+            assure((sfd = socket(AF_INET, SOCK_STREAM, 0)) != -1);
+            assure(!connect(sfd, (struct sockaddr*)&addr, sizeof(addr)));
+        }
+        int dfd = accept(lfd, NULL, NULL);
+        assure(dfd != -1);
+        fds.push_back(sfd);
+        fds.push_back(dfd);
+        threads.emplace_back(pump, dfd, download, nullptr);
+        threads.emplace_back(pump, sfd, !download, &bytes);
+    }
+
+    auto start = steady_clock::now();
+    std::this_thread::sleep_for(std::chrono::seconds(seconds));
+    uint64_t total = bytes;
+    double elapsed = duration_cast<microseconds>(steady_clock::now() - start).count() / 1e6;
+    gStop = true;
+    //unblocks the pumps, the relays die on their own once they notice
+    for (int fd : fds) shutdown(fd, SHUT_RDWR);
+    for (auto &t : threads) t.join();
+    for (int fd : fds) close(fd);
+    close(lfd);
+    Reaper::shared()->drain();
+    return total / elapsed / 1e6;
+}
+
+int main(int argc, const char * argv[]) {
+    int seconds = (argc > 1) ? atoi(argv[1]) : 3;
+    int maxConns = (argc > 2) ? atoi(argv[2]) : 8;
+    signal(SIGPIPE, SIG_IGN);
+    log_level = LL_WARNING;
+
+    printf("seconds per run: %d\n", seconds);
+    printf("connections  direction  SockConn relay MB/s  plain loopback MB/s\n");
+    try {
+        for (int conns = 1; conns <= maxConns; conns *= 8) {
+            for (bool download : {true, false}) {
+                double relayed = run(conns, seconds, download, true);
+                double plain = run(conns, seconds, download, false);
+                printf("%11d  %-9s  %19.1f  %19.1f\n", conns, download ? "download" : "upload", relayed, plain);
+            }
+        }
+    } catch (tihmstar::exception &e) {
+        printf("benchmark failed: %s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
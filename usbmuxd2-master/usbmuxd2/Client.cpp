@@ -16,12 +16,20 @@
 #include <netinet/tcp.h>
 #include <unistd.h>
 #include <sysconf/sysconf.hpp>
+#include <string.h>
+#include <poll.h>
+#include <errno.h>
 #include <system_error>
 
+#define CLIENT_SEND_IOVS 64 //header+payload of up to 32 packets per sendmsg
+
+size_t Client::gOutQueueLimit = 0x100000;
 
 Client::Client(Muxer *mux, int fd, uint64_t number)
-    :  _muxer(mux), _recvbuffer(NULL), _info{}, _killInProcess(false), _wlock{}, _recvbufferSize(0), _number(number), _fd(fd),
-        _proto_version(0), _isListening(false)
+    :  _muxer(mux), _recvbuffer(NULL), _info{}, _killInProcess(false), _wlock{}, _flushRequested(false),
+        _outQueuedBytes(0), _outQueuedBytesPeak(0), _outDroppedPkts(0), _outSendCalls(0), _outOverflow(false), _outPkts(0), _outBytes(0), _inBytes(0), _inCommands(0), _outPollout(false), _fdEvents(POLLIN),
+        _connecting(NULL), _connectPending(false), _connectResultSent(false), _connectTag(0), _connectDeadline{}, _recvbufferSize(0), _number(number), _fd(fd), _watchedFd(fd),
+        _proto_version(0), _isListening(false), _binaryPlist(false)
 {
     debug("[allocing] client (%p) %d",this,_fd);
     const int bufsize = Client::bufsize;
@@ -45,6 +53,7 @@ Client::Client(Muxer *mux, int fd, uint64_t number)
 #ifdef __APPLE__
     setsockopt(_fd, SOL_SOCKET, SO_NOSIGPIPE, (void*)&yes, sizeof(int));
 #endif
+    watchFd(_fd, POLLIN);
 }
 
 Client::~Client(){
@@ -55,6 +64,11 @@ Client::~Client(){
 #endif
     
     _muxer->delete_client(this); //triggers kill, but that's fine
+    stopLoop(); //unregister from reactor before closing the socket
+    if (_connecting) {
+        _connecting->abortConnect();
+        _connecting = NULL;
+    }
     safeFree(_info.bundleID);
     safeFree(_info.clientVersionString);
     safeFree(_info.progName);
@@ -63,16 +77,25 @@ Client::~Client(){
         int cfd = _fd; _fd = -1;
         close(cfd);
     }
-    stopLoop();
 
     safeFree(_recvbuffer);
-    debug("[deleted] client (%p) %d",this,_fd);
+    debug("[deleted] client (%p) %d queued=%zu peak=%zu dropped=%llu",this,_fd,_outQueuedBytes.load(),_outQueuedBytesPeak.load(),(unsigned long long)_outDroppedPkts.load());
 }
 
-void Client::loopEvent(){
-    _recvbufferSize = 0;
+void Client::fdEvent(int fd, uint32_t revents){
     try {
-        recv_data();
+        if (revents & Reactor::TIMEOUT) {
+            connect_check();
+        }
+        if (revents & POLLOUT) {
+            flush_outqueue();
+            if (_connecting) {
+                connect_check(); //result of the connect might be written completely now
+            }
+        }
+        if ((revents & ~(POLLOUT | Reactor::TIMEOUT)) && _fd != -1) {
+            recv_data();
+        }
     } catch (tihmstar::exception &e) {
         error("failed to recv_data on client %d with error=%s code=%d",_fd,e.what(),e.code());
         this->kill(); //safe to call multiple times
@@ -97,48 +120,58 @@ void Client::update_client_info(const plist_t dict){
     if ((node = plist_dict_get_item(dict, "kLibUSBMuxVersion")) && (plist_get_node_type(node) == PLIST_UINT)) {
         plist_get_uint_val(node, &_info.kLibUSBMuxVersion);
     }
+    
+    if ((node = plist_dict_get_item(dict, USBMUXD_BPLIST_CAPABILITY)) && (plist_get_node_type(node) == PLIST_BOOLEAN)) {
+        uint8_t val = 0;
+        plist_get_bool_val(node, &val);
+        _binaryPlist |= (val != 0);
+    }
 }
 
 void Client::readData(){
     ssize_t got = 0;
-    got = recv(_fd, _recvbuffer+_recvbufferSize, Client::bufsize-_recvbufferSize, 0);
+    got = recv(_fd, _recvbuffer+_recvbufferSize, Client::bufsize-_recvbufferSize, MSG_DONTWAIT);
     if (got == 0) {
         reterror("client %d disconnected!",_fd);
     }
+    if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return; //spurious wakeup
+    }
     assure(got > 0);
     _recvbufferSize+=got;
+    _inBytes += got;
 }
 
-void Client::recv_data(){    
+void Client::recv_data(){
     readData();
-    
-    if (_recvbufferSize < sizeof(usbmuxd_header)) {
-        readData();
-        retassure(_recvbufferSize >= sizeof(struct usbmuxd_header), "message is too short for header");
-    }
-    
-    while(_recvbufferSize < hdr->length) {
-        readData();
-        retassure(_recvbufferSize<Client::bufsize, "no more space to read");
+    process_commands();
+}
+
+void Client::process_commands(){
+    //process all complete messages, keep partial ones until more data arrives
+    while (!_connecting && _recvbufferSize >= sizeof(usbmuxd_header)) {
+        retassure(hdr->length >= sizeof(usbmuxd_header), "message is too short for header");
+        retassure(hdr->length <= Client::bufsize, "no more space to read");
+        if (_recvbufferSize < hdr->length) {
+            break;
+        }
+        uint32_t msglen = hdr->length;
+        _inCommands++;
+        processData(hdr);
+        _recvbufferSize -= msglen;
+        memmove(_recvbuffer, _recvbuffer+msglen, _recvbufferSize);
     }
-    
-    processData(hdr);
 }
 
 void Client::kill() noexcept{
     //sets _killInProcess to true and executes if statement if it was false before
     if (!_killInProcess.exchange(true)) {
-    
-        std::thread delthread([this](){
 #ifdef DEBUG
-            debug("killing client (%p) %d",this,_fd);
+        debug("killing client (%p) %d",this,_fd);
 #else
-            info("killing client %d",_fd);
+        info("killing client %d",_fd);
 #endif
-            delete this;
-        });
-        delthread.detach();
-        
+        release();
     }
 }
 
@@ -171,7 +204,8 @@ void Client::processData(usbmuxd_header *hdr){
             payload = (char*)(hdr) + sizeof(struct usbmuxd_header);
             payload_size = hdr->length - sizeof(struct usbmuxd_header);
             
-            plist_from_xml(payload, payload_size, &p_recieved);
+            plist_from_memory(payload, payload_size, &p_recieved);
+            retassure(p_recieved, "Failed to parse plist from client %d",_fd);
             
             {
                 plist_t p_messageType = NULL;
@@ -235,12 +269,7 @@ void Client::processData(usbmuxd_header *hdr){
                 send_plist_pkt(hdr->tag, p_rsp);
                 return;
             } else if (message == "ReadPairRecord") {
-                plist_t p_devrecord = NULL;
-                plist_t p_rsp = NULL;
-                cleanup([&]{
-                    safeFreeCustom(p_devrecord, plist_free);
-                    safeFreeCustom(p_rsp, plist_free);
-                });
+                std::shared_ptr<const SerializedPlist> rsp = nullptr;
                 std::string record_id;
                 plist_t p_recordid = NULL;
                 
@@ -260,23 +289,13 @@ void Client::processData(usbmuxd_header *hdr){
                 }
                 
                 try {
-                    p_devrecord = sysconf_get_device_record(record_id.c_str());
+                    rsp = sysconf_get_device_record_response(record_id.c_str());
                 } catch (tihmstar::exception &e) {
                     info("no record data found for device %s",record_id.c_str());
                     send_result(hdr->tag, ENOENT);
                     return;
                 }
-                p_rsp = plist_new_dict();
-                {
-                    char *plistbin = NULL;
-                    uint32_t plistbin_len = 0;
-                    cleanup([&]{
-                        safeFreeCustom(plistbin, plist_to_bin_free);
-                    });
-                    plist_to_bin(p_devrecord, &plistbin, &plistbin_len);
-                    plist_dict_set_item(p_rsp, "PairRecordData", plist_new_data(plistbin, plistbin_len));
-                }
-                send_plist_pkt(hdr->tag, p_rsp);
+                send_plist_pkt(hdr->tag, rsp);
                 return;
             } else if (message == "SavePairRecord") {
                 plist_t p_parsedPairRecord = NULL;
@@ -347,6 +366,9 @@ void Client::processData(usbmuxd_header *hdr){
                 sysconf_remove_device_record(record_id.c_str());
                 send_result(hdr->tag, RESULT_OK);
                 return;
+            }else if (message == "GetStatistics") {
+                _muxer->send_statistics(this, hdr->tag);
+                return;
             }else if (message == "ListListeners") {
 #warning UNTESTED
                 _muxer->send_listenerList(this, hdr->tag);
@@ -375,13 +397,13 @@ void Client::processData(usbmuxd_header *hdr){
 PLIST_CLIENT_CONNECTION_LOC:
     debug("Client %d connection request to device %d port %d", _fd, device_id, portnum);
     try {
-        //transfer socket ownership to device!
+        //socket ownership gets transferred to the device once the connection is established, see connect_check()
         _muxer->start_connect(device_id, portnum, this);
     } catch (tihmstar::exception &e) {
         send_result(hdr->tag, RESULT_CONNREFUSED);
         return;
     }
-    reterror("graceful kill");
+    return;
     
 PLIST_CLIENT_LISTEN_LOC:
     send_result(hdr->tag, RESULT_OK);
@@ -391,40 +413,167 @@ PLIST_CLIENT_LISTEN_LOC:
     return;
 }
 
-void Client::writeData(struct usbmuxd_header *hdr, void *buf, size_t buflen){
-    ssize_t sent = 0;
-    bool didGetLock = false;
-    
-    cleanup([&]{ //cleanup only code
-        if (didGetLock)//unlock mutex if we locked it!
-            pthread_mutex_unlock(&_wlock);
-    });
-    
-    assure(!pthread_mutex_lock(&_wlock)); didGetLock = true;
-    
-    assure((sent = send(_fd, hdr, sizeof(usbmuxd_header), 0)) == sizeof(usbmuxd_header));
-    assure((sent = send(_fd, buf, buflen, 0)) == buflen);
+void Client::updateFdEvents() noexcept{
+    uint32_t events = (_connectPending ? 0 : POLLIN) | (_outPollout ? POLLOUT : 0);
+    if (events != _fdEvents) {
+        setFdEvents(_fd, events);
+        _fdEvents = events;
+    }
+}
+
+/*
+ Writes as much of the queue as the socket takes. Packets are gathered and retired under _wlock,
+ but the sendmsg itself happens without it, so enqueueing never waits for the socket.
+ */
+void Client::write_outqueue(){
+    while (true) {
+        struct iovec iov[CLIENT_SEND_IOVS];
+        struct msghdr msg = {};
+        size_t want = 0;
+        ssize_t sent = 0;
+        int fd = -1;
+
+        //gather header and payload of as many queued packets as fit into a single sendmsg
+        pthread_mutex_lock(&_wlock);
+        fd = _fd;
+        for (auto &pkt : _outQueue) {
+            uint32_t off = pkt.sent;
+            if (msg.msg_iovlen + 2 > CLIENT_SEND_IOVS) break;
+            if (off < sizeof(usbmuxd_header)) {
+                iov[msg.msg_iovlen].iov_base = (char*)&pkt.hdr + off;
+                iov[msg.msg_iovlen].iov_len = sizeof(usbmuxd_header) - off;
+                want += iov[msg.msg_iovlen++].iov_len;
+                off = sizeof(usbmuxd_header);
+            }
+            off -= sizeof(usbmuxd_header);
+            if (off < pkt.payloadSize) {
+                iov[msg.msg_iovlen].iov_base = (char*)pkt.payload.get() + off;
+                iov[msg.msg_iovlen].iov_len = pkt.payloadSize - off;
+                want += iov[msg.msg_iovlen++].iov_len;
+            }
+        }
+        pthread_mutex_unlock(&_wlock);
+        if (!want) break;
+        msg.msg_iov = iov; //queued packets stay where they are, push_back() doesn't move deque elements
+
+        if ((sent = sendmsg(fd, &msg, MSG_DONTWAIT)) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break; //socket is full, wait for POLLOUT
+            reterror("failed to send to client %d errno=%d(%s)",fd,errno,strerror(errno));
+        }
+        _outQueuedBytes -= sent;
+        _outBytes += sent;
+        _outSendCalls++;
+
+        //retire what was written completely, the first unfinished packet remembers its offset
+        pthread_mutex_lock(&_wlock);
+        for (size_t left = sent; left && _outQueue.size();) {
+            outPacket &pkt = _outQueue.front();
+            size_t pktLeft = sizeof(usbmuxd_header) + pkt.payloadSize - pkt.sent;
+            if (left < pktLeft) {
+                pkt.sent += left;
+                break;
+            }
+            left -= pktLeft;
+            _outQueue.pop_front();
+        }
+        pthread_mutex_unlock(&_wlock);
+        if ((size_t)sent < want) break; //short write, socket is full
+    }
+
+    pthread_mutex_lock(&_wlock);
+    _outPollout = _outQueue.size() != 0; //the reactor writes the rest once the socket takes more
+    updateFdEvents();
+    pthread_mutex_unlock(&_wlock);
+}
+
+/*
+ Can be called from any thread. If another thread is currently writing, that thread picks up our request,
+ so device notifications never wait for a slow client.
+ */
+void Client::flush_outqueue(){
+    _flushRequested = true;
+    while (_flushRequested && _flushLck.try_lock()) {
+        std::unique_lock<std::mutex> fl(_flushLck, std::adopt_lock);
+        _flushRequested = false;
+        write_outqueue();
+    }
+}
+
+void Client::enqueue_pkt(uint32_t tag, usbmuxd_msgtype msg, std::shared_ptr<const char> payload, uint32_t payload_length){
+    size_t pktSize = sizeof(usbmuxd_header) + payload_length;
+    {
+        bool didGetLock = false;
+        cleanup([&]{ //cleanup only code
+            if (didGetLock)//unlock mutex if we locked it!
+                pthread_mutex_unlock(&_wlock);
+        });
+        assure(!pthread_mutex_lock(&_wlock)); didGetLock = true;
+        retassure(_fd >= 0, "client doesn't own a socket anymore");
+        retassure(!_outOverflow, "client %d is being disconnected",_fd);
+
+        //always accept at least one packet, no matter how large
+        if (_outQueue.size() && _outQueuedBytes + pktSize > gOutQueueLimit) {
+            //a client which misses messages would have an inconsistent view of the devices, disconnect it instead
+            _outDroppedPkts++;
+            _outOverflow = true;
+            error("client %d fell behind with %zu bytes queued, disconnecting",_fd,_outQueuedBytes.load());
+            shutdown(_fd, SHUT_RDWR); //reactor sees the hangup and kills the client
+            reterror("output queue of client %d overflowed",_fd);
+        }
+
+        outPacket pkt = {};
+        pkt.hdr.version = _proto_version;
+        pkt.hdr.length = (uint32_t)pktSize;
+        pkt.hdr.message = msg;
+        pkt.hdr.tag = tag;
+        pkt.payload = payload;
+        pkt.payloadSize = payload_length;
+        _outQueue.push_back(pkt);
+        _outPkts++;
+        size_t queued = (_outQueuedBytes += pktSize);
+        if (queued > _outQueuedBytesPeak) {
+            _outQueuedBytesPeak = queued;
+        }
+    }
+    //write right away if nobody else is writing, otherwise that thread or the reactor (POLLOUT) takes care of it
+    flush_outqueue();
 }
 
 void Client::send_pkt(uint32_t tag, enum usbmuxd_msgtype msg, void *payload, int payload_length){
-    struct usbmuxd_header hdr;
-    hdr.version = _proto_version;
-    hdr.length = sizeof(hdr) + payload_length;
-    hdr.message = msg;
-    hdr.tag = tag;
+    std::shared_ptr<const char> buf = nullptr;
     debug("send_pkt fd %d tag %d msg %d payload_length %d", _fd, tag, msg, payload_length);
-    writeData(&hdr, payload, payload_length);
+    if (payload_length) {
+        char *cpy = NULL;
+        assure(cpy = (char*)malloc(payload_length));
+        memcpy(cpy, payload, payload_length);
+        buf = std::shared_ptr<const char>(cpy, free);
+    }
+    enqueue_pkt(tag, msg, buf, payload_length);
 }
 
 void Client::send_plist_pkt(uint32_t tag, plist_t plist){
-    char *xml = NULL;
-    uint32_t xmlsize = 0;
+    char *buf = NULL;
+    uint32_t bufsize = 0;
+    std::shared_ptr<const char> payload = nullptr;
     cleanup([&](){ //cleanup only code
-        safeFree(xml);
+        safeFree(buf);
     });
     
-    plist_to_xml(plist, &xml, &xmlsize);
-    send_pkt(tag, MESSAGE_PLIST, xml, xmlsize);
+    if (_binaryPlist) {
+        plist_to_bin(plist, &buf, &bufsize);
+    } else {
+        plist_to_xml(plist, &buf, &bufsize);
+    }
+    assure(buf);
+    payload = std::shared_ptr<const char>(buf, free); buf = NULL; //transfer ownership
+    enqueue_pkt(tag, MESSAGE_PLIST, payload, bufsize);
+}
+
+void Client::send_plist_pkt(uint32_t tag, std::shared_ptr<const SerializedPlist> plist){
+    uint32_t bufsize = 0;
+    const char *buf = plist->data(_binaryPlist, bufsize);
+    //the payload keeps the shared plist alive until it was sent
+    enqueue_pkt(tag, MESSAGE_PLIST, std::shared_ptr<const char>(plist, buf), bufsize);
 }
 
 void Client::send_result(uint32_t tag, uint32_t result){
@@ -434,14 +583,112 @@ void Client::send_result(uint32_t tag, uint32_t result){
             plist_free(dict);
         }
     });
-    if (_proto_version == 1) {
+    if (_proto_version == 1 && !_binaryPlist) {
         /* XML plist packet */
         dict = plist_new_dict();
         plist_dict_set_item(dict, "MessageType", plist_new_string("Result"));
         plist_dict_set_item(dict, "Number", plist_new_uint(result));
         send_plist_pkt(tag, dict);
     } else {
-        /* binary packet */
+        /* binary packet, also used for clients which speak binary plists, since it is all they need */
         send_pkt(tag, MESSAGE_RESULT, &result, sizeof(uint32_t));
     }
 }
+
+void Client::connect_begin(connection *conn, uint32_t timeoutMs) noexcept{
+    _connecting = conn;
+    _connectTag = hdr->tag;
+    _connectResultSent = false;
+    _connectDeadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+
+    pthread_mutex_lock(&_wlock);
+    _connectPending = true;
+    updateFdEvents();
+    pthread_mutex_unlock(&_wlock);
+
+    //arm the timer before looking at the status, so a connection finishing right now can't be missed
+    setFdTimer(_watchedFd, timeoutMs*1000ULL + 1);
+    if (conn->connectStatus() != connection::CONNECT_PENDING) {
+        connect_kick();
+    }
+}
+
+void Client::connect_kick() noexcept{
+    setFdTimer(_watchedFd, 1); //connect_check() runs on our loop thread
+}
+
+void Client::connect_check(){
+    connection *conn = _connecting;
+    if (!conn) return;
+
+    switch (conn->connectStatus()) {
+        case connection::CONNECT_PENDING:
+        {
+            auto now = std::chrono::steady_clock::now();
+            if (now < _connectDeadline) {
+                //woken up early, wait for the rest of the timeout
+                setFdTimer(_watchedFd, std::chrono::duration_cast<std::chrono::microseconds>(_connectDeadline - now).count() + 1);
+                return;
+            }
+            error("Client %d timed out waiting for the device to accept the connection",_fd);
+        }
+            //fall through
+        case connection::CONNECT_FAILED:
+            _connecting = NULL;
+            conn->abortConnect();
+            setFdTimer(_watchedFd, 0);
+            pthread_mutex_lock(&_wlock);
+            _connectPending = false;
+            updateFdEvents();
+            pthread_mutex_unlock(&_wlock);
+            send_result(_connectTag, RESULT_CONNREFUSED);
+            process_commands(); //client might have sent more commands already
+            return;
+
+        case connection::CONNECT_DONE:
+            if (!_connectResultSent) {
+                _connectResultSent = true;
+                send_result(_connectTag, RESULT_OK);
+            }
+            if (_outQueuedBytes) {
+                return; //result needs to be on the wire before the socket carries the connection, POLLOUT calls us again
+            }
+            break;
+    }
+
+    //hand the socket over to the connection
+    int fd = _fd;
+    _connecting = NULL;
+    unwatchFd(fd); //make sure we won't handle events on this fd anymore
+    pthread_mutex_lock(&_wlock);
+    _fd = -1;
+    pthread_mutex_unlock(&_wlock);
+    debug("Client %d handing socket over to the device",fd);
+    cleanup([&]{
+        kill(); //we are done
+    });
+    conn->takeover(fd);
+}
+
+Client::outqueueStats Client::getOutQueueStats() const noexcept{
+    return {_outQueuedBytes.load(), _outQueuedBytesPeak.load(), _outDroppedPkts.load(), _outSendCalls.load()};
+}
+
+client_stats Client::getStats() noexcept{
+    client_stats ret = {};
+    ret.number = _number;
+    if (_info.progName) ret.progName = _info.progName;
+    ret.bytesIn = _inBytes;
+    ret.commands = _inCommands;
+    ret.bytesOut = _outBytes;
+    ret.pktsOut = _outPkts;
+    ret.sendCalls = _outSendCalls;
+    ret.droppedPkts = _outDroppedPkts;
+    ret.queuedBytesPeak = _outQueuedBytesPeak;
+    ret.queuedBytes = _outQueuedBytes;
+    return ret;
+}
+
+void Client::setOutQueueLimit(size_t bytes) noexcept{
+    gOutQueueLimit = bytes;
+}
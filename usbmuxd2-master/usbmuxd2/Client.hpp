@@ -10,15 +10,22 @@
 #define Client_hpp
 
 #include <Manager/Manager.hpp>
+#include <Reaper.hpp>
 #include <Muxer.hpp>
+#include <SerializedPlist.hpp>
+#include <Stats.hpp>
 #include <usbmuxd2-proto.h>
 #include <plist/plist.h>
 #include <functional>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <chrono>
 
 /*
  Well a Client is also a Manager, because it manages the connection to the other end of the socket
  */
-class Client : public Manager{
+class Client : public Manager, public Reapable{
 public:
     static constexpr int bufsize = 0x20000;
     struct cinfo{
@@ -32,31 +39,93 @@ public:
         CLIENT_LISTEN,         // listening for devices
         CLIENT_CONNECTED      // connected
     };
+    struct outqueueStats{
+        size_t queuedBytes;
+        size_t queuedBytesPeak;
+        uint64_t droppedPkts;
+        uint64_t sendCalls; //syscalls used to write the queue
+    };
+    /*
+     A connection to a device, which takes over the client socket once it is established (TCP, SockConn).
+     The client stops reading commands while the connect is pending and finishes it on its own loop thread:
+     when the connection reports CONNECT_DONE, RESULT_OK is written and the socket is handed over with takeover().
+     The client holds a reference on the connection, which it hands back with either takeover() or abortConnect().
+     */
+    class connection{
+    public:
+        enum status{
+            CONNECT_PENDING,
+            CONNECT_DONE,
+            CONNECT_FAILED
+        };
+        virtual ~connection(){}
+        virtual status connectStatus() noexcept = 0;
+        virtual void takeover(int fd) = 0; //the socket belongs to the connection, even if this throws
+        virtual void abortConnect() noexcept = 0; //connect failed, timed out or the client went away
+    };
 private:
+    struct outPacket{
+        usbmuxd_header hdr;
+        std::shared_ptr<const char> payload; //may be shared with other clients
+        uint32_t payloadSize;
+        uint32_t sent; //bytes of hdr+payload already written to the socket
+    };
     Muxer *_muxer; // unmanaged
     usbmuxd_header *hdr; //unmanaged
     char *_recvbuffer;
     cinfo _info;
     std::atomic_bool _killInProcess;
-    pthread_mutex_t _wlock;
+    pthread_mutex_t _wlock; //only held for queue operations, never while writing to the socket
+    std::mutex _flushLck; //serializes writing the queue to the socket, only ever try-locked
+    std::atomic_bool _flushRequested;
+    std::deque<outPacket> _outQueue; //needs _wlock. Only the thread holding _flushLck removes packets or touches their sent offset
+    std::atomic<size_t> _outQueuedBytes;
+    std::atomic<size_t> _outQueuedBytesPeak;
+    std::atomic<uint64_t> _outDroppedPkts;
+    std::atomic<uint64_t> _outSendCalls;
+    std::atomic_bool _outOverflow; //client fell too far behind and is being disconnected
+    std::atomic<uint64_t> _outPkts;
+    std::atomic<uint64_t> _outBytes;
+    std::atomic<uint64_t> _inBytes;
+    std::atomic<uint64_t> _inCommands;
+    bool _outPollout; //needs _wlock
+    uint32_t _fdEvents; //needs _wlock
+    connection *_connecting; //only used by our loop thread
+    bool _connectPending; //needs _wlock, we don't read commands while connecting
+    bool _connectResultSent;
+    uint32_t _connectTag;
+    std::chrono::steady_clock::time_point _connectDeadline;
+
+    static size_t gOutQueueLimit;
     size_t _recvbufferSize;
     uint64_t _number;
     int _fd;
+    const int _watchedFd; //_fd as registered with the reactor, stays valid after the socket was handed over
     uint32_t _proto_version;
     bool _isListening;
+    bool _binaryPlist; //client understands binary plists, so we don't need to generate XML
     
-    virtual void loopEvent() override;
+    virtual void fdEvent(int fd, uint32_t revents) override;
     void update_client_info(const plist_t dict);
     
     void readData();
     void recv_data();
+    void process_commands();
     
     void processData(usbmuxd_header *hdr);
     
-    void writeData(struct usbmuxd_header *hdr, void *buf, size_t buflen);
+    void updateFdEvents() noexcept; //needs _wlock
+    void write_outqueue(); //needs _flushLck
+    void flush_outqueue(); //writes what the socket takes without blocking, from any thread
+    void enqueue_pkt(uint32_t tag, usbmuxd_msgtype msg, std::shared_ptr<const char> payload, uint32_t payload_length);
     void send_pkt(uint32_t tag, usbmuxd_msgtype msg, void *payload, int payload_length);
     void send_plist_pkt(uint32_t tag, plist_t plist);
+    void send_plist_pkt(uint32_t tag, std::shared_ptr<const SerializedPlist> plist);
     void send_result(uint32_t tag, uint32_t result);
+
+    void connect_begin(connection *conn, uint32_t timeoutMs) noexcept; //from our loop thread, takes the reference conn holds for us. timeoutMs 0 only for connections which are established already
+    void connect_kick() noexcept; //any thread, status of the pending connection changed
+    void connect_check(); //from our loop thread
     
     ~Client();
 public:
@@ -64,9 +133,13 @@ public:
     Client(Client &&o) = delete; //move constructor
     
     Client(Muxer *mux, int fd, uint64_t number);
-    void kill() noexcept;
+    void kill() noexcept; //drops the initial reference
     
     const cinfo &getClientInfo(){return _info;};
+    outqueueStats getOutQueueStats() const noexcept;
+    client_stats getStats() noexcept;
+
+    static void setOutQueueLimit(size_t bytes) noexcept; //needs to be called before clients are added
     friend class Muxer;
     friend class TCP;
     friend class SockConn;
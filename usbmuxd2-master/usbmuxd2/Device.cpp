@@ -9,7 +9,6 @@
 #include "Device.hpp"
 #include <libgeneral/macros.h>
 #include <algorithm>
-#include <thread>
 #include <unistd.h>
 #include <system_error>
 
@@ -28,19 +27,19 @@ Device::~Device(){
     assert(_killInProcess);
 }
 
+void Device::killAction() noexcept{
+    //do nothing by default
+}
+
 void Device::kill() noexcept{
     //sets _killInProcess to true and executes if statement if it was false before
     if (!_killInProcess.exchange(true)){
-    
-        std::thread delthread([this](){
 #ifdef DEBUG
-            debug("killing device (%p) %s",this,_serial);
+        debug("killing device (%p) %s",this,_serial);
 #else
-            info("killing device %s",_serial);
+        info("killing device %s",_serial);
 #endif
-            delete this;
-        });
-        delthread.detach();
-        
+        killAction();
+        release();
     }
 }
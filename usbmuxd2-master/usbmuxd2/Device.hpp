@@ -10,11 +10,12 @@
 #define Device_hpp
 
 #include <atomic>
+#include <Reaper.hpp>
 
 class Muxer;
 class Client;
 
-class Device{
+class Device : public Reapable{
 public:
     enum mux_conn_type{
         MUXCONN_UNAVAILABLE = 0,
@@ -30,6 +31,7 @@ protected:
     char _serial[256];
 
     virtual ~Device();
+    virtual void killAction() noexcept; //executed once when the device gets killed, before the initial reference is dropped
 public:
     Device(const Device &) =delete; //delete copy constructor
     Device(Device &&o) = delete; //move constructor
@@ -39,7 +41,7 @@ public:
     virtual void start_connect(uint16_t dport, Client *cli) = 0;
 
     const char *getSerial() noexcept {return _serial;}
-    void kill() noexcept;
+    void kill() noexcept; //drops the initial reference, the device is deleted once nobody else holds one
     
     friend Muxer;
 };
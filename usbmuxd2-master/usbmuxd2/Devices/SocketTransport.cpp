@@ -0,0 +1,123 @@
+//
+//  SocketTransport.cpp
+//  usbmuxd2
+//
+//  Created by tihmstar on 28.11.20.
+//  Copyright © 2020 tihmstar. All rights reserved.
+//
+
+#include "SocketTransport.hpp"
+#include <log.h>
+#include <libgeneral/macros.h>
+#include <Devices/USBDevice.hpp>
+#include <Manager/DeviceManager/USBDeviceManager.hpp>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+
+void tx_callback(struct libusb_transfer *xfer) noexcept;
+
+SocketTransport::SocketTransport(int fd)
+: _dev(NULL), _rxBuf(NULL), _txThread(NULL), _txStop(false), _cancelled(false), _fd(fd)
+{
+    assure(_rxBuf = (unsigned char *)malloc(USB_MRU));
+}
+
+SocketTransport::~SocketTransport(){
+    //the device is gone by now, so nothing is submitted anymore
+    _txLck.lock();
+    _txStop = true;
+    _txLck.unlock();
+    _txCond.notify_all();
+    if (_txThread) {
+        _txThread->join();
+        delete _txThread; _txThread = NULL;
+    }
+    stopLoop();
+    if (_fd >= 0) {
+        close(_fd); _fd = -1;
+    }
+    safeFree(_rxBuf);
+}
+
+void SocketTransport::start(USBDevice *dev){
+    assure(!_dev);
+    _dev = dev;
+    _dev->retain(); //released in afterLoop
+    _txThread = new std::thread([this]{
+        tx_loop();
+    });
+    startLoop();
+}
+
+void SocketTransport::submit(struct libusb_transfer *xfer){
+    std::unique_lock<std::mutex> ul(_txLck);
+    retassure(!_cancelled, "transport was cancelled");
+    _txQueue.push_back(xfer);
+    _txCond.notify_one();
+}
+
+void SocketTransport::cancel() noexcept{
+    _txLck.lock();
+    _cancelled = true;
+    _txLck.unlock();
+    _txCond.notify_all();
+    shutdown(_fd, SHUT_RDWR); //wakes up the loop thread and fails a blocking send
+}
+
+void SocketTransport::loopEvent(){
+    ssize_t len = 0;
+    assure(_dev); //stopLoop() starts the loop if start() was never called
+    if ((len = recv(_fd, _rxBuf, USB_MRU, 0)) <= 0) {
+        if (len < 0 && errno == EINTR) return;
+        reterror("transport of device %s closed (ret=%zd errno=%d)", _dev->getSerial(), len, errno);
+    }
+    _dev->device_data_input(_rxBuf, (uint32_t)len, USB_MRU);
+}
+
+void SocketTransport::afterLoop() noexcept{
+    if (!_dev) return;
+    _dev->kill(); //the other end is gone, same as unplugging a device
+    _dev->release(); //might delete the device and us
+}
+
+void SocketTransport::stopAction() noexcept{
+    shutdown(_fd, SHUT_RDWR);
+}
+
+/*
+ Writes transfers in the order they were submitted. Once cancelled, the remaining ones fail like cancelled libusb transfers.
+ */
+void SocketTransport::tx_loop() noexcept{
+    std::unique_lock<std::mutex> ul(_txLck);
+    while (true) {
+        struct libusb_transfer *xfer = NULL;
+        if (!_txQueue.size()) {
+            if (_txStop) break;
+            _txCond.wait(ul);
+            continue;
+        }
+        xfer = _txQueue.front();
+        _txQueue.pop_front();
+        if (_cancelled) {
+            xfer->status = LIBUSB_TRANSFER_CANCELLED;
+            xfer->actual_length = 0;
+        } else {
+            ssize_t sent = 0;
+            ul.unlock();
+            //ZLPs only matter to real USB hardware
+            if (xfer->length == 0 || (sent = send(_fd, xfer->buffer, xfer->length, MSG_NOSIGNAL)) == xfer->length) {
+                xfer->status = LIBUSB_TRANSFER_COMPLETED;
+                xfer->actual_length = xfer->length;
+            } else {
+                xfer->status = LIBUSB_TRANSFER_NO_DEVICE;
+                xfer->actual_length = 0;
+            }
+            ul.lock();
+        }
+        ul.unlock();
+        tx_callback(xfer); //might drop the last reference to the device
+        ul.lock();
+    }
+}
@@ -0,0 +1,51 @@
+//
+//  SocketTransport.hpp
+//  usbmuxd2
+//
+//  Created by tihmstar on 28.11.20.
+//  Copyright © 2020 tihmstar. All rights reserved.
+//
+
+#ifndef SocketTransport_hpp
+#define SocketTransport_hpp
+
+#include <Devices/USBTransport.hpp>
+#include <Manager/Manager.hpp>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+/*
+ USBTransport over a message preserving socket (SOCK_SEQPACKET on linux, SOCK_DGRAM elsewhere),
+ every message is one bulk transfer.
+ Input is read on the loop thread, TX transfers are written on a separate thread so submit() never blocks.
+ */
+class SocketTransport : public USBTransport, Manager{
+    USBDevice *_dev; //holds a reference while the loop is running
+    unsigned char *_rxBuf;
+    std::thread *_txThread;
+    std::mutex _txLck;
+    std::condition_variable _txCond;
+    std::deque<struct libusb_transfer *> _txQueue; //needs _txLck
+    bool _txStop; //needs _txLck
+    bool _cancelled; //needs _txLck
+    int _fd;
+
+    virtual void loopEvent() override;
+    virtual void afterLoop() noexcept override;
+    virtual void stopAction() noexcept override;
+    void tx_loop() noexcept;
+
+public:
+    SocketTransport(int fd); //takes ownership of fd
+    SocketTransport(const SocketTransport &) = delete; //delete copy constructor
+    SocketTransport(SocketTransport &&o) = delete; //move constructor
+    virtual ~SocketTransport() override;
+
+    virtual void start(USBDevice *dev) override;
+    virtual void submit(struct libusb_transfer *xfer) override;
+    virtual void cancel() noexcept override;
+};
+
+#endif /* SocketTransport_hpp */
@@ -10,82 +10,412 @@
 #include <log.h>
 #include <libgeneral/macros.h>
 #include <Manager/DeviceManager/USBDeviceManager.hpp>
+#include <Manager/CaptureManager.hpp>
+#include <Devices/USBTransport.hpp>
 #include <TCP.hpp>
 #include <Client.hpp>
+#include <sysconf/sysconf.hpp>
 #include <string.h>
 
+// how long a sender waits for a pooled tx transfer before allocating an additional one
+#define TX_POOL_MAX_WAIT_MS 1000
+
 #pragma mark libusb_callback definitions
 
 void tx_callback(struct libusb_transfer *xfer) noexcept;
 
 #pragma mark USBDevice
 
+unsigned USBDevice::gRXMaxTransfers = 0;
+
 USBDevice::USBDevice(Muxer *mux)
-: Device(mux, Device::MUXCONN_USB), _parent(NULL), _state{MUXDEV_INIT}, _usbdev(NULL), _speed(0), _wMaxPacketSize(0), _devdesc{},
-    _muxdev{}, _pid(0), _bus(0), _address(0), _interface(0), _ep_in(0), _ep_out(0), _nextPort(1)
+: Device(mux, Device::MUXCONN_USB), _parent(NULL), _state{MUXDEV_INIT}, _usbdev(NULL), _transport(NULL), _speed(0), _wMaxPacketSize(0), _devdesc{},
+    _muxdev{}, _pid(0), _bus(0), _address(0), _interface(0), _ep_in(0), _ep_out(0),
+    _bringupStart(std::chrono::steady_clock::now()), _stageStart(_bringupStart), _stageUsec{},
+    _rxFrags{}, _rxFragsLen{}, _rxFragsCnt(0), _rxFragsTotal(0),
+    _rxStats{}, _rxWinStart(_bringupStart), _rxWinBytes(0), _rxWinXfers(0), _rxWinFull(0),
+    _connPages{}, _connsUnused(1), _connsFreeCnt(0), _connsFreeHead(0), _connsFreeTail(0), _connsOpenHead(0), //port 0 is never used
+    _txPoolAllocated(0), _txPoolWaiters(0), _txPoolDying(false), _txPoolHits(0), _txPoolMisses(0), _counters{}
 {
-    assure(_muxdev.pktbuf = (unsigned char *)malloc(DEV_MRU));
-    _muxdev.pktlen = 0;
+    //
 }
 
 USBDevice::~USBDevice(){
     debug("deleting device %s",_serial);
+    if (_transport) {
+        delete _transport; _transport = NULL; //joins its threads, which might still be returning from calls into us
+    }
+    if (_rxStats.transfers) {
+        info("RX stats for device %s: %llu bytes in %llu transfers (%llu full), depth %u of %u-%u, size %u of %u, %llu adjustments",
+             _serial, (unsigned long long)_rxStats.bytes, (unsigned long long)_rxStats.transfers, (unsigned long long)_rxStats.fullTransfers,
+             _rxStats.depth, _rxStats.minDepth, _rxStats.maxDepth, _rxStats.size, _rxStats.maxSize, (unsigned long long)_rxStats.adjustments);
+    }
     
     _muxer->delete_device(this);
     
-    //cancel all rx transfers
-    _rx_xfers.addMember();
+    //in flight transfers and connections hold references to us, so all of them are gone by now
+#ifdef DEBUG
+    assert(_rx_xfers._elems.empty());
+    assert(_tx_xfers._elems.empty());
+#endif
+    
+    //free tx transfer pool
+    {
+        std::unique_lock<std::mutex> ul(_txPoolLck);
+        _txPoolCond.wait(ul, [this]{return _txPoolWaiters == 0;});
+        for (auto xfer : _txPool) {
+            safeFree(xfer->buffer);
+            libusb_free_transfer(xfer);
+            _txPoolAllocated--;
+        }
+        _txPool.clear();
+    }
+    debug("device %s tx pool hits=%llu misses=%llu",_serial,(unsigned long long)_txPoolHits,(unsigned long long)_txPoolMisses);
+    
+    //free resources
+    if (_usbdev){
+        libusb_release_interface(_usbdev, _interface);
+        libusb_close(_usbdev);
+    }
+    
+    rx_drop_fragments();
+    for (auto &page : _connPages) {
+        delete [] page.exchange(NULL);
+    }
+    
+    debug("[deleted] device (%p) %s",this,_serial);
+}
+
+void USBDevice::killAction() noexcept{
+    //wake up senders waiting for a tx transfer
+    _txPoolLck.lock();
+    _txPoolDying = true;
+    _txPoolLck.unlock();
+    _txPoolCond.notify_all();
+    
+    //in flight transfers hold a reference to us, cancel them so they get released.
+    //No new transfers are submitted once _killInProcess is set
+    if (_transport) {
+        _transport->cancel(); //completes its transfers asynchronously
+    } else {
+        cancel_xfers();
+    }
+    
+    //connections hold a reference to us as well, their destructors close their slots.
+    //Don't wait here, we might be called while handling input for one of them
+    std::vector<uint16_t> ports;
+    try {
+        conn_open_ports(ports);
+    } catch (...) {
+        error("Failed to list connections of dying device %s, they stay open until their clients leave",_serial);
+    }
+    for (uint16_t sPort : ports) {
+        if (TCP *conn = conn_acquire(sPort)) {
+            conn->kill();
+            conn_release(sPort);
+        }
+    }
+}
+
+void USBDevice::cancel_xfers() noexcept{
+    _rx_xfers.lockMember();
     for (auto xfer : _rx_xfers._elems) {
         debug("cancelling _rx_xfers(%p)",xfer);
         libusb_cancel_transfer(xfer);
     }
-    _rx_xfers.delMember();
+    _rx_xfers.unlockMember();
     
-
-    //cancel all tx transfers
-    _tx_xfers.addMember();
+    _tx_xfers.lockMember();
     for (auto xfer : _tx_xfers._elems) {
         debug("cancelling _tx_xfers(%p)",xfer);
         libusb_cancel_transfer(xfer);
     }
-    _tx_xfers.delMember();
+    _tx_xfers.unlockMember();
+}
 
-    
-    // Busy-wait until all xfers are closed
-    while (_rx_xfers._elems.size() > 0){
-        _rx_xfers.notifyBlock();
+void USBDevice::setRXMaxTransfers(unsigned xfers) noexcept{
+    gRXMaxTransfers = xfers;
+}
+
+USBDevice::rx_stats USBDevice::getRXStats() noexcept{
+    rx_stats ret = {};
+    _rx_xfers.lockMember();
+    ret = _rxStats;
+    ret.inFlight = (uint32_t)_rx_xfers._elems.size();
+    _rx_xfers.unlockMember();
+    return ret;
+}
+
+usb_stats USBDevice::getStats() noexcept{
+    usb_stats ret = {};
+    rx_stats rx = getRXStats();
+    ret.rxSubmitted = _counters.rxSubmitted;
+    ret.rxCompleted = rx.transfers;
+    ret.rxFull = rx.fullTransfers;
+    ret.rxBytes = rx.bytes;
+    ret.rxReassembled = _counters.rxReassembled;
+    ret.rxDropped = _counters.rxDropped;
+    ret.txSubmitted = _counters.txSubmitted;
+    ret.txCompleted = _counters.txCompleted;
+    ret.txBytes = _counters.txBytes;
+    ret.txZLPs = _counters.txZLPs;
+    ret.txPoolHits = _txPoolHits;
+    ret.txPoolMisses = _txPoolMisses;
+    ret.errors = _counters.errors;
+    ret.rxInFlight = rx.inFlight;
+    ret.rxDepth = rx.depth;
+    ret.rxSize = rx.size;
+    return ret;
+}
+
+void USBDevice::getConnStats(std::vector<tcp_stats> &conns){
+    std::vector<uint16_t> ports;
+    conn_open_ports(ports);
+    for (uint16_t sPort : ports) {
+        TCP *conn = conn_acquire(sPort);
+        if (!conn) continue;
+        cleanup([&]{
+            conn_release(sPort);
+        });
+        conns.push_back(conn->getStats());
     }
-    while (_tx_xfers._elems.size() > 0) {
-        _tx_xfers.notifyBlock();
+}
+
+/*
+ Picks the RX limits for the link speed, unless they are overridden for this device.
+ Starts out with the largest transfers, rx_tune() shrinks them if the device turns out to be idle.
+ */
+void USBDevice::rx_init(){
+    unsigned maxDepth = 0;
+    unsigned maxSize = USB_MRU;
+    unsigned depth = 0;
+
+    if (_speed >= 5000000000) {
+        _rxStats.minDepth = 2;
+        depth = NUM_RX_LOOPS+1;
+        maxDepth = 16;
+    } else if (_speed >= 480000000) {
+        _rxStats.minDepth = 1;
+        depth = NUM_RX_LOOPS;
+        maxDepth = 8;
+    } else {
+        _rxStats.minDepth = 1;
+        depth = 1;
+        maxDepth = 2;
+        maxSize = RX_XFER_SIZE_STEP;
     }
-    
-    //close connections
-    while (_conns._elems.size()) {
-        std::pair<uint16_t, TCP*> sPort = {0,NULL};
-        _conns.addMember();
-        if (_conns._elems.size()) {
-            sPort = *_conns._elems.begin();
-        }
-        _conns.delMember();
-        
-        if (sPort.first) {
-            try {
-                close_connection(sPort.first);
-            } catch (...) {
-                //
+    if (gRXMaxTransfers) {
+        maxDepth = gRXMaxTransfers;
+    }
+    if (sysconf_get_device_rx_limits(_serial, maxDepth, maxSize)) {
+        info("Using configured RX limits for device %s: %u transfers of up to %u bytes", _serial, maxDepth, maxSize);
+    }
+
+    //usbfs splits larger transfers, which breaks reassembly
+    maxSize -= maxSize % RX_XFER_SIZE_STEP;
+    if (maxSize < RX_XFER_SIZE_STEP) maxSize = RX_XFER_SIZE_STEP;
+    if (maxSize > USB_MRU) maxSize = USB_MRU;
+    if (!maxDepth) maxDepth = 1;
+    if (_rxStats.minDepth > maxDepth) _rxStats.minDepth = maxDepth;
+    if (depth > maxDepth) depth = maxDepth;
+
+    _rxStats.maxDepth = maxDepth;
+    _rxStats.depth = depth;
+    _rxStats.maxSize = maxSize;
+    _rxStats.size = maxSize;
+    _rxWinStart = std::chrono::steady_clock::now();
+    debug("RX limits for device %s: %u-%u transfers (starting with %u) of up to %u bytes", _serial, _rxStats.minDepth, maxDepth, depth, maxSize);
+}
+
+/*
+ Called for every completed RX transfer.
+ If most transfers came back full, the device had more data than we asked for: grow the transfers first, then add more of them.
+ If there was hardly any traffic, drop transfers first, then shrink them.
+ */
+int USBDevice::rx_tune(struct libusb_transfer *xfer) noexcept{
+    auto now = std::chrono::steady_clock::now();
+    uint32_t inFlight = (uint32_t)_rx_xfers._elems.size(); //includes xfer
+    
+    _rxStats.bytes += xfer->actual_length;
+    _rxStats.transfers++;
+    _rxWinBytes += xfer->actual_length;
+    _rxWinXfers++;
+    if (xfer->actual_length == xfer->length) {
+        _rxStats.fullTransfers++;
+        _rxWinFull++;
+    }
+
+    if (now - _rxWinStart >= std::chrono::milliseconds(RX_TUNE_INTERVAL_MS)) {
+        uint32_t depth = _rxStats.depth;
+        uint32_t size = _rxStats.size;
+        if (_rxWinFull*2 > _rxWinXfers) {
+            if (size < _rxStats.maxSize) {
+                size += RX_XFER_SIZE_STEP;
+            } else if (depth < _rxStats.maxDepth) {
+                depth++;
             }
+        } else if (!_rxWinFull && _rxWinBytes < RX_IDLE_BYTES) {
+            if (depth > _rxStats.minDepth) {
+                depth--;
+            } else if (size > RX_XFER_SIZE_STEP) {
+                size -= RX_XFER_SIZE_STEP;
+            }
+        }
+        if (depth != _rxStats.depth || size != _rxStats.size) {
+            debug("Adjusting RX of device %s: %u -> %u transfers, %u -> %u bytes (%u of %u full, %llu bytes in the last interval)",
+                  _serial, _rxStats.depth, depth, _rxStats.size, size, _rxWinFull, _rxWinXfers, (unsigned long long)_rxWinBytes);
+            _rxStats.depth = depth;
+            _rxStats.size = size;
+            _rxStats.adjustments++;
         }
+        _rxWinStart = now;
+        _rxWinBytes = 0;
+        _rxWinXfers = 0;
+        _rxWinFull = 0;
     }
-    
-    //free resources
-    if (_usbdev){
-        libusb_release_interface(_usbdev, _interface);
-        libusb_close(_usbdev);
+
+    if (inFlight > _rxStats.depth) {
+        return -1;
+    }
+    if ((uint32_t)xfer->length != _rxStats.size) {
+        if (void *buf = realloc(xfer->buffer, _rxStats.size)) {
+            xfer->buffer = (unsigned char *)buf;
+            xfer->length = (int)_rxStats.size;
+        }
+    }
+    return (int)(_rxStats.depth - inFlight);
+}
+
+void USBDevice::tx_pool_init(){
+    std::vector<struct libusb_transfer *> xfers;
+    cleanup([&]{
+        for (auto xfer : xfers) {
+            safeFree(xfer->buffer);
+            libusb_free_transfer(xfer);
+        }
+    });
+    for (int i=0; i<NUM_TX_XFERS; i++) {
+        xfers.push_back(tx_alloc());
+    }
+    _txPoolLck.lock();
+    _txPool.insert(_txPool.end(), xfers.begin(), xfers.end());
+    _txPoolAllocated += (uint32_t)xfers.size();
+    _txPoolLck.unlock();
+    xfers.clear();
+}
+
+struct libusb_transfer *USBDevice::tx_alloc(){
+    struct libusb_transfer *xfer = NULL;
+    unsigned char *buf = NULL;
+    cleanup([&]{
+        safeFree(buf);
+        if (xfer) {
+            libusb_free_transfer(xfer);
+        }
+    });
+    retassure(xfer = libusb_alloc_transfer(0), "Failed to allocate TX transfer for device %d-%d", _bus, _address);
+    retassure(buf = (unsigned char *)malloc(USB_MTU), "Failed to allocate TX buffer for device %d-%d", _bus, _address);
+    libusb_fill_bulk_transfer(xfer, _usbdev, _ep_out, buf, 0, tx_callback, this, 0);
+    buf = NULL;
+    {
+        struct libusb_transfer *ret = xfer; xfer = NULL;
+        return ret;
+    }
+}
+
+/*
+ Takes an idle transfer from the pool.
+ If the pool is empty, waits up to TX_POOL_MAX_WAIT_MS for tx_callback to return one (back-pressure).
+ Never waits when called from the libusb event thread, since that thread is the one recycling transfers.
+ If no transfer becomes available, an additional one is allocated which is dropped again once the pool is full.
+ */
+struct libusb_transfer *USBDevice::tx_acquire(bool mayBlock){
+    struct libusb_transfer *xfer = NULL;
+    std::unique_lock<std::mutex> ul(_txPoolLck);
+    retassure(!_txPoolDying, "Device %d-%d is dying", _bus, _address);
+    if (_txPool.size()) {
+        xfer = _txPool.back();
+        _txPool.pop_back();
+        _txPoolHits++;
+        return xfer;
+    }
+    _txPoolMisses++;
+
+    if (mayBlock && !USBDeviceManager::isEventThread()) {
+        _txPoolWaiters++;
+        _txPoolCond.wait_for(ul, std::chrono::milliseconds(TX_POOL_MAX_WAIT_MS), [this]{return _txPool.size() || _txPoolDying;});
+        _txPoolWaiters--;
+        if (_txPoolDying) {
+            ul.unlock();
+            _txPoolCond.notify_all(); //destructor might be waiting for us
+            reterror("Device %d-%d is dying", _bus, _address);
+        }
+        if (_txPool.size()) {
+            xfer = _txPool.back();
+            _txPool.pop_back();
+            return xfer;
+        }
+        debug("tx pool of device %d-%d exhausted, allocating additional transfer", _bus, _address);
+    }
+
+    _txPoolAllocated++;
+    ul.unlock();
+    try {
+        return tx_alloc();
+    } catch (...) {
+        ul.lock();
+        _txPoolAllocated--;
+        throw;
+    }
+}
+
+/*
+ untracks xfer and puts it back into the pool.
+ Done while holding _txPoolLck, so the destructor can't free the pool while we are still in here.
+ */
+void USBDevice::tx_release(struct libusb_transfer *xfer) noexcept{
+    bool wasInFlight = false;
+    _txPoolLck.lock();
+    _tx_xfers.lockMember();
+    wasInFlight = _tx_xfers._elems.erase(xfer);
+    _tx_xfers.unlockMember();
+    if (!_txPoolDying && _txPool.size() < NUM_TX_XFERS) {
+        _txPool.push_back(xfer);
+        xfer = NULL;
+        _txPoolCond.notify_one();
+    } else {
+        _txPoolAllocated--;
+    }
+    _txPoolLck.unlock();
+    if (xfer) {
+        safeFree(xfer->buffer);
+        libusb_free_transfer(xfer);
+    }
+    if (wasInFlight) {
+        release(); //might delete us
+    }
+}
+
+/*
+ tracks xfer and submits it.
+ The transfer holds a reference to us until tx_release(), also if submitting fails.
+ */
+void USBDevice::tx_submit(struct libusb_transfer *xfer){
+    int ret = 0;
+    _tx_xfers.lockMember();
+    cleanup([&]{
+        _tx_xfers.unlockMember();
+    });
+    retassure(!_killInProcess, "Device %d-%d is dying", _bus, _address); //killAction() won't see transfers submitted after it ran
+    _tx_xfers._elems.insert(xfer);
+    retain();
+    _counters.txSubmitted++;
+    _counters.txBytes += xfer->length; //xfer might be recycled as soon as it was submitted
+    if (_transport) {
+        _transport->submit(xfer);
+    } else {
+        retassure(((ret = libusb_submit_transfer(xfer)),ret) >=0, "Failed to submit TX transfer %p len %d to device %d-%d: %d", xfer, xfer->length, _bus, _address, ret);
     }
-    
-    safeFree(_muxdev.pktbuf);
-    
-    debug("[deleted] device (%p) %s",this,_serial);
 }
 
 void USBDevice::mux_init(){
@@ -98,57 +428,54 @@ void USBDevice::mux_init(){
     send_packet(MUX_PROTO_VERSION, &vh, sizeof(vh));
 }
 
+void USBDevice::bringup_stage_done(bringup_stage stage) noexcept{
+    auto now = std::chrono::steady_clock::now();
+    _stageUsec[stage] = (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(now - _stageStart).count();
+    _stageStart = now;
+}
+
+void USBDevice::bringup_report() noexcept{
+    uint32_t total = (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(_stageStart - _bringupStart).count();
+    info("Bring-up of device %s took %.1fms (queued %.1fms, descriptor %.1fms, configuration %.1fms, rx %.1fms, version %.1fms, preflight %.1fms)",
+         _serial, total/1000.0,
+         _stageUsec[BRINGUP_QUEUED]/1000.0, _stageUsec[BRINGUP_DESCRIPTOR]/1000.0, _stageUsec[BRINGUP_CONFIGURATION]/1000.0,
+         _stageUsec[BRINGUP_RXLOOP]/1000.0, _stageUsec[BRINGUP_VERSION]/1000.0, _stageUsec[BRINGUP_PREFLIGHT]/1000.0);
+}
+
 /*
- always frees buf
+ always consumes xfer (it is either submitted or returned to the pool)
  */
-void USBDevice::usb_send(void *buf, size_t length){
-    int ret = 0;
-    struct libusb_transfer *xfer = NULL;
+void USBDevice::usb_send(struct libusb_transfer *xfer, size_t length){
     cleanup([&]{
-        safeFree(buf);
         if (xfer) {
-            _tx_xfers.lockMember();
-            _tx_xfers._elems.erase(xfer);
-            _tx_xfers.unlockMember();
-            safeFree(xfer->buffer);
-            libusb_free_transfer(xfer);
+            tx_release(xfer);
         }
     });
 
-    assure(length<=INT_MAX); //sanity check
-    assure(xfer = libusb_alloc_transfer(0));
-    libusb_fill_bulk_transfer(xfer, _usbdev, _ep_out, (unsigned char *)buf, (int)length, tx_callback, this, 0);
-    buf = NULL;
-
-    _tx_xfers.lockMember();
-    _tx_xfers._elems.insert(xfer);
-    _tx_xfers.unlockMember();
-    retassure(((ret = libusb_submit_transfer(xfer)),ret) >=0, "Failed to submit TX transfer %p len %zu to device %d-%d: %d", buf, length, _bus, _address, ret);
+    assure(length<=USB_MTU); //sanity check
+    xfer->length = (int)length;
+    tx_submit(xfer);
     xfer = NULL;
     
     if (length % _wMaxPacketSize == 0) {
         debug("Send ZLP");
         // Send Zero Length Packet
-        xfer = libusb_alloc_transfer(0);
-        buf = malloc(1);
-        libusb_fill_bulk_transfer(xfer, _usbdev, _ep_out, (unsigned char *)buf, 0, tx_callback, this, 0);
-        buf = NULL;
-
-        _tx_xfers.lockMember();
-        _tx_xfers._elems.insert(xfer);
-        _tx_xfers.unlockMember();
-        retassure(((ret = libusb_submit_transfer(xfer)),ret) >=0, "Failed to submit TX ZLP transfer to device %d-%d: %d", _bus, _address, ret);
+        xfer = tx_acquire(false); //we are holding _usbLck, don't wait here
+        xfer->length = 0;
+        tx_submit(xfer);
         xfer = NULL;
+        _counters.txZLPs++;
     }
 }
 
 
 void USBDevice::send_packet(enum mux_protocol proto, const void *data, size_t length, tcphdr *header){
     /*
-     buf allocated and guaranteed transfered to usb_send without failing in between.
-     usb_send will always make sure buf is freed, even in case of failure.
-     Don't free buf in this function in any case!
+     xfer taken from the pool and guaranteed transfered to usb_send without failing in between.
+     usb_send will always make sure xfer is returned to the pool, even in case of failure.
+     Don't release xfer in this function in any case!
      */
+    struct libusb_transfer *xfer = NULL;
     unsigned char *buf = NULL; //unchecked
     size_t buflen = 0;
     struct mux_header *mhdr = NULL; //unchecked
@@ -164,7 +491,13 @@ void USBDevice::send_packet(enum mux_protocol proto, const void *data, size_t le
     
     retassure(buflen <= USB_MTU, "Tried to send packet larger than USB MTU (hdr %zu data %zu total %zu) to device %s", buflen, length, buflen, _serial);
     
-    buf = (unsigned char *)malloc(buflen); //unchecked
+    if (CaptureManager *cap = _muxer->captureManager()) {
+        struct iovec iov[2] = {{header, header ? sizeof(tcphdr) : 0}, {(void*)data, length}};
+        cap->capture(_id, true, proto, iov, 2, (uint32_t)(buflen - mux_header_size));
+    }
+
+    xfer = tx_acquire(); //may block until a transfer is available (back-pressure)
+    buf = xfer->buffer;
     mhdr = (struct mux_header *)buf;
     mhdr->protocol = htonl(proto);
     mhdr->length = htonl(buflen);
@@ -189,8 +522,8 @@ void USBDevice::send_packet(enum mux_protocol proto, const void *data, size_t le
     }
     
     try {
-        unsigned char *sendbuf = buf; buf = NULL; //freed by usb_send in any case
-        usb_send(sendbuf, buflen);
+        struct libusb_transfer *sendxfer = xfer; xfer = NULL; //released by usb_send in any case
+        usb_send(sendxfer, buflen);
     } catch (tihmstar::exception &e) {
         debug("failed to send packet to usbdevice(%p) error=%s code=%d",this,e.what(),e.code());
         _usbLck.unlock();
@@ -201,11 +534,40 @@ void USBDevice::send_packet(enum mux_protocol proto, const void *data, size_t le
 }
 
 
-void USBDevice::device_data_input(unsigned char *buffer, uint32_t length){
+void USBDevice::rx_keep_fragment(unsigned char *&buffer, uint32_t length, uint32_t xferSize){
+    unsigned char *fresh = NULL;
+    if (_rxFragsCnt >= RX_MAX_FRAGMENTS-1) { //leave room for the last part
+        rx_drop_fragments();
+        _counters.rxDropped++;
+        reterror("Incoming split packet for device %s has too many fragments, dropping!", _serial);
+    }
+    assure(fresh = (unsigned char *)malloc(xferSize));
+    _rxFrags[_rxFragsCnt] = buffer;
+    _rxFragsLen[_rxFragsCnt] = length;
+    _rxFragsCnt++;
+    _rxFragsTotal += length;
+    buffer = fresh; //the RX transfer continues with the fresh buffer
+}
+
+void USBDevice::rx_drop_fragments() noexcept{
+    for (uint32_t i=0; i<_rxFragsCnt; i++) {
+        safeFree(_rxFrags[i]);
+    }
+    _rxFragsCnt = 0;
+    _rxFragsTotal = 0;
+}
+
+/*
+ Mux packets larger than an RX transfer arrive in several transfers.
+ Instead of copying them into a reassembly buffer, the transfer buffers are taken over (and replaced by fresh ones)
+ until the packet is complete. The packet is then processed as a list of views into these buffers.
+ Packets contained in a single transfer are processed in place.
+ */
+void USBDevice::device_data_input(unsigned char *&buffer, uint32_t length, uint32_t xferSize){
+    std::unique_lock<std::mutex> ul(_rxLck);
+    struct iovec frags[RX_MAX_FRAGMENTS] = {};
     struct mux_header *mhdr = NULL;
-    unsigned char *payload = NULL;
-    uint32_t payload_length = 0;
-    int mux_header_size = 0;
+    int fragsCnt = 0;
 
     if(!length)
         return;
@@ -214,41 +576,85 @@ void USBDevice::device_data_input(unsigned char *buffer, uint32_t length){
     retassure((length <= USB_MRU) && (length <= DEV_MRU),"Too much data received from USB (%u), file a bug", length);
     
     debug("Mux data input for device %s: len %u", _serial, length);
-    mhdr = (struct mux_header *)_muxdev.pktbuf;
     
     // handle broken up transfers
-    if(_muxdev.pktlen) {
-        if((length + _muxdev.pktlen) > DEV_MRU) {
-            error("Incoming split packet is too large (%u so far), dropping!", length + _muxdev.pktlen);
-            _muxdev.pktlen = 0;
+    if(_rxFragsCnt) {
+        if((length + _rxFragsTotal) > DEV_MRU) {
+            error("Incoming split packet is too large (%u so far), dropping!", length + _rxFragsTotal);
+            rx_drop_fragments();
+            _counters.rxDropped++;
             return;
         }
-        
-        memcpy(_muxdev.pktbuf + _muxdev.pktlen, buffer, length);
-        
-        if((length < USB_MRU) || (ntohl(mhdr->length) == (length + _muxdev.pktlen))) {
-            buffer = _muxdev.pktbuf;
-            length += _muxdev.pktlen;
-            _muxdev.pktlen = 0;
-            debug("Gathered mux data from buffer (total size: %u)", length);
-        } else {
-            _muxdev.pktlen += (uint32_t)length;
-            debug("Appended mux data to buffer (total size: %u)", _muxdev.pktlen);
+        mhdr = (struct mux_header *)_rxFrags[0];
+        if((length == xferSize) && (ntohl(mhdr->length) != (length + _rxFragsTotal))) {
+            rx_keep_fragment(buffer, length, xferSize);
+            debug("Kept mux data fragment (total size: %u)", _rxFragsTotal);
             return;
         }
+        for (; fragsCnt < (int)_rxFragsCnt; fragsCnt++) {
+            frags[fragsCnt].iov_base = _rxFrags[fragsCnt];
+            frags[fragsCnt].iov_len = _rxFragsLen[fragsCnt];
+        }
+        debug("Gathered mux data from %d transfers (total size: %u)", fragsCnt+1, length + _rxFragsTotal);
+        _counters.rxReassembled++;
     } else {
-        if((length == USB_MRU) && (length < ntohl(mhdr->length))) {
-            memcpy(_muxdev.pktbuf, buffer, length);
-            _muxdev.pktlen = (uint32_t)length;
-            debug("Copied mux data to buffer (size: %u)", _muxdev.pktlen);
+        mhdr = (struct mux_header *)buffer;
+        if((length == xferSize) && (length < ntohl(mhdr->length))) {
+            rx_keep_fragment(buffer, length, xferSize);
+            debug("Kept mux data fragment (size: %u)", _rxFragsTotal);
             return;
         }
     }
-    
-    mhdr = (struct mux_header *)buffer;
+    //the last part is only referenced while processing, no need to take it over
+    frags[fragsCnt].iov_base = buffer;
+    frags[fragsCnt].iov_len = length;
+    fragsCnt++;
+
+    {
+        cleanup([&]{
+            rx_drop_fragments();
+        });
+        device_packet_input(frags, fragsCnt, length + _rxFragsTotal);
+    }
+}
+
+/*
+ frags[0] holds at least the mux and TCP headers, since a packet only spans multiple transfers if the first one is full.
+ */
+void USBDevice::device_packet_input(const struct iovec *frags, int fragsCnt, uint32_t length){
+    struct mux_header *mhdr = NULL;
+    unsigned char *payload = NULL;
+    unsigned char *linear = NULL;
+    uint32_t payload_length = 0;
+    int mux_header_size = 0;
+    cleanup([&]{
+        safeFree(linear);
+    });
+
+    mhdr = (struct mux_header *)frags[0].iov_base;
     mux_header_size = ((_muxdev.version < 2) ? 8 : sizeof(struct mux_header));
     retassure(ntohl(mhdr->length) == length, "Incoming packet size mismatch (dev %s, expected %d, got %u)", _serial, ntohl(mhdr->length), length);
     
+    if (CaptureManager *cap = _muxer->captureManager(); cap && frags[0].iov_len >= (size_t)mux_header_size) {
+        struct iovec capFrags[RX_MAX_FRAGMENTS] = {};
+        for (int i=0; i<fragsCnt; i++) {
+            capFrags[i] = frags[i];
+        }
+        capFrags[0].iov_base = (char*)frags[0].iov_base + mux_header_size;
+        capFrags[0].iov_len -= mux_header_size;
+        cap->capture(_id, false, ntohl(mhdr->protocol), capFrags, fragsCnt, length - mux_header_size);
+    }
+
+    if (fragsCnt > 1 && ntohl(mhdr->protocol) != MUX_PROTO_TCP) {
+        //rare, not worth handling fragments everywhere
+        uint32_t off = 0;
+        assure(linear = (unsigned char *)malloc(length));
+        for (int i=0; i<fragsCnt; i++) {
+            memcpy(linear+off, frags[i].iov_base, frags[i].iov_len);
+            off += (uint32_t)frags[i].iov_len;
+        }
+        mhdr = (struct mux_header *)linear;
+    }
     
     if (_muxdev.version >= 2) {
         _muxdev.rx_seq = ntohs(mhdr->rx_seq);
@@ -271,29 +677,33 @@ void USBDevice::device_data_input(unsigned char *buffer, uint32_t length){
             break;
         case MUX_PROTO_TCP:
             retassure(length >= (mux_header_size + sizeof(struct tcphdr)), "Incoming TCP packet is too small (%u)", length);
+            retassure(frags[0].iov_len >= (mux_header_size + sizeof(struct tcphdr)), "Incoming TCP packet header is split (%zu)", frags[0].iov_len);
         {
+            struct iovec payloadFrags[RX_MAX_FRAGMENTS] = {};
             tcphdr* tcp_header = reinterpret_cast<tcphdr*>(mhdr+1);
             payload = reinterpret_cast<std::uint8_t*>(tcp_header+1);
             payload_length = length - sizeof(tcphdr) - mux_header_size;
 
+            //view of the payload, skipping the headers in the first fragment
+            payloadFrags[0].iov_base = payload;
+            payloadFrags[0].iov_len = frags[0].iov_len - (payload - (unsigned char *)frags[0].iov_base);
+            for (int i=1; i<fragsCnt; i++) {
+                payloadFrags[i] = frags[i];
+            }
+
             uint16_t dport = htons(tcp_header->th_dport);
-            _conns.addMember();
-            auto conn = _conns._elems.find(dport);
-            if (conn != _conns._elems.end()) {
-                assert((*conn).first == dport);
-                TCP *connect = (*conn).second;
-                connect->retain();
-                _conns.delMember();
+            TCP *connect = conn_acquire(dport);
+            if (connect) {
+                cleanup([&]{
+                    conn_release(dport);
+                });
                 try {
-                    connect->handle_input(tcp_header, payload, payload_length);
+                    connect->handle_input(tcp_header, payloadFrags, fragsCnt, payload_length);
                 } catch (tihmstar::exception &e) {
-                    connect->release();
                     error("failed to handle input on snum=%d device(%d)=%s with error=%d (%s)",dport,_id,_serial,e.code(),e.what());
                     throw;
                 }
-                connect->release();
             }else{
-                _conns.delMember();
                 try {
                     TCP::send_RST(this, tcp_header);
                 } catch (...) {
@@ -326,6 +736,7 @@ void USBDevice::device_version_input(struct mux_version_header *vh){
     
     info("Connected to v%d.%d device %s on location 0x%x", _muxdev.version, vh->minor, _serial, usb_location());
     _state = MUXDEV_ACTIVE;
+    bringup_stage_done(BRINGUP_VERSION);
     
     //this device is now set up and ready to be used by muxer
     _muxer->add_device(this);
@@ -369,32 +780,118 @@ void USBDevice::device_control_input(unsigned char *payload, uint32_t payload_le
     }
 }
 
+USBDevice::connSlot *USBDevice::conn_slot(uint16_t sPort) noexcept{
+    connSlot *page = _connPages[sPort / USB_PORT_PAGE_SLOTS].load();
+    return page ? &page[sPort % USB_PORT_PAGE_SLOTS] : NULL;
+}
+
+TCP *USBDevice::conn_acquire(uint16_t sPort) noexcept{
+    connSlot *slot = conn_slot(sPort);
+    if (!slot) return NULL;
+    slot->refs.fetch_add(1);
+    //close_connection clears conn before waiting for refs, so either we see NULL here or it waits for us
+    TCP *conn = slot->conn.load();
+    if (!conn) {
+        conn_release(sPort);
+    }
+    return conn;
+}
+
+void USBDevice::conn_release(uint16_t sPort) noexcept{
+    connSlot *slot = conn_slot(sPort);
+    if (slot->refs.fetch_sub(1) == 1 && !slot->conn.load()) {
+        //slot is being closed, wake up close_connection
+        std::unique_lock<std::mutex> ul(_connsLck);
+        _connsCond.notify_all();
+    }
+}
+
+/*
+ Ports which were never used are handed out first, until enough closed ones are waiting to be reused.
+ That way a closed port is reused as late as possible, while only the pages of ports we actually need get allocated.
+ */
+uint16_t USBDevice::conn_alloc_port(){
+    uint16_t sPort = 0;
+    connSlot *slot = NULL;
+    if (_connsUnused < USB_PORT_SLOTS && (_connsFreeCnt < USB_PORT_REUSE_DELAY || !_connsFreeHead)) {
+        std::atomic<connSlot *> &page = _connPages[_connsUnused / USB_PORT_PAGE_SLOTS];
+        if (!page.load()) {
+            connSlot *fresh = NULL;
+            retassure(fresh = new (std::nothrow) connSlot[USB_PORT_PAGE_SLOTS](), "Failed to allocate connection slots for device %s", _serial);
+            page.store(fresh);
+        }
+        sPort = (uint16_t)_connsUnused++;
+        slot = conn_slot(sPort);
+    } else {
+        assure(_connsFreeHead); //we can't handle more connections than we have ports!
+        sPort = _connsFreeHead;
+        slot = conn_slot(sPort);
+        _connsFreeHead = slot->next;
+        if (!_connsFreeHead) _connsFreeTail = 0;
+        _connsFreeCnt--;
+    }
+    slot->prev = 0;
+    slot->next = _connsOpenHead;
+    if (_connsOpenHead) conn_slot(_connsOpenHead)->prev = sPort;
+    _connsOpenHead = sPort;
+    return sPort;
+}
+
+void USBDevice::conn_free_port(uint16_t sPort) noexcept{
+    connSlot *slot = conn_slot(sPort);
+    if (slot->prev) {
+        conn_slot(slot->prev)->next = slot->next;
+    } else {
+        _connsOpenHead = slot->next;
+    }
+    if (slot->next) conn_slot(slot->next)->prev = slot->prev;
+
+    slot->prev = 0;
+    slot->next = 0;
+    if (_connsFreeTail) {
+        conn_slot(_connsFreeTail)->next = sPort;
+    } else {
+        _connsFreeHead = sPort;
+    }
+    _connsFreeTail = sPort;
+    _connsFreeCnt++;
+}
+
+void USBDevice::conn_open_ports(std::vector<uint16_t> &ports){
+    std::unique_lock<std::mutex> ul(_connsLck);
+    for (uint16_t sPort = _connsOpenHead; sPort; sPort = conn_slot(sPort)->next) {
+        ports.push_back(sPort);
+    }
+}
+
 void USBDevice::start_connect(uint16_t dport, Client *cli){
     uint16_t sPort = 0;
     TCP *conn = nullptr;
     cleanup([&]{
-        conn->release();
         if (sPort) {
             close_connection(sPort);
         }
+        if (conn) {
+            conn->release();
+        }
     });
 
-    assure(_conns._elems.size() < 0xfff0); //we can't handle more connections than we have ports!
-    
-    _conns.lockMember();
-    while (_conns._elems.find(_nextPort) != _conns._elems.end() || _nextPort == 0){
-        _nextPort++;
+    {
+        std::unique_lock<std::mutex> ul(_connsLck);
+        sPort = conn_alloc_port();
     }
-    sPort = _nextPort;
-    
     try {
-        conn = new TCP(sPort,dport,this,cli); //implicitly "calls" retain()
+        conn = new TCP(sPort,dport,this,cli);
     } catch (...) {
-        _conns.unlockMember();
+        std::unique_lock<std::mutex> ul(_connsLck);
+        conn_free_port(sPort);
+        sPort = 0;
         throw;
     }
-    _conns._elems[sPort] = conn;
-    _conns.unlockMember();
+    conn->retain(); //reference for the client, keeps conn alive while connecting even if it gets killed meanwhile
+    conn_slot(sPort)->conn.store(conn);
+    //killAction() might have missed the new slot
+    retassure(!_killInProcess, "Device %s is dying", _serial);
     
     try {
         conn->connect();
@@ -402,17 +899,27 @@ void USBDevice::start_connect(uint16_t dport, Client *cli){
         error("failed to connect client=(%p) dport=%d error=%s code=%d",cli,dport,e.what(),e.code());
         throw;
     }
+    //client finishes the connect and owns the reference now
     sPort = 0;
+    conn = nullptr;
 }
 
-void USBDevice::close_connection(uint16_t sPort) noexcept{
-    _conns.lockMember();
-    auto conn = _conns._elems.find(sPort);
-    if (conn != _conns._elems.end()) {
-        (*conn).second->kill();
-        _conns._elems.erase(sPort);
+void USBDevice::close_connection(uint16_t sPort, TCP *conn) noexcept{
+    connSlot *slot = conn_slot(sPort);
+    if (!slot) return;
+    if (conn) {
+        if (!slot->conn.compare_exchange_strong(conn, NULL)) return; //already closed, port might belong to someone else by now
+    } else if (!(conn = slot->conn.exchange(NULL))) {
+        return;
+    }
+    
+    {
+        //wait for readers still using the connection, then hand out the port again
+        std::unique_lock<std::mutex> ul(_connsLck);
+        _connsCond.wait(ul, [slot]{return slot->refs.load() == 0;});
+        conn_free_port(sPort);
     }
-    _conns.unlockMember();
+    conn->kill();
 }
 
 
@@ -450,15 +957,12 @@ void tx_callback(struct libusb_transfer *xfer) noexcept{
                 // this should never be reached.
                 break;
         }
+        if (xfer->status != LIBUSB_TRANSFER_CANCELLED) dev->_counters.errors++;
         dev->kill();
+    } else {
+        dev->_counters.txCompleted++;
     }
     
-    //remove transfer
-    dev->_tx_xfers.lockMember();
-    dev->_tx_xfers._elems.erase(xfer);
-    dev->_tx_xfers.unlockMember();
-
-//    debug("freing tx xfer (%p) for USBDevice(%p)",xfer,dev);
-    safeFree(xfer->buffer);
-    libusb_free_transfer(xfer);
+    //remove transfer and recycle it
+    dev->tx_release(xfer);
 }
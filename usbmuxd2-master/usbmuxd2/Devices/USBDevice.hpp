@@ -11,19 +11,30 @@
 
 #include <Device.hpp>
 #include <Muxer.hpp>
+#include <Stats.hpp>
 #include <lck_container.h>
 #include <vector>
 #include <set>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <sys/uio.h>
 #include <libusb-1.0/libusb.h>
 #include <map>
 #include <stdint.h>
 #include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
 
 #define DEV_MRU 65535
+#define RX_MAX_FRAGMENTS 8 //RX transfers a single mux packet may span
+#define USB_PORT_SLOTS 0x10000 //one connection slot per source port
+#define USB_PORT_PAGE_SLOTS 0x100 //slots are allocated in pages, once a port in them is used
+#define USB_PORT_REUSE_DELAY 0x400 //closed ports are only reused once this many are waiting, unused ports are handed out before
 
 class USBDeviceManager;
+class SimDeviceManager;
+class USBTransport;
 class TCP;
 
 class USBDevice : public Device{
@@ -47,8 +58,6 @@ public:
     };
     struct mux_device{
         int version;
-        unsigned char *pktbuf;
-        uint32_t pktlen;
         uint16_t rx_seq;
         uint16_t tx_seq;
     };
@@ -58,11 +67,33 @@ public:
         MUX_PROTO_SETUP = 2,
         MUX_PROTO_TCP = IPPROTO_TCP,
     };
+    enum bringup_stage {
+        BRINGUP_QUEUED,         // waiting for a bring-up worker
+        BRINGUP_DESCRIPTOR,     // open device, read descriptors and serial
+        BRINGUP_CONFIGURATION,  // set configuration, claim interface
+        BRINGUP_RXLOOP,         // start RX transfers
+        BRINGUP_VERSION,        // version handshake
+        BRINGUP_PREFLIGHT,      // lockdown preflight
+        BRINGUP_STAGES
+    };
+    struct rx_stats{
+        uint64_t bytes;
+        uint64_t transfers;
+        uint64_t fullTransfers;  // came back completely filled, the device had more data waiting
+        uint64_t adjustments;    // number of depth or size changes
+        uint32_t depth;          // target number of in flight transfers
+        uint32_t minDepth;
+        uint32_t maxDepth;
+        uint32_t size;           // target transfer size
+        uint32_t maxSize;
+        uint32_t inFlight;
+    };
     
 private:
     USBDeviceManager *_parent; //unmanaged
     mux_dev_state _state;
     libusb_device_handle *_usbdev;
+    USBTransport *_transport; //replaces libusb if set, owned by us
     uint64_t _speed;
     int _wMaxPacketSize;
     struct libusb_device_descriptor _devdesc;
@@ -70,14 +101,82 @@ private:
     uint16_t _pid;
     uint8_t _bus, _address;
     uint8_t _interface, _ep_in, _ep_out;
-    std::atomic<uint16_t> _nextPort;
+
+    //bring-up timing, stages run one after another so only one thread touches these at a time
+    std::chrono::steady_clock::time_point _bringupStart;
+    std::chrono::steady_clock::time_point _stageStart;
+    uint32_t _stageUsec[BRINGUP_STAGES];
     
     std::mutex _usbLck;
     lck_contrainer<std::set<struct libusb_transfer *>> _rx_xfers;
+
+    //rx reassembly (protected by _rxLck)
+    std::mutex _rxLck; //serializes device_data_input, so packets are processed in order
+    unsigned char *_rxFrags[RX_MAX_FRAGMENTS]; //RX transfer buffers we took over, holding the start of a packet
+    uint32_t _rxFragsLen[RX_MAX_FRAGMENTS];
+    uint32_t _rxFragsCnt;
+    uint32_t _rxFragsTotal;
+
+    //rx transfer tuning (needs _rx_xfers lock)
+    static unsigned gRXMaxTransfers;
+    rx_stats _rxStats;
+    std::chrono::steady_clock::time_point _rxWinStart;
+    uint64_t _rxWinBytes;
+    uint32_t _rxWinXfers;
+    uint32_t _rxWinFull;
     lck_contrainer<std::set<struct libusb_transfer *>> _tx_xfers;
-    lck_contrainer<std::map<uint16_t,TCP *>> _conns;
+
+    //connections, indexed by source port
+    struct connSlot{
+        std::atomic<TCP *> conn;
+        std::atomic<uint32_t> refs; //readers currently using conn
+        uint16_t next; //needs _connsLck. Next port in the free list while closed, in the open list while in use
+        uint16_t prev; //needs _connsLck. Previous port in the open list
+    };
+    std::atomic<connSlot *> _connPages[USB_PORT_SLOTS / USB_PORT_PAGE_SLOTS]; //pages are only freed with the device
+    std::mutex _connsLck; //protects the port lists and allocating pages, used with _connsCond to wait for readers leaving a slot
+    std::condition_variable _connsCond;
+    uint32_t _connsUnused; //lowest port which was never handed out
+    uint32_t _connsFreeCnt;
+    uint16_t _connsFreeHead; //closed ports are handed out FIFO, so they are reused as late as possible. 0 terminates the lists
+    uint16_t _connsFreeTail;
+    uint16_t _connsOpenHead; //ports in use, so killAction() and getConnStats() don't need to look at every slot
+
+    //tx transfer pool
+    std::mutex _txPoolLck;
+    std::condition_variable _txPoolCond;
+    std::vector<struct libusb_transfer *> _txPool; //idle transfers, buffers are USB_MTU sized
+    uint32_t _txPoolAllocated; //idle + in flight
+    uint32_t _txPoolWaiters;
+    bool _txPoolDying;
+    std::atomic<uint64_t> _txPoolHits;
+    std::atomic<uint64_t> _txPoolMisses;
+
+    //statistics, see usb_stats
+    struct{
+        std::atomic<uint64_t> rxSubmitted, rxReassembled, rxDropped;
+        std::atomic<uint64_t> txSubmitted, txCompleted, txBytes, txZLPs;
+        std::atomic<uint64_t> errors;
+    } _counters;
+
+    struct libusb_transfer *tx_alloc();
+    struct libusb_transfer *tx_acquire(bool mayBlock = true);
+    void tx_release(struct libusb_transfer *xfer) noexcept;
+    void tx_submit(struct libusb_transfer *xfer);
+    connSlot *conn_slot(uint16_t sPort) noexcept; //NULL if the page of sPort was never used
+    TCP *conn_acquire(uint16_t sPort) noexcept; //returns NULL if there is no connection, otherwise conn_release() needs to be called when done
+    void conn_release(uint16_t sPort) noexcept;
+    uint16_t conn_alloc_port(); //needs _connsLck
+    void conn_free_port(uint16_t sPort) noexcept; //needs _connsLck
+    void conn_open_ports(std::vector<uint16_t> &ports); //appends all ports in use
+    void cancel_xfers() noexcept; //cancels in flight libusb transfers
+    void rx_keep_fragment(unsigned char *&buffer, uint32_t length, uint32_t xferSize); //needs _rxLck
+    void rx_drop_fragments() noexcept; //needs _rxLck
+    void device_packet_input(const struct iovec *frags, int fragsCnt, uint32_t length); //needs _rxLck
+    int rx_tune(struct libusb_transfer *xfer) noexcept; //needs _rx_xfers lock. Returns how many transfers to add, or -1 if xfer should be retired
 
     virtual ~USBDevice() override;
+    virtual void killAction() noexcept override;
 public:
     USBDevice(const USBDevice &) =delete; //delete copy constructor
     USBDevice(USBDevice &&o) = delete; //move constructor
@@ -85,23 +184,38 @@ public:
     USBDevice(Muxer *mux);
     
     uint32_t usb_location(){return (_bus << 16) | _address;}
+    bool usesLibusb() const noexcept {return !_transport;}
     
+    uint64_t txPoolHits() const noexcept {return _txPoolHits;}
+    uint64_t txPoolMisses() const noexcept {return _txPoolMisses;}
+
+    static void setRXMaxTransfers(unsigned xfers) noexcept; //0 picks the limit based on link speed. Needs to be called before devices are added
+
+    rx_stats getRXStats() noexcept;
+    usb_stats getStats() noexcept;
+    void getConnStats(std::vector<tcp_stats> &conns); //appends all open connections
+
+    void bringup_stage_done(bringup_stage stage) noexcept; //stage took the time since the previous one finished
+    void bringup_report() noexcept;
+
+    void tx_pool_init();
+    void rx_init(); //needs _speed and _serial
     void mux_init();
-    void usb_send(void *buf, size_t length);
+    void usb_send(struct libusb_transfer *xfer, size_t length);
     void send_packet(enum mux_protocol proto, const void *data, size_t length, tcphdr *header = NULL);
-    void device_data_input(unsigned char *buffer, uint32_t length);
+    void device_data_input(unsigned char *&buffer, uint32_t length, uint32_t xferSize); //may take over buffer, replacing it with a fresh one of xferSize bytes
     void device_version_input(struct mux_version_header *vh);
     void device_control_input(unsigned char *payload, uint32_t payload_length);
 
     virtual void start_connect(uint16_t dport, Client *cli) override;
-    void close_connection(uint16_t sPort) noexcept;
+    void close_connection(uint16_t sPort, TCP *conn = NULL) noexcept; //if conn is set, only close the slot if it still holds conn
 
     
     friend Muxer;
     friend USBDeviceManager;
+    friend SimDeviceManager;
     friend void usb_start_rx_loop(USBDevice *dev);
-    friend void usb_get_langid_callback(struct libusb_transfer *transfer) noexcept;
-    friend void usb_get_serial_callback(struct libusb_transfer *transfer) noexcept;
+    friend void usb_submit_rx_xfer(USBDevice *dev, uint32_t size);
     friend void rx_callback(struct libusb_transfer *xfer) noexcept;
     friend void tx_callback(struct libusb_transfer *xfer) noexcept;
 };
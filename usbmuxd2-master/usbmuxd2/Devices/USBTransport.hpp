@@ -0,0 +1,33 @@
+//
+//  USBTransport.hpp
+//  usbmuxd2
+//
+//  Created by tihmstar on 28.11.20.
+//  Copyright © 2020 tihmstar. All rights reserved.
+//
+
+#ifndef USBTransport_hpp
+#define USBTransport_hpp
+
+#include <libusb-1.0/libusb.h>
+
+class USBDevice;
+
+/*
+ Abstract class
+ Moves bulk transfers of a USBDevice over something other than libusb (e.g. a simulated device).
+ Devices without a transport talk to libusb directly.
+
+ Submitted TX transfers are completed asynchronously through tx_callback(), just like libusb does.
+ Input is handed to USBDevice::device_data_input() one transfer at a time.
+ */
+class USBTransport{
+public:
+    virtual ~USBTransport() {}
+
+    virtual void start(USBDevice *dev) = 0; //start delivering input to dev
+    virtual void submit(struct libusb_transfer *xfer) = 0;
+    virtual void cancel() noexcept = 0; //fail all transfers and stop input, called when the device gets killed
+};
+
+#endif /* USBTransport_hpp */
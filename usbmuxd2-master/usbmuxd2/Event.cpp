@@ -8,54 +8,75 @@
 
 #include <libgeneral/macros.h>
 #include "Event.hpp"
+#include <thread>
+#include <chrono>
+#include <limits.h>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+static void futex_wait(std::atomic<uint32_t> *addr, uint32_t val) noexcept{
+    //returns right away if *addr != val, spurious wakeups are handled by the caller
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(addr), FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_wake(std::atomic<uint32_t> *addr) noexcept{
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(addr), FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+#endif
 
 Event::Event()
-: _members(0), _curSendEvent(0), _curWaitEvent(0), _isDying(false)
+: _seq(0), _members(0)
 {
     
 }
 
 
 Event::~Event(){
-    _m.lock();
-    _isDying = true;
-    _m.unlock();
-    
-    while (_members) {
-        std::unique_lock<std::mutex> lk(_m);
-        _cm.wait(lk, [&]{return !_members;});
+    //waiters leave as soon as they got notified, so yield first and only sleep if it takes longer
+    for (int i=0; _members.load(); i++) {
+        if (i < 100) {
+            std::this_thread::yield();
+        } else {
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+        }
     }
 }
 
-void Event::wait(){
-    std::unique_lock<std::mutex> lk(_m);
-    ++_members;
-    assert(!_isDying);
+uint32_t Event::sequence() const noexcept{
+    return _seq.load();
+}
 
-    uint64_t waitingForEvent = _curWaitEvent+1;
-    if (waitingForEvent == 0) waitingForEvent++;
+void Event::wait(){
+    wait(_seq.load());
+}
 
-    _cv.wait(lk, [&]{return _curSendEvent>=waitingForEvent;});
-    
-    _curWaitEvent = _curSendEvent;
-    
+void Event::wait(uint32_t seq){
+    //announce ourself before looking at _seq, notifyAll() increments _seq before looking at _members
+    ++_members;
+#ifdef __linux__
+    while (_seq.load() == seq) {
+        futex_wait(&_seq, seq);
+    }
+#else
+    {
+        std::unique_lock<std::mutex> lk(_m);
+        _cv.wait(lk, [&]{return _seq.load() != seq;});
+    }
+#endif
     --_members;
-    _cm.notify_all();
 }
 
 void Event::notifyAll(){
-    std::unique_lock<std::mutex> *lk = new std::unique_lock<std::mutex>(_m);
-    bool doUnlockHere = true;
-    cleanup([&]{
-        if (doUnlockHere) {
-            lk->unlock();
-            delete lk;
-        }
-    });
-    assert(!_isDying);
-    
-    if(++_curSendEvent == 0) ++_curSendEvent;
+    ++_seq;
+    if (!_members.load()) return; //nobody to wake up
+#ifdef __linux__
+    futex_wake(&_seq);
+#else
+    std::unique_lock<std::mutex> lk(_m);
     _cv.notify_all();
+#endif
 }
 
 uint64_t Event::members() const{
@@ -9,24 +9,33 @@
 #ifndef Event_hpp
 #define Event_hpp
 
-#include <thread>
+#include <stdint.h>
+#include <atomic>
+#ifndef __linux__
 #include <mutex>
 #include <condition_variable>
-#include <atomic>
+#endif
 
+/*
+ wait() returns once notifyAll() was called after wait() was entered, every waiter is woken up.
+ To not miss an event sent between checking a condition and calling wait(), take sequence() before checking
+ and pass it to wait(seq), which returns right away if notifyAll() was called in between.
+ notifyAll() is a single atomic increment unless someone is actually waiting.
+ */
 class Event{
+    std::atomic<uint32_t> _seq; //futex word on linux
+    std::atomic<uint32_t> _members;
+#ifndef __linux__
     std::mutex _m;
     std::condition_variable _cv;
-    std::condition_variable _cm;
-    std::atomic<uint64_t> _members;
-    uint64_t _curSendEvent;
-    uint64_t _curWaitEvent;
-    bool _isDying;
+#endif
 public:
     Event();
     ~Event();
     
+    uint32_t sequence() const noexcept;
     void wait();
+    void wait(uint32_t seq);
     void notifyAll();
     uint64_t members() const;
     
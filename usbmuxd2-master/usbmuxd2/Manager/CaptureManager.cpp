@@ -0,0 +1,323 @@
+//
+//  CaptureManager.cpp
+//  usbmuxd2
+//
+//  Created by tihmstar on 30.11.20.
+//  Copyright © 2020 tihmstar. All rights reserved.
+//
+
+#include "CaptureManager.hpp"
+#include <log.h>
+#include <libgeneral/macros.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <chrono>
+#include <algorithm>
+
+#define CAPTURE_RING_SIZE   0x800000    //power of 2
+#define CAPTURE_PAD         0x80000000  //commit flag of the filler in front of a record which would wrap around
+#define CAPTURE_WAKEUP_MSEC 50          //max time packets sit in the ring, unless it fills up
+
+#define PCAPNG_SHB          0x0A0D0D0A
+#define PCAPNG_IDB          0x00000001
+#define PCAPNG_EPB          0x00000006
+#define PCAPNG_BOM          0x1A2B3C4D
+#define LINKTYPE_USER0      147 //mux protocol and length (network order), followed by the payload
+#define LINKTYPE_IPV4       228
+
+enum capture_iface{
+    IFACE_TCP = 0,
+    IFACE_MUX = 1
+};
+
+/*
+ A record is reserved by advancing _head, filled and then published by setting commit to its size.
+ The loop thread writes records in ring order and zeroes them, so an unpublished record always reads commit == 0.
+ */
+struct CaptureManager::record{
+    std::atomic<uint32_t> commit;
+    uint32_t origLen;
+    uint64_t ts; //nsec since epoch
+    int32_t device;
+    uint32_t capLen;
+    uint32_t proto;
+    uint8_t outgoing;
+};
+
+#pragma mark helpers
+static size_t pad4(size_t len){
+    return (len + 3) & ~3;
+}
+
+static void put32(std::string &blk, uint32_t val){
+    blk.append((const char *)&val, sizeof(val));
+}
+
+static size_t begin_block(std::string &blk, uint32_t type){
+    size_t start = blk.size();
+    put32(blk, type);
+    put32(blk, 0); //length, set by finish_block
+    return start;
+}
+
+static void put_option(std::string &blk, uint16_t code, const void *val, uint16_t len){
+    blk.append((const char *)&code, sizeof(code));
+    blk.append((const char *)&len, sizeof(len));
+    blk.append((const char *)val, len);
+    blk.append(pad4(len) - len, '\0');
+}
+
+static void finish_block(std::string &blk, size_t start){
+    uint32_t len = 0;
+    put32(blk, 0); //opt_endofopt
+    put32(blk, 0);
+    len = (uint32_t)(blk.size() - start);
+    memcpy(&blk[start + 4], &len, sizeof(len));
+    memcpy(&blk[blk.size() - 4], &len, sizeof(len));
+}
+
+static uint16_t ip_checksum(const void *buf, size_t len){
+    const uint16_t *p = (const uint16_t *)buf;
+    uint32_t sum = 0;
+    for (size_t i=0; i<len/2; i++) {
+        sum += p[i];
+    }
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return (uint16_t)~sum;
+}
+
+#pragma mark CaptureManager
+CaptureManager::CaptureManager(const char *path, uint32_t snaplen)
+: _path(path), _f(NULL), _snaplen(snaplen), _ring(NULL), _head(0), _dropped(0), _tail(0), _written(0), _droppedReported(0), _droppedReportTime(0), _failed(false)
+{
+    assure(_ring = (unsigned char *)calloc(1, CAPTURE_RING_SIZE));
+    retassure(_f = fopen(path, "wb"), "failed to open capture file '%s': %s", path, strerror(errno));
+    setvbuf(_f, NULL, _IOFBF, 1 << 20);
+    write_header();
+}
+
+CaptureManager::~CaptureManager(){
+    info("[destroying] CaptureManager");
+    stopLoop();
+    if (_f) {
+        fclose(_f); _f = NULL;
+    }
+    safeFree(_ring);
+}
+
+void CaptureManager::loopEvent(){
+    drain();
+    std::unique_lock<std::mutex> ul(_wakeupLck);
+    _wakeupCond.wait_for(ul, std::chrono::milliseconds(CAPTURE_WAKEUP_MSEC), [this]{
+        return _loopState != LOOP_RUNNING || _head.load(std::memory_order_relaxed) - _tail.load(std::memory_order_relaxed) > CAPTURE_RING_SIZE/2;
+    });
+}
+
+void CaptureManager::afterLoop() noexcept{
+    if (!_failed) {
+        try {
+            drain();
+        } catch (tihmstar::exception &e) {
+            error("failed to write capture file '%s' with error=%d (%s)",_path.c_str(),e.code(),e.what());
+        }
+    }
+    _failed = true; //nobody writes the ring anymore
+}
+
+void CaptureManager::stopAction() noexcept{
+    std::unique_lock<std::mutex> ul(_wakeupLck);
+    _wakeupCond.notify_all();
+}
+
+void CaptureManager::write_header(){
+    std::string blk;
+    size_t start = 0;
+    uint32_t snaplen = _snaplen ? _snaplen : 0xffff;
+    uint8_t tsresol = 9; //nsec
+    const char *appl = "usbmuxd2";
+
+    //Section Header Block
+    start = begin_block(blk, PCAPNG_SHB);
+    put32(blk, PCAPNG_BOM);
+    put32(blk, 1); //version 1.0
+    put32(blk, 0xffffffff); put32(blk, 0xffffffff); //section length unknown
+    put_option(blk, 4, appl, strlen(appl)); //shb_userappl
+    finish_block(blk, start);
+
+    //Interface Description Blocks, in capture_iface order
+    start = begin_block(blk, PCAPNG_IDB);
+    put32(blk, LINKTYPE_IPV4); //linktype, reserved
+    put32(blk, snaplen + sizeof(struct ip));
+    put_option(blk, 2, "usbmux-tcp", strlen("usbmux-tcp")); //if_name
+    put_option(blk, 9, &tsresol, sizeof(tsresol)); //if_tsresol
+    finish_block(blk, start);
+
+    start = begin_block(blk, PCAPNG_IDB);
+    put32(blk, LINKTYPE_USER0);
+    put32(blk, snaplen + 8);
+    put_option(blk, 2, "usbmux", strlen("usbmux"));
+    put_option(blk, 9, &tsresol, sizeof(tsresol));
+    finish_block(blk, start);
+
+    retassure(fwrite(blk.data(), 1, blk.size(), _f) == blk.size(), "failed to write capture header: %s", strerror(errno));
+    retassure(!fflush(_f), "failed to write capture header: %s", strerror(errno));
+}
+
+void CaptureManager::write_record(const record *rec){
+    const unsigned char *data = (const unsigned char *)(rec+1);
+    uint32_t epb[7] = {};
+    uint32_t trailer[4] = {};
+    uint32_t pad = 0;
+    uint32_t blklen = 0;
+    union{
+        struct ip ip;
+        uint32_t mux[2];
+    } lhdr = {};
+    uint32_t lhdrLen = 0;
+
+    if (rec->proto == IPPROTO_TCP) {
+        uint32_t host = htonl(0x0a000001 | ((rec->device & 0xffff) << 8));
+        uint32_t dev = htonl(0x0a000002 | ((rec->device & 0xffff) << 8));
+        lhdr.ip.ip_v = 4;
+        lhdr.ip.ip_hl = sizeof(struct ip) / 4;
+        lhdr.ip.ip_len = htons((uint16_t)std::min<uint32_t>(sizeof(struct ip) + rec->origLen, 0xffff));
+        lhdr.ip.ip_off = htons(IP_DF);
+        lhdr.ip.ip_ttl = 64;
+        lhdr.ip.ip_p = IPPROTO_TCP;
+        lhdr.ip.ip_src.s_addr = rec->outgoing ? host : dev;
+        lhdr.ip.ip_dst.s_addr = rec->outgoing ? dev : host;
+        lhdr.ip.ip_sum = ip_checksum(&lhdr.ip, sizeof(lhdr.ip));
+        lhdrLen = sizeof(lhdr.ip);
+    } else {
+        lhdr.mux[0] = htonl(rec->proto);
+        lhdr.mux[1] = htonl(rec->origLen + sizeof(lhdr.mux));
+        lhdrLen = sizeof(lhdr.mux);
+    }
+    pad = (uint32_t)(pad4(lhdrLen + rec->capLen) - (lhdrLen + rec->capLen));
+    blklen = sizeof(epb) + lhdrLen + rec->capLen + pad + sizeof(trailer);
+
+    //Enhanced Packet Block
+    epb[0] = PCAPNG_EPB;
+    epb[1] = blklen;
+    epb[2] = (rec->proto == IPPROTO_TCP) ? IFACE_TCP : IFACE_MUX;
+    epb[3] = (uint32_t)(rec->ts >> 32);
+    epb[4] = (uint32_t)rec->ts;
+    epb[5] = lhdrLen + rec->capLen;
+    epb[6] = lhdrLen + rec->origLen;
+
+    trailer[0] = 2 | (4 << 16); //epb_flags
+    trailer[1] = rec->outgoing ? 2 : 1; //direction
+    trailer[2] = 0; //opt_endofopt
+    trailer[3] = blklen;
+
+    {
+        uint32_t zero = 0;
+        struct iovec iov[5] = {
+            {epb, sizeof(epb)},
+            {&lhdr, lhdrLen},
+            {(void*)data, rec->capLen},
+            {&zero, pad},
+            {trailer, sizeof(trailer)},
+        };
+        for (auto &v : iov) {
+            retassure(fwrite(v.iov_base, 1, v.iov_len, _f) == v.iov_len, "failed to write capture file: %s", strerror(errno));
+        }
+    }
+}
+
+bool CaptureManager::drain(){
+    uint64_t tail = _tail.load(std::memory_order_relaxed);
+    uint64_t head = _head.load(std::memory_order_acquire);
+    uint64_t dropped = 0;
+    bool didWrite = false;
+
+    while (tail != head) {
+        record *rec = (record *)(_ring + (tail & (CAPTURE_RING_SIZE-1)));
+        uint32_t commit = rec->commit.load(std::memory_order_acquire);
+        if (!commit) break; //reserved, but not written yet
+        uint32_t size = commit & ~CAPTURE_PAD;
+        if (!(commit & CAPTURE_PAD)) {
+            write_record(rec);
+            _written.fetch_add(1, std::memory_order_relaxed);
+            didWrite = true;
+        }
+        memset((void*)rec, 0, size);
+        tail += size;
+        if (tail - _tail.load(std::memory_order_relaxed) >= CAPTURE_RING_SIZE/16) {
+            _tail.store(tail, std::memory_order_release); //hand space back in chunks, the cache line is shared with every capture()
+        }
+    }
+    _tail.store(tail, std::memory_order_release);
+
+    if ((dropped = _dropped) != _droppedReported && time(NULL) != _droppedReportTime) {
+        warning("[CaptureManager] dropped %llu packets, writing '%s' can't keep up",(unsigned long long)(dropped - _droppedReported),_path.c_str());
+        _droppedReported = dropped;
+        _droppedReportTime = time(NULL);
+    }
+    if (didWrite) {
+        retassure(!fflush(_f), "failed to write capture file: %s", strerror(errno));
+    }
+    return didWrite;
+}
+
+void CaptureManager::capture(int device, bool outgoing, uint32_t proto, const struct iovec *iov, int iovcnt, uint32_t length) noexcept{
+    struct timespec ts = {};
+    uint32_t capLen = length;
+    uint32_t recSize = 0;
+    uint64_t head = 0;
+    uint64_t pos = 0;
+    uint64_t pad = 0;
+    record *rec = NULL;
+
+    if (_failed) return;
+    if (_snaplen && capLen > _snaplen) capLen = _snaplen;
+    recSize = (uint32_t)((sizeof(record) + capLen + 7) & ~7);
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    //reserve space, a record which would wrap around is placed at the start of the ring instead
+    head = _head.load(std::memory_order_relaxed);
+    do {
+        pos = head & (CAPTURE_RING_SIZE-1);
+        pad = (pos + recSize > CAPTURE_RING_SIZE) ? CAPTURE_RING_SIZE - pos : 0;
+        if (head + pad + recSize - _tail.load(std::memory_order_acquire) > CAPTURE_RING_SIZE) {
+            _dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+    } while (!_head.compare_exchange_weak(head, head + pad + recSize, std::memory_order_relaxed));
+
+    if (pad) {
+        ((record *)(_ring + pos))->commit.store(CAPTURE_PAD | (uint32_t)pad, std::memory_order_release);
+        pos = 0;
+    }
+
+    rec = (record *)(_ring + pos);
+    rec->origLen = length;
+    rec->ts = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    rec->device = device;
+    rec->capLen = capLen;
+    rec->proto = proto;
+    rec->outgoing = outgoing;
+    {
+        unsigned char *dst = (unsigned char *)(rec+1);
+        uint32_t left = capLen;
+        for (int i=0; i<iovcnt && left; i++) {
+            uint32_t cnt = (uint32_t)std::min<size_t>(iov[i].iov_len, left);
+            memcpy(dst, iov[i].iov_base, cnt);
+            dst += cnt;
+            left -= cnt;
+        }
+        rec->capLen = capLen - left; //iov may hold less than length
+    }
+    rec->commit.store(recSize, std::memory_order_release);
+
+    if (head + pad + recSize - _tail.load(std::memory_order_relaxed) > CAPTURE_RING_SIZE/2) {
+        _wakeupCond.notify_one(); //don't wait for the timeout
+    }
+}
@@ -0,0 +1,64 @@
+//
+//  CaptureManager.hpp
+//  usbmuxd2
+//
+//  Created by tihmstar on 30.11.20.
+//  Copyright © 2020 tihmstar. All rights reserved.
+//
+
+#ifndef CaptureManager_hpp
+#define CaptureManager_hpp
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <string>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <sys/uio.h>
+#include <Manager/Manager.hpp>
+
+/*
+ Writes the mux packets exchanged with USB devices into a pcapng file, which can be opened in Wireshark.
+ TCP packets get a synthesized IPv4 header (host 10.<id>.1, device 10.<id>.2), everything else
+ is written with its mux protocol and length on a second (user defined) interface.
+
+ capture() may be called from any thread, it only copies the packet into a lock-free ring buffer.
+ The loop thread writes the ring to disk. If it can't keep up, packets are dropped instead of blocking the data path.
+ */
+class CaptureManager : public Manager{
+    struct record;
+    std::string _path;
+    FILE *_f;
+    uint32_t _snaplen;
+    unsigned char *_ring;
+    alignas(64) std::atomic<uint64_t> _head; //next byte to be reserved by capture()
+    std::atomic<uint64_t> _dropped;
+    alignas(64) std::atomic<uint64_t> _tail; //next byte to be written by the loop thread, advanced in chunks
+    std::atomic<uint64_t> _written; //packets written to the file
+    uint64_t _droppedReported; //only used by the loop thread
+    time_t _droppedReportTime;
+    std::atomic_bool _failed; //writing failed, stop capturing
+    std::mutex _wakeupLck;
+    std::condition_variable _wakeupCond;
+
+    virtual void loopEvent() override;
+    virtual void afterLoop() noexcept override;
+    virtual void stopAction() noexcept override;
+
+    void write_header();
+    void write_record(const record *rec);
+    bool drain();
+
+public:
+    CaptureManager(const char *path, uint32_t snaplen = 0); //snaplen 0 captures whole packets
+    virtual ~CaptureManager() override;
+
+    void capture(int device, bool outgoing, uint32_t proto, const struct iovec *iov, int iovcnt, uint32_t length) noexcept; //iov holds the packet without the mux header
+
+    uint64_t written() const noexcept {return _written;}
+    uint64_t dropped() const noexcept {return _dropped;}
+};
+
+#endif /* CaptureManager_hpp */
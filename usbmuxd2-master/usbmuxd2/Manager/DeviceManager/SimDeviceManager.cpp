@@ -0,0 +1,373 @@
+//
+//  SimDeviceManager.cpp
+//  usbmuxd2
+//
+//  Created by tihmstar on 28.11.20.
+//  Copyright © 2020 tihmstar. All rights reserved.
+//
+
+#include "SimDeviceManager.hpp"
+#include <log.h>
+#include <libgeneral/macros.h>
+#include <Manager/DeviceManager/USBDeviceManager.hpp>
+#include <Devices/USBDevice.hpp>
+#include <Devices/SocketTransport.hpp>
+#include <TCP.hpp>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <poll.h>
+
+#ifdef __linux__
+#   define SIM_SOCK_TYPE SOCK_SEQPACKET
+#else
+#   define SIM_SOCK_TYPE SOCK_DGRAM
+#endif
+
+#define SIM_SOCKBUF (1024*1024)
+#define SIM_RCV_WIN 0x40000 //window we advertise to the host
+#define SIM_MSS TCP::TCP_MTU
+#define SIM_OUTQUEUE_MAX 8 //packets generated ahead of the socket
+#define SIM_POLL_MS 100
+
+#define MIN(a,b) (((a)<(b)) ? (a) : (b))
+
+SimDeviceManager::SimDeviceManager(Muxer *mux, unsigned count)
+: DeviceManager(mux), _count(count)
+{
+    retassure(_count && _count <= 0xff, "can't simulate %u devices (1-255)", _count); //one USB address per device
+    info("SimDeviceManager simulating %u device%s", _count, (_count == 1) ? "" : "s");
+}
+
+SimDeviceManager::~SimDeviceManager(){
+    stopLoop();
+}
+
+void SimDeviceManager::beforeLoop(){
+    for (unsigned i=0; i<_count; i++) {
+        try {
+            add_device(i);
+        } catch (tihmstar::exception &e) {
+            error("failed to add simulated device %u with error=%d (%s)",i,e.code(),e.what());
+        }
+    }
+}
+
+void SimDeviceManager::loopEvent(){
+    std::vector<struct pollfd> pfds;
+    std::vector<simDevice *> devs = _devs;
+    int ret = 0;
+
+    for (simDevice *sim : devs) {
+        struct pollfd pfd = {};
+        pfd.fd = sim->fd;
+        pfd.events = POLLIN | (sim->outQueue.size() ? POLLOUT : 0);
+        pfds.push_back(pfd);
+    }
+    if ((ret = poll(pfds.data(), (nfds_t)pfds.size(), SIM_POLL_MS)) < 0) {
+        retassure(errno == EINTR, "poll failed errno=%d(%s)",errno,strerror(errno));
+        return;
+    }
+
+    for (size_t i=0; i<devs.size(); i++) {
+        simDevice *sim = devs[i];
+        if (pfds[i].revents & POLLIN) {
+            if (!device_input(sim)) {
+                drop_device(sim);
+                continue;
+            }
+        } else if (pfds[i].revents & (POLLHUP | POLLERR | POLLNVAL)) {
+            drop_device(sim);
+            continue;
+        }
+        produce(sim);
+        if (!flush(sim)) {
+            drop_device(sim);
+        }
+    }
+}
+
+void SimDeviceManager::afterLoop() noexcept{
+    while (_devs.size()) {
+        drop_device(_devs.front());
+    }
+}
+
+void SimDeviceManager::add_device(unsigned num){
+    int fds[2] = {-1,-1};
+    USBDevice *dev = NULL;
+    simDevice *sim = NULL;
+    cleanup([&]{ //cleanup only code
+        if (fds[0] >= 0) close(fds[0]);
+        if (fds[1] >= 0) close(fds[1]);
+        if (dev) {
+            dev->kill();
+        }
+        if (sim) {
+            delete sim;
+        }
+    });
+    int bufsize = SIM_SOCKBUF;
+
+    retassure(!socketpair(AF_UNIX, SIM_SOCK_TYPE, 0, fds), "failed to create socketpair errno=%d(%s)",errno,strerror(errno));
+    for (int fd : fds) {
+        //a message needs to fit into the socket buffer as a whole
+        if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize)) || setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize))) {
+            warning("failed to grow socket buffers for simulated device %u errno=%d(%s)",num,errno,strerror(errno));
+        }
+    }
+
+    assure(dev = new USBDevice(_mux));
+    snprintf(dev->_serial, sizeof(dev->_serial), "usbmuxd2-sim-%u", num);
+    dev->_bus = 0; //libusb never reports bus 0, so we don't collide with real devices
+    dev->_address = (uint8_t)(num+1);
+    dev->_speed = 5000000000;
+    dev->_wMaxPacketSize = 1024;
+    dev->bringup_stage_done(USBDevice::BRINGUP_DESCRIPTOR);
+
+    dev->_transport = new SocketTransport(fds[0]); fds[0] = -1;
+    dev->tx_pool_init();
+    dev->bringup_stage_done(USBDevice::BRINGUP_CONFIGURATION);
+
+    sim = new simDevice();
+    sim->fd = fds[1]; fds[1] = -1;
+    sim->num = num;
+    _devs.push_back(sim); sim = NULL;
+
+    dev->_transport->start(dev);
+    dev->bringup_stage_done(USBDevice::BRINGUP_RXLOOP);
+
+    //the version reply hands the device over to the Muxer
+    dev->mux_init();
+    dev = NULL;
+}
+
+void SimDeviceManager::drop_device(simDevice *sim) noexcept{
+    info("Simulated device %u went away after receiving %llu and sending %llu bytes", sim->num, (unsigned long long)sim->bytesIn, (unsigned long long)sim->bytesOut);
+    for (auto it = _devs.begin(); it != _devs.end(); it++) {
+        if (*it == sim) {
+            _devs.erase(it);
+            break;
+        }
+    }
+    close(sim->fd);
+    delete sim;
+}
+
+bool SimDeviceManager::device_input(simDevice *sim){
+    unsigned char buf[USB_MTU];
+    while (true) {
+        ssize_t len = 0;
+        uint32_t pktlen = 0;
+        if ((len = recv(sim->fd, buf, sizeof(buf), MSG_DONTWAIT)) < 0) {
+            return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+        }
+        if (len == 0) return false;
+
+        //we don't know whether real devices accept several packets in one transfer, so we don't either
+        if (len < 8 || (pktlen = ntohl(((const uint32_t *)buf)[1])) != (uint32_t)len) {
+            error("Simulated device %u dropping transfer of %zd bytes, which doesn't hold exactly one packet (length %u)", sim->num, len, pktlen);
+            continue;
+        }
+        try {
+            packet_input(sim, buf, pktlen);
+        } catch (tihmstar::exception &e) {
+            error("Simulated device %u failed to handle packet with error=%d (%s)",sim->num,e.code(),e.what());
+        }
+    }
+}
+
+void SimDeviceManager::packet_input(simDevice *sim, const unsigned char *pkt, uint32_t length){
+    uint32_t proto = ntohl(((const uint32_t *)pkt)[0]);
+
+    if (!sim->versionDone) {
+        //the host starts with an old style header, announcing its version
+        USBDevice::mux_version_header vh = {};
+        retassure(proto == USBDevice::MUX_PROTO_VERSION && length >= 8 + sizeof(vh), "expected version packet, got protocol %u", proto);
+        vh.major = htonl(2);
+        vh.minor = htonl(0);
+        send_packet(sim, USBDevice::MUX_PROTO_VERSION, &vh, sizeof(vh));
+        sim->versionDone = true;
+        return;
+    }
+
+    retassure(length >= sizeof(USBDevice::mux_header), "packet too small (%u)", length);
+    {
+        const USBDevice::mux_header *mhdr = (const USBDevice::mux_header *)pkt;
+        retassure(ntohl(mhdr->magic) == 0xfeedface, "bad magic 0x%08x", ntohl(mhdr->magic));
+        sim->rxSeq = ntohs(mhdr->tx_seq);
+    }
+    switch (proto) {
+        case USBDevice::MUX_PROTO_SETUP:
+            sim->txSeq = 0;
+            break;
+        case USBDevice::MUX_PROTO_TCP:
+            tcp_input(sim, pkt + sizeof(USBDevice::mux_header), length - sizeof(USBDevice::mux_header));
+            break;
+        default:
+            debug("Simulated device %u ignoring protocol %u", sim->num, proto);
+            break;
+    }
+}
+
+void SimDeviceManager::tcp_input(simDevice *sim, const unsigned char *pkt, uint32_t length){
+    tcphdr th = {};
+    uint16_t hostPort = 0;
+    uint32_t payloadLen = 0;
+    retassure(length >= sizeof(th), "TCP packet too small (%u)", length);
+    memcpy(&th, pkt, sizeof(th));
+    hostPort = ntohs(th.th_sport);
+    payloadLen = length - sizeof(th);
+    sim->bytesIn += payloadLen;
+
+    auto it = sim->conns.find(hostPort);
+    if (th.th_flags & TH_RST) {
+        if (it != sim->conns.end()) sim->conns.erase(it);
+        return;
+    }
+
+    if (th.th_flags == TH_SYN) {
+        uint16_t port = ntohs(th.th_dport);
+        simConn conn = {};
+        conn.port = port;
+        conn.ack = ntohl(th.th_seq) + 1;
+        conn.seq = conn.acked = (uint32_t)random();
+        conn.hostWin = ntohs(th.th_win) << 8;
+        if (port != SIM_PORT_ECHO && port != SIM_PORT_SINK && port != SIM_PORT_SOURCE) {
+            debug("Simulated device %u refusing connection to port %u", sim->num, port);
+            send_tcp(sim, hostPort, conn, TH_RST);
+            return;
+        }
+        send_tcp(sim, hostPort, conn, TH_SYN | TH_ACK);
+        conn.seq++;
+        conn.acked = conn.seq;
+        sim->conns[hostPort] = conn;
+        return;
+    }
+
+    if (it == sim->conns.end()) {
+        simConn conn = {};
+        conn.seq = ntohl(th.th_ack);
+        conn.ack = ntohl(th.th_seq) + payloadLen;
+        send_tcp(sim, hostPort, conn, TH_RST);
+        return;
+    }
+
+    {
+        simConn &conn = it->second;
+        uint32_t rAck = ntohl(th.th_ack);
+        if (rAck - conn.acked <= conn.seq - conn.acked) { //ignore acks for data we didn't send
+            conn.acked = rAck;
+        }
+        conn.hostWin = ntohs(th.th_win) << 8;
+        conn.established = true;
+
+        if (!payloadLen) return;
+        if (ntohl(th.th_seq) != conn.ack) {
+            send_tcp(sim, hostPort, conn, TH_ACK); //duplicate ack, the host retransmits
+            return;
+        }
+        conn.ack += payloadLen;
+        if (conn.port == SIM_PORT_ECHO) {
+            conn.pending.append((const char *)pkt + sizeof(th), payloadLen);
+        }
+        send_tcp(sim, hostPort, conn, TH_ACK);
+    }
+}
+
+void SimDeviceManager::send_packet(simDevice *sim, uint32_t proto, const void *data, size_t length, const void *tcpHdr){
+    std::string pkt;
+    size_t hdrlen = sim->versionDone ? sizeof(USBDevice::mux_header) : 8;
+    size_t total = hdrlen + (tcpHdr ? sizeof(tcphdr) : 0) + length;
+    USBDevice::mux_header mhdr = {};
+
+    mhdr.protocol = htonl(proto);
+    mhdr.length = htonl((uint32_t)total);
+    mhdr.magic = htonl(0xfeedface);
+    mhdr.tx_seq = htons(sim->txSeq++);
+    mhdr.rx_seq = htons(sim->rxSeq);
+
+    pkt.reserve(total);
+    pkt.append((const char *)&mhdr, hdrlen);
+    if (tcpHdr) {
+        pkt.append((const char *)tcpHdr, sizeof(tcphdr));
+    }
+    pkt.append((const char *)data, length);
+    sim->outQueue.push_back(std::move(pkt));
+}
+
+void SimDeviceManager::send_tcp(simDevice *sim, uint16_t hostPort, simConn &conn, uint8_t flags, const void *data, size_t length){
+    tcphdr th = {};
+    uint32_t win = SIM_RCV_WIN - MIN((uint32_t)conn.pending.size(), (uint32_t)SIM_RCV_WIN);
+    th.th_sport = htons(conn.port);
+    th.th_dport = htons(hostPort);
+    th.th_seq = htonl(conn.seq);
+    th.th_ack = htonl(conn.ack);
+    th.th_flags = flags;
+    th.th_off = sizeof(th) / 4;
+    th.th_win = htons((uint16_t)(win >> 8));
+    conn.winAdvertised = win;
+    send_packet(sim, USBDevice::MUX_PROTO_TCP, data, length, &th);
+    sim->bytesOut += length;
+}
+
+/*
+ Generates as much data as the host's windows allow, but only a few packets ahead of the socket.
+ Connections take turns one segment at a time, starting after the one served last, so they share the device fairly.
+ */
+void SimDeviceManager::produce(simDevice *sim){
+    static char pattern[SIM_MSS];
+    if (!pattern[0]) {
+        for (size_t i=0; i<sizeof(pattern); i++) {
+            pattern[i] = (char)(' ' + i % 95);
+        }
+    }
+
+    auto it = sim->conns.upper_bound(sim->lastServed);
+    for (size_t idle = 0; idle < sim->conns.size() && sim->outQueue.size() < SIM_OUTQUEUE_MAX; it++) {
+        if (it == sim->conns.end()) it = sim->conns.begin();
+        simConn &conn = it->second;
+        uint32_t inflight = conn.seq - conn.acked;
+        uint32_t room = (conn.hostWin > inflight) ? conn.hostWin - inflight : 0;
+        uint32_t len = MIN(room, (uint32_t)SIM_MSS);
+        if (!conn.established) {
+            len = 0;
+        } else if (conn.port == SIM_PORT_ECHO) {
+            len = MIN(len, (uint32_t)conn.pending.size());
+        } else if (conn.port != SIM_PORT_SOURCE) {
+            len = 0;
+        }
+        if (!len) {
+            idle++;
+            continue;
+        }
+        idle = 0;
+        sim->lastServed = it->first;
+        send_tcp(sim, it->first, conn, TH_ACK, (conn.port == SIM_PORT_ECHO) ? conn.pending.data() : pattern, len);
+        conn.seq += len;
+        if (conn.port == SIM_PORT_ECHO) {
+            conn.pending.erase(0, len);
+        }
+    }
+
+    for (auto &c : sim->conns) {
+        simConn &conn = c.second;
+        if (conn.established && conn.port == SIM_PORT_ECHO && SIM_RCV_WIN - conn.pending.size() >= conn.winAdvertised + SIM_MSS) {
+            send_tcp(sim, c.first, conn, TH_ACK); //window update
+        }
+    }
+}
+
+bool SimDeviceManager::flush(simDevice *sim){
+    while (sim->outQueue.size()) {
+        const std::string &pkt = sim->outQueue.front();
+        if (send(sim->fd, pkt.data(), pkt.size(), MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+            return (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS || errno == EINTR);
+        }
+        sim->outQueue.pop_front();
+    }
+    return true;
+}
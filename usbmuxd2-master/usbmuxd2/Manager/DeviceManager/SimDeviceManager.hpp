@@ -0,0 +1,75 @@
+//
+//  SimDeviceManager.hpp
+//  usbmuxd2
+//
+//  Created by tihmstar on 28.11.20.
+//  Copyright © 2020 tihmstar. All rights reserved.
+//
+
+#ifndef SimDeviceManager_hpp
+#define SimDeviceManager_hpp
+
+#include <Manager/DeviceManager/DeviceManager.hpp>
+#include <stdint.h>
+#include <string>
+#include <deque>
+#include <map>
+#include <vector>
+
+// services offered by simulated devices (same numbers as the classic inet services)
+#define SIM_PORT_ECHO 7     // sends back everything it receives
+#define SIM_PORT_SINK 9     // discards everything it receives
+#define SIM_PORT_SOURCE 19  // sends data as fast as the host accepts it
+
+/*
+ Adds synthetic devices, which are regular USBDevices using a socket pair instead of libusb (see SocketTransport).
+ The loop thread plays the device side of the mux protocol (version, setup and TCP) for all of them,
+ so the whole data path from clients down to the transport can be exercised and measured without any hardware.
+ Connections to ports other than the ones above get refused.
+ */
+class SimDeviceManager : public DeviceManager{
+    struct simConn{
+        uint16_t port;      //service port
+        bool established;   //host acknowledged our SYN/ACK
+        uint32_t seq;       //next byte we send
+        uint32_t acked;     //oldest byte the host didn't acknowledge yet
+        uint32_t ack;       //next byte we expect from the host
+        uint32_t hostWin;
+        uint32_t winAdvertised;
+        std::string pending; //received by the echo service, not sent back yet
+    };
+    struct simDevice{
+        int fd;
+        unsigned num;
+        bool versionDone;
+        uint16_t txSeq;
+        uint16_t rxSeq;
+        std::map<uint16_t, simConn> conns; //by host port
+        uint16_t lastServed; //host port of the connection produce() sent the last segment for
+        std::deque<std::string> outQueue; //packets the socket didn't take yet
+        uint64_t bytesIn;
+        uint64_t bytesOut;
+    };
+    std::vector<simDevice *> _devs; //only used by the loop thread
+    unsigned _count;
+
+    virtual void beforeLoop() override;
+    virtual void loopEvent() override;
+    virtual void afterLoop() noexcept override;
+
+    void add_device(unsigned num);
+    void drop_device(simDevice *sim) noexcept;
+    bool device_input(simDevice *sim); //false once the host side is gone
+    void packet_input(simDevice *sim, const unsigned char *pkt, uint32_t length);
+    void tcp_input(simDevice *sim, const unsigned char *pkt, uint32_t length);
+    void send_packet(simDevice *sim, uint32_t proto, const void *data, size_t length, const void *tcpHdr = NULL);
+    void send_tcp(simDevice *sim, uint16_t hostPort, simConn &conn, uint8_t flags, const void *data = NULL, size_t length = 0);
+    void produce(simDevice *sim);
+    bool flush(simDevice *sim); //false once the host side is gone
+
+public:
+    SimDeviceManager(Muxer *mux, unsigned count);
+    virtual ~SimDeviceManager() override;
+};
+
+#endif /* SimDeviceManager_hpp */
@@ -10,15 +10,15 @@
 #include <log.h>
 #include <libgeneral/macros.h>
 #include <Devices/USBDevice.hpp>
+#include <TCP.hpp>
 #include <unistd.h>
 #include <string.h>
 
 #pragma mark libusb_callback definitions
 int usb_hotplug_cb(libusb_context *ctx, libusb_device *device, libusb_hotplug_event event, void *user_data) noexcept;
-void usb_get_langid_callback(struct libusb_transfer *transfer) noexcept;
-void usb_get_serial_callback(struct libusb_transfer *transfer) noexcept;
 void rx_callback(struct libusb_transfer *xfer) noexcept;
 
+static thread_local bool gIsUSBEventThread = false;
 
 #pragma mark USBDeviceManager
 
@@ -49,8 +49,13 @@ USBDeviceManager::~USBDeviceManager(){
     libusb_exit(NULL);
 }
 
+void USBDeviceManager::beforeLoop(){
+    gIsUSBEventThread = true;
+}
+
 void USBDeviceManager::loopEvent(){
     int ret = 0;
+    TCP::rx_batch batch; //small segments completed in this pass get written to the clients once it's done
     retassure(!(ret = libusb_handle_events_completed(NULL, NULL)), "libusb_handle_events_completed failed: %d", ret);
 }
 
@@ -58,23 +63,27 @@ void USBDeviceManager::stopAction() noexcept{
     libusb_hotplug_deregister_callback(NULL, _usb_hotplug_cb_handle); //trigger final event
 }
 
+bool USBDeviceManager::isEventThread() noexcept{
+    return gIsUSBEventThread;
+}
+
 void USBDeviceManager::add_constructing(uint8_t bus, uint8_t addr){
     assure(!_isDying);
     _constructing.lockMember();
-    _constructing._elems.insert((uint16_t)(bus<<16) | addr);
+    _constructing._elems.insert(((uint32_t)bus<<16) | addr);
     _constructing.unlockMember();
 }
 
 void USBDeviceManager::del_constructing(uint8_t bus, uint8_t addr){
     _constructing.lockMember();
-    _constructing._elems.erase((uint16_t)(bus<<16) | addr);
+    _constructing._elems.erase(((uint32_t)bus<<16) | addr);
     _constructing.unlockMember();
 }
 
 bool USBDeviceManager::is_constructing(uint8_t bus, uint8_t addr){
     bool ret = false;
     _constructing.addMember();
-    ret = _constructing._elems.find((uint16_t)(bus<<16) | addr) != _constructing._elems.end();
+    ret = _constructing._elems.find(((uint32_t)bus<<16) | addr) != _constructing._elems.end();
     _constructing.delMember();
     return ret;
 }
@@ -84,17 +93,65 @@ void USBDeviceManager::device_add(libusb_device *dev){
     int ret = 0;
     assure(!_isDying);
 
-    struct libusb_transfer *transfer = NULL;
-    unsigned char *transfer_buffer = NULL;
+    bool isConstructing = false;
+    bool hasRef = false;
+    cleanup([&]{ //cleanup only code
+        if (hasRef) {
+            libusb_unref_device(dev);
+        }
+        if (isConstructing) {
+            del_constructing(libusb_get_bus_number(dev), libusb_get_device_address(dev));
+        }
+    });
+
+    uint8_t bus = 0;
+    uint8_t address = 0;
+    struct libusb_device_descriptor devdesc = {};
+    std::chrono::steady_clock::time_point queued = {};
+
+    bus = libusb_get_bus_number(dev);
+    assure((address = libusb_get_device_address(dev))>0);
+    
+    if (_mux->have_usb_device(bus, address) || is_constructing(bus, address)) {
+        //device already found
+        return;
+    }
+
+    retassure(!(ret = libusb_get_device_descriptor(dev, &devdesc)), "Could not get device descriptor for device %d-%d: %d", bus, address, ret);
+    
+    retassure(devdesc.idVendor == VID_APPLE, "USBDevice is not an Apple device");
+    retassure(devdesc.idProduct >= PID_RANGE_LOW && devdesc.idProduct <= PID_RANGE_MAX, "USBDevice is Apple, but not PID is not in observe range");
+    
+    info("Found new device with v/p %04x:%04x at %d-%d", devdesc.idVendor, devdesc.idProduct, bus, address);
+    
+    // No blocking operation can follow: this runs in the libusb hotplug callback and libusb will refuse any
+    // blocking call. Everything else happens on a bring-up worker, so many devices can be set up at once
+    add_constructing(bus, address); isConstructing = true;
+    libusb_ref_device(dev); hasRef = true;
+    queued = std::chrono::steady_clock::now();
+    _mux->queue_bringup([this,dev,bus,address,queued]{
+        //synchronous libusb calls may handle events (and thus run callbacks of other devices) on this thread
+        gIsUSBEventThread = true;
+        try {
+            device_bringup(dev, queued);
+        } catch (tihmstar::exception &e) {
+            error("failed to bring up device %d-%d error=%s code=%d",bus,address,e.what(),e.code());
+        }
+        gIsUSBEventThread = false;
+        del_constructing(bus, address);
+        libusb_unref_device(dev);
+    });
+    isConstructing = false; //job owns these now
+    hasRef = false;
+}
+
+void USBDeviceManager::device_bringup(libusb_device *dev, std::chrono::steady_clock::time_point queued){
+    int ret = 0;
     libusb_device_handle *handle = NULL;
     struct libusb_config_descriptor *config = NULL;
     USBDevice *newDevice = NULL;
     
     cleanup([&]{ //cleanup only code
-        if (transfer) {
-            libusb_free_transfer(transfer);
-        }
-        safeFree(transfer_buffer);
         if (handle){
             libusb_close(handle);
         }
@@ -109,27 +166,59 @@ void USBDeviceManager::device_add(libusb_device *dev){
     uint8_t bus = 0;
     uint8_t address = 0;
     int current_config = 0;
+    int rx_loops = 0;
+    int rx_depth = 0;
     struct libusb_device_descriptor devdesc = {};
 
+    assure(!_isDying);
     bus = libusb_get_bus_number(dev);
-    assure((address = libusb_get_device_address(dev))>0);
-    
-    if (_mux->have_usb_device(bus, address) || is_constructing(bus, address)) {
-        //device already found
-        return;
-    }
+    address = libusb_get_device_address(dev);
+
+    assure(newDevice = new USBDevice(_mux));
+    newDevice->_bringupStart = newDevice->_stageStart = queued;
+    newDevice->bringup_stage_done(USBDevice::BRINGUP_QUEUED);
 
     retassure(!(ret = libusb_get_device_descriptor(dev, &devdesc)), "Could not get device descriptor for device %d-%d: %d", bus, address, ret);
-    
-    retassure(devdesc.idVendor == VID_APPLE, "USBDevice is not an Apple device");
-    retassure(devdesc.idProduct >= PID_RANGE_LOW && devdesc.idProduct <= PID_RANGE_MAX, "USBDevice is Apple, but not PID is not in observe range");
-    
-    info("Found new device with v/p %04x:%04x at %d-%d", devdesc.idVendor, devdesc.idProduct, bus, address);
-    
-    // No blocking operation can follow: it may be run in the libusb hotplug callback and libusb will refuse any
-    // blocking call
     retassure(!(ret = libusb_open(dev, &handle)),"Could not open device %d-%d: %d", bus, address, ret);
     
+    {
+        unsigned char data[1024] = {};
+        uint16_t langid = 0;
+        unsigned int di = 0, si = 0;
+
+        /**
+         * From libusb:
+         *     Asking for the zero'th index is special - it returns a string
+         *     descriptor that contains all the language IDs supported by the
+         *     device.
+         **/
+        retassure((ret = libusb_get_string_descriptor(handle, 0, 0, data, sizeof(data))) >= 4, "Failed to request lang ID for device %d-%d (%d)", bus, address, ret);
+        langid = (uint16_t)(data[2] | (data[3] << 8));
+        info("Got lang ID %u for device %d-%d", langid, bus, address);
+
+        retassure((ret = libusb_get_string_descriptor(handle, devdesc.iSerialNumber, langid, data, sizeof(data))) >= 2, "Failed to request serial for device %d-%d (%d)", bus, address, ret);
+        
+        /* De-unicode, taken from libusb */
+        for (di = 0, si = 2; si < data[0] && si+1 < (unsigned int)ret && di < sizeof(newDevice->_serial)-1; si += 2) {
+            if ((data[si] & 0x80) || (data[si + 1])) /* non-ASCII */
+                newDevice->_serial[di++] = '?';
+            else if (data[si] == '\0')
+                break;
+            else
+                newDevice->_serial[di++] = data[si];
+        }
+        newDevice->_serial[di] = '\0';
+            
+        /* new style UDID: add hyphen between first 8 and following 16 digits */
+        if (di == 24) {
+            memmove(&newDevice->_serial[9], &newDevice->_serial[8], 16);
+            newDevice->_serial[8] = '-';
+            newDevice->_serial[di+1] = '\0';
+        }
+        info("Got serial '%s' for device %d-%d (%p)", newDevice->_serial, bus, address, newDevice);
+    }
+    newDevice->bringup_stage_done(USBDevice::BRINGUP_DESCRIPTOR);
+    
     retassure(!(ret = libusb_get_configuration(handle, &current_config)), "Could not get configuration for device %d-%d: %d", bus, address, ret);
     
     if (current_config != devdesc.bNumConfigurations) {
@@ -157,7 +246,6 @@ void USBDeviceManager::device_add(libusb_device *dev){
     
     retassure(!(ret = libusb_get_active_config_descriptor(dev, &config)), "Could not get configuration descriptor for device %d-%d: %d", bus, address, ret);
     
-    assure(newDevice = new USBDevice(_mux));
     newDevice->_pid = devdesc.idProduct;
     newDevice->_parent = this;
     
@@ -195,9 +283,6 @@ found_device:
     
     retassure(!(ret = libusb_claim_interface(handle, newDevice->_interface)), "Could not claim interface %d for device %d-%d: %d", newDevice->_interface, bus, address, ret);
     
-    retassure(transfer = libusb_alloc_transfer(0), "Failed to allocate transfer for device %d-%d: %d", bus, address, ret);
-    
-    newDevice->_serial[0] = 0;
     newDevice->_bus = bus;
     newDevice->_address = address;
     newDevice->_devdesc = devdesc;
@@ -232,58 +317,74 @@ found_device:
     
     info("USB Speed is %g MBit/s for device %d-%d", (double)(newDevice->_speed / 1000000.0), newDevice->_bus, newDevice->_address);
     
+    newDevice->tx_pool_init();
+    newDevice->rx_init();
+    newDevice->bringup_stage_done(USBDevice::BRINGUP_CONFIGURATION);
+
+    // Spin up parallel usb data retrieval loops, rx_callback adapts their number and size to the load later
+    // Old usbmuxds used only 1 rx loop, but that leaves the
+    // USB port sleeping most of the time
+    rx_depth = newDevice->getRXStats().depth;
+    for (int i = 0; i < rx_depth; i++) {
+        try {
+            usb_start_rx_loop(newDevice);
+            rx_loops++;
+        } catch (tihmstar::exception &e) {
+            warning("Failed to start RX loop number %d", i+1);
+        }
+    }
     
-    /**
-     * From libusb:
-     *     Asking for the zero'th index is special - it returns a string
-     *     descriptor that contains all the language IDs supported by the
-     *     device.
-     **/
-    retassure(transfer_buffer = (unsigned char *)malloc(1024 + LIBUSB_CONTROL_SETUP_SIZE + 8), "Failed to allocate transfer buffer for device %d-%d: %d", bus, address, ret);
-    memset(transfer_buffer, '\0', 1024 + LIBUSB_CONTROL_SETUP_SIZE + 8);
-    
-    
-    libusb_fill_control_setup(transfer_buffer, LIBUSB_ENDPOINT_IN, LIBUSB_REQUEST_GET_DESCRIPTOR, LIBUSB_DT_STRING << 8, 0, 1024 + LIBUSB_CONTROL_SETUP_SIZE);
-    libusb_fill_control_transfer(transfer, newDevice->_usbdev, transfer_buffer, usb_get_langid_callback, newDevice, 1000);
-    newDevice = NULL; //transfer ownership to Muxer if transfer succeeds, otherwise free newDevice (in callback)
-    
-    retassure(!(ret = libusb_submit_transfer(transfer)), "Could not request transfer for device %d-%d (%d)", newDevice->_bus, newDevice->_address, ret);
-    
-    transfer = NULL; //transfer in process, needs to be freed by callback
-    transfer_buffer = NULL; //transfer in process, needs to be freed by callback
+    // Ensure we have at least 1 RX loop going
+    retassure(rx_loops, "Failed to start any RX loop for device %d-%d", bus, address);
+    if (rx_loops != rx_depth) {
+        warning("Failed to start all %d RX loops. Going on with %d loops. This may have negative impact on device read speed.", rx_depth, rx_loops);
+    } else {
+        debug("All %d RX loops started successfully", rx_depth);
+    }
+    newDevice->bringup_stage_done(USBDevice::BRINGUP_RXLOOP);
     
-    add_constructing(bus, address);
+    //the version reply (handled in rx_callback) hands the device over to the Muxer
+    newDevice->mux_init();
+    newDevice = NULL;
 }
 
-// Start a read-callback loop for this device
-void usb_start_rx_loop(USBDevice *dev){
+// Submit an additional RX transfer, needs dev->_rx_xfers lock
+void usb_submit_rx_xfer(USBDevice *dev, uint32_t size){
     int ret = 0;
     void *buf = NULL;
     struct libusb_transfer *xfer = NULL;
     cleanup([&](){ //cleanup only code
         safeFree(buf);
         if (xfer) {
-            dev->_rx_xfers.lockMember();
             dev->_rx_xfers._elems.erase(xfer);
-            dev->_rx_xfers.unlockMember();
             safeFree(xfer->buffer);
             libusb_free_transfer(xfer);
         }
     });
     
-    assure(buf = malloc(USB_MRU));
+    retassure(!dev->_killInProcess, "Device %d-%d is dying", dev->_bus, dev->_address);
+    assure(buf = malloc(size));
     assure(xfer = libusb_alloc_transfer(0));
     
-    libusb_fill_bulk_transfer(xfer, dev->_usbdev, dev->_ep_in, (unsigned char *)buf, USB_MRU, rx_callback, dev, 0);
+    libusb_fill_bulk_transfer(xfer, dev->_usbdev, dev->_ep_in, (unsigned char *)buf, (int)size, rx_callback, dev, 0);
     buf = NULL; //owned by xfer now
 
-    dev->_rx_xfers.lockMember();
     dev->_rx_xfers._elems.insert(xfer);//transfer ownsership of transfer to device
-    dev->_rx_xfers.unlockMember();
-    retassure(!((ret = libusb_submit_transfer(xfer)),ret),"Failed to submit RX transfer to device %d-%d: %d", dev->_bus, dev->_address, ret);
+    retassure(!(ret = libusb_submit_transfer(xfer)), "Failed to submit RX transfer to device %d-%d: %d", dev->_bus, dev->_address, ret);
+    dev->retain(); //in flight transfers keep the device alive
+    dev->_counters.rxSubmitted++;
     xfer = NULL;
 }
 
+// Start a read-callback loop for this device
+void usb_start_rx_loop(USBDevice *dev){
+    dev->_rx_xfers.lockMember();
+    cleanup([&](){
+        dev->_rx_xfers.unlockMember();
+    });
+    usb_submit_rx_xfer(dev, dev->_rxStats.size);
+}
+
 #pragma mark libusb_callback implementations
 
 int usb_hotplug_cb(libusb_context *ctx, libusb_device *device, libusb_hotplug_event event, void *user_data) noexcept{
@@ -314,128 +415,49 @@ error:
     return 0;
 }
 
-void usb_get_langid_callback(struct libusb_transfer *transfer) noexcept{
-    int err = 0;
-    int ret = 0;
-    USBDevice *usbdev = (USBDevice *)transfer->user_data;
-    unsigned char *data = NULL;
-    uint16_t langid = 0;
-    
-    transfer->flags |= LIBUSB_TRANSFER_FREE_BUFFER;
-    cretassure(transfer->status == LIBUSB_TRANSFER_COMPLETED, "Failed to request lang ID for device %d-%d (%i)", usbdev->_bus, usbdev->_address, transfer->status);
-    
-    data = libusb_control_transfer_get_data(transfer); //error-free function
-    langid = (uint16_t)(data[2] | (data[3] << 8));
-    info("Got lang ID %u for device %d-%d", langid, usbdev->_bus, usbdev->_address);
-    
-    /* re-use the same transfer */
-    libusb_fill_control_setup(transfer->buffer, LIBUSB_ENDPOINT_IN, LIBUSB_REQUEST_GET_DESCRIPTOR,
-                              (uint16_t)((LIBUSB_DT_STRING << 8) | usbdev->_devdesc.iSerialNumber),
-                              langid, 1024 + LIBUSB_CONTROL_SETUP_SIZE);
-    libusb_fill_control_transfer(transfer, usbdev->_usbdev, transfer->buffer, usb_get_serial_callback, usbdev, 1000);
-    
-    cretassure((ret = libusb_submit_transfer(transfer)) >= 0, "Could not request transfer for device %d-%d (%d)", usbdev->_bus, usbdev->_address, ret);
-    
-error:
-    if (err) {
-        usbdev->_parent->del_constructing(usbdev->_bus, usbdev->_address);
-        //only free on error
-        if (transfer)
-            libusb_free_transfer(transfer);transfer = NULL;
-        //at this point we are the only owner of usbdev
-        //if anything goes wrong, this is the last chance to delete the object without leaking it
-        usbdev->kill();
-    }
-}
-
-
-void usb_get_serial_callback(struct libusb_transfer *transfer) noexcept{
-    int err = 0;
-    USBDevice *usbdev = (USBDevice *)transfer->user_data;
-    unsigned char *data = NULL;
-    std::shared_ptr<Muxer> mux = NULL;
-    int rx_loops = 0;
-    unsigned int di = 0, si = 0;
-    
-    cretassure(transfer->status == LIBUSB_TRANSFER_COMPLETED, "Failed to request serial for device %d-%d (%i)", usbdev->_bus, usbdev->_address, transfer->status);
-    
-    /* De-unicode, taken from libusb */
-    cassure(data = libusb_control_transfer_get_data(transfer));
-    
-    for (di = 0, si = 2; si < data[0] && di < sizeof(usbdev->_serial)-1; si += 2) {
-        if ((data[si] & 0x80) || (data[si + 1])) /* non-ASCII */
-            usbdev->_serial[di++] = '?';
-        else if (data[si] == '\0')
-            break;
-        else
-            usbdev->_serial[di++] = data[si];
-    }
-    //should already be zero terminated at the correct offset (hopefully)
-    //just doing sanity zero termination
-    usbdev->_serial[sizeof(usbdev->_serial)-1] = 0;
-        
-    /* new style UDID: add hyphen between first 8 and following 16 digits */
-    if (di == 24) {
-        memmove(&usbdev->_serial[9], &usbdev->_serial[8], 16);
-        usbdev->_serial[8] = '-';
-        usbdev->_serial[di+1] = '\0';
-    }
-
-    info("Got serial '%s' for device %d-%d (%p)", usbdev->_serial, usbdev->_bus, usbdev->_address,usbdev);
-
-
-    // Spin up NUM_RX_LOOPS parallel usb data retrieval loops
-    // Old usbmuxds used only 1 rx loop, but that leaves the
-    // USB port sleeping most of the time
-    
-    for (rx_loops = 0; rx_loops < NUM_RX_LOOPS; rx_loops++) {
-        try {
-            usb_start_rx_loop(usbdev);
-        } catch (tihmstar::exception &e) {
-            warning("Failed to start RX loop number %d", NUM_RX_LOOPS - rx_loops);
-        }
-    }
-    
-    // Ensure we have at least 1 RX loop going
-    cretassure(rx_loops, "Failed to start any RX loop for device %d-%d", usbdev->_bus, usbdev->_address);
-    if (rx_loops != NUM_RX_LOOPS) {
-        warning("Failed to start all %d RX loops. Going on with %d loops. This may have negative impact on device read speed.", NUM_RX_LOOPS, rx_loops);
-    } else {
-        debug("All %d RX loops started successfully", NUM_RX_LOOPS);
-    }
-    
-    try {
-        usbdev->mux_init();
-    } catch (tihmstar::exception &e) {
-        creterror("failed to mux_init usbdev=%s error=%s code=%d",usbdev->_serial,e.what(),e.code());
-    }
-    
-error:
-    usbdev->_parent->del_constructing(usbdev->_bus, usbdev->_address);
-    usbdev = NULL; //transfered ownership to Muxer
-    libusb_free_transfer(transfer);
-    
-    if (usbdev) { //we are the only owner of usbdev, if something goes wrong, free the object
-        usbdev->kill();
-    }
-    if (err) {
-        error("usb_get_serial_callback err=%d",err);
-    }
-}
-
 void rx_callback(struct libusb_transfer *xfer) noexcept{
     int err = 0;
+    int ret = 0;
     USBDevice *dev = (USBDevice *)xfer->user_data;
     
     debug("RX callback dev %d-%d len %d status %d", dev->_bus, dev->_address, xfer->actual_length, xfer->status);
     if(xfer->status == LIBUSB_TRANSFER_COMPLETED) {
+        int add = 0;
         try {
-            dev->device_data_input(xfer->buffer, xfer->actual_length);
+            dev->device_data_input(xfer->buffer, xfer->actual_length, xfer->length);
         } catch (tihmstar::exception &e) {
             creterror("failed to device_data_input usbdev=%s error=%s code=%d",dev->_serial,e.what(),e.code());
         }
-        libusb_submit_transfer(xfer);
-        return;
+        dev->_rx_xfers.lockMember();
+        if ((add = dev->rx_tune(xfer)) < 0) {
+            //more transfers in flight than needed, retire this one
+            dev->_rx_xfers._elems.erase(xfer);
+            dev->_rx_xfers.unlockMember();
+            safeFree(xfer->buffer);
+            libusb_free_transfer(xfer);
+            dev->release(); //reference held by this transfer, might delete dev
+            return;
+        }
+        //resubmit unless the device is dying, killAction() won't see transfers submitted after it ran
+        if (!dev->_killInProcess && !(ret = libusb_submit_transfer(xfer))) {
+            dev->_counters.rxSubmitted++;
+            for (; add > 0; add--) {
+                try {
+                    usb_submit_rx_xfer(dev, dev->_rxStats.size);
+                } catch (tihmstar::exception &e) {
+                    warning("Failed to add RX transfer to device %d-%d", dev->_bus, dev->_address);
+                    break;
+                }
+            }
+            dev->_rx_xfers.unlockMember();
+            return;
+        }
+        dev->_rx_xfers.unlockMember();
+        if (ret) {
+            error("Failed to resubmit RX transfer to device %d-%d: %d", dev->_bus, dev->_address, ret);
+            dev->_counters.errors++;
+        }
+        goto error;
     }
     switch(xfer->status) {
         case LIBUSB_TRANSFER_COMPLETED: //shut up compiler
@@ -464,6 +486,7 @@ void rx_callback(struct libusb_transfer *xfer) noexcept{
             // this should never be reached.
             break;
     }
+    if (xfer->status != LIBUSB_TRANSFER_CANCELLED) dev->_counters.errors++;
     
 error:
     //remove transfer
@@ -475,4 +498,5 @@ error:
     safeFree(xfer->buffer);
     libusb_free_transfer(xfer);
     dev->kill();
+    dev->release(); //reference held by this transfer, might delete dev
 }
@@ -13,6 +13,7 @@
 #include <libusb-1.0/libusb.h>
 #include <lck_container.h>
 #include <set>
+#include <chrono>
 
 
 #pragma mark USBDefines
@@ -39,14 +40,28 @@
 #define PID_RANGE_LOW 0x1290
 #define PID_RANGE_MAX 0x12af
 
+// initial number of in flight RX transfers on high speed links, adapted to the load afterwards (see USBDevice::rx_tune)
 #define NUM_RX_LOOPS 3
 
+// RX transfer sizes are multiples of this, up to USB_MRU
+#define RX_XFER_SIZE_STEP 16384
+
+// RX depth and size are re-evaluated this often while data comes in
+#define RX_TUNE_INTERVAL_MS 250
+
+// less than this per interval without any full transfer counts as idle
+#define RX_IDLE_BYTES 0x10000
+
+// number of preallocated TX transfers (each with a USB_MTU sized buffer) kept per device
+#define NUM_TX_XFERS 16
+
 class USBDeviceManager : public DeviceManager{
     libusb_hotplug_callback_handle _usb_hotplug_cb_handle;
-    lck_contrainer<std::set<uint16_t>> _constructing;
+    lck_contrainer<std::set<uint32_t>> _constructing; //(bus<<16) | addr, like USBDevice::usb_location()
     bool _isDying;
 
     
+    virtual void beforeLoop() override;
     virtual void loopEvent() override;
     virtual void stopAction() noexcept override;
     
@@ -54,15 +69,16 @@ class USBDeviceManager : public DeviceManager{
     void del_constructing(uint8_t bus, uint8_t addr);
     bool is_constructing(uint8_t bus, uint8_t addr);
 
-    void device_add(libusb_device *dev);
+    void device_add(libusb_device *dev); //called from the hotplug callback, queues device_bringup()
+    void device_bringup(libusb_device *dev, std::chrono::steady_clock::time_point queued);
     
 public:
     USBDeviceManager(Muxer *mux);
     virtual ~USBDeviceManager() override;    
+
+    static bool isEventThread() noexcept; //true if called from within a libusb callback
     
     friend int usb_hotplug_cb(libusb_context *ctx, libusb_device *device, libusb_hotplug_event event, void *user_data) noexcept;
-    friend void usb_get_langid_callback(struct libusb_transfer *transfer) noexcept;
-    friend void usb_get_serial_callback(struct libusb_transfer *transfer) noexcept;
 
 };
 
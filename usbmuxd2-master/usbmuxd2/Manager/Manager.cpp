@@ -14,7 +14,7 @@
 
 
 Manager::Manager()
-: _loopThread(nullptr),_loopState(LOOP_UNINITIALISED)
+: _loopThread(nullptr), _didAfterLoop(false), _reactorLoop(-1), _loopState(LOOP_UNINITIALISED)
 {
     //empty
 }
@@ -28,15 +28,111 @@ Manager::~Manager(){
     assert(_loopState == LOOP_UNINITIALISED || _loopState == LOOP_STOPPED);
     assert(!_loopThread);
 #endif
+    for (auto &w : _watches) {
+        delete w.watch;
+    }
+    _watches.clear();
 }
 
 void Manager::loopEvent(){
     reterror("[Manager] LoopEvent wasn't overwritten. Probably subclass construction failed!");
 }
 
+void Manager::fdEvent(int fd, uint32_t revents){
+    reterror("[Manager] fdEvent wasn't overwritten. Probably subclass construction failed!");
+}
+
+void Manager::watchFd(int fd, uint32_t events){
+    retassure(_loopState == LOOP_UNINITIALISED, "[Manager] can't watch fds after loop was initialized");
+    Reactor *reactor = Reactor::shared();
+    if (_reactorLoop == -1) {
+        _reactorLoop = reactor->pickLoop(); //all fds of a Manager are handled by the same loop thread
+    }
+    //events are armed in startLoop()
+    Reactor::Watch *w = reactor->add(_reactorLoop, fd, 0, [this](int fd, uint32_t revents){
+        reactorEvent(fd, revents);
+    });
+    _watches.push_back({w,events});
+}
+
+void Manager::unwatchFd(int fd) noexcept{
+    for (auto &w : _watches) {
+        if (w.watch->fd() == fd) {
+            Reactor::shared()->remove(w.watch);
+        }
+    }
+}
+
+void Manager::setFdEvents(int fd, uint32_t events) noexcept{
+    for (auto &w : _watches) {
+        if (w.watch->fd() == fd) {
+            w.events = events;
+            if (_loopState == LOOP_RUNNING) {
+                Reactor::shared()->modify(w.watch, events);
+            }
+        }
+    }
+}
+
+void Manager::setFdTimer(int fd, uint64_t usec) noexcept{
+    for (auto &w : _watches) {
+        if (w.watch->fd() == fd) {
+            Reactor::shared()->setTimer(w.watch, usec);
+        }
+    }
+}
+
+void Manager::unwatchAll() noexcept{
+    for (auto &w : _watches) {
+        Reactor::shared()->remove(w.watch);
+    }
+}
+
+void Manager::finishLoop() noexcept{
+    if (!_didAfterLoop.exchange(true)) {
+        afterLoop();
+    }
+    _loopState = LOOP_STOPPED;
+}
+
+void Manager::reactorEvent(int fd, uint32_t revents) noexcept{
+    if (_loopState != LOOP_RUNNING) return;
+    try {
+        fdEvent(fd, revents);
+    } catch (tihmstar::exception &e) {
+        debug("[Manager] breaking Manager-Loop because of exception error=%s code=%d",e.what(),e.code());
+        loop_state expected = LOOP_RUNNING;
+        loop_state tobeplaced = LOOP_STOPPING;
+        _loopState.compare_exchange_strong(expected, tobeplaced);
+        unwatchAll(); //safe to call from within the callback
+        finishLoop();
+    }
+}
+
 
 void Manager::startLoop(){
     retassure(_loopState == LOOP_UNINITIALISED, "[Manager] loop already initialized");
+    if (_watches.size()) {
+        //reactor driven loop, no thread needed
+        loop_state expected = LOOP_UNINITIALISED;
+        loop_state tobeplaced = LOOP_CONSTRUCTING;
+        assure(_loopState.compare_exchange_strong(expected, tobeplaced));
+        _loopState = LOOP_RUNNING;
+        try {
+            beforeLoop();
+        } catch (tihmstar::exception &e) {
+            debug("failed to execute beforeLoop action of exception error=%s code=%d",e.what(),e.code());
+            _loopState = LOOP_STOPPING;
+            unwatchAll();
+            finishLoop();
+            return;
+        }
+        for (auto &w : _watches) {
+            Reactor::shared()->modify(w.watch, w.events);
+        }
+        return;
+    }
+
     cleanup([&]{
         _sleepy.unlock();
     });
@@ -49,7 +145,7 @@ void Manager::startLoop(){
     assure(!_loopThread);
 
     
-    _loopThread = new std::thread([&]{
+    std::thread *loopThread = new std::thread([&]{
         _loopState = LOOP_RUNNING;
         _sleepy.unlock();
         try {
@@ -69,6 +165,11 @@ void Manager::startLoop(){
         afterLoop();
         _loopState = LOOP_STOPPED;
     });
+    {
+        std::unique_lock<std::mutex> ul(_loopThreadLck);
+        _loopThread = loopThread;
+        _loopThreadCond.notify_all();
+    }
 
     //hangs here iff _loopThread didn't spawn yet
     _sleepy.lock();
@@ -76,6 +177,21 @@ void Manager::startLoop(){
 }
 
 void Manager::stopLoop() noexcept{
+    if (_watches.size()) {
+        bool didStart = (_loopState != LOOP_UNINITIALISED);
+        loop_state expected = LOOP_RUNNING;
+        loop_state tobeplaced = LOOP_STOPPING;
+        if (_loopState.compare_exchange_strong(expected, tobeplaced)) {
+            stopAction();
+        }
+        unwatchAll(); //waits for running callbacks to finish
+        if (didStart) {
+            finishLoop();
+        } else {
+            _loopState = LOOP_STOPPED;
+        }
+        return;
+    }
     if (_loopState < LOOP_STOPPED) {
         if (_loopState == LOOP_UNINITIALISED) {
             try{
@@ -85,14 +201,12 @@ void Manager::stopLoop() noexcept{
             }
         }
         
-        while (_loopState < LOOP_RUNNING) {
-            //if we are constructing a thread, wait for it being constructed
-            sched_yield();
-        }
-        
-        while (!_loopThread) {
-            //wait for _loopThread variable to be set
-            sched_yield();
+        {
+            //if we are constructing a thread, wait for it being constructed and _loopThread variable being set
+            std::unique_lock<std::mutex> ul(_loopThreadLck);
+            while (!_loopThreadCond.wait_for(ul, std::chrono::seconds(5), [this]{return _loopState >= LOOP_RUNNING && _loopThread;})) {
+                warning("[Manager] Manager(%p) still waiting for loop thread to be constructed",this);
+            }
         }
         
         loop_state expected = LOOP_RUNNING;
@@ -10,9 +10,15 @@
 #define Manager_hpp
 
 #include <future>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <Manager/Reactor.hpp>
 
 /*
  Abstract class
+ A Manager either owns a thread which repeatedly calls loopEvent(),
+ or (if it registered fds using watchFd() before startLoop()) gets fdEvent() called by the shared Reactor.
  */
 
 enum loop_state{
@@ -24,12 +30,31 @@ enum loop_state{
 };
 
 class Manager{
+    struct fdWatch{
+        Reactor::Watch *watch;
+        uint32_t events;
+    };
     std::thread *_loopThread;
     std::mutex _sleepy;
+    std::mutex _loopThreadLck; //used with _loopThreadCond to wait for the loop thread being constructed
+    std::condition_variable _loopThreadCond;
+    std::vector<fdWatch> _watches;
+    std::atomic_bool _didAfterLoop;
+    int _reactorLoop;
+
+    void reactorEvent(int fd, uint32_t revents) noexcept;
+    void unwatchAll() noexcept;
+    void finishLoop() noexcept;
 protected:
     std::atomic<loop_state> _loopState;
     
     virtual void loopEvent();
+    virtual void fdEvent(int fd, uint32_t revents);
+
+    void watchFd(int fd, uint32_t events); //needs to be called before startLoop
+    void unwatchFd(int fd) noexcept;
+    void setFdEvents(int fd, uint32_t events) noexcept; //e.g. pause reading by setting events to 0
+    void setFdTimer(int fd, uint64_t usec) noexcept; //fdEvent() gets called with Reactor::TIMEOUT once the timer expires. 0 disarms
     
 public:
     Manager(const Manager&) = delete; //delete copy constructor
@@ -0,0 +1,377 @@
+//
+//  Reactor.cpp
+//  usbmuxd2
+//
+//  Created by tihmstar on 02.11.20.
+//  Copyright © 2020 tihmstar. All rights reserved.
+//
+
+#include "Reactor.hpp"
+#include <log.h>
+#include <libgeneral/macros.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <string.h>
+#include <system_error>
+
+#ifdef __APPLE__
+#   include <sys/types.h>
+#   include <sys/event.h>
+#   include <sys/time.h>
+#else
+#   include <sys/epoll.h>
+static_assert(EPOLLIN == POLLIN && EPOLLOUT == POLLOUT && EPOLLERR == POLLERR && EPOLLHUP == POLLHUP, "epoll flags don't match poll flags");
+#endif
+
+#define MAX_EVENTS 64
+
+unsigned Reactor::gDefaultThreads = 0;
+
+#pragma mark Watch
+
+Reactor::Watch::Watch(int fd, int loop, uint64_t id, uint32_t events, callback_t cb)
+: _cb(cb), _id(id), _fd(fd), _loop(loop), _events(events), _deadline{}, _hasTimer(false)
+{
+    //
+}
+
+#pragma mark Reactor
+
+Reactor::Reactor(unsigned threads)
+: _nextID(1), _nextLoop(0), _isDying(false)
+{
+    cleanup([&]{
+        if (_isDying) {
+            for (auto l : _loops) {
+                safeClose(l->qfd);
+                safeClose(l->wakefds[0]);
+                safeClose(l->wakefds[1]);
+                delete l;
+            }
+            _loops.clear();
+        }
+    });
+    _isDying = true; //cleanup in case we fail in here
+
+    if (!threads) {
+        threads = std::thread::hardware_concurrency();
+        if (!threads) threads = 1;
+    }
+
+    for (unsigned i=0; i<threads; i++) {
+        Loop *l = new Loop{};
+        l->thread = nullptr;
+        l->qfd = -1;
+        l->wakefds[0] = l->wakefds[1] = -1;
+        _loops.push_back(l);
+        retassure(!pipe(l->wakefds), "Failed to create wakeup pipe: %s",strerror(errno));
+        for (int fd : l->wakefds) {
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+            fcntl(fd, F_SETFL, O_NONBLOCK);
+        }
+#ifdef __APPLE__
+        struct kevent kev = {};
+        retassure((l->qfd = kqueue()) >= 0, "kqueue() failed: %s",strerror(errno));
+        EV_SET(&kev, l->wakefds[0], EVFILT_READ, EV_ADD, 0, 0, (void*)0);
+        retassure(!kevent(l->qfd, &kev, 1, NULL, 0, NULL), "Failed to register wakeup pipe: %s",strerror(errno));
+#else
+        struct epoll_event ev = {};
+        retassure((l->qfd = epoll_create1(EPOLL_CLOEXEC)) >= 0, "epoll_create1() failed: %s",strerror(errno));
+        ev.events = EPOLLIN;
+        ev.data.u64 = 0; //id 0 is reserved for the wakeup pipe
+        retassure(!epoll_ctl(l->qfd, EPOLL_CTL_ADD, l->wakefds[0], &ev), "Failed to register wakeup pipe: %s",strerror(errno));
+#endif
+    }
+    _isDying = false;
+
+    for (auto l : _loops) {
+        l->thread = new std::thread([this,l]{
+            loop(l);
+        });
+    }
+    info("[Reactor] started %u event loop threads",threads);
+}
+
+Reactor::~Reactor(){
+    debug("[Reactor] destroying Reactor(%p)",this);
+    _isDying = true;
+    for (auto l : _loops) {
+        wakeup(l);
+    }
+    for (auto l : _loops) {
+        if (l->thread) {
+            l->thread->join();
+            delete l->thread; l->thread = nullptr;
+        }
+#ifdef DEBUG
+        if (l->watches.size()) {
+            error("[Reactor] destroying loop with %zu watches still registered",l->watches.size());
+        }
+#endif
+        safeClose(l->qfd);
+        safeClose(l->wakefds[0]);
+        safeClose(l->wakefds[1]);
+        delete l;
+    }
+    _loops.clear();
+}
+
+Reactor *Reactor::shared(){
+    static Reactor gReactor(gDefaultThreads);
+    return &gReactor;
+}
+
+void Reactor::setDefaultThreads(unsigned threads) noexcept{
+    gDefaultThreads = threads;
+}
+
+void Reactor::wakeup(Loop *l) noexcept{
+    char c = 0;
+    if (write(l->wakefds[1], &c, 1) != 1 && errno != EAGAIN) { //a full pipe means a wakeup is pending anyways
+        error("[Reactor] failed to wake event loop (%p): %s",l,strerror(errno));
+    }
+}
+
+int Reactor::pickLoop() noexcept{
+    return (int)(_nextLoop++ % _loops.size());
+}
+
+void Reactor::ctl(Loop *l, Watch *w, uint32_t oldEvents, uint32_t newEvents){
+#ifdef __APPLE__
+    struct kevent kev[4] = {};
+    int kevcnt = 0;
+    static const struct {uint32_t flag; short filter;} filters[] = {{POLLIN,EVFILT_READ},{POLLOUT,EVFILT_WRITE}};
+    for (auto &f : filters) {
+        if ((oldEvents & f.flag) && !(newEvents & f.flag)) {
+            EV_SET(&kev[kevcnt++], w->_fd, f.filter, EV_DELETE, 0, 0, (void*)w->_id);
+        } else if (!(oldEvents & f.flag) && (newEvents & f.flag)) {
+            EV_SET(&kev[kevcnt++], w->_fd, f.filter, EV_ADD, 0, 0, (void*)w->_id);
+        }
+    }
+    if (kevcnt) {
+        retassure(!kevent(l->qfd, kev, kevcnt, NULL, 0, NULL), "[Reactor] kevent failed for fd=%d: %s",w->_fd,strerror(errno));
+    }
+#else
+    struct epoll_event ev = {};
+    int op = EPOLL_CTL_MOD;
+    ev.events = newEvents;
+    ev.data.u64 = w->_id;
+    if (oldEvents == (uint32_t)-1) {
+        op = EPOLL_CTL_ADD;
+    } else if (newEvents == (uint32_t)-1) {
+        op = EPOLL_CTL_DEL;
+    }
+    retassure(!epoll_ctl(l->qfd, op, w->_fd, &ev), "[Reactor] epoll_ctl(%d) failed for fd=%d: %s",op,w->_fd,strerror(errno));
+#endif
+}
+
+Reactor::Watch *Reactor::add(int loop, int fd, uint32_t events, callback_t cb){
+    Watch *w = nullptr;
+    Loop *l = nullptr;
+    cleanup([&]{
+        if (w) {
+            l->lck.lock();
+            l->watches.erase(w->_id);
+            l->lck.unlock();
+            delete w;
+        }
+    });
+    retassure(!_isDying, "[Reactor] can't add watches while dying");
+    retassure(loop >= 0 && loop < (int)_loops.size(), "[Reactor] bad loop index=%d",loop);
+    retassure(fd >= 0, "[Reactor] bad fd=%d",fd);
+    l = _loops.at(loop);
+
+    w = new Watch(fd, loop, _nextID++, events, cb);
+
+    l->lck.lock();
+    l->watches[w->_id] = w;
+    l->lck.unlock();
+
+#ifdef __APPLE__
+    ctl(l, w, 0, events);
+#else
+    ctl(l, w, (uint32_t)-1, events);
+#endif
+
+    {
+        Watch *ret = w; w = nullptr;
+        return ret;
+    }
+}
+
+void Reactor::modify(Watch *w, uint32_t events) noexcept{
+    std::unique_lock<std::mutex> clk(w->_ctlLck);
+    if (w->_fd == -1 || w->_events == events) {
+        return;
+    }
+    try {
+        ctl(_loops.at(w->_loop), w, w->_events, events);
+        w->_events = events;
+    } catch (tihmstar::exception &e) {
+        error("[Reactor] failed to modify watch for fd=%d error=%s",w->_fd,e.what());
+    }
+}
+
+void Reactor::remove(Watch *w) noexcept{
+    Loop *l = _loops.at(w->_loop);
+
+    l->lck.lock();
+    l->watches.erase(w->_id);
+    if (w->_hasTimer) {
+        l->timers.erase({w->_deadline,w->_id});
+        w->_hasTimer = false;
+    }
+    l->lck.unlock();
+
+    //waits for a running callback to finish
+    std::unique_lock<std::recursive_mutex> wlk(w->_lck);
+    std::unique_lock<std::mutex> clk(w->_ctlLck);
+    if (w->_fd == -1) {
+        return;
+    }
+    try {
+#ifdef __APPLE__
+        ctl(l, w, w->_events, 0);
+#else
+        ctl(l, w, w->_events, (uint32_t)-1);
+#endif
+    } catch (tihmstar::exception &e) {
+        //fd might have been closed already, which removes it implicitly
+        debug("[Reactor] failed to remove watch for fd=%d error=%s",w->_fd,e.what());
+    }
+    w->_fd = -1;
+}
+
+void Reactor::setTimer(Watch *w, uint64_t usec) noexcept{
+    Loop *l = _loops.at(w->_loop);
+    bool needsWakeup = false;
+
+    l->lck.lock();
+    if (w->_hasTimer) {
+        l->timers.erase({w->_deadline,w->_id});
+        w->_hasTimer = false;
+    }
+    if (usec && l->watches.find(w->_id) != l->watches.end()) {
+        w->_deadline = clock_t::now() + std::chrono::microseconds(usec);
+        w->_hasTimer = true;
+        l->timers.insert({w->_deadline,w->_id});
+        needsWakeup = (l->timers.begin()->second == w->_id); //loop might be sleeping for longer than that
+    }
+    l->lck.unlock();
+
+    if (needsWakeup) {
+        wakeup(l);
+    }
+}
+
+int Reactor::nextTimeout(Loop *l) noexcept{
+    int ret = -1;
+    l->lck.lock();
+    if (l->timers.size()) {
+        auto diff = l->timers.begin()->first - clock_t::now();
+        if (diff.count() <= 0) {
+            ret = 0;
+        } else {
+            //round up, so we don't wake up too early and spin
+            ret = (int)std::chrono::duration_cast<std::chrono::milliseconds>(diff + std::chrono::milliseconds(1) - clock_t::duration(1)).count();
+        }
+    }
+    l->lck.unlock();
+    return ret;
+}
+
+void Reactor::fireTimers(Loop *l) noexcept{
+    std::vector<uint64_t> expired;
+    auto now = clock_t::now();
+
+    l->lck.lock();
+    while (l->timers.size() && l->timers.begin()->first <= now) {
+        uint64_t id = l->timers.begin()->second;
+        l->timers.erase(l->timers.begin());
+        auto it = l->watches.find(id);
+        if (it != l->watches.end()) {
+            it->second->_hasTimer = false;
+            expired.push_back(id);
+        }
+    }
+    l->lck.unlock();
+
+    for (uint64_t id : expired) {
+        dispatch(l, id, TIMEOUT);
+    }
+}
+
+void Reactor::dispatch(Loop *l, uint64_t id, uint32_t revents) noexcept{
+    Watch *w = nullptr;
+    l->lck.lock();
+    {
+        auto it = l->watches.find(id);
+        if (it != l->watches.end()) {
+            w = it->second;
+            w->_lck.lock();
+        }
+    }
+    l->lck.unlock();
+    if (!w) return; //watch got removed after event was queued
+
+    if (w->_fd != -1) {
+        try {
+            w->_cb(w->_fd, revents);
+        } catch (...) {
+            error("[Reactor] callback for fd=%d threw an exception",w->_fd);
+        }
+    }
+    w->_lck.unlock();
+}
+
+void Reactor::loop(Loop *l) noexcept{
+#ifdef __APPLE__
+    struct kevent evs[MAX_EVENTS];
+#else
+    struct epoll_event evs[MAX_EVENTS];
+#endif
+    while (!_isDying) {
+        int cnt = 0;
+        int timeout = nextTimeout(l);
+#ifdef __APPLE__
+        struct timespec ts = {};
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (timeout % 1000) * 1000000;
+        cnt = kevent(l->qfd, NULL, 0, evs, MAX_EVENTS, (timeout < 0) ? NULL : &ts);
+#else
+        cnt = epoll_wait(l->qfd, evs, MAX_EVENTS, timeout);
+#endif
+        if (cnt < 0) {
+            if (errno == EINTR) continue;
+            error("[Reactor] waiting for events failed: %s",strerror(errno));
+            break;
+        }
+
+        for (int i=0; i<cnt && !_isDying; i++) {
+            uint64_t id = 0;
+            uint32_t revents = 0;
+#ifdef __APPLE__
+            id = (uint64_t)evs[i].udata;
+            revents = (evs[i].filter == EVFILT_WRITE) ? POLLOUT : POLLIN;
+            if (evs[i].flags & EV_EOF) revents |= POLLHUP;
+            if (evs[i].flags & EV_ERROR) revents |= POLLERR;
+#else
+            id = evs[i].data.u64;
+            revents = evs[i].events;
+#endif
+            if (!id) {
+                //wakeup pipe
+                char buf[0x40];
+                while (read(l->wakefds[0], buf, sizeof(buf)) > 0);
+                continue;
+            }
+            dispatch(l, id, revents);
+        }
+        if (!_isDying) {
+            fireTimers(l);
+        }
+    }
+    debug("[Reactor] event loop (%p) finished",l);
+}
@@ -0,0 +1,102 @@
+//
+//  Reactor.hpp
+//  usbmuxd2
+//
+//  Created by tihmstar on 02.11.20.
+//  Copyright © 2020 tihmstar. All rights reserved.
+//
+
+#ifndef Reactor_hpp
+#define Reactor_hpp
+
+#include <stdint.h>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <map>
+#include <set>
+#include <chrono>
+#include <functional>
+
+/*
+ Fixed size pool of event loop threads (epoll on linux, kqueue on darwin).
+ Every loop thread owns its own event queue, so callbacks of fds registered on the same loop never run concurrently.
+ Events are specified using the poll(2) flags (POLLIN, POLLOUT, ...).
+ Every watch can additionally have a single one-shot timer, which calls the callback with revents=Reactor::TIMEOUT.
+ */
+
+class Reactor{
+public:
+    typedef std::function<void(int fd, uint32_t revents)> callback_t;
+    typedef std::chrono::steady_clock clock_t;
+    static constexpr uint32_t TIMEOUT = 0x08000000; //not used by poll/epoll
+
+
+    class Watch{
+        std::recursive_mutex _lck; //held while callback is running
+        std::mutex _ctlLck; //protects _events and _fd, never held while callback is running
+        callback_t _cb;
+        uint64_t _id;
+        int _fd;
+        int _loop;
+        uint32_t _events;
+        clock_t::time_point _deadline; //protected by loop lck
+        bool _hasTimer; //protected by loop lck
+        Watch(int fd, int loop, uint64_t id, uint32_t events, callback_t cb);
+    public:
+        Watch(const Watch &) = delete; //delete copy constructor
+        Watch(Watch &&o) = delete; //move constructor
+        int fd() const noexcept {return _fd;}
+        friend Reactor;
+    };
+
+private:
+    struct Loop{
+        std::thread *thread;
+        std::mutex lck; //protects watches and timers
+        std::map<uint64_t,Watch*> watches;
+        std::set<std::pair<clock_t::time_point,uint64_t>> timers;
+        int qfd;
+        int wakefds[2];
+    };
+    std::vector<Loop*> _loops;
+    std::atomic<uint64_t> _nextID;
+    std::atomic<uint32_t> _nextLoop;
+    std::atomic_bool _isDying;
+
+    static unsigned gDefaultThreads;
+
+    void loop(Loop *l) noexcept;
+    void ctl(Loop *l, Watch *w, uint32_t oldEvents, uint32_t newEvents);
+    void dispatch(Loop *l, uint64_t id, uint32_t revents) noexcept;
+    int nextTimeout(Loop *l) noexcept; //in milliseconds, -1 if no timers are armed
+    void fireTimers(Loop *l) noexcept;
+    static void wakeup(Loop *l) noexcept;
+
+public:
+    Reactor(const Reactor&) = delete; //delete copy constructor
+    Reactor(Reactor &&o) = delete; //move constructor
+
+    Reactor(unsigned threads);
+    ~Reactor();
+
+    static Reactor *shared();
+    static void setDefaultThreads(unsigned threads) noexcept; //0 means one thread per core. Needs to be called before first use of shared()
+
+    unsigned threads() const noexcept {return (unsigned)_loops.size();}
+    int pickLoop() noexcept;
+
+    /*
+     Watches are owned by the caller.
+     remove() blocks until a running callback of this watch returned (unless called from within that callback)
+     and must be called before deleting the watch.
+     modify() and setTimer() never block on running callbacks and can be called from any thread.
+     */
+    Watch *add(int loop, int fd, uint32_t events, callback_t cb);
+    void modify(Watch *w, uint32_t events) noexcept;
+    void remove(Watch *w) noexcept;
+    void setTimer(Watch *w, uint64_t usec) noexcept; //(re)arms the timer of the watch, 0 disarms it
+};
+
+#endif /* Reactor_hpp */
@@ -0,0 +1,102 @@
+//
+//  StatsManager.cpp
+//  usbmuxd2
+//
+//  Created by tihmstar on 29.11.20.
+//  Copyright © 2020 tihmstar. All rights reserved.
+//
+
+#include "StatsManager.hpp"
+#include <log.h>
+#include <libgeneral/macros.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#ifndef MSG_NOSIGNAL
+#   define MSG_NOSIGNAL 0 //SIGPIPE is ignored anyways
+#endif
+
+#define STATS_SEND_TIMEOUT_SEC 1 //a reader which doesn't keep up doesn't get to block the next one for long
+
+StatsManager::StatsManager(Muxer *mux, const char *path)
+: _mux(mux), _path(path), _listenfd(-1)
+{
+    struct sockaddr_un bind_addr = {};
+
+    retassure(_path.size() < sizeof(bind_addr.sun_path), "stats socket path '%s' is too long", path);
+    retassure(unlink(path) != -1 || errno == ENOENT, "unlink(%s) failed: %s", path, strerror(errno));
+
+    retassure((_listenfd = socket(AF_UNIX, SOCK_STREAM, 0))>=0, "socket() failed: %s", strerror(errno));
+
+    bind_addr.sun_family = AF_UNIX;
+    strcpy(bind_addr.sun_path, path);
+    retassure(!bind(_listenfd, (struct sockaddr*)&bind_addr, sizeof(bind_addr)), "bind() failed: %s", strerror(errno));
+
+    retassure(!listen(_listenfd, 5), "listen() failed: %s", strerror(errno));
+
+    assure(!chmod(path, 0666));
+}
+
+StatsManager::~StatsManager(){
+    info("[destroying] StatsManager");
+    stopLoop();
+    if (_listenfd >= 0) {
+        int cfd = _listenfd; _listenfd = -1;
+        close(cfd);
+        unlink(_path.c_str());
+    }
+}
+
+void StatsManager::loopEvent(){
+    int cfd = -1;
+    cleanup([&]{
+        if (cfd >= 0) {
+            close(cfd);
+        }
+    });
+
+    retassure((cfd = accept(_listenfd, NULL, NULL))>=0, "accept() failed (%s)", strerror(errno));
+    if (_loopState != LOOP_RUNNING) return; //stopAction() woke us up
+
+    try {
+        send_dump(cfd);
+    } catch (tihmstar::exception &e) {
+        error("failed to send statistics with error=%d (%s)",e.code(),e.what());
+    }
+}
+
+void StatsManager::stopAction() noexcept{
+    //connect to the socket in order to "unblock it"
+    int mfd = -1;
+    struct sockaddr_un sAddr = {};
+
+    if ((mfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        error("StatsManager stopAction failed to create socket: %s", strerror(errno));
+        return;
+    }
+    sAddr.sun_family = AF_UNIX;
+    strncpy(sAddr.sun_path, _path.c_str(), sizeof(sAddr.sun_path)-1);
+    connect(mfd, (struct sockaddr*)&sAddr, sizeof(sAddr));
+    close(mfd);
+}
+
+void StatsManager::send_dump(int fd){
+    struct timeval tv = {};
+    std::string dump = _mux->stats_text();
+    size_t sent = 0;
+
+    tv.tv_sec = STATS_SEND_TIMEOUT_SEC;
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    while (sent < dump.size()) {
+        ssize_t cnt = send(fd, dump.data() + sent, dump.size() - sent, MSG_NOSIGNAL);
+        if (cnt < 0 && errno == EINTR) continue;
+        retassure(cnt > 0, "send() failed after %zu of %zu bytes (%s)", sent, dump.size(), strerror(errno));
+        sent += cnt;
+    }
+}
@@ -0,0 +1,37 @@
+//
+//  StatsManager.hpp
+//  usbmuxd2
+//
+//  Created by tihmstar on 29.11.20.
+//  Copyright © 2020 tihmstar. All rights reserved.
+//
+
+#ifndef StatsManager_hpp
+#define StatsManager_hpp
+
+#include <stdint.h>
+#include <string>
+#include <Muxer.hpp>
+#include <Manager/Manager.hpp>
+
+/*
+ Serves the runtime statistics in Prometheus text format on a unix socket.
+ Every connection gets a fresh dump, then the socket is closed.
+ */
+class StatsManager : public Manager{
+    Muxer *_mux; //unmanaged
+    std::string _path;
+    int _listenfd;
+
+    virtual void loopEvent() override;
+    virtual void stopAction() noexcept override;
+
+    void send_dump(int fd);
+
+public:
+    StatsManager(Muxer *mux, const char *path);
+
+    virtual ~StatsManager() override;
+};
+
+#endif /* StatsManager_hpp */
@@ -14,8 +14,12 @@
 #include <Devices/WIFIDevice.hpp>
 #include <algorithm>
 #include <Manager/DeviceManager/USBDeviceManager.hpp>
+#include <Manager/DeviceManager/SimDeviceManager.hpp>
 #include <Manager/ClientManager.hpp>
+#include <Manager/StatsManager.hpp>
+#include <Manager/CaptureManager.hpp>
 #include <Client.hpp>
+#include <Reaper.hpp>
 #include <limits.h>
 #include <sysconf/preflight.hpp>
 #include <sysconf/sysconf.hpp>
@@ -37,47 +41,137 @@ const int i = 1;
 
 #define MAXID (INT_MAX/2)
 
+unsigned Muxer::gBringupWorkers = 8;
+
+/*
+ Each field shows up under key in GetStatistics responses and as usbmuxd_<object>_<metric> in the text dump.
+ */
+template<typename T>
+struct statsField{
+    const char *key;
+    const char *metric;
+    const char *help;
+    bool isCounter;
+    uint64_t (*get)(const T &s);
+};
+
+#define STATS_FIELD(T, field, metric, isCounter, help) {#field, metric, help, isCounter, [](const T &s)->uint64_t{return s.field;}}
+
+static const statsField<usb_stats> gUSBStatsFields[] = {
+    STATS_FIELD(usb_stats, rxSubmitted,     "rx_submitted_total",       true,  "RX transfers submitted, including resubmissions"),
+    STATS_FIELD(usb_stats, rxCompleted,     "rx_completed_total",       true,  "RX transfers completed"),
+    STATS_FIELD(usb_stats, rxFull,          "rx_full_total",            true,  "RX transfers which came back completely filled"),
+    STATS_FIELD(usb_stats, rxBytes,         "rx_bytes_total",           true,  "Bytes received from the device"),
+    STATS_FIELD(usb_stats, rxReassembled,   "rx_reassembled_total",     true,  "Packets gathered from multiple RX transfers"),
+    STATS_FIELD(usb_stats, rxDropped,       "rx_dropped_total",         true,  "Packets dropped during reassembly"),
+    STATS_FIELD(usb_stats, txSubmitted,     "tx_submitted_total",       true,  "TX transfers submitted, including ZLPs"),
+    STATS_FIELD(usb_stats, txCompleted,     "tx_completed_total",       true,  "TX transfers completed"),
+    STATS_FIELD(usb_stats, txBytes,         "tx_bytes_total",           true,  "Bytes sent to the device"),
+    STATS_FIELD(usb_stats, txZLPs,          "tx_zlps_total",            true,  "Zero length packets sent"),
+    STATS_FIELD(usb_stats, txPoolHits,      "tx_pool_hits_total",       true,  "TX transfers taken from the pool"),
+    STATS_FIELD(usb_stats, txPoolMisses,    "tx_pool_misses_total",     true,  "TX transfers which had to be allocated"),
+    STATS_FIELD(usb_stats, errors,          "errors_total",             true,  "Failed transfers"),
+    STATS_FIELD(usb_stats, rxInFlight,      "rx_in_flight",             false, "RX transfers currently in flight"),
+    STATS_FIELD(usb_stats, rxDepth,         "rx_depth",                 false, "Target number of in flight RX transfers"),
+    STATS_FIELD(usb_stats, rxSize,          "rx_size_bytes",            false, "Target RX transfer size"),
+};
+
+static const statsField<tcp_stats> gTCPStatsFields[] = {
+    STATS_FIELD(tcp_stats, bytesIn,         "bytes_in_total",           true,  "Bytes received from the device"),
+    STATS_FIELD(tcp_stats, bytesOut,        "bytes_out_total",          true,  "Bytes sent to the device, without retransmissions"),
+    STATS_FIELD(tcp_stats, segmentsIn,      "segments_in_total",        true,  "Segments received from the device"),
+    STATS_FIELD(tcp_stats, segmentsOut,     "segments_out_total",       true,  "Segments sent to the device, without retransmissions"),
+    STATS_FIELD(tcp_stats, segmentsDropped, "segments_dropped_total",   true,  "Segments dropped, because they were out of order or exceeded the window"),
+    STATS_FIELD(tcp_stats, retransmits,     "retransmits_total",        true,  "Segments sent again"),
+    STATS_FIELD(tcp_stats, windowStalls,    "window_stalls_total",      true,  "Times reading from the client stopped, because the device didn't acknowledge"),
+    STATS_FIELD(tcp_stats, windowStallUsec, "window_stall_usec_total",  true,  "Time spent in window stalls"),
+    STATS_FIELD(tcp_stats, clientStalls,    "client_stalls_total",      true,  "Times the client socket was full"),
+    STATS_FIELD(tcp_stats, clientWrites,    "client_writes_total",      true,  "Syscalls used to write to the client"),
+    STATS_FIELD(tcp_stats, rxBuffered,      "rx_buffered_bytes",        false, "Bytes waiting to be written to the client"),
+    STATS_FIELD(tcp_stats, txInFlight,      "tx_in_flight_bytes",       false, "Bytes sent to the device, not yet acknowledged"),
+};
+
+static const statsField<client_stats> gClientStatsFields[] = {
+    STATS_FIELD(client_stats, bytesIn,          "bytes_in_total",       true,  "Bytes received from the client"),
+    STATS_FIELD(client_stats, commands,         "commands_total",       true,  "Messages received from the client"),
+    STATS_FIELD(client_stats, bytesOut,         "bytes_out_total",      true,  "Bytes written to the client"),
+    STATS_FIELD(client_stats, pktsOut,          "packets_out_total",    true,  "Messages queued for the client"),
+    STATS_FIELD(client_stats, sendCalls,        "send_calls_total",     true,  "Syscalls used to write to the client"),
+    STATS_FIELD(client_stats, droppedPkts,      "dropped_packets_total",true,  "Messages dropped, because the client fell behind"),
+    STATS_FIELD(client_stats, queuedBytesPeak,  "queued_bytes_peak",    false, "Largest amount of data queued for the client"),
+    STATS_FIELD(client_stats, queuedBytes,      "queued_bytes",         false, "Data queued for the client"),
+};
+
+template<typename T>
+static void stats_text_header(std::string &out, const char *object, const statsField<T> &f){
+    std::string name = std::string("usbmuxd_") + object + "_" + f.metric;
+    out += "# HELP " + name + " " + f.help + "\n";
+    out += "# TYPE " + name + (f.isCounter ? " counter\n" : " gauge\n");
+}
+
+static std::string stats_label_escape(const std::string &val){
+    std::string ret;
+    for (char c : val) {
+        if (c == '\\' || c == '"') {
+            ret += '\\';
+        } else if (c == '\n') {
+            ret += "\\n";
+            continue;
+        }
+        ret += c;
+    }
+    return ret;
+}
+
 Muxer::Muxer()
-    : _climgr(NULL), _usbdevmgr(NULL),_wifidevmgr(NULL), _newid(1), _isDying(false), _doPreflight(true),
-    _refcnt(0)
+    : _climgr(NULL), _usbdevmgr(NULL),_wifidevmgr(NULL), _simdevmgr(NULL), _statsmgr(NULL), _capturemgr(NULL), _devListVersion(0), _newid(1), _isDying(false), _doPreflight(true),
+    _refcnt(0), _bringup(NULL)
 {
-    //
+    _bringup = new WorkerPool(gBringupWorkers);
 }
 
 Muxer::~Muxer(){
     debug("[Muxer] destroing muxer");
     _isDying = true;
 
+    if (_statsmgr) {
+        delete _statsmgr; _statsmgr = NULL; //it reads clients and devices, which are about to go away
+    }
+
     debug("[Muxer] deleting clients");
-    while (_clients._elems.size()) {
+    while (true) {
         Client *cli = nullptr;
-        _clients.addMember();
-        if (_clients._elems.size()) {
-            cli = *_clients._elems.begin();
-        }
-        _clients.delMember();
-        if (cli) {
-            delete_client(cli);
+        {
+            auto clients = _clients.read();
+            if (!clients->size()) break;
+            cli = clients->front();
         }
+        delete_client(cli);
     }
 
     debug("[Muxer] deleting devices");
-    while (_devices._elems.size()) {
+    while (true) {
         Device *dev = nullptr;
-        _devices.addMember();
-        if (_devices._elems.size()) {
-            dev = *_devices._elems.begin();
-        }
-        _devices.delMember();
-        if (dev) {
-            delete_device(dev);
+        {
+            auto devices = _devices.read();
+            if (!devices->size()) break;
+            dev = devices->front();
         }
+        delete_device(dev);
     }
 
-    while (_refcnt > 0){
-        _refevent.wait();
+    debug("[Muxer] waiting for bring-up jobs");
+    _bringup->stop();
+
+    while (true){
+        uint32_t seq = _refevent.sequence();
+        if (_refcnt <= 0) break;
+        _refevent.wait(seq);
     }
 
+    //let the Reaper delete everything we killed
+    Reaper::shared()->drain();
+
     if (_climgr) {
         delete _climgr;
     }
@@ -89,6 +183,13 @@ Muxer::~Muxer(){
         delete _wifidevmgr;
     }
 #endif
+    if (_simdevmgr) {
+        delete _simdevmgr;
+    }
+    if (_capturemgr) {
+        delete _capturemgr; _capturemgr = NULL; //devices are gone, nobody captures anymore
+    }
+    delete _bringup; _bringup = NULL;
 }
 
 void Muxer::spawnClientManager(){
@@ -116,34 +217,67 @@ void Muxer::spawnWIFIDeviceManager(){
 #endif
 }
 
+void Muxer::spawnSimDeviceManager(unsigned count){
+    assure(!_isDying);
+    assert(!_simdevmgr);
+    _simdevmgr = new SimDeviceManager(this, count);
+    _simdevmgr->startLoop();
+}
+
+void Muxer::spawnStatsManager(const char *path){
+    assure(!_isDying);
+    assert(!_statsmgr);
+    _statsmgr = new StatsManager(this, path);
+    _statsmgr->startLoop();
+}
+
+void Muxer::spawnCaptureManager(const char *path, uint32_t snaplen){
+    assure(!_isDying);
+    assert(!_capturemgr);
+    assure(!devices_cnt()); //devices check for a CaptureManager without locking
+    _capturemgr = new CaptureManager(path, snaplen);
+    _capturemgr->startLoop();
+}
+
 bool Muxer::hasDeviceManager() noexcept{
-    return _wifidevmgr != NULL || _usbdevmgr != NULL;
+    return _wifidevmgr != NULL || _usbdevmgr != NULL || _simdevmgr != NULL;
+}
+
+void Muxer::queue_bringup(std::function<void()> job){
+    assure(!_isDying);
+    _bringup->submit(job);
 }
 
 
 void Muxer::add_client(Client *cli){
     assure(!_isDying);
     debug("add_client %p",cli);
-    _clients.lockMember();
-    _clients._elems.push_back(cli);
+    _clients.update([cli](std::vector<Client *> &clients){
+        clients.push_back(cli);
+    });
     try{
         cli->startLoop();
     }catch(tihmstar::exception &e){
-        _clients.unlockMember();
+        _clients.update([cli](std::vector<Client *> &clients){
+            clients.erase(std::remove(clients.begin(), clients.end(), cli), clients.end());
+        });
         throw;
     }
-    _clients.unlockMember();
 }
 
 void Muxer::delete_client(Client *cli){
+    bool found = false;
     debug("delete_client %p",cli);
-    _clients.lockMember();
-    const auto target = std::remove(_clients._elems.begin(), _clients._elems.end(), cli);
-    if (target != _clients._elems.end()){
-        _clients._elems.erase(target, _clients._elems.end());
+    //always publish and wait for readers, so the client's destructor knows nobody uses it anymore
+    _clients.update([cli,&found](std::vector<Client *> &clients){
+        const auto target = std::remove(clients.begin(), clients.end(), cli);
+        if ((found = (target != clients.end()))) {
+            clients.erase(target, clients.end());
+        }
+    });
+    if (found) {
         cli->kill();
     }
-    _clients.unlockMember();
 }
 
 void Muxer::add_device(Device *dev) noexcept{
@@ -155,52 +289,53 @@ void Muxer::add_device(Device *dev) noexcept{
 
     //get id of already connected device but with the other connection type
     //discard the id-based connection type information
-    dev->_id = id_for_device(dev->_serial, dev->_conntype == Device::MUXCONN_USB ? Device::MUXCONN_WIFI : Device::MUXCONN_USB) & ~1;
-
-    if (!dev->_id){
-        //there can be no device with ID 1 or 0
-        //thus if id is 0 then this is the device's first connection
-        //assign it a fresh ID
-
-        _devices.addMember();
-    retryID:
-        for (auto odev : _devices._elems) {
-            if ((odev->_id >> 1) == _newid) {
-                _newid++;
-                if (_newid>MAXID) {
-                    _newid = 1;
+    int otherID = id_for_device(dev->_serial, dev->_conntype == Device::MUXCONN_USB ? Device::MUXCONN_WIFI : Device::MUXCONN_USB) & ~1;
+
+    _devices.update([this,dev,otherID](std::vector<Device *> &devices){
+        dev->_id = otherID;
+        if (!dev->_id){
+            //there can be no device with ID 1 or 0
+            //thus if id is 0 then this is the device's first connection
+            //assign it a fresh ID
+        retryID:
+            for (auto odev : devices) {
+                if ((odev->_id >> 1) == _newid) {
+                    _newid++;
+                    if (_newid>MAXID) {
+                        _newid = 1;
+                    }
                     goto retryID;
                 }
             }
+            dev->_id = (_newid << 1);
         }
-        dev->_id = (_newid << 1);
-        _devices.delMember();
-    }
-
-    //fixup connection information in ID
-    dev->_id |= (dev->_conntype == Device::MUXCONN_WIFI);
 
-    debug("Muxer: adding device (%p) %s assigning id %d",dev,dev->_serial,dev->_id);
+        //fixup connection information in ID
+        dev->_id |= (dev->_conntype == Device::MUXCONN_WIFI);
 
-    _devices.lockMember();
-    _devices._elems.push_back(dev);
-    _devices.unlockMember();
-
-    _devices.addMember();
-    if (std::find(_devices._elems.begin(), _devices._elems.end(), dev) == _devices._elems.end()) {
-        error("Device disappeared before it could be used!");
-        _devices.delMember();
-        return;
-    }
+        debug("Muxer: adding device (%p) %s assigning id %d",dev,dev->_serial,dev->_id);
+        devices.push_back(dev);
+    });
+    rebuild_deviceList();
 
 #ifdef HAVE_WIFI_SUPPORT
     if (dev->_conntype == Device::MUXCONN_WIFI){
         WIFIDevice *wifidev = (WIFIDevice*)dev;
-        try{
-            wifidev->startLoop();
-        }catch (tihmstar::exception &e){
-            error("Failed to start WIFIDevice %s with error=%d (%s)",wifidev->_serial,e.code(),e.what());
-            _devices.delMember();
+        bool didStart = false;
+        {
+            auto devices = _devices.read();
+            if (std::find(devices->begin(), devices->end(), dev) == devices->end()) {
+                error("Device disappeared before it could be used!");
+                return;
+            }
+            try{
+                wifidev->startLoop();
+                didStart = true;
+            }catch (tihmstar::exception &e){
+                error("Failed to start WIFIDevice %s with error=%d (%s)",wifidev->_serial,e.code(),e.what());
+            }
+        }
+        if (!didStart) {
             delete_device(dev);
             return;
         }
@@ -208,39 +343,54 @@ void Muxer::add_device(Device *dev) noexcept{
 #endif //HAVE_WIFI_SUPPORT
 
 
+    bool didQueuePreflight = false;
 #warning TODO make preflighting a configurable option!
 #ifdef HAVE_LIBIMOBILEDEVICE
-    if (dev->_conntype == Device::MUXCONN_USB && _doPreflight){
-        char *serial = strdup(dev->_serial);
-
-
-        std::thread b([](char *serial, int devID){
-            try {
-                preflight_device(serial,devID);
-            } catch (tihmstar::exception &e) {
-                error("failed to preflight device %s with error=%s code=%d",serial,e.what(),e.code());
-            }
-            free(serial);
-        },serial,dev->_id);
-        b.detach();
-
-
+    //devices behind a transport (e.g. simulated ones) have no lockdownd to talk to
+    if (dev->_conntype == Device::MUXCONN_USB && _doPreflight && ((USBDevice*)dev)->usesLibusb()){
+        USBDevice *usbdev = (USBDevice*)dev;
+        usbdev->retain(); //held by the preflight job
+        try {
+            _bringup->submit([this,usbdev]{
+                if (!_isDying) {
+                    try {
+                        preflight_device(usbdev->_serial,usbdev->_id);
+                    } catch (tihmstar::exception &e) {
+                        error("failed to preflight device %s with error=%s code=%d",usbdev->_serial,e.what(),e.code());
+                    }
+                    usbdev->bringup_stage_done(USBDevice::BRINGUP_PREFLIGHT);
+                    usbdev->bringup_report();
+                }
+                usbdev->release();
+            });
+            didQueuePreflight = true;
+        } catch (tihmstar::exception &e) {
+            error("failed to queue preflight for device %s with error=%s code=%d",usbdev->_serial,e.what(),e.code());
+            usbdev->release();
+        }
     }
 #endif //HAVE_LIBIMOBILEDEVICE
-    _devices.delMember();
+    if (dev->_conntype == Device::MUXCONN_USB && !didQueuePreflight) {
+        ((USBDevice*)dev)->bringup_report();
+    }
     notify_device_add(dev);
 }
 
 void Muxer::delete_device(Device *dev) noexcept{
+    bool found = false;
     debug("delete_device %p",dev);
-    _devices.lockMember();
-    const auto target = std::remove(_devices._elems.begin(), _devices._elems.end(), dev);
-    if (target != _devices._elems.end()){
-        _devices._elems.erase(target, _devices._elems.end());
+    //always publish and wait for readers, so the device's destructor knows nobody uses it anymore
+    _devices.update([dev,&found](std::vector<Device *> &devices){
+        const auto target = std::remove(devices.begin(), devices.end(), dev);
+        if ((found = (target != devices.end()))) {
+            devices.erase(target, devices.end());
+        }
+    });
+    if (found) {
+        rebuild_deviceList(); //drop the device from the cache before it can be freed
         notify_device_remove(dev->_id);
         dev->kill();
     }
-    _devices.unlockMember();
 }
 
 void Muxer::delete_device(int id) noexcept{
@@ -256,182 +406,371 @@ void Muxer::delete_device(int id) noexcept{
 }
 
 Device *Muxer::get_device_by_id(int id){
-    _devices.addMember();
-    for (Device *dev : _devices._elems) {
+    auto devices = _devices.read();
+    for (Device *dev : *devices) {
         if (dev->_id == id) {
-            _devices.delMember();
             return dev;
         }
     }
-    _devices.delMember();
     reterror("get_device_by_id failed");
 }
 
-void Muxer::delete_device_async(uint8_t bus, uint8_t address) noexcept{
-    ++_refcnt;_refevent.notifyAll(); //async thread has a ref to this
-    std::thread async([this,bus,address]{
-        _devices.addMember();
-        for (auto dev : _devices._elems){
-            if (dev->_conntype == Device::MUXCONN_USB) {
-                USBDevice *usbdev = (USBDevice*)dev;
-                if (usbdev->_address == address && usbdev->_bus == bus) {
-                    _devices.delMember();
-                    delete_device(dev);
-                    --_refcnt;_refevent.notifyAll();
-                    return;
+void Muxer::rebuild_deviceList() noexcept{
+    std::unique_lock<std::mutex> ul(_devListBuildLck);
+    std::shared_ptr<const deviceListCache> old = std::atomic_load(&_devList);
+    std::shared_ptr<deviceListCache> cache = nullptr;
+    try {
+        plist_t p_rsp = NULL;
+        plist_t p_devarr = NULL;
+        cleanup([&]{
+            safeFreeCustom(p_rsp, plist_free);
+            safeFreeCustom(p_devarr, plist_free);
+        });
+        cache = std::make_shared<deviceListCache>();
+        cache->version = ++_devListVersion;
+        assure(p_rsp = plist_new_dict());
+        assure(p_devarr = plist_new_array());
+        {
+            auto devices = _devices.read();
+            for (Device *dev : *devices) {
+                std::shared_ptr<const SerializedPlist> attached = nullptr;
+                if (old) {
+                    //device properties don't change while it is attached, reuse the payload
+                    for (auto &c : old->devices) {
+                        if (c.dev == dev && c.id == dev->_id) {
+                            attached = c.attached;
+                            break;
+                        }
+                    }
                 }
+                if (!attached) {
+                    plist_t p_devp = NULL;
+                    assure(p_devp = getDevicePlist(dev));
+                    attached = std::make_shared<const SerializedPlist>(p_devp);
+                }
+                plist_array_append_item(p_devarr, plist_copy(attached->plist()));
+                cache->devices.push_back({dev, dev->_id, attached});
             }
         }
-        _devices.delMember();
-        error("We are not managing a device on bus 0x%02x, address 0x%02x",bus,address);
+        plist_dict_set_item(p_rsp, "DeviceList", p_devarr); p_devarr = NULL; //transfer ownership
+        cache->list = std::make_shared<const SerializedPlist>(p_rsp); p_rsp = NULL; //transfer ownership
+    } catch (tihmstar::exception &e) {
+        error("Failed to rebuild device list with error=%d (%s)",e.code(),e.what());
+        cache = nullptr;
+    } catch (...) {
+        error("Failed to rebuild device list");
+        cache = nullptr;
+    }
+    debug("rebuilt device list version %llu",(unsigned long long)_devListVersion);
+    std::atomic_store(&_devList, std::shared_ptr<const deviceListCache>(cache));
+}
+
+std::shared_ptr<const Muxer::deviceListCache> Muxer::get_deviceList() noexcept{
+    std::shared_ptr<const deviceListCache> cache = std::atomic_load(&_devList);
+    if (!cache) {
+        rebuild_deviceList();
+        cache = std::atomic_load(&_devList);
+    }
+    return cache;
+}
+
+void Muxer::delete_device_async(uint8_t bus, uint8_t address) noexcept{
+    ++_refcnt;_refevent.notifyAll(); //the job has a ref to this
+    try {
+        //runs on the bring-up workers, so hotplug churn doesn't spawn a thread per removal
+        _bringup->submit([this,bus,address]{
+            Device *found = nullptr;
+            {
+                auto devices = _devices.read();
+                for (auto dev : *devices){
+                    if (dev->_conntype == Device::MUXCONN_USB) {
+                        USBDevice *usbdev = (USBDevice*)dev;
+                        if (usbdev->_address == address && usbdev->_bus == bus) {
+                            found = dev;
+                            break;
+                        }
+                    }
+                }
+            }
+            if (found) {
+                delete_device(found);
+            } else {
+                error("We are not managing a device on bus 0x%02x, address 0x%02x",bus,address);
+            }
+            --_refcnt;_refevent.notifyAll();
+        });
+    } catch (tihmstar::exception &e) {
+        //we are dying, the destructor removes all devices anyways
+        error("Failed to queue removal of device on bus 0x%02x, address 0x%02x with error=%d (%s)",bus,address,e.code(),e.what());
         --_refcnt;_refevent.notifyAll();
-    });
-    async.detach();
+    } catch (...) {
+        error("Failed to queue removal of device on bus 0x%02x, address 0x%02x",bus,address);
+        --_refcnt;_refevent.notifyAll();
+    }
 }
 
 bool Muxer::have_usb_device(uint8_t bus, uint8_t address) noexcept{
-    _devices.addMember();
-    for (auto dev : _devices._elems){
+    auto devices = _devices.read();
+    for (auto dev : *devices){
         if (dev->_conntype == Device::MUXCONN_USB) {
             USBDevice *usbdev = (USBDevice*)dev;
             if (usbdev->_address == address && usbdev->_bus == bus) {
-                _devices.delMember();
                 return true;
             }
         }
     }
-    _devices.delMember();
     return false;
 }
 
 bool Muxer::have_wifi_device(std::string macaddr) noexcept{
-    _devices.addMember();
-    for (auto dev : _devices._elems){
+    auto devices = _devices.read();
+    for (auto dev : *devices){
         if (dev->_conntype == Device::MUXCONN_WIFI) {
             WIFIDevice *wifidev = (WIFIDevice*)dev;
 
             if (wifidev->_serviceName.substr(0,wifidev->_serviceName.find("@")) == macaddr) {
-                _devices.delMember();
                 return true;
             }
         }
     }
-    _devices.delMember();
     return false;
 }
 
 int Muxer::id_for_device(const char *uuid, Device::mux_conn_type type) noexcept{
-    int ret = 0;
-    _devices.addMember();
-    for (auto dev : _devices._elems){
+    auto devices = _devices.read();
+    for (auto dev : *devices){
         if (dev->_conntype == type && strcmp(uuid,dev->_serial) == 0) {
-            ret = dev->_id;
-            break;
+            return dev->_id;
         }
     }
-    _devices.delMember();
-    return ret;
+    return 0;
 }
 
 size_t Muxer::devices_cnt() noexcept{
-    return _devices._elems.size();
+    return _devices.read()->size();
 }
 
 
 
 #pragma mark Connection
 void Muxer::start_connect(int device_id, uint16_t dport, Client *cli){
+    Device *found = nullptr;
     assure(!_isDying);
-    _devices.addMember();
-    for (Device *dev : _devices._elems) {
-        if (dev->_id == device_id) {
-            try {
-                dev->start_connect(dport, cli);
-            } catch (...) {
-                _devices.delMember();
-                throw;
+    {
+        auto devices = _devices.read();
+        for (Device *dev : *devices) {
+            if (dev->_id == device_id && dev->tryRetain()) { //keeps the device alive while connecting
+                found = dev;
+                break;
             }
-            _devices.delMember();
-            return;
         }
     }
-    _devices.delMember();
-    reterror("start_connect(%d,%d,%d) failed",device_id,dport,cli->_fd);
+    retassure(found, "start_connect(%d,%d,%d) failed",device_id,dport,cli->_fd);
+    cleanup([&]{
+        found->release();
+    });
+    found->start_connect(dport, cli);
 }
 
 
 void Muxer::send_deviceList(Client *client, uint32_t tag){
+    auto cache = get_deviceList();
+    retassure(cache, "device list unavailable");
+    client->send_plist_pkt(tag, cache->list);
+}
+
+void Muxer::send_listenerList(Client *client, uint32_t tag){
     plist_t p_rsp = NULL;
-    plist_t p_devarr = NULL;
+    plist_t p_cliarr = NULL;
     cleanup([&]{
         safeFreeCustom(p_rsp, plist_free);
-        safeFreeCustom(p_devarr, plist_free);
+        safeFreeCustom(p_cliarr, plist_free);
     });
     assure(p_rsp = plist_new_dict());
-    assure(p_devarr = plist_new_array());
+    assure(p_cliarr = plist_new_array());
 
-    _devices.addMember();
-    for (Device *dev : _devices._elems) {
-        plist_array_append_item(p_devarr, getDevicePlist(dev));
+
+    {
+        auto clients = _clients.read();
+        for (Client *c : *clients) {
+            plist_array_append_item(p_cliarr, getClientPlist(c));
+        }
     }
-    _devices.delMember();
 
-    plist_dict_set_item(p_rsp, "DeviceList", p_devarr); p_devarr = NULL; //transfer ownership
+    plist_dict_set_item(p_rsp, "ListenerList", p_cliarr); p_cliarr = NULL; //transfer ownership
 
     client->send_plist_pkt(tag, p_rsp);
 }
 
-void Muxer::send_listenerList(Client *client, uint32_t tag){
+void Muxer::send_statistics(Client *client, uint32_t tag){
     plist_t p_rsp = NULL;
-    plist_t p_cliarr = NULL;
+    plist_t p_arr = NULL;
+    plist_t p_entry = NULL;
+    plist_t p_conns = NULL;
     cleanup([&]{
         safeFreeCustom(p_rsp, plist_free);
-        safeFreeCustom(p_cliarr, plist_free);
+        safeFreeCustom(p_arr, plist_free);
+        safeFreeCustom(p_entry, plist_free);
+        safeFreeCustom(p_conns, plist_free);
     });
+    mux_stats stats;
+    collect_stats(stats);
+
     assure(p_rsp = plist_new_dict());
-    assure(p_cliarr = plist_new_array());
 
+    assure(p_arr = plist_new_array());
+    for (auto &dev : stats.devices) {
+        assure(p_entry = plist_new_dict());
+        plist_dict_set_item(p_entry, "DeviceID", plist_new_uint(dev.id));
+        plist_dict_set_item(p_entry, "SerialNumber", plist_new_string(dev.serial.c_str()));
+        for (auto &f : gUSBStatsFields) {
+            plist_dict_set_item(p_entry, f.key, plist_new_uint(f.get(dev.usb)));
+        }
+        assure(p_conns = plist_new_array());
+        for (auto &conn : dev.conns) {
+            plist_t p_conn = plist_new_dict();
+            plist_dict_set_item(p_conn, "SourcePort", plist_new_uint(conn.sPort));
+            plist_dict_set_item(p_conn, "PortNumber", plist_new_uint(conn.dPort));
+            for (auto &f : gTCPStatsFields) {
+                plist_dict_set_item(p_conn, f.key, plist_new_uint(f.get(conn)));
+            }
+            plist_array_append_item(p_conns, p_conn);
+        }
+        plist_dict_set_item(p_entry, "Connections", p_conns); p_conns = NULL; //transfer ownership
+        plist_array_append_item(p_arr, p_entry); p_entry = NULL; //transfer ownership
+    }
+    plist_dict_set_item(p_rsp, "Devices", p_arr); p_arr = NULL; //transfer ownership
+
+    assure(p_arr = plist_new_array());
+    for (auto &cli : stats.clients) {
+        assure(p_entry = plist_new_dict());
+        plist_dict_set_item(p_entry, "Number", plist_new_uint(cli.number));
+        plist_dict_set_item(p_entry, "ProgName", plist_new_string(cli.progName.c_str()));
+        for (auto &f : gClientStatsFields) {
+            plist_dict_set_item(p_entry, f.key, plist_new_uint(f.get(cli)));
+        }
+        plist_array_append_item(p_arr, p_entry); p_entry = NULL; //transfer ownership
+    }
+    plist_dict_set_item(p_rsp, "Clients", p_arr); p_arr = NULL; //transfer ownership
 
-    _clients.addMember();
-    for (Client *c : _clients._elems) {
-        plist_array_append_item(p_cliarr, getClientPlist(c));
+    client->send_plist_pkt(tag, p_rsp);
+}
+
+#pragma mark Statistics
+void Muxer::collect_stats(mux_stats &stats){
+    std::vector<USBDevice *> usbdevs;
+    cleanup([&]{
+        for (auto dev : usbdevs) {
+            dev->release();
+        }
+    });
+
+    {
+        auto devices = _devices.read();
+        for (Device *dev : *devices) {
+            if (dev->_conntype != Device::MUXCONN_USB) continue; //WiFi connections are plain sockets, nothing to count there
+            if (!dev->tryRetain()) continue; //dying
+            try {
+                usbdevs.push_back((USBDevice*)dev);
+            } catch (...) {
+                dev->release();
+                throw;
+            }
+        }
+    }
+    for (auto dev : usbdevs) {
+        mux_stats::device entry = {};
+        entry.id = dev->_id;
+        entry.serial = dev->_serial;
+        entry.usb = dev->getStats();
+        dev->getConnStats(entry.conns);
+        stats.devices.push_back(std::move(entry));
     }
-    _clients.delMember();
 
-    plist_dict_set_item(p_rsp, "ListenerList", p_cliarr); p_cliarr = NULL; //transfer ownership
+    {
+        auto clients = _clients.read();
+        for (Client *c : *clients) {
+            stats.clients.push_back(c->getStats());
+        }
+    }
+}
 
-    client->send_plist_pkt(tag, p_rsp);
+std::string Muxer::stats_text(){
+    std::string ret;
+    mux_stats stats;
+    collect_stats(stats);
+
+    for (auto &f : gUSBStatsFields) {
+        stats_text_header(ret, "device", f);
+        for (auto &dev : stats.devices) {
+            ret += "usbmuxd_device_"; ret += f.metric;
+            ret += "{device=\"" + std::to_string(dev.id) + "\",serial=\"" + stats_label_escape(dev.serial) + "\"} ";
+            ret += std::to_string(f.get(dev.usb)) + "\n";
+        }
+    }
+    for (auto &f : gTCPStatsFields) {
+        stats_text_header(ret, "tcp", f);
+        for (auto &dev : stats.devices) {
+            for (auto &conn : dev.conns) {
+                ret += "usbmuxd_tcp_"; ret += f.metric;
+                ret += "{device=\"" + std::to_string(dev.id) + "\",sport=\"" + std::to_string(conn.sPort) + "\",dport=\"" + std::to_string(conn.dPort) + "\"} ";
+                ret += std::to_string(f.get(conn)) + "\n";
+            }
+        }
+    }
+    for (auto &f : gClientStatsFields) {
+        stats_text_header(ret, "client", f);
+        for (auto &cli : stats.clients) {
+            ret += "usbmuxd_client_"; ret += f.metric;
+            ret += "{client=\"" + std::to_string(cli.number) + "\",prog=\"" + stats_label_escape(cli.progName) + "\"} ";
+            ret += std::to_string(f.get(cli)) + "\n";
+        }
+    }
+    ret += "# HELP usbmuxd_log_dropped_total Log messages lost, because a thread's log buffer was full\n";
+    ret += "# TYPE usbmuxd_log_dropped_total counter\n";
+    ret += "usbmuxd_log_dropped_total " + std::to_string(log_dropped()) + "\n";
+    if (_capturemgr) {
+        ret += "# HELP usbmuxd_capture_packets_total Packets written to the capture file\n";
+        ret += "# TYPE usbmuxd_capture_packets_total counter\n";
+        ret += "usbmuxd_capture_packets_total " + std::to_string(_capturemgr->written()) + "\n";
+        ret += "# HELP usbmuxd_capture_dropped_total Packets missing from the capture file, because the writer couldn't keep up\n";
+        ret += "# TYPE usbmuxd_capture_dropped_total counter\n";
+        ret += "usbmuxd_capture_dropped_total " + std::to_string(_capturemgr->dropped()) + "\n";
+    }
+    return ret;
 }
 
 #pragma mark notification
 void Muxer::notify_device_add(Device *dev) noexcept{
     debug("notify_device_add(%p)",dev);
-    plist_t p_rsp = NULL;
-    cleanup([&]{
-        safeFreeCustom(p_rsp, plist_free);
-    });
+    std::shared_ptr<const SerializedPlist> attached = nullptr;
 
-    _devices.addMember();
-    if (std::find(_devices._elems.begin(), _devices._elems.end(), dev) == _devices._elems.end()) {
+    {
+        auto cache = get_deviceList();
+        if (cache) {
+            for (auto &c : cache->devices) {
+                if (c.dev == dev) {
+                    attached = c.attached;
+                    break;
+                }
+            }
+        }
+    }
+    if (!attached) {
         error("Device disappeared before it could be used!");
-        _devices.delMember();
         return;
     }
 
-    p_rsp = getDevicePlist(dev);
-    _devices.delMember();
-
-    _clients.addMember();
-    for (Client *c : _clients._elems){
+    auto clients = _clients.read();
+    for (Client *c : *clients){
         if (c->_isListening) {
             try {
-                c->send_plist_pkt(0, p_rsp);
+                c->send_plist_pkt(0, attached);
             } catch (...) {
                 //we don't care if this fails
             }
         }
     }
-    _clients.delMember();
 }
 
 void Muxer::notify_device_remove(int deviceID) noexcept{
@@ -444,8 +783,8 @@ void Muxer::notify_device_remove(int deviceID) noexcept{
     plist_dict_set_item(p_rsp, "MessageType", plist_new_string("Detached"));
     plist_dict_set_item(p_rsp, "DeviceID", plist_new_uint(deviceID));
 
-    _clients.addMember();
-    for (Client *c : _clients._elems){
+    auto clients = _clients.read();
+    for (Client *c : *clients){
         if (c->_isListening) {
             try {
                 c->send_plist_pkt(0, p_rsp);
@@ -454,7 +793,6 @@ void Muxer::notify_device_remove(int deviceID) noexcept{
             }
         }
     }
-    _clients.delMember();
 }
 
 
@@ -468,8 +806,8 @@ void Muxer::notify_device_paired(int deviceID) noexcept{
     plist_dict_set_item(p_rsp, "MessageType", plist_new_string("Paired"));
     plist_dict_set_item(p_rsp, "DeviceID", plist_new_uint(deviceID));
 
-    _clients.addMember();
-    for (Client *c : _clients._elems){
+    auto clients = _clients.read();
+    for (Client *c : *clients){
         if (c->_isListening) {
             try {
                 c->send_plist_pkt(0, p_rsp);
@@ -478,7 +816,6 @@ void Muxer::notify_device_paired(int deviceID) noexcept{
             }
         }
     }
-    _clients.delMember();
 }
 
 void Muxer::notify_alldevices(Client *cli) noexcept{
@@ -488,20 +825,18 @@ void Muxer::notify_alldevices(Client *cli) noexcept{
         return;
     }
 
-    _devices.addMember();
-    for (Device *d : _devices._elems){
-        plist_t p_rsp = NULL;
-        cleanup([&]{
-            safeFreeCustom(p_rsp, plist_free);
-        });
-        p_rsp = getDevicePlist(d);
+    auto cache = get_deviceList();
+    if (!cache) {
+        error("notify_alldevices: device list unavailable");
+        return;
+    }
+    for (auto &c : cache->devices){
         try {
-            cli->send_plist_pkt(0, p_rsp);
+            cli->send_plist_pkt(0, c.attached);
         } catch (...) {
             //we don't care if this fails
         }
     }
-    _devices.delMember();
 }
 
 
@@ -590,3 +925,7 @@ plist_t Muxer::getClientPlist(Client *client) noexcept{
         return ret;
     }
 }
+
+void Muxer::setBringupWorkers(unsigned workers) noexcept{
+    gBringupWorkers = workers;
+}
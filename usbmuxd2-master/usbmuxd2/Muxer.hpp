@@ -11,29 +11,59 @@
 
 #include <stdint.h>
 #include <vector>
-#include <lck_container.h>
+#include <rcu_container.h>
 #include <plist/plist.h>
 #include <set>
+#include <memory>
+#include <mutex>
 #include <Device.hpp>
+#include <SerializedPlist.hpp>
+#include <Stats.hpp>
 #include <Event.hpp>
+#include <WorkerPool.hpp>
+#include <functional>
+#include <string>
 
 class Client;
 class ClientManager;
 class USBDeviceManager;
 class WIFIDeviceManager;
+class SimDeviceManager;
+class StatsManager;
+class CaptureManager;
 
 class Muxer {
+    struct cachedDevice{
+        Device *dev; //only used for comparison, never dereferenced
+        int id;
+        std::shared_ptr<const SerializedPlist> attached;
+    };
+    struct deviceListCache{
+        uint64_t version;
+        std::shared_ptr<const SerializedPlist> list;
+        std::vector<cachedDevice> devices;
+    };
     ClientManager *_climgr;
     USBDeviceManager* _usbdevmgr;
     WIFIDeviceManager* _wifidevmgr;
-    lck_contrainer<std::vector<Device *>> _devices;
-    lck_contrainer<std::vector<Client *>> _clients;
+    SimDeviceManager* _simdevmgr;
+    StatsManager* _statsmgr;
+    CaptureManager* _capturemgr;
+    rcu_container<std::vector<Device *>> _devices;
+    rcu_container<std::vector<Client *>> _clients;
+    std::shared_ptr<const deviceListCache> _devList; //use std::atomic_load/std::atomic_store
+    std::mutex _devListBuildLck; //serializes rebuilding _devList
+    uint64_t _devListVersion; //needs _devListBuildLck
     int _newid;
     bool _isDying;
     std::atomic<int> _refcnt;
     Event _refevent;
+    WorkerPool *_bringup; //device bring-up, preflight and removal jobs
+    static unsigned gBringupWorkers;
 
     Device *get_device_by_id(int id);
+    void rebuild_deviceList() noexcept;
+    std::shared_ptr<const deviceListCache> get_deviceList() noexcept;
     
 public:
     bool _doPreflight;
@@ -48,7 +78,12 @@ public:
     void spawnClientManager();
     void spawnUSBDeviceManager();
     void spawnWIFIDeviceManager();
+    void spawnSimDeviceManager(unsigned count);
+    void spawnStatsManager(const char *path);
+    void spawnCaptureManager(const char *path, uint32_t snaplen); //needs to be called before devices are added
+    CaptureManager *captureManager() noexcept {return _capturemgr;}
     bool hasDeviceManager() noexcept;
+    void queue_bringup(std::function<void()> job);
 
     //---- Clients ----
     void add_client(Client *client);
@@ -68,6 +103,11 @@ public:
     void start_connect(int device_id, uint16_t dport, Client *cli);
     void send_deviceList(Client *client, uint32_t tag);
     void send_listenerList(Client *client, uint32_t tag);
+    void send_statistics(Client *client, uint32_t tag);
+
+    //---- Statistics ----
+    void collect_stats(mux_stats &stats);
+    std::string stats_text(); //Prometheus text format
     
     //---- Notification ----
     void notify_device_add(Device *dev) noexcept;
@@ -78,6 +118,7 @@ public:
     //---- Static ----
     static plist_t getDevicePlist(Device *dev) noexcept;
     static plist_t getClientPlist(Client *client) noexcept;
+    static void setBringupWorkers(unsigned workers) noexcept; //needs to be called before the Muxer is created
 };
 
 
@@ -0,0 +1,99 @@
+//
+//  Reaper.cpp
+//  usbmuxd2
+//
+//  Created by tihmstar on 05.11.20.
+//  Copyright © 2020 tihmstar. All rights reserved.
+//
+
+#include "Reaper.hpp"
+#include <libgeneral/macros.h>
+
+#pragma mark Reapable
+
+Reapable::Reapable()
+: _refCnt(1)
+{
+    //
+}
+
+Reapable::~Reapable(){
+#ifdef DEBUG
+    assert(_refCnt == 0);
+#endif
+}
+
+void Reapable::retain() noexcept{
+    ++_refCnt;
+}
+
+bool Reapable::tryRetain() noexcept{
+    uint32_t cnt = _refCnt.load();
+    do {
+        if (!cnt) return false;
+    } while (!_refCnt.compare_exchange_weak(cnt, cnt+1));
+    return true;
+}
+
+void Reapable::release() noexcept{
+    if (--_refCnt == 0) {
+        Reaper::shared()->reap(this);
+    }
+}
+
+#pragma mark Reaper
+
+Reaper::Reaper()
+: _thread(nullptr), _busy(false), _stop(false)
+{
+    _thread = new std::thread([this]{
+        loop();
+    });
+}
+
+Reaper::~Reaper(){
+    {
+        std::unique_lock<std::mutex> ul(_lck);
+        _stop = true;
+        _cond.notify_all();
+    }
+    _thread->join();
+    delete _thread; _thread = nullptr;
+}
+
+Reaper *Reaper::shared(){
+    static Reaper gReaper;
+    return &gReaper;
+}
+
+void Reaper::loop() noexcept{
+    std::unique_lock<std::mutex> ul(_lck);
+    while (true) {
+        if (_queue.empty()) {
+            if (_stop) break;
+            _cond.wait(ul);
+            continue;
+        }
+        Reapable *obj = _queue.front();
+        _queue.pop_front();
+        _busy = true;
+        ul.unlock();
+        delete obj; //may release (and thus queue) more objects
+        ul.lock();
+        _busy = false;
+        if (_queue.empty()) {
+            _cond.notify_all(); //wake up drain()
+        }
+    }
+}
+
+void Reaper::reap(Reapable *obj) noexcept{
+    std::unique_lock<std::mutex> ul(_lck);
+    _queue.push_back(obj);
+    _cond.notify_all();
+}
+
+void Reaper::drain() noexcept{
+    std::unique_lock<std::mutex> ul(_lck);
+    _cond.wait(ul, [this]{return _queue.empty() && !_busy;});
+}
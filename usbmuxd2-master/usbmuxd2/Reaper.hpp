@@ -0,0 +1,62 @@
+//
+//  Reaper.hpp
+//  usbmuxd2
+//
+//  Created by tihmstar on 05.11.20.
+//  Copyright © 2020 tihmstar. All rights reserved.
+//
+
+#ifndef Reaper_hpp
+#define Reaper_hpp
+
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <deque>
+#include <stdint.h>
+
+/*
+ Intrusive reference count.
+ Objects start with one reference, which is usually dropped by kill().
+ Once the last reference is released, the object is handed to the Reaper and deleted there.
+ */
+class Reapable{
+    std::atomic<uint32_t> _refCnt;
+protected:
+    virtual ~Reapable();
+public:
+    Reapable();
+    Reapable(const Reapable &) = delete; //delete copy constructor
+    Reapable(Reapable &&o) = delete; //move constructor
+
+    void retain() noexcept; //caller needs to hold a reference already
+    bool tryRetain() noexcept; //fails if the object is already waiting to be deleted
+    void release() noexcept;
+
+    friend class Reaper;
+};
+
+/*
+ Single thread deleting Reapables in the order they were released.
+ Destructors run here, so they may block (e.g. waiting for callbacks to finish) without stalling the thread releasing the object.
+ */
+class Reaper{
+    std::mutex _lck;
+    std::condition_variable _cond;
+    std::deque<Reapable *> _queue;
+    std::thread *_thread;
+    bool _busy;
+    bool _stop;
+
+    void loop() noexcept;
+    Reaper();
+    ~Reaper();
+public:
+    static Reaper *shared();
+
+    void reap(Reapable *obj) noexcept;
+    void drain() noexcept; //wait until everything released so far is deleted. Must not be called from a destructor
+};
+
+#endif /* Reaper_hpp */
@@ -0,0 +1,45 @@
+//
+//  SerializedPlist.cpp
+//  usbmuxd2
+//
+//  Created by tihmstar on 07.11.20.
+//  Copyright © 2020 tihmstar. All rights reserved.
+//
+
+#include "SerializedPlist.hpp"
+#include <libgeneral/macros.h>
+#include <stdlib.h>
+
+SerializedPlist::SerializedPlist(plist_t plist)
+: _plist(plist), _xml(NULL), _xmlSize(0), _bin(NULL), _binSize(0)
+{
+    bool didSerialize = false;
+    cleanup([&]{ //cleanup only code
+        if (!didSerialize) {
+            //destructor won't be called if we throw
+            safeFree(_xml);
+            safeFree(_bin);
+            safeFreeCustom(_plist, plist_free);
+        }
+    });
+    plist_to_xml(_plist, &_xml, &_xmlSize);
+    assure(_xml);
+    plist_to_bin(_plist, &_bin, &_binSize);
+    assure(_bin);
+    didSerialize = true;
+}
+
+SerializedPlist::~SerializedPlist(){
+    safeFree(_xml);
+    safeFree(_bin);
+    safeFreeCustom(_plist, plist_free);
+}
+
+const char *SerializedPlist::data(bool binary, uint32_t &size) const noexcept{
+    if (binary) {
+        size = _binSize;
+        return _bin;
+    }
+    size = _xmlSize;
+    return _xml;
+}
@@ -0,0 +1,35 @@
+//
+//  SerializedPlist.hpp
+//  usbmuxd2
+//
+//  Created by tihmstar on 07.11.20.
+//  Copyright © 2020 tihmstar. All rights reserved.
+//
+
+#ifndef SerializedPlist_hpp
+#define SerializedPlist_hpp
+
+#include <plist/plist.h>
+#include <stdint.h>
+
+/*
+ Immutable plist, serialized once to XML and to binary.
+ Meant to be shared (e.g. through std::shared_ptr) between all clients receiving the same message.
+ */
+class SerializedPlist{
+    plist_t _plist;
+    char *_xml;
+    uint32_t _xmlSize;
+    char *_bin;
+    uint32_t _binSize;
+public:
+    SerializedPlist(plist_t plist); //takes ownership of plist
+    SerializedPlist(const SerializedPlist &) = delete; //delete copy constructor
+    SerializedPlist(SerializedPlist &&o) = delete; //move constructor
+    ~SerializedPlist();
+
+    plist_t plist() const noexcept {return _plist;}
+    const char *data(bool binary, uint32_t &size) const noexcept;
+};
+
+#endif /* SerializedPlist_hpp */
@@ -25,15 +25,21 @@
 #include <netdb.h>
 #include <system_error>
 
+#define SOCKCONN_RELAY_SIZE 0x40000
+
 
 SockConn::SockConn(std::string ipaddr, uint16_t dPort, Client *cli) 
-: _ipaddr(ipaddr), _cli(cli), _dPort(dPort), _killInProcess(false), _didConnect(false), _cfd(-1), _dfd(-1), _pfds(NULL)
+: _ipaddr(ipaddr), _cli(cli), _dPort(dPort), _killInProcess(false), _didConnect(false), _cfd(-1), _dfd(-1),
+    _relay{{-1,-1,{-1,-1},NULL,0,0},{-1,-1,{-1,-1},NULL,0,0}}, _cEvents(0), _dEvents(0)
 {
 
 }
 
 SockConn::~SockConn(){
 	debug("Destroying SockConn (%p) dPort=%u",this,_dPort);
+    stopLoop(); //unregister from reactor before closing the sockets
+    relay_free(_relay[0]);
+    relay_free(_relay[1]);
 	auto fdlist = {_cfd,_dfd};
 	_cfd = -1; 
 	_dfd = -1;
@@ -44,7 +50,6 @@ SockConn::~SockConn(){
         	close(fd);
   		}
 	}
-	safeFree(_pfds);
 }
 
 void SockConn::connect(){
@@ -75,55 +80,167 @@ void SockConn::connect(){
 	devaddr.sin_port = htons(_dPort);
 
 	retassure(!(err = ::connect(_dfd, (sockaddr*)&devaddr, sizeof(devaddr))), "failed to connect to device on port=%d with err=%d errno=%d(%s)",_dPort,err,errno,strerror(errno));
-	
-    _cli->send_result(_cli->hdr->tag, RESULT_OK);
-    _cfd = _cli->_fd;
 
-    _cli->_fd = -1; //discard file descriptor, because the device (TCP) owns it now
+    _cli->connect_begin(this, 0); //we are connected already, client hands the socket over once the result was sent
+}
+
+Client::connection::status SockConn::connectStatus() noexcept{
+    return CONNECT_DONE;
+}
+
+void SockConn::abortConnect() noexcept{
+    _cli = nullptr;
+    kill();
+}
+
+void SockConn::takeover(int fd){
+    _cfd = fd;
     _cli = nullptr; // we don't need to keep a pointer in here anymore!
     debug("SockConn connected _cfd=%d _dfd=%d",_cfd,_dfd);
+    try {
+        relay_start();
+    } catch (...) {
+        kill();
+        throw;
+    }
+}
 
-    _pfds = (struct pollfd*) malloc(sizeof(struct pollfd)*2);
-    _pfds[0].fd = _cfd;
-	_pfds[0].events = POLLIN;
-    _pfds[1].fd = _dfd;
-	_pfds[1].events = POLLIN;
+void SockConn::relay_start(){
+    //partial writes are kept in the relay until the socket becomes writable again
+    for (int fd : {_cfd,_dfd}){
+        int flags = fcntl(fd, F_GETFL, 0);
+        retassure(flags != -1 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) != -1, "failed to make fd=%d non-blocking",fd);
+    }
+    relay_init(_relay[0], _cfd, _dfd);
+    relay_init(_relay[1], _dfd, _cfd);
 
+    watchFd(_cfd, _cEvents = POLLIN);
+    watchFd(_dfd, _dEvents = POLLIN);
     startLoop();
 }
 
+void SockConn::relay_init(relay &r, int from, int to){
+    r.from = from;
+    r.to = to;
+#ifdef __linux__
+    if (!pipe2(r.pipe, O_NONBLOCK | O_CLOEXEC)) {
+        fcntl(r.pipe[1], F_SETPIPE_SZ, SOCKCONN_RELAY_SIZE); //best effort, the default is 64KiB
+        return;
+    }
+    debug("SockConn failed to create pipe, falling back to copying err=%s",strerror(errno));
+    r.pipe[0] = r.pipe[1] = -1;
+#endif
+    assure(r.buf = (char*)malloc(SOCKCONN_RELAY_SIZE));
+}
+
+void SockConn::relay_free(relay &r) noexcept{
+    for (int &fd : r.pipe){
+        if (fd != -1) {
+            close(fd); fd = -1;
+        }
+    }
+    safeFree(r.buf);
+}
+
+/*
+ Moves one chunk from r.from to r.to.
+ On linux data goes socket->pipe->socket using splice(), so it never gets copied to user space.
+ */
+void SockConn::relay_read(relay &r){
+    ssize_t cnt = 0;
+    if (r.pending) return; //r.to needs to take what we have first
+
+#ifdef __linux__
+    if (r.pipe[0] != -1 && (cnt = splice(r.from, NULL, r.pipe[1], NULL, SOCKCONN_RELAY_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK)) < 0 && errno == EINVAL) {
+        //splice isn't supported for this socket, copy through user space instead
+        debug("SockConn splice not supported on fd=%d, falling back to copying",r.from);
+        relay_free(r);
+        assure(r.buf = (char*)malloc(SOCKCONN_RELAY_SIZE));
+    }
+    if (r.pipe[0] == -1)
+#endif
+    {
+        cnt = read(r.from, r.buf, SOCKCONN_RELAY_SIZE);
+    }
+    if (cnt < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return; //spurious wakeup
+    }
+    retassure(cnt>0, "read failed on fd=%d with cnt=%zd err=%s",r.from,cnt,strerror(errno));
+    r.off = 0;
+    r.pending = cnt;
+    relay_flush(r);
+}
+
+void SockConn::relay_flush(relay &r){
+    while (r.pending) {
+        ssize_t cnt = 0;
+#ifdef __linux__
+        if (r.pipe[0] != -1) {
+            cnt = splice(r.pipe[0], NULL, r.to, NULL, r.pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        } else
+#endif
+        {
+            cnt = write(r.to, r.buf+r.off, r.pending);
+        }
+        if (cnt < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return; //socket is full, wait for POLLOUT
+        }
+        retassure(cnt>0, "send failed on fd=%d with cnt=%zd err=%s",r.to,cnt,strerror(errno));
+        r.off += cnt;
+        r.pending -= cnt;
+    }
+}
+
+/*
+ Stop reading from a socket while the other one can't take more data
+ */
+void SockConn::updateFdEvents() noexcept{
+    uint32_t cEvents = 0;
+    uint32_t dEvents = 0;
+    if (_relay[0].pending) {
+        dEvents |= POLLOUT;
+    } else {
+        cEvents |= POLLIN;
+    }
+    if (_relay[1].pending) {
+        cEvents |= POLLOUT;
+    } else {
+        dEvents |= POLLIN;
+    }
+    if (cEvents != _cEvents) {
+        setFdEvents(_cfd, _cEvents = cEvents);
+    }
+    if (dEvents != _dEvents) {
+        setFdEvents(_dfd, _dEvents = dEvents);
+    }
+}
+
 
 void SockConn::kill() noexcept{
     //sets _killInProcess to true and executes if statement if it was false before
     if (!_killInProcess.exchange(true)) {
-        
-        std::thread delthread([this](){
 #ifdef DEBUG
-            debug("killing SockConn (%p) C=%d D=%d",this,_cfd,_dfd);
+        debug("killing SockConn (%p) C=%d D=%d",this,_cfd,_dfd);
 #else
-            info("killing SockConn C=%d D=%d",_cfd,_dfd);
+        info("killing SockConn C=%d D=%d",_cfd,_dfd);
 #endif
-            delete this;
-        });
-        delthread.detach();
-        
+        release();
     }
 }
 
 
-void SockConn::loopEvent(){
-	int err = 0;
-	ssize_t cnt = 0;
-	char buf[0x4000];
-	assure((err = poll(_pfds,2,-1)) != -1);
-
-	for (int i = 0; i < 2; ++i){
-		retassure((_pfds[i].revents & (~POLLIN)) == 0, "bad poll revents=0x%02x for fd=%d",_pfds[i].revents,i);
-		if (_pfds[i].revents & POLLIN){
-			retassure((cnt = read(_pfds[i].fd, buf, sizeof(buf)))>0, "read failed on fd=%d with cnt=%lld err=%s",_pfds[i],cnt,strerror(errno));
-			retassure((cnt = write(_pfds[(i+1)&1].fd, buf, cnt))>0, "send failed on fd=%d with cnt=%lld err=%s",_pfds[i],cnt,strerror(errno));
-		}
+void SockConn::fdEvent(int fd, uint32_t revents){
+	relay &in = _relay[(fd == _cfd) ? 0 : 1]; //reads from fd
+	relay &out = _relay[(fd == _cfd) ? 1 : 0]; //writes to fd
+
+	retassure((revents & (~(POLLIN | POLLOUT))) == 0, "bad poll revents=0x%02x for fd=%d",revents,fd);
+	if (revents & POLLOUT) {
+		relay_flush(out);
+	}
+	if (revents & POLLIN) {
+		relay_read(in);
 	}
+	updateFdEvents();
 }
 
 void SockConn::afterLoop() noexcept{
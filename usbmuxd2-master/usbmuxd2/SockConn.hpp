@@ -10,11 +10,19 @@
 #define SockConn_hpp
 
 #include <Manager/Manager.hpp>
+#include <Reaper.hpp>
+#include <Client.hpp>
 #include <atomic>
 
-class Client;
-
-class SockConn : Manager{
+class SockConn : Manager, public Reapable, public Client::connection{
+    struct relay{
+        int from;
+        int to;
+        int pipe[2]; //splice() goes through this pipe, -1 if we use buf instead
+        char *buf;
+        size_t off;
+        size_t pending; //bytes read from "from", which weren't written to "to" yet
+    };
 	std::string _ipaddr;
     Client *_cli; //unmanaged
     uint16_t _dPort;
@@ -22,17 +30,28 @@ class SockConn : Manager{
     std::atomic_bool _didConnect;
     int _cfd; //client socket lifetime managed by this class
     int _dfd; //device socket also managed
-    struct pollfd *_pfds;
-
-	virtual void loopEvent() override;
+    relay _relay[2]; //client->device and device->client. Only touched by our reactor loop thread
+    uint32_t _cEvents;
+    uint32_t _dEvents;
+
+	virtual void fdEvent(int fd, uint32_t revents) override;
+    void relay_start();
+    void relay_init(relay &r, int from, int to);
+    void relay_free(relay &r) noexcept;
+    void relay_read(relay &r);
+    void relay_flush(relay &r);
+    void updateFdEvents() noexcept;
     virtual void afterLoop() noexcept override;
 	~SockConn();
 public:
 	SockConn(std::string ipaddr, uint16_t dPort, Client *cli);
 
-	void connect();
+	void connect(); //connects to the device, the client hands its socket over afterwards
+    virtual status connectStatus() noexcept override;
+    virtual void takeover(int fd) override;
+    virtual void abortConnect() noexcept override;
 
-	void kill() noexcept;
+	void kill() noexcept; //drops the initial reference
 };
 
 
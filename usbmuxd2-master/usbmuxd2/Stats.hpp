@@ -0,0 +1,81 @@
+//
+//  Stats.hpp
+//  usbmuxd2
+//
+//  Created by tihmstar on 29.11.20.
+//  Copyright © 2020 tihmstar. All rights reserved.
+//
+
+#ifndef Stats_hpp
+#define Stats_hpp
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/*
+ Snapshots of the runtime counters, taken while everything keeps running.
+ Counters only grow over the lifetime of their object, fields marked as gauge don't.
+ */
+
+struct tcp_stats{
+    uint16_t sPort;
+    uint16_t dPort;
+    uint64_t bytesIn;           // device -> client
+    uint64_t bytesOut;          // client -> device, without retransmissions
+    uint64_t segmentsIn;
+    uint64_t segmentsOut;       // without retransmissions
+    uint64_t segmentsDropped;   // out of order or exceeding our window
+    uint64_t retransmits;       // segments sent again
+    uint64_t windowStalls;      // stopped reading from the client, because the device didn't ACK
+    uint64_t windowStallUsec;   // time spent in those stalls
+    uint64_t clientStalls;      // client socket was full
+    uint64_t clientWrites;      // syscalls used to write bytesIn to the client
+    uint32_t rxBuffered;        // gauge: received from the device, not yet written to the client
+    uint32_t txInFlight;        // gauge: sent to the device, not yet acknowledged
+};
+
+struct usb_stats{
+    uint64_t rxSubmitted;       // transfers, including resubmissions
+    uint64_t rxCompleted;
+    uint64_t rxFull;            // completed transfers which were completely filled
+    uint64_t rxBytes;
+    uint64_t rxReassembled;     // packets gathered from multiple transfers
+    uint64_t rxDropped;         // packets dropped, because they couldn't be reassembled
+    uint64_t txSubmitted;       // transfers, including ZLPs
+    uint64_t txCompleted;
+    uint64_t txBytes;
+    uint64_t txZLPs;
+    uint64_t txPoolHits;
+    uint64_t txPoolMisses;
+    uint64_t errors;            // failed transfers
+    uint32_t rxInFlight;        // gauge
+    uint32_t rxDepth;           // gauge: target number of in flight RX transfers
+    uint32_t rxSize;            // gauge: target RX transfer size
+};
+
+struct client_stats{
+    uint64_t number;
+    std::string progName;
+    uint64_t bytesIn;
+    uint64_t commands;
+    uint64_t bytesOut;
+    uint64_t pktsOut;
+    uint64_t sendCalls;         // syscalls used to write bytesOut
+    uint64_t droppedPkts;
+    uint64_t queuedBytesPeak;
+    uint64_t queuedBytes;       // gauge
+};
+
+struct mux_stats{
+    struct device{
+        int id;
+        std::string serial;
+        usb_stats usb;
+        std::vector<tcp_stats> conns;
+    };
+    std::vector<device> devices; // USB devices only
+    std::vector<client_stats> clients;
+};
+
+#endif /* Stats_hpp */
@@ -16,22 +16,70 @@
 #include <errno.h>
 #include <string.h>
 #include <poll.h>
+#include <sys/socket.h>
 #include <system_error>
 
 
 #define MIN(a,b) (((a)<(b)) ? (a) : (b))
 
+#define TCP_RX_BATCH_MAX 4096 //smaller segments get collected while an rx_batch is active
+
+#define TCP_RTO_MS 250
+#define TCP_RTO_MAX_MS 8000
+#define TCP_MAX_RETRIES 8
+#define TCP_CONNECT_TIMEOUT_MS 10000
+
+static thread_local TCP::rx_batch *gRXBatch = NULL;
+
+#pragma mark rx_batch
+
+TCP::rx_batch::rx_batch() noexcept{
+    if (!gRXBatch) gRXBatch = this;
+}
+
+TCP::rx_batch::~rx_batch(){
+    if (gRXBatch == this) gRXBatch = NULL;
+    for (TCP *conn : _deferred) {
+        conn->_rxDeferred = false;
+        try {
+            if (!conn->_killInProcess) conn->flush_rx();
+        } catch (tihmstar::exception &e) {
+            debug("[TCP] sport=%u failed to flush batched input with error=%d (%s)",conn->_sPort,e.code(),e.what());
+        }
+        conn->release();
+    }
+}
+
+bool TCP::rx_batch::defer(TCP *conn){
+    if (conn->_rxDeferred.exchange(true)) return true;
+    //the caller only holds the port slot, a concurrent kill() may have dropped the last reference already
+    if (!conn->tryRetain()) {
+        conn->_rxDeferred = false;
+        return false;
+    }
+    try {
+        _deferred.push_back(conn);
+    } catch (...) {
+        conn->_rxDeferred = false;
+        conn->release();
+        throw;
+    }
+    return true;
+}
+
+#pragma mark TCP
+
 TCP::TCP(uint16_t sPort, uint16_t dPort, USBDevice *dev, Client *cli)
-    : _stx{0,0,0,0,0,131072}, _connState(CONN_CONNECTING), _cli(cli), _device(dev), _payloadBuf(NULL), _killInProcess(false), _didConnect(false), _refCnt(1),
-        _lockStx{}, _sPort(sPort), _dPort(dPort), _pfds(NULL)
+    : _stx{0,0,0,0,0,0,TCP::bufsize,TCP::bufsize,TCP_RTO_MS,0}, _connState(CONN_CONNECTING), _cli(cli), _device(dev), _payloadBuf(NULL), _rxBuf(NULL), _rxHead(0), _rxTail(0),
+        _killInProcess(false), _didConnect(false), _clientPaused(false), _rxReady(false), _rxPending(false), _rxFlushRequested(false), _rxDeferred(false),
+        _lockStx{}, _flushRequested(false), _sPort(sPort), _dPort(dPort), _fd(cli->_fd), _counters{}
 {
     debug("[TCP] (%d) creating connection for sport=%u",cli->_fd,_sPort);
     assure(_payloadBuf = (char*)malloc(TCP::bufsize));
+    assure(_rxBuf = (char*)malloc(TCP::bufsize));
 
-    _stx.seqAcked = _stx.seq = (uint32_t)random();
-    assure(_pfds = (struct pollfd*) malloc(sizeof(struct pollfd)));
-    _pfds[0].fd = cli->_fd;
-    _pfds[0].events = POLLIN;
+    _stx.tail = _stx.seqAcked = _stx.seq = (uint32_t)random();
+    _device->retain(); //device stays alive as long as we do
 }
 
 TCP::~TCP() {
@@ -43,8 +91,11 @@ TCP::~TCP() {
 #endif
 
     debug("[TCP] destroying connection for sport=%u",_sPort);
-    if (_didConnect && _pfds[0].fd>0) { // only kill socket if we connected successfully, otherwise the socket still belongs to client
-        int delfd = _pfds[0].fd; _pfds[0].fd = -1;
+    _device->close_connection(_sPort, this); //waits until the device doesn't deliver input to us anymore
+    stopLoop(); //unregister from reactor before closing the socket
+
+    if (_didConnect && _fd>0) { // only kill socket if we connected successfully, otherwise the socket still belongs to client
+        int delfd = _fd; _fd = -1;
         close(delfd);
     }
 
@@ -55,63 +106,278 @@ TCP::~TCP() {
         //
     }
 
-#warning UAF: device might be dead by now
-#warning TODO: add reference counting to Device
-    _device->close_connection(_sPort);
-    _connState = CONN_DYING;
-    _lockCanSend.notifyAll();
-    stopLoop();
+    _device->release();
+    safeFree(_payloadBuf);
+    safeFree(_rxBuf);
+}
 
-    while (!_didConnect || _refCnt) { //connect is always called right away, let's wait until we did
-        sched_yield();
+void TCP::setConnState(mux_conn_state state) noexcept{
+    std::unique_lock<std::mutex> ul(_lockConn);
+    _connState = state;
+    if (_cli) {
+        _cli->connect_kick(); //client is waiting for us
     }
+}
 
-    safeFree(_payloadBuf);
-    safeFree(_pfds);
+uint32_t TCP::sendableBytes() noexcept{
+    uint32_t inflight = _stx.seq - _stx.seqAcked; //unsigned arithmetic takes care of seq overflows
+    return (_stx.inWin > inflight) ? _stx.inWin - inflight : 0;
 }
 
-void TCP::loopEvent(){
-    int err = 0;
-    ssize_t cnt = 0;
+uint32_t TCP::ringFree() noexcept{
+    return TCP::bufsize - (_stx.tail - _stx.seqAcked); //don't overwrite unacknowledged data
+}
 
-    uint32_t lseqAck = ((uint64_t)_stx.seqAcked + TCP::bufsize)%TCP::bufsize;
-    uint32_t lseq = ((uint64_t)_stx.seq + TCP::bufsize)%TCP::bufsize;
-    char *bufstart = _payloadBuf+lseq;
+uint32_t TCP::rxFree() noexcept{
+    return TCP::bufsize - (_rxTail - _rxHead);
+}
 
-    size_t maxRCV = (lseq >= lseqAck) ? (TCP::bufsize - lseq) : lseqAck-lseq;
+void TCP::updateFdEvents() noexcept{
+    std::unique_lock<std::mutex> ul(_lockEvents);
+    uint32_t events = 0;
+    if (!_clientPaused) events |= POLLIN;
+    if (_rxPending) events |= POLLOUT;
+    setFdEvents(_fd, events);
+}
 
-    assure((err = poll(_pfds,1,-1)) != -1);
-    if ((_pfds[0].revents & (~POLLIN)) != 0){
+void TCP::stall_end() noexcept{
+    _counters.windowStallUsec += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - _stallStart).count();
+}
+
+void TCP::fdEvent(int fd, uint32_t revents){
+    ssize_t cnt = 0;
+    uint32_t ltail = 0;
+    uint32_t maxRCV = 0;
+
+    if (revents & Reactor::TIMEOUT) {
+        retransmit();
+        if (!(revents &= ~Reactor::TIMEOUT)) return;
+    }
+
+    if ((revents & (~(POLLIN | POLLOUT))) != 0){
       kill();
-      reterror("[TCP] (fd=%d) unexpected poll revent=%d",_pfds[0].fd,_pfds[0].revents);
-    }else if (!(_pfds[0].revents & POLLIN)){
-      warning("[TCP] poll returned, but no data to read");
-      return;
-    }else if ((cnt = recv(_pfds[0].fd, bufstart, maxRCV, MSG_DONTWAIT))<=0){
+      reterror("[TCP] (fd=%d) unexpected poll revent=%d",fd,revents);
+    }
+
+    if (revents & POLLOUT) {
+        flush_rx();
+        if (!(revents & POLLIN)) return;
+    }
+
+    _lockStx.lock();
+    ltail = _stx.tail % TCP::bufsize;
+    maxRCV = MIN(ringFree(), TCP::bufsize - ltail);
+    _lockStx.unlock();
+
+    if (!maxRCV) {
+        //send ring is full of unacknowledged data, stop reading from client until we receive an ACK
+        debug("[TCP] send ring full, pausing client fd=%d",fd);
+        _stallStart = std::chrono::steady_clock::now();
+        _clientPaused = true;
+        _counters.windowStalls++;
+        updateFdEvents();
+
+        //an ACK might have arrived before we paused
+        _lockStx.lock();
+        maxRCV = ringFree();
+        _lockStx.unlock();
+        if (maxRCV && _clientPaused.exchange(false)) {
+            stall_end();
+            updateFdEvents();
+        }
+        return;
+    }
+
+    if ((cnt = recv(fd, _payloadBuf+ltail, maxRCV, MSG_DONTWAIT))<=0){
+        if (cnt < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return; //spurious wakeup
+        }
         kill();
-        reterror("[TCP] recv failed on client %d with error=%d (%s)",_pfds[0].fd,errno,strerror(errno));
+        reterror("[TCP] recv failed on client %d with error=%d (%s)",fd,errno,strerror(errno));
     }
 
     debug("got packet of size %zd",cnt);
 
-    while (cnt>0) {
-        ssize_t doSend = MIN(cnt,TCP::TCP_MTU);
-        if (ssize_t optSend = MIN(doSend, _stx.inWin - (_stx.seq - _stx.seqAcked))){ //packet size optimization
-            doSend = optSend; //don't "optimize" if value is zero (which means we have to wait for ACK anyways)
+    _lockStx.lock();
+    _stx.tail += (uint32_t)cnt;
+    _lockStx.unlock();
+
+    flush_send();
+}
+
+/*
+ Sends everything between head and tail the device's window allows.
+ Can be called from any thread. If another thread is currently sending, that thread picks up our request.
+ */
+void TCP::flush_send(){
+    _flushRequested = true;
+    while (_flushRequested && _lockSend.try_lock()) {
+        std::unique_lock<std::mutex> sl(_lockSend, std::adopt_lock);
+        _flushRequested = false;
+        while (true) {
+            uint32_t seq = 0;
+            uint32_t len = 0;
+            uint32_t rto = 0;
+            bool armTimer = false;
+
+            _lockStx.lock();
+            seq = _stx.seq;
+            len = MIN(_stx.tail - _stx.seq, sendableBytes());
+            len = MIN(len, (uint32_t)TCP::TCP_MTU);
+            len = MIN(len, TCP::bufsize - seq % TCP::bufsize); //segments don't wrap around the ring
+            if (len) {
+                armTimer = (_stx.seq == _stx.seqAcked); //first unacknowledged segment starts the retransmission timer
+                rto = _stx.rto;
+                _stx.seq += len;
+            }
+            _lockStx.unlock();
+            if (!len) break;
+
+            if (armTimer) {
+                setFdTimer(_fd, rto * 1000);
+            }
+            send_data(seq, _payloadBuf + seq % TCP::bufsize, len);
+            _counters.segmentsOut++;
+            _counters.bytesOut += len;
         }
-    lessPayload:
-        try {
-            send_data(bufstart,doSend);
-        } catch (int leftdata) {
-            doSend = MIN(leftdata,doSend);
-            debug("less payload=%u",leftdata);
-            goto lessPayload;
+    }
+}
+
+/*
+ Retransmission timer expired: resend everything which wasn't acknowledged yet (go-back-N).
+ Unacknowledged data is never overwritten in the ring, so we can resend it straight from there.
+ */
+void TCP::retransmit(){
+    std::unique_lock<std::mutex> sl(_lockSend);
+    uint32_t seq = 0;
+    uint32_t end = 0;
+    uint32_t rto = 0;
+    uint32_t retries = 0;
+
+    _lockStx.lock();
+    seq = _stx.seqAcked;
+    end = _stx.seq;
+    if (seq != end) {
+        retries = ++_stx.retries;
+        rto = _stx.rto = MIN(_stx.rto * 2, TCP_RTO_MAX_MS);
+    }
+    _lockStx.unlock();
+
+    if (seq == end) return; //everything got acknowledged in the meantime
+
+    if (retries > TCP_MAX_RETRIES) {
+        kill();
+        reterror("[TCP] sport=%u giving up after %u retransmissions",_sPort,retries-1);
+    }
+
+    info("[TCP] sport=%u retransmitting %u bytes starting at seq=%u (try %u)",_sPort,end-seq,seq,retries);
+    setFdTimer(_fd, rto * 1000);
+    while (seq != end) {
+        uint32_t len = MIN(end - seq, (uint32_t)TCP::TCP_MTU);
+        len = MIN(len, TCP::bufsize - seq % TCP::bufsize);
+        send_data(seq, _payloadBuf + seq % TCP::bufsize, len);
+        _counters.retransmits++;
+        seq += len;
+    }
+}
+
+/*
+ Writes buffered device data to the client without blocking.
+ If the client can't take everything, we wait for POLLOUT and the device's window shrinks accordingly.
+ Can be called from any thread. If another thread is currently flushing, that thread picks up our request.
+ */
+void TCP::flush_rx(){
+    bool windowUpdate = false;
+    if (!_rxReady) return; //takeover() flushes once the client socket belongs to us
+
+    _rxFlushRequested = true;
+    while (_rxFlushRequested && _lockRxFlush.try_lock()) {
+        std::unique_lock<std::mutex> fl(_lockRxFlush, std::adopt_lock);
+        _rxFlushRequested = false;
+        while (true) {
+            struct iovec iov[2] = {};
+            struct msghdr msg = {};
+            ssize_t cnt = 0;
+
+            _lockStx.lock();
+            msg.msg_iovlen = rx_iov(iov);
+            _lockStx.unlock();
+            if (!msg.msg_iovlen) {
+                if (_rxPending.exchange(false)) {
+                    updateFdEvents();
+                }
+                break;
+            }
+            msg.msg_iov = iov;
+
+            _counters.clientWrites++;
+            if ((cnt = sendmsg(_fd, &msg, MSG_DONTWAIT)) < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    if (!_rxPending.exchange(true)) {
+                        debug("[TCP] sport=%u client is slow, waiting for POLLOUT",_sPort);
+                        _counters.clientStalls++;
+                        updateFdEvents();
+                    }
+                    break;
+                }
+                //client died, but don't throw, since it wasn't the devices fault!
+                //terminate TCP instead
+                kill();
+                return;
+            }
+
+            _lockStx.lock();
+            _rxHead += (uint32_t)cnt;
+            _stx.win = rxFree();
+            //avoid silly window syndrome: only announce the window if it grew by a full segment
+            windowUpdate = _stx.win >= _stx.winAdvertised + TCP::TCP_MTU || (!_stx.winAdvertised && _stx.win);
+            _lockStx.unlock();
         }
-        bufstart += doSend;
-        cnt -= doSend;
+    }
+
+    if (windowUpdate) {
+        send_ack(true);
     }
 }
 
+void TCP::rx_append(const struct iovec *payload, int payloadCnt, uint32_t skip) noexcept{
+    for (int i=0; i<payloadCnt; i++) {
+        const char *p = (const char *)payload[i].iov_base;
+        uint32_t len = (uint32_t)payload[i].iov_len;
+        if (skip >= len) {
+            skip -= len;
+            continue;
+        }
+        p += skip;
+        len -= skip;
+        skip = 0;
+        while (len) {
+            uint32_t tail = _rxTail % TCP::bufsize;
+            uint32_t part = MIN(len, TCP::bufsize - tail);
+            memcpy(_rxBuf + tail, p, part);
+            _rxTail += part;
+            p += part;
+            len -= part;
+        }
+    }
+}
+
+int TCP::rx_iov(struct iovec iov[2]) noexcept{
+    uint32_t head = _rxHead % TCP::bufsize;
+    uint32_t len = _rxTail - _rxHead;
+    uint32_t part = MIN(len, TCP::bufsize - head);
+    int cnt = 0;
+    if (part) {
+        iov[cnt].iov_base = _rxBuf + head;
+        iov[cnt++].iov_len = part;
+    }
+    if (len > part) {
+        iov[cnt].iov_base = _rxBuf;
+        iov[cnt++].iov_len = len - part;
+    }
+    return cnt;
+}
+
 void TCP::send_tcp(std::uint8_t flags) {
     tcphdr tcp_header{};
     _lockStx.lock();
@@ -128,16 +394,17 @@ void TCP::send_tcp(std::uint8_t flags) {
           _sPort, _dPort, _stx.seq, _stx.ack, flags, _stx.win, _stx.win >> 8, 0);
     // Update TCP states
     _stx.acked = _stx.ack;
+    _stx.winAdvertised = _stx.win;
     _lockStx.unlock();
 
     _device->send_packet(USBDevice::MUX_PROTO_TCP, NULL, 0, &tcp_header);
 }
 
-void TCP::send_ack(){
+void TCP::send_ack(bool windowUpdate){
     bool doSend = false;
     tcphdr tcp_header{};
     _lockStx.lock();
-    if ((doSend = (_stx.acked != _stx.ack))) {
+    if ((doSend = (_stx.acked != _stx.ack || windowUpdate))) {
         debug("Sending tcp ack packet: sport=%u dport=%u seq=%u ack=%u flags=0x%x window=%u[%u]",
               _sPort, _dPort, _stx.seq, _stx.ack, TH_ACK, _stx.win, _stx.win >> 8);
 
@@ -151,6 +418,7 @@ void TCP::send_ack(){
 
         // Update TCP states
         _stx.acked = _stx.ack;
+        _stx.winAdvertised = _stx.win;
     }
     _lockStx.unlock();
     if (doSend) {
@@ -158,54 +426,14 @@ void TCP::send_ack(){
     }
 }
 
-void TCP::send_data(void* buf, size_t len) {
+void TCP::send_data(uint32_t seq, const void *buf, size_t len) {
     tcphdr tcp_header{};
-    int rembytes = 0;
-retry:
-    for (int i=0; i<10; i++) {
-        _lockStx.lock();
-        if (_stx.seq + len - _stx.seqAcked > _stx.inWin) {
-            _lockStx.unlock();
-            sched_yield();
-        }else{
-            goto cnt_label; //fast path
-        }
-    }
+    //caller makes sure [seq, seq+len) is in the send ring and fits into the device's window
     _lockStx.lock();
-    //slow path
-    rembytes = (int)(_stx.inWin - (_stx.seq - _stx.seqAcked));
-
-    //account for seq overflows
-    if (_stx.seq < _stx.seqAcked) {
-        rembytes = (int)(_stx.inWin - (uint32_t)(((uint64_t)(_stx.seq+0x100000000) - _stx.seqAcked)));
-        if (len <= rembytes) {
-            goto cnt_label;
-        }
-    }
-
-    if (rembytes<=0) {
-        //at this point we *have to* wait for an ACK
-        //no smaller payload is possible
-        debug("we have to wait for ACK before sending more data!");
-
-        // **** Put this thread to sleep until we can send more data **** //
-
-
-        _lockStx.unlock(); //unlocking _lockStx inbetween _lockCanSend locks, makes sure we never lock if we could send data!
-
-        assure(_connState == CONN_CONNECTED);
-        _lockCanSend.wait();//this lock will always be "blocking", unless we can send more data
-
-        goto retry;
-    }
-    _lockStx.unlock();
-
-    throw int(rembytes);
-cnt_label:
 
     tcp_header.th_sport = htons(_sPort);
     tcp_header.th_dport = htons(_dPort);
-    tcp_header.th_seq = htonl(_stx.seq);
+    tcp_header.th_seq = htonl(seq);
     tcp_header.th_ack = htonl(_stx.ack);
     tcp_header.th_flags = TH_ACK;
     tcp_header.th_off = sizeof(tcphdr) / 4;
@@ -213,7 +441,7 @@ cnt_label:
 
     // Update TCP states
     _stx.acked = _stx.ack;
-    _stx.seq += len;
+    _stx.winAdvertised = _stx.win;
     _lockStx.unlock();
     debug("Sending tcp payload packet: sport=%u dport=%u seq=%u ack=%u flags=0x%x window=%u[%u] len=%zu rwindow=%u[%u]",
           htons(tcp_header.th_sport), htons(tcp_header.th_dport), htonl(tcp_header.th_seq), htonl(tcp_header.th_ack),
@@ -224,49 +452,78 @@ cnt_label:
 
 
 void TCP::connect() {
-    cleanup([&]{
-        _didConnect = true; // make sure destructor knows this function was called and returned
-    });
     info("Starting TCP connection");
-
     send_tcp(TH_SYN);
+    _cli->connect_begin(this, TCP_CONNECT_TIMEOUT_MS); //SYN/ACK or RST from the device kick the client
+}
 
-    while (_connState == CONN_CONNECTING)
-        sched_yield();
+Client::connection::status TCP::connectStatus() noexcept{
+    std::unique_lock<std::mutex> ul(_lockConn);
+    switch (_connState) {
+        case CONN_CONNECTING:
+            return CONNECT_PENDING;
+        case CONN_CONNECTED:
+            return CONNECT_DONE;
+        default:
+            return CONNECT_FAILED;
+    }
+}
 
-    assure(_connState == CONN_CONNECTED);
+void TCP::takeover(int fd){
+    cleanup([&]{
+        release(); //drop the reference the client held while connecting
+    });
+    {
+        std::unique_lock<std::mutex> ul(_lockConn);
+        _cli = nullptr; // we don't need to keep a pointer in here anymore!
+    }
+    _fd = fd;
+    _didConnect = true; //socket belongs to us now
     info("TCP Connected to device");
     try {
-        _cli->send_result(_cli->hdr->tag, RESULT_OK);
+        watchFd(_fd, POLLIN);
+        startLoop();
     } catch (...) {
-        _pfds[0].fd = -1; //discard file descriptor, because (Client) still owns it
+        _device->close_connection(_sPort, this);
         throw;
     }
-    _cli->_fd = -1; //discard file descriptor, because the device (TCP) owns it now
-    _cli = nullptr; // we don't need to keep a pointer in here anymore!
-    startLoop();
+    _rxReady = true;
+    flush_rx(); //device might have sent data already
 }
 
-void TCP::handle_input(tcphdr* tcp_header, uint8_t* payload, uint32_t payload_len) {
+void TCP::abortConnect() noexcept{
+    {
+        std::unique_lock<std::mutex> ul(_lockConn);
+        _cli = nullptr;
+    }
+    debug("[TCP] sport=%u connect aborted",_sPort);
+    _device->close_connection(_sPort, this); //kills us, unless that happened already
+    release(); //drop the reference the client held while connecting
+}
+
+void TCP::handle_input(tcphdr* tcp_header, const struct iovec *payload, int payloadCnt, uint32_t payload_len) {
     debug("[TCP IN] sport=%u dport=%u seq=%u ack=%u flags=0x%x window=%u[%u] len=%u",
           _sPort, _dPort, ntohl(tcp_header->th_seq), ntohl(tcp_header->th_ack), tcp_header->th_flags, ntohs(tcp_header->th_win) << 8, ntohs(tcp_header->th_win), payload_len);
 
     // Update TCP receiver state
     uint32_t rSeq = ntohl(tcp_header->th_seq);
     uint32_t rAck = ntohl(tcp_header->th_ack);
+    _counters.segmentsIn++;
 
     if(_connState == CONN_CONNECTING) {
         if(tcp_header->th_flags == (TH_SYN | TH_ACK)) {
             debug("Received SYN/ACK during device handshake");
-            _stx.seq++;
+            _lockStx.lock();
+            _stx.tail = _stx.seqAcked = ++_stx.seq; //our SYN got acknowledged
             _stx.ack = rSeq+1; //just copy this on first packet without parsing
             _stx.inWin = ntohs(tcp_header->th_win) << 8;
+            _lockStx.unlock();
 
             send_ack();
-            _connState = CONN_CONNECTED;
+            setConnState(CONN_CONNECTED);
         } else {
             retassure(tcp_header->th_flags & TH_RST,"Received unexpected data while connecting");
-            _connState = CONN_REFUSED;
+            setConnState(CONN_REFUSED);
             info("Connection refused by device");
             kill();
         }
@@ -275,63 +532,107 @@ void TCP::handle_input(tcphdr* tcp_header, uint8_t* payload, uint32_t payload_le
 
         if (tcp_header->th_flags == TH_ACK) {
 
-            //either forward packet, or discard it
+            //either buffer packet, or discard it
             _lockStx.lock();
             if (_stx.ack == rSeq) {
-                _stx.ack += payload_len;
-                _lockStx.unlock();
-                if (payload_len) { // don't bounce doubleACKs
-                    debug("[TCP IN ACKING] sport=%u dport=%u _stx.ack=%u len=%u",_sPort, _dPort, _stx.ack, payload_len);
-                    send_ack();
-
-                    //forward without buffering
-                    if(send(_pfds[0].fd, payload, payload_len, 0) != payload_len){
-                        //client died, but don't throw, since it wasn't the devices fault!
-                        //terminate TCP instead
-                        kill();
-                        return;
+                if (payload_len > rxFree()) {
+                    //device ignored our window, drop it and let the device retransmit
+                    debug("[TCP IN] sport=%u payload of %u bytes exceeds window %u, dropping",_sPort,payload_len,rxFree());
+                    _lockStx.unlock();
+                    _counters.segmentsDropped++;
+                    send_ack(true);
+                } else if (payload_len) { // don't bounce doubleACKs
+                    uint32_t sent = 0;
+                    bool defer = false;
+                    if (gRXBatch && payload_len < TCP_RX_BATCH_MAX) {
+                        //small segment, more are likely to arrive in the same batch. Write them all at once when it ends
+                        rx_append(payload, payloadCnt, 0);
+                        defer = true;
+                    } else if (_rxReady && !_rxPending && _lockRxFlush.try_lock()) {
+                        //write what is buffered plus the payload with a single sendmsg, the payload straight from the USB buffers.
+                        //Holding _lockRxFlush keeps flush_rx() from sending anything until the rest is buffered
+                        std::unique_lock<std::mutex> fl(_lockRxFlush, std::adopt_lock);
+                        struct iovec iov[2+RX_MAX_FRAGMENTS] = {};
+                        struct msghdr msg = {};
+                        uint32_t buffered = _rxTail - _rxHead;
+                        uint32_t fromRing = 0;
+                        ssize_t cnt = 0;
+                        int iovcnt = rx_iov(iov);
+                        for (int i=0; i<payloadCnt; i++) {
+                            iov[iovcnt++] = payload[i];
+                        }
+                        msg.msg_iov = iov;
+                        msg.msg_iovlen = iovcnt;
+                        _lockStx.unlock();
+                        _counters.clientWrites++;
+                        if ((cnt = sendmsg(_fd, &msg, MSG_DONTWAIT)) < 0) {
+                            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                                //client died, but don't throw, since it wasn't the devices fault!
+                                fl.unlock();
+                                kill();
+                                return;
+                            }
+                            cnt = 0;
+                        }
+                        fromRing = MIN((uint32_t)cnt, buffered);
+                        sent = (uint32_t)cnt - fromRing;
+                        _lockStx.lock();
+                        _rxHead += fromRing;
+                        rx_append(payload, payloadCnt, sent);
+                    } else {
+                        rx_append(payload, payloadCnt, 0);
+                    }
+                    _stx.ack += payload_len;
+                    _stx.win = rxFree();
+                    _lockStx.unlock();
+                    _counters.bytesIn += payload_len;
+                    debug("[TCP IN ACKING] sport=%u dport=%u _stx.ack=%u len=%u (%u sent directly)",_sPort, _dPort, _stx.ack, payload_len, sent);
+                    if (!defer || !gRXBatch->defer(this)) {
+                        flush_rx(); //try writing to the client right away, this likely frees the window again before we ACK
                     }
+                    send_ack();
+                } else {
+                    _lockStx.unlock();
                 }
             }else{
                 debug("discarding packet");
                 _lockStx.unlock();
+                if (payload_len) _counters.segmentsDropped++;
                 send_ack();
             }
 
             _lockStx.lock();
-
-            if (rAck >= _stx.seqAcked || _stx.seq < _stx.seqAcked){//check for seq overflow
-
-                _stx.seqAcked = rAck; //update ACK on sent packets
+            {
+                uint32_t inflight = _stx.seq - _stx.seqAcked;
+                uint32_t newlyAcked = rAck - _stx.seqAcked; //unsigned arithmetic takes care of seq overflows
+                bool canRead = false;
+                uint32_t rto = 0;
+
+                if (newlyAcked > inflight) {
+                    //ACK for data we never sent, or an old ACK arriving late
+                    debug("[TCP] sport=%u ignoring ack=%u (acked=%u head=%u)",_sPort,rAck,_stx.seqAcked,_stx.seq);
+                    _lockStx.unlock();
+                    return;
+                }
+                _stx.seqAcked = rAck;
                 _stx.inWin = ntohs(tcp_header->th_win) << 8;
-
-                _lockCanSend.notifyAll();
-
-                _lockStx.unlock();
-            }else {
-
-                //this will never ever happen (i think)
-                debug("Re-sending tcp payload packet: sport=%u dport=%u seq=%u ack=%u flags=0x%x window=%u[%u] len=%u",
-                      _sPort, _dPort, rAck, _stx.ack, TH_ACK, _stx.win, _stx.win >> 8, _stx.seqAcked-rAck);
-
-                tcphdr tcp_header{};
-
-                tcp_header.th_sport = htons(_sPort);
-                tcp_header.th_dport = htons(_dPort);
-                tcp_header.th_seq = htonl(rAck);
-                tcp_header.th_ack = htonl(_stx.ack);
-                tcp_header.th_flags = TH_ACK;
-                tcp_header.th_off = sizeof(tcphdr) / 4;
-                tcp_header.th_win = htons(static_cast<std::uint16_t>(_stx.win >> 8));
-
-                // Update TCP states
-                _stx.acked = _stx.ack;
+                if (newlyAcked) {
+                    _stx.retries = 0;
+                    _stx.rto = TCP_RTO_MS;
+                    rto = (_stx.seq != _stx.seqAcked) ? _stx.rto : 0; //restart timer for remaining data, or stop it
+                }
+                canRead = ringFree() > 0;
                 _lockStx.unlock();
 
-#warning This was never tested lol
-                char *bufstart = _payloadBuf+((uint64_t)rAck + TCP::bufsize)%TCP::bufsize;
-                _device->send_packet(USBDevice::MUX_PROTO_TCP, bufstart, _stx.seqAcked-rAck, &tcp_header);
+                if (newlyAcked) {
+                    setFdTimer(_fd, rto * 1000);
+                }
+                if (canRead && _clientPaused.exchange(false)) {
+                    stall_end();
+                    updateFdEvents(); //resume reading from client
+                }
             }
+            flush_send(); //window might have opened
         } else if (tcp_header->th_flags == TH_RST){
             info("Connection reset by device, flags: %u sport=%u dport=%u", tcp_header->th_flags,_sPort,_dPort);
             kill();
@@ -346,21 +647,36 @@ void TCP::handle_input(tcphdr* tcp_header, uint8_t* payload, uint32_t payload_le
 void TCP::kill() noexcept{
     //sets _killInProcess to true and executes if statement if it was false before
     if (!_killInProcess.exchange(true)) {
-        
-        std::thread delthread([this](){
 #ifdef DEBUG
-            debug("killing TCP (%p) %d",this,_pfds[0].fd);
+        debug("killing TCP (%p) %d",this,_fd);
 #else
-            info("killing TCP %d",_pfds[0].fd);
+        info("killing TCP %d",_fd);
 #endif
-            delete this;
-        });
-        delthread.detach();
-        
-
+        setConnState(CONN_DYING); //lets a client waiting for the connect know
+        release();
     }
 }
 
+tcp_stats TCP::getStats() noexcept{
+    tcp_stats ret = {};
+    ret.sPort = _sPort;
+    ret.dPort = _dPort;
+    ret.bytesIn = _counters.bytesIn;
+    ret.bytesOut = _counters.bytesOut;
+    ret.segmentsIn = _counters.segmentsIn;
+    ret.segmentsOut = _counters.segmentsOut;
+    ret.segmentsDropped = _counters.segmentsDropped;
+    ret.retransmits = _counters.retransmits;
+    ret.windowStalls = _counters.windowStalls;
+    ret.windowStallUsec = _counters.windowStallUsec;
+    ret.clientStalls = _counters.clientStalls;
+    ret.clientWrites = _counters.clientWrites;
+    _lockStx.lock();
+    ret.rxBuffered = _rxTail - _rxHead;
+    ret.txInFlight = _stx.seq - _stx.seqAcked;
+    _lockStx.unlock();
+    return ret;
+}
 
 void TCP::send_RST(USBDevice *dev, tcphdr *hdr){
     tcphdr tcp_header{};
@@ -13,11 +13,16 @@
 #include <stdint.h>
 #include <Manager/DeviceManager/USBDeviceManager.hpp>
 #include <netinet/tcp.h>
+#include <sys/uio.h>
 #include <Devices/USBDevice.hpp>
 #include <Event.hpp>
+#include <Reaper.hpp>
+#include <Stats.hpp>
+#include <Client.hpp>
+#include <mutex>
+#include <vector>
 
-class Client;
-class TCP : Manager {
+class TCP : Manager, public Reapable, public Client::connection {
     enum mux_conn_state {
         CONN_CONNECTING,    // SYN
         CONN_CONNECTED,        // SYN/SYNACK/ACK -> active
@@ -25,29 +30,81 @@ class TCP : Manager {
         CONN_DYING            // RST received
     } _connState;
     struct TCPSenderState {
-        uint32_t seq, seqAcked, ack, acked, inWin, win;//131072
+        //send ring (sequence numbers, _payloadBuf offset is seq % bufsize)
+        uint32_t seqAcked;  //acked: oldest byte not yet acknowledged by the device
+        uint32_t seq;       //head: next byte to be sent to the device
+        uint32_t tail;      //end of data read from the client
+        uint32_t ack, acked, inWin;
+        uint32_t win;           //free space in our receive ring
+        uint32_t winAdvertised; //window we last told the device about
+        //retransmission
+        uint32_t rto;       //current retransmission timeout in ms
+        uint32_t retries;
     } _stx;
 
-    Client *_cli; //unmanaged
-    USBDevice* _device; // lifetime of this object is NOT managed by this class!
+    Client *_cli; //unmanaged, needs _lockConn. Only set while the client waits for the connect to finish
+    USBDevice* _device; //retained in the constructor, released in the destructor
     char *_payloadBuf;
+    char *_rxBuf; //data received from the device, waiting to be written to the client
+    uint32_t _rxHead; //needs _lockStx
+    uint32_t _rxTail; //needs _lockStx
     std::atomic_bool _killInProcess;
     std::atomic_bool _didConnect;
-    std::atomic_uint32_t _refCnt;
+    std::atomic_bool _clientPaused; //we stopped reading from client, because the device's window is full
+    std::atomic_bool _rxReady; //client socket belongs to us, data may be written to it
+    std::atomic_bool _rxPending; //client socket is full, waiting for POLLOUT
+    std::atomic_bool _rxFlushRequested;
+    std::atomic_bool _rxDeferred; //buffered input gets written once the current rx_batch ends
+    std::mutex _lockRxFlush; //serializes writing to the client
+    std::mutex _lockEvents; //serializes updating the events we are waiting for
+    std::mutex _lockConn; //protects _connState and _cli
     std::mutex _lockStx;
-    Event _lockCanSend; //puts threads to sleep if we can't send data
+    std::mutex _lockSend; //serializes sending segments to the device, so they leave in order
+    std::atomic_bool _flushRequested;
     uint16_t _sPort; //unmanaged
     uint16_t _dPort;
-    struct pollfd *_pfds;  //socket lifetime IS managed by this class
+    int _fd;  //socket lifetime IS managed by this class
 
-    virtual void loopEvent() override;
+    //statistics, see tcp_stats
+    struct{
+        std::atomic<uint64_t> bytesIn, bytesOut;
+        std::atomic<uint64_t> segmentsIn, segmentsOut, segmentsDropped, retransmits;
+        std::atomic<uint64_t> windowStalls, windowStallUsec, clientStalls, clientWrites;
+    } _counters;
+    std::chrono::steady_clock::time_point _stallStart; //set before _clientPaused
+
+    void setConnState(mux_conn_state state) noexcept;
+    virtual void fdEvent(int fd, uint32_t revents) override;
+    uint32_t sendableBytes() noexcept; //needs _lockStx
+    uint32_t ringFree() noexcept; //needs _lockStx
+    uint32_t rxFree() noexcept; //needs _lockStx
+    void updateFdEvents() noexcept;
+    void stall_end() noexcept; //call after clearing _clientPaused
     void send_tcp(std::uint8_t flags);
-    void send_ack();
+    void send_ack(bool windowUpdate = false);
+    void flush_rx();
+    void rx_append(const struct iovec *payload, int payloadCnt, uint32_t skip) noexcept; //needs _lockStx, caller made sure it fits
+    int rx_iov(struct iovec iov[2]) noexcept; //needs _lockStx, describes the buffered input (wraps at most once)
 
-    void send_data(void *buf, size_t len);
+    void send_data(uint32_t seq, const void *buf, size_t len);
+    void flush_send();
+    void retransmit();
 
     ~TCP();
 public:
+    /*
+     While one exists on a thread, small segments handed to handle_input() on that thread are only buffered.
+     They get written once it goes out of scope, so a burst of segments reaches the client with a single write.
+     */
+    class rx_batch{
+        std::vector<TCP*> _deferred; //retained
+    public:
+        rx_batch() noexcept;
+        rx_batch(const rx_batch &) = delete;
+        ~rx_batch();
+        bool defer(TCP *conn); //false if conn is already dying and wasn't deferred
+    };
+
     static constexpr int bufsize = 0x20000;
     static constexpr int TCP_MTU = (USB_MTU-sizeof(tcphdr)-sizeof(USBDevice::mux_header))&0xff00;
 
@@ -55,14 +112,14 @@ public:
     TCP(const TCP &) = delete;
     TCP(TCP &&o) = delete;
 
-    void connect();
-    void handle_input(tcphdr* tcp_header, uint8_t* payload, uint32_t payload_len);
-
-    void retain() noexcept {++_refCnt;};
-    void release() noexcept {--_refCnt;};
-
+    void connect(); //sends SYN, the client finishes the connect on its loop thread
+    virtual status connectStatus() noexcept override;
+    virtual void takeover(int fd) override;
+    virtual void abortConnect() noexcept override;
+    void handle_input(tcphdr* tcp_header, const struct iovec *payload, int payloadCnt, uint32_t payload_len); //payload is only referenced during the call
 
-    void kill() noexcept;
+    void kill() noexcept; //drops the initial reference
+    tcp_stats getStats() noexcept;
 
     static void send_RST(USBDevice *dev, tcphdr *hdr);
 };
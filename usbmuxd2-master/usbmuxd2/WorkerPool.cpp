@@ -0,0 +1,75 @@
+//
+//  WorkerPool.cpp
+//  usbmuxd2
+//
+//  Created by tihmstar on 21.11.20.
+//  Copyright © 2020 tihmstar. All rights reserved.
+//
+
+#include "WorkerPool.hpp"
+#include <log.h>
+#include <libgeneral/macros.h>
+
+WorkerPool::WorkerPool(unsigned maxThreads)
+: _maxThreads(maxThreads ? maxThreads : 1), _idle(0), _stop(false)
+{
+    //
+}
+
+WorkerPool::~WorkerPool(){
+    stop();
+}
+
+void WorkerPool::loop() noexcept{
+    std::unique_lock<std::mutex> ul(_lck);
+    while (true) {
+        if (_queue.empty()) {
+            if (_stop) break;
+            _idle++;
+            _cond.wait(ul);
+            _idle--;
+            continue;
+        }
+        std::function<void()> job = std::move(_queue.front());
+        _queue.pop_front();
+        ul.unlock();
+        try {
+            job();
+        } catch (tihmstar::exception &e) {
+            error("[WorkerPool] job failed with error=%s code=%d",e.what(),e.code());
+        } catch (std::exception &e) {
+            error("[WorkerPool] job failed with exception=%s",e.what());
+        } catch (...) {
+            error("[WorkerPool] job failed with an unknown exception");
+        }
+        job = nullptr; //destroy captures outside of the lock
+        ul.lock();
+    }
+}
+
+void WorkerPool::submit(std::function<void()> job){
+    std::unique_lock<std::mutex> ul(_lck);
+    retassure(!_stop, "WorkerPool is stopped");
+    _queue.push_back(std::move(job));
+    if (_idle < _queue.size() && _threads.size() < _maxThreads) {
+        //not enough idle workers to pick this up right away
+        _threads.push_back(new std::thread([this]{
+            loop();
+        }));
+    }
+    _cond.notify_one();
+}
+
+void WorkerPool::stop() noexcept{
+    std::vector<std::thread *> threads;
+    {
+        std::unique_lock<std::mutex> ul(_lck);
+        _stop = true;
+        _cond.notify_all();
+        threads.swap(_threads);
+    }
+    for (auto t : threads) {
+        t->join();
+        delete t;
+    }
+}
@@ -0,0 +1,44 @@
+//
+//  WorkerPool.hpp
+//  usbmuxd2
+//
+//  Created by tihmstar on 21.11.20.
+//  Copyright © 2020 tihmstar. All rights reserved.
+//
+
+#ifndef WorkerPool_hpp
+#define WorkerPool_hpp
+
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <deque>
+#include <vector>
+#include <functional>
+
+/*
+ Bounded set of threads running jobs in the order they were queued.
+ Threads are spawned on demand (up to maxThreads) and stay around until stop() is called.
+ Jobs may block, but should not wait on other jobs of the same pool.
+ */
+class WorkerPool{
+    std::mutex _lck;
+    std::condition_variable _cond;
+    std::deque<std::function<void()>> _queue;
+    std::vector<std::thread *> _threads;
+    unsigned _maxThreads;
+    unsigned _idle;
+    bool _stop;
+
+    void loop() noexcept;
+public:
+    WorkerPool(unsigned maxThreads);
+    WorkerPool(const WorkerPool &) = delete; //delete copy constructor
+    WorkerPool(WorkerPool &&o) = delete; //move constructor
+    ~WorkerPool();
+
+    void submit(std::function<void()> job); //throws once the pool is stopped
+    void stop() noexcept; //runs all queued jobs, then joins the threads. Must not be called from a job
+};
+
+#endif /* WorkerPool_hpp */
@@ -24,6 +24,9 @@ class lck_contrainer{
     Event _leaveEvent;
     Event _notifyEvent;
 
+    template <typename _cond>
+    static inline void waitFor(Event &ev, _cond cond); //sequence is taken before checking, so a notify in between isn't lost
+
 public:
     _container _elems;
 
@@ -51,19 +54,27 @@ lck_contrainer<_container>::lck_contrainer()
 
 template <class _container>
 lck_contrainer<_container>::~lck_contrainer(){
-    while (_members) {
-        _enterEvent.wait();
-    }
+    waitFor(_enterEvent, [this]{return !_members;});
 }
 
 
+template <class _container>
+template <typename _cond>
+void lck_contrainer<_container>::waitFor(Event &ev, _cond cond){
+    while (true) {
+        uint32_t seq = ev.sequence();
+        if (cond()) break;
+        ev.wait(seq);
+    }
+}
+
 template <class _container>
 void lck_contrainer<_container>::addMember(){
     while (true){
         if (_members.fetch_add(1) >= lck_contrainer::maxMembers){
             _members.fetch_sub(1);
-            while (_members>=lck_contrainer::maxMembers)
-                _enterEvent.wait();
+            _leaveEvent.notifyAll(); //a writer might have seen our attempt
+            waitFor(_enterEvent, [this]{return _members < lck_contrainer::maxMembers;});
         }else{
             break;
         }
@@ -72,10 +83,12 @@ void lck_contrainer<_container>::addMember(){
 
 template <class _container>
 void lck_contrainer<_container>::delMember(){
-    _members.fetch_sub(1);
-    _enterEvent.notifyAll();
-    _leaveEvent.notifyAll();
-    _notifyEvent.notifyAll();
+    uint32_t prev = _members.fetch_sub(1);
+    if (prev > lck_contrainer::maxMembers)
+        _leaveEvent.notifyAll(); //a writer is waiting for readers to leave
+    if (prev == 1)
+        _enterEvent.notifyAll(); //destructor waits for the container to be unused
+    _notifyEvent.notifyAll(); //a no-op unless someone is in notifyBlock()
 }
 
 template <class _container>
@@ -83,11 +96,11 @@ void lck_contrainer<_container>::lockMember(){
     while (true){
         if (_members.fetch_add(lck_contrainer::maxMembers) >= lck_contrainer::maxMembers){
             _members.fetch_sub(lck_contrainer::maxMembers);
-            while (_members>=lck_contrainer::maxMembers)
-                _enterEvent.wait();
+            _enterEvent.notifyAll(); //others might have seen our attempt
+            _leaveEvent.notifyAll();
+            waitFor(_enterEvent, [this]{return _members < lck_contrainer::maxMembers;});
         }else{
-            while (_members > lck_contrainer::maxMembers)
-                _leaveEvent.wait(); //wait until all members are gone
+            waitFor(_leaveEvent, [this]{return _members <= lck_contrainer::maxMembers;}); //wait until all members are gone
             break;
         }
     }
@@ -98,9 +111,7 @@ template <class _container>
 void lck_contrainer<_container>::unlockMember(){
     _members.fetch_sub(lck_contrainer::maxMembers);
     _enterEvent.notifyAll();
-    _leaveEvent.notifyAll();
     _notifyEvent.notifyAll();
-
 }
 
 template <class _container>
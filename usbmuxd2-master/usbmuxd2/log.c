@@ -12,19 +12,66 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
 #include <sys/time.h>
 #include <time.h>
+#include <errno.h>
 #include <syslog.h>
 
+/*
+ Logging only formats the message on the calling thread and copies it into a ring buffer owned by that thread.
+ A single drainer thread merges all rings in timestamp order and does the actual (blocking) output.
+ Ordering is per drain pass, a message committed while a pass is running may show up slightly late (same as with the old mutex).
+ Fatal messages and threads which can't get a ring are written synchronously.
+ */
+
+#define LOG_RING_SIZE   0x10000 //per thread, power of 2
+#define LOG_MSG_MAX     1024    //longer messages get truncated
+#define LOG_DRAIN_MS    20      //drainer wakes up at least this often
+#define LOG_ALIGN(x)    (((x)+7) & ~7u)
+
+struct log_record{
+    uint32_t size;      //whole record including header, 0 means the rest of the ring is unused and the next record starts at 0
+    uint32_t level;
+    struct timespec ts;
+    char msg[];         //NUL terminated
+};
+
+struct log_ring{
+    struct log_ring *next;  //needs gRingsLck
+    _Atomic uint32_t head;  //written by the owning thread
+    _Atomic uint32_t tail;  //written by the drainer
+    _Atomic uint64_t dropped;
+    atomic_bool orphaned;   //owning thread exited, free once drained
+    char buf[LOG_RING_SIZE];
+};
+
 static int log_syslog = 0;
 
 #ifdef DEBUG
-enum loglevel log_level = LL_DEBUG;
+unsigned int log_level = LL_DEBUG;
 #else
-enum loglevel log_level = LL_INFO;
+unsigned int log_level = LL_INFO;
 #endif
 
+static pthread_mutex_t gRingsLck = PTHREAD_MUTEX_INITIALIZER; //protects gRings and serializes output
+static pthread_cond_t gDrainCond = PTHREAD_COND_INITIALIZER;
+static struct log_ring *gRings = NULL;
+static _Atomic uint64_t gDropped = 0;
+static atomic_bool gDrainerRunning = 0;
+static atomic_bool gDrainerFailed = 0;
+static pthread_key_t gRingKey;
+static pthread_once_t gRingKeyOnce = PTHREAD_ONCE_INIT;
+static _Thread_local struct log_ring *tRing = NULL;
+
+//timestamp cache, only used with gRingsLck held
+static time_t gCachedSec = -1;
+static char gCachedTime[16];
+
 void log_enable_syslog(){
+    log_flush(); //earlier messages keep going to stdout
     if (!log_syslog) {
         openlog("usbmuxd", LOG_PID, 0);
         log_syslog = 1;
@@ -32,6 +79,7 @@ void log_enable_syslog(){
 }
 
 void log_disable_syslog(){
+    log_flush();
     if (log_syslog) {
         closelog();
         log_syslog = 0;
@@ -46,39 +94,270 @@ static int level_to_syslog_level(int level){
     return result;
 }
 
+//needs gRingsLck (or otherwise exclusive access to the output)
+static void log_output(uint32_t level, const struct timespec *ts, const char *msg){
+    if (log_syslog) {
+        syslog(level_to_syslog_level(level), "[%d] %s", level, msg);
+        return;
+    }
+    if (ts->tv_sec != gCachedSec) {
+        struct tm tm = {};
+        localtime_r(&ts->tv_sec, &tm);
+        strftime(gCachedTime, sizeof(gCachedTime), "%H:%M:%S", &tm);
+        gCachedSec = ts->tv_sec;
+    }
+    fprintf((level > LL_WARNING) ? stdout : stderr, "[%s.%03d][%d] %s\n", gCachedTime, (int)(ts->tv_nsec / 1000000), level, msg);
+}
+
+static struct log_record *ring_peek(struct log_ring *ring, uint32_t head){
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    while (tail != head) {
+        uint32_t pos = tail & (LOG_RING_SIZE-1);
+        struct log_record *rec = (struct log_record *)&ring->buf[pos];
+        if (rec->size) return rec;
+        tail += LOG_RING_SIZE - pos; //skip the unused end
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    }
+    return NULL;
+}
+
+static int ts_before(const struct timespec *a, const struct timespec *b){
+    return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/*
+ Writes everything which was logged before the call, oldest first. Needs gRingsLck.
+ */
+static void drain_rings(void){
+    struct timespec now = {};
+    struct log_ring **pring = NULL;
+    uint32_t heads[64];
+    struct log_ring *rings[64];
+    int cnt = 0;
+
+    //heads are snapshotted, so a busy thread can't keep us here forever
+    for (struct log_ring *ring = gRings; ring; ring = ring->next) {
+        uint64_t dropped = atomic_exchange(&ring->dropped, 0);
+        if (dropped) {
+            clock_gettime(CLOCK_REALTIME, &now);
+            char msg[64];
+            snprintf(msg, sizeof(msg), "[log] %llu messages dropped, buffer was full", (unsigned long long)dropped);
+            log_output(LL_WARNING, &now, msg);
+        }
+        if (cnt == sizeof(rings)/sizeof(*rings)) {
+            //more threads than we merge at once, the rest gets written unmerged
+            uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+            struct log_record *rec = NULL;
+            while ((rec = ring_peek(ring, head))) {
+                log_output(rec->level, &rec->ts, rec->msg);
+                atomic_store_explicit(&ring->tail, atomic_load_explicit(&ring->tail, memory_order_relaxed) + rec->size, memory_order_release);
+            }
+            continue;
+        }
+        rings[cnt] = ring;
+        heads[cnt++] = atomic_load_explicit(&ring->head, memory_order_acquire);
+    }
+
+    while (1) {
+        struct log_record *oldest = NULL;
+        int oldestIdx = -1;
+        for (int i=0; i<cnt; i++) {
+            struct log_record *rec = ring_peek(rings[i], heads[i]);
+            if (rec && (!oldest || ts_before(&rec->ts, &oldest->ts))) {
+                oldest = rec;
+                oldestIdx = i;
+            }
+        }
+        if (!oldest) break;
+        log_output(oldest->level, &oldest->ts, oldest->msg);
+        atomic_store_explicit(&rings[oldestIdx]->tail, atomic_load_explicit(&rings[oldestIdx]->tail, memory_order_relaxed) + oldest->size, memory_order_release);
+    }
+    if (!log_syslog) {
+        fflush(stdout);
+        fflush(stderr);
+    }
+
+    //free rings of threads which are gone
+    pring = &gRings;
+    while (*pring) {
+        struct log_ring *ring = *pring;
+        if (atomic_load(&ring->orphaned) && atomic_load(&ring->tail) == atomic_load(&ring->head)) {
+            *pring = ring->next;
+            free(ring);
+        } else {
+            pring = &ring->next;
+        }
+    }
+}
+
+static void *drainer_loop(void *arg){
+    pthread_mutex_lock(&gRingsLck);
+    while (1) {
+        struct timespec deadline = {};
+        drain_rings();
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += LOG_DRAIN_MS * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&gDrainCond, &gRingsLck, &deadline);
+    }
+    return NULL;
+}
+
+static void ring_orphan(void *arg){
+    struct log_ring *ring = (struct log_ring *)arg;
+    tRing = NULL; //runs on the exiting thread, which gets a new ring should it log again
+    atomic_store(&ring->orphaned, 1);
+}
+
+//the child only has the forking thread, its rings are gone as well as the drainer
+static void log_atfork_prepare(void){
+    pthread_mutex_lock(&gRingsLck);
+    drain_rings(); //don't let both processes write the same messages
+}
+
+static void log_atfork_parent(void){
+    pthread_mutex_unlock(&gRingsLck);
+}
+
+static void log_atfork_child(void){
+    for (struct log_ring *ring = gRings; ring; ring = ring->next) {
+        if (ring != tRing) atomic_store(&ring->orphaned, 1);
+    }
+    atomic_store(&gDrainerRunning, 0);
+    pthread_mutex_unlock(&gRingsLck);
+}
+
+static void ring_key_init(void){
+    pthread_key_create(&gRingKey, ring_orphan);
+    pthread_atfork(log_atfork_prepare, log_atfork_parent, log_atfork_child);
+    atexit(log_flush);
+}
+
+static int drainer_start(void){
+    pthread_t thread;
+    int ret = 0;
+    if (atomic_load(&gDrainerRunning)) return 0;
+    if (atomic_load(&gDrainerFailed)) return -1;
+    pthread_mutex_lock(&gRingsLck);
+    if (!atomic_load(&gDrainerRunning)) {
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if ((ret = pthread_create(&thread, &attr, drainer_loop, NULL))) {
+            atomic_store(&gDrainerFailed, 1);
+        } else {
+            atomic_store(&gDrainerRunning, 1);
+        }
+        pthread_attr_destroy(&attr);
+    }
+    pthread_mutex_unlock(&gRingsLck);
+    return ret ? -1 : 0;
+}
+
+static struct log_ring *ring_get(void){
+    struct log_ring *ring = NULL;
+    if (!atomic_load_explicit(&gDrainerRunning, memory_order_relaxed)) {
+        //first message, or first one after fork()
+        pthread_once(&gRingKeyOnce, ring_key_init);
+        if (drainer_start()) return NULL;
+    }
+    if ((ring = tRing)) return ring;
+
+    if (!(ring = (struct log_ring *)calloc(1, sizeof(struct log_ring)))) return NULL;
+    pthread_setspecific(gRingKey, ring);
+
+    pthread_mutex_lock(&gRingsLck);
+    ring->next = gRings;
+    gRings = ring;
+    pthread_mutex_unlock(&gRingsLck);
+    return tRing = ring;
+}
+
+/*
+ Single producer: only the owning thread calls this. Returns 0 if the ring is full.
+ */
+static int ring_put(struct log_ring *ring, uint32_t level, const struct timespec *ts, const char *msg, uint32_t len){
+    uint32_t need = LOG_ALIGN((uint32_t)sizeof(struct log_record) + len + 1);
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    uint32_t pos = head & (LOG_RING_SIZE-1);
+    uint32_t contiguous = LOG_RING_SIZE - pos;
+    uint32_t avail = LOG_RING_SIZE - (head - tail);
+    struct log_record *rec = NULL;
+
+    if (contiguous < need) {
+        //records don't wrap around, leave the end unused
+        if (avail < contiguous + need) return 0;
+        ((struct log_record *)&ring->buf[pos])->size = 0;
+        head += contiguous;
+        pos = 0;
+    } else if (avail < need) {
+        return 0;
+    }
+
+    rec = (struct log_record *)&ring->buf[pos];
+    rec->size = need;
+    rec->level = level;
+    rec->ts = *ts;
+    memcpy(rec->msg, msg, len);
+    rec->msg[len] = '\0';
+    atomic_store_explicit(&ring->head, head + need, memory_order_release);
+
+    if (head + need - tail > LOG_RING_SIZE/2) {
+        pthread_cond_signal(&gDrainCond); //don't wait for the timer, we're filling up
+    }
+    return 1;
+}
+
+void log_flush(void){
+    pthread_mutex_lock(&gRingsLck);
+    drain_rings();
+    pthread_mutex_unlock(&gRingsLck);
+}
+
+unsigned long long log_dropped(void){
+    return atomic_load(&gDropped);
+}
+
 void usbmuxd_log(enum loglevel level, const char *fmt, ...){
     int err = 0;
     va_list ap;
-    char *fs = NULL;
-
+    struct timespec ts = {};
+    struct log_ring *ring = NULL;
+    char msg[LOG_MSG_MAX];
+    int len = 0;
 
     //don't log if below log level. Note: this is not an error
     cassure(level <= log_level);
 
-    cassure(fs = malloc(20 + strlen(fmt)));
-
+    clock_gettime(CLOCK_REALTIME, &ts);
+    va_start(ap, fmt);
+    len = vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+    cassure(len >= 0);
+    if (len >= (int)sizeof(msg)) len = (int)sizeof(msg)-1;
 
-    if(log_syslog) {
-        sprintf(fs, "[%d] %s\n", level, fmt);
-    } else {
-        struct timeval ts = {};
-        struct tm *tp = NULL;
-        gettimeofday(&ts, NULL);
-        tp = localtime(&ts.tv_sec);
-        strftime(fs, 10, "[%H:%M:%S", tp);
-        sprintf(fs+9, ".%03d][%d] %s\n", (int)(ts.tv_usec / 1000), level, fmt);
+    if (level != LL_FATAL && (ring = ring_get())) {
+        if (!ring_put(ring, level, &ts, msg, (uint32_t)len)) {
+            atomic_fetch_add(&ring->dropped, 1);
+            atomic_fetch_add(&gDropped, 1);
+        }
+        return;
     }
 
-    va_start(ap, fmt);
-    if (log_syslog) {
-        vsyslog(level_to_syslog_level(level), fs, ap);
-    }else{
-        vfprintf((level > LL_WARNING) ? stdout : stderr, fs,ap);
+    //fatal messages often precede exiting, so they (and everything before them) are written right away
+    pthread_mutex_lock(&gRingsLck);
+    drain_rings();
+    log_output(level, &ts, msg);
+    if (!log_syslog) {
+        fflush(stdout);
+        fflush(stderr);
     }
-    va_end(ap);
-
+    pthread_mutex_unlock(&gRingsLck);
 
 error:
-    safeFree(fs);
     return;
 }
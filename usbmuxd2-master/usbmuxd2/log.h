@@ -16,17 +16,26 @@ extern "C"{
     
 #include <stdio.h>
     
-#define notice(a ...) usbmuxd_log(LL_NOTICE,a)
-#define info(a ...) usbmuxd_log(LL_INFO,a)
-#define warning(a ...) usbmuxd_log(LL_WARNING,a)
-#define error(a ...) usbmuxd_log(LL_ERROR,a)
-#define fatal(a ...) usbmuxd_log(LL_FATAL,a)
-    
-#ifdef DEBUG
-#   define debug(a ...) usbmuxd_log(LL_DEBUG,a)
-#else
-#   define debug(a ...)
+/*
+ Call sites above LOG_MAX_LEVEL are removed at compile time, the others are skipped
+ without evaluating their arguments if log_level filters them at runtime.
+ */
+#ifndef LOG_MAX_LEVEL
+#   ifdef DEBUG
+#       define LOG_MAX_LEVEL LL_DEBUG
+#   else
+#       define LOG_MAX_LEVEL LL_NOTICE
+#   endif
 #endif
+
+#define usbmuxd_log_at(level, a ...) ({if ((level) <= LOG_MAX_LEVEL && (level) <= log_level) usbmuxd_log(level,a);})
+
+#define notice(a ...) usbmuxd_log_at(LL_NOTICE,a)
+#define info(a ...) usbmuxd_log_at(LL_INFO,a)
+#define warning(a ...) usbmuxd_log_at(LL_WARNING,a)
+#define error(a ...) usbmuxd_log_at(LL_ERROR,a)
+#define fatal(a ...) usbmuxd_log_at(LL_FATAL,a)
+#define debug(a ...) usbmuxd_log_at(LL_DEBUG,a)
     
     enum loglevel {
         LL_FATAL = 0,
@@ -41,6 +50,8 @@ extern "C"{
     
     void log_enable_syslog(void);
     void log_disable_syslog(void);
+    void log_flush(void); //blocks until everything logged so far was written
+    unsigned long long log_dropped(void); //messages lost, because a thread's buffer was full
     
     void usbmuxd_log(enum loglevel level, const char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
     
@@ -9,6 +9,9 @@
 #include <iostream>
 #include <libgeneral/macros.h>
 #include "Muxer.hpp"
+#include <Manager/Reactor.hpp>
+#include <Devices/USBDevice.hpp>
+#include <Client.hpp>
 #include <future>
 #include <signal.h>
 #include <pthread.h>
@@ -176,6 +179,14 @@ static void usage(){
     printf("  -X, --force-exit\tNotify a running instance to exit even if there are still\n");
     printf("                  \tdevices connected (always works) and exit.\n");
     printf("  -l, --logfile=LOGFILE\tLog (append) to LOGFILE instead of stderr or syslog.\n");
+    printf("  -t, --threads=NUM\tNumber of event loop threads (default: one per CPU core).\n");
+    printf("      --client-queue=KB\tMax unsent data per client before it gets disconnected (default: 1024).\n");
+    printf("      --bringup-workers=NUM\tNumber of devices brought up in parallel (default: 8).\n");
+    printf("      --rx-transfers=MAX\tMax in flight USB reads per device (default: based on link speed).\n");
+    printf("      --simulate-devices=NUM\tAdd NUM synthetic devices offering echo (7), sink (9) and source (19) services.\n");
+    printf("      --stats-socket=PATH\tServe runtime statistics in Prometheus text format on the unix socket PATH.\n");
+    printf("      --capture=FILE\tWrite all packets exchanged with USB devices to the pcapng file FILE.\n");
+    printf("      --capture-snaplen=BYTES\tOnly capture the first BYTES of each packet (default: whole packets).\n");
     printf("      --nowifi\t do not start WIFIDeviceManager\n");
     printf("      --nousb\t do not start USBDeviceManager\n");
     printf("      --debug\t enable debug logging\n");
@@ -198,17 +209,25 @@ static void parse_opts(int argc, const char **argv){
         {"force-exit", no_argument, NULL, 'X'},
         {"logfile", required_argument, NULL, 'l'},
         {"user", required_argument, NULL, 'U'},
+        {"threads", required_argument, NULL, 't'},
         {"nowifi", optional_argument, NULL, '0'},
         {"nousb", optional_argument, NULL, '1'},
         {"debug", no_argument, NULL, 2},
+        {"client-queue", required_argument, NULL, 4},
+        {"bringup-workers", required_argument, NULL, 5},
+        {"rx-transfers", required_argument, NULL, 6},
+        {"simulate-devices", required_argument, NULL, 7},
+        {"stats-socket", required_argument, NULL, 8},
+        {"capture", required_argument, NULL, 9},
+        {"capture-snaplen", required_argument, NULL, 10},
         {NULL, 0, NULL, 0}
     };
     int c;
 
 #ifdef WANT_SYSTEMD
-    const char* opts_spec = "hvVdzsxXl:U:";
+    const char* opts_spec = "hvVdzsxXl:U:t:";
 #else
-    const char* opts_spec = "hvVdzxXl:U:";
+    const char* opts_spec = "hvVdzxXl:U:t:";
 #endif
     
     while (1) {
@@ -233,6 +252,13 @@ static void parse_opts(int argc, const char **argv){
         case 'U':
             gConfig->dropUser = optarg;
             break;
+        case 't':
+            gConfig->reactorThreads = atoi(optarg);
+            if (gConfig->reactorThreads < 0) {
+                fatal("ERROR: --threads requires a non-negative number");
+                exit(2);
+            }
+            break;
 #ifdef WANT_SYSTEMD
         case 's':
             gConfig->enableExit = true;
@@ -275,6 +301,47 @@ static void parse_opts(int argc, const char **argv){
         case 2: //debug
                 gConfig->debugLevel++;
                 break;
+        case 4: //client-queue
+            gConfig->clientQueueKB = atoi(optarg);
+            if (gConfig->clientQueueKB <= 0) {
+                fatal("ERROR: --client-queue requires a positive number");
+                exit(2);
+            }
+            break;
+        case 5: //bringup-workers
+            gConfig->bringupWorkers = atoi(optarg);
+            if (gConfig->bringupWorkers <= 0) {
+                fatal("ERROR: --bringup-workers requires a positive number");
+                exit(2);
+            }
+            break;
+        case 6: //rx-transfers
+            gConfig->rxMaxTransfers = atoi(optarg);
+            if (gConfig->rxMaxTransfers <= 0) {
+                fatal("ERROR: --rx-transfers requires a positive number");
+                exit(2);
+            }
+            break;
+        case 7: //simulate-devices
+            gConfig->simulateDevices = atoi(optarg);
+            if (gConfig->simulateDevices <= 0 || gConfig->simulateDevices > 255) {
+                fatal("ERROR: --simulate-devices requires a number between 1 and 255");
+                exit(2);
+            }
+            break;
+        case 8: //stats-socket
+            gConfig->statsSocket = optarg;
+            break;
+        case 9: //capture
+            gConfig->captureFile = optarg;
+            break;
+        case 10: //capture-snaplen
+            gConfig->captureSnaplen = atoi(optarg);
+            if (gConfig->captureSnaplen <= 0) {
+                fatal("ERROR: --capture-snaplen requires a positive number");
+                exit(2);
+            }
+            break;
         default:
             usage();
             exit(2);
@@ -376,7 +443,11 @@ int main(int argc, const char * argv[]) {
         cretassure(write(lfd, pids, strlen(pids)) == strlen(pids), "Could not write pidfile!");
     }
 
-    //starting    
+    //starting
+    Reactor::setDefaultThreads(gConfig->reactorThreads);
+    Client::setOutQueueLimit((size_t)gConfig->clientQueueKB * 1024);
+    Muxer::setBringupWorkers(gConfig->bringupWorkers);
+    USBDevice::setRXMaxTransfers(gConfig->rxMaxTransfers);
     mux = new Muxer();
 
     if (!(mux->_doPreflight = gConfig->doPreflight)){
@@ -392,6 +463,16 @@ int main(int argc, const char * argv[]) {
         fatal("Terminating since a ClientManager is require to operate");
         cassure(0);
     }
+
+    if (gConfig->captureFile.size()){
+        //before dropping privileges and before any device shows up
+        try{
+            mux->spawnCaptureManager(gConfig->captureFile.c_str(), gConfig->captureSnaplen);
+            info("Inited CaptureManager writing to %s",gConfig->captureFile.c_str());
+        }catch (tihmstar::exception &e){
+            error("failed to spawnCaptureManager with error=%d (%s)",e.code(),e.what());
+        }
+    }
     
 
     // drop elevated privileges
@@ -440,6 +521,24 @@ int main(int argc, const char * argv[]) {
         }
     }
     
+    if (gConfig->simulateDevices){
+        try{
+            mux->spawnSimDeviceManager(gConfig->simulateDevices);
+            info("Inited SimDeviceManager");
+        }catch (tihmstar::exception &e){
+            fatal("failed to spawnSimDeviceManager with error=%d (%s)",e.code(),e.what());
+        }
+    }
+
+    if (gConfig->statsSocket.size()){
+        try{
+            mux->spawnStatsManager(gConfig->statsSocket.c_str());
+            info("Inited StatsManager on %s",gConfig->statsSocket.c_str());
+        }catch (tihmstar::exception &e){
+            error("failed to spawnStatsManager with error=%d (%s)",e.code(),e.what());
+        }
+    }
+
     if (!mux->hasDeviceManager()){
         fatal("failed to spawn any DeviceManager");
         fatal("Terminating since at least one DeviceManager is require to operate");
@@ -478,6 +577,7 @@ error:
     if (mux){
         delete mux;
     }
+    sysconf_flush_device_records(); //don't lose pair records which weren't written yet
     if (gConfig){
         Config *cfg = gConfig; gConfig = nullptr;
         delete cfg;
@@ -0,0 +1,164 @@
+//
+//  rcu_container.h
+//  usbmuxd2
+//
+//  Created by tihmstar on 03.11.20.
+//  Copyright © 2020 tihmstar. All rights reserved.
+//
+
+#ifndef rcu_container_h
+#define rcu_container_h
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <chrono>
+
+/*
+ Read-mostly container.
+ Readers get a consistent snapshot without taking any locks (an atomic increment on enter and a decrement on leave).
+ Writers modify a private copy, publish it and then wait for all readers of the old snapshot to leave (epoch based reclamation).
+ Once update() returned, elements removed by it are not referenced by any reader anymore.
+
+ Don't call update() or synchronize() while holding a snapshot of the same container, that would wait for ourself.
+ */
+
+template <class _container>
+class rcu_container{
+    std::atomic<const _container *> _cur;
+    std::atomic<uint32_t> _epoch;
+    std::atomic<uint32_t> _readers[2];
+    std::mutex _writeLck;
+
+    inline uint32_t readLock() noexcept;
+    inline void readUnlock(uint32_t epoch) noexcept;
+    inline void waitReaders() noexcept; //needs _writeLck
+
+public:
+    class snapshot{
+        rcu_container *_parent;
+        const _container *_elems;
+        uint32_t _epoch;
+    public:
+        snapshot(rcu_container *parent) noexcept;
+        snapshot(const snapshot &) = delete; //delete copy constructor
+        snapshot(snapshot &&o) noexcept; //move constructor
+        ~snapshot();
+
+        const _container &operator*() const noexcept {return *_elems;}
+        const _container *operator->() const noexcept {return _elems;}
+    };
+
+    inline rcu_container();
+    inline ~rcu_container();
+
+    inline snapshot read() noexcept;
+
+    //modify(_container &elems) operates on a copy which is published afterwards
+    template <typename F>
+    inline void update(F modify);
+
+    //block until all readers which entered before this call left
+    inline void synchronize() noexcept;
+};
+
+#pragma mark snapshot
+
+template <class _container>
+rcu_container<_container>::snapshot::snapshot(rcu_container *parent) noexcept
+: _parent(parent), _elems(nullptr), _epoch(0)
+{
+    _epoch = _parent->readLock();
+    _elems = _parent->_cur.load();
+}
+
+template <class _container>
+rcu_container<_container>::snapshot::snapshot(snapshot &&o) noexcept
+: _parent(o._parent), _elems(o._elems), _epoch(o._epoch)
+{
+    o._parent = nullptr;
+    o._elems = nullptr;
+}
+
+template <class _container>
+rcu_container<_container>::snapshot::~snapshot(){
+    if (_parent) {
+        _parent->readUnlock(_epoch);
+    }
+}
+
+#pragma mark rcu_container
+
+template <class _container>
+rcu_container<_container>::rcu_container()
+: _cur(new _container()), _epoch(0), _readers{{0},{0}}
+{
+    //
+}
+
+template <class _container>
+rcu_container<_container>::~rcu_container(){
+    synchronize();
+    delete _cur.load();
+}
+
+template <class _container>
+uint32_t rcu_container<_container>::readLock() noexcept{
+    while (true) {
+        uint32_t epoch = _epoch.load();
+        _readers[epoch & 1].fetch_add(1);
+        if (_epoch.load() == epoch) {
+            return epoch;
+        }
+        //a writer flipped the epoch in between, retry so it won't miss us
+        _readers[epoch & 1].fetch_sub(1);
+    }
+}
+
+template <class _container>
+void rcu_container<_container>::readUnlock(uint32_t epoch) noexcept{
+    _readers[epoch & 1].fetch_sub(1);
+}
+
+template <class _container>
+void rcu_container<_container>::waitReaders() noexcept{
+    uint32_t epoch = _epoch.fetch_add(1);
+    //readers are short lived, so yield first and only sleep if someone holds a snapshot for longer
+    for (int i=0; _readers[epoch & 1].load(); i++) {
+        if (i < 100) {
+            std::this_thread::yield();
+        } else {
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+        }
+    }
+}
+
+template <class _container>
+typename rcu_container<_container>::snapshot rcu_container<_container>::read() noexcept{
+    return snapshot(this);
+}
+
+template <class _container>
+template <typename F>
+void rcu_container<_container>::update(F modify){
+    std::unique_lock<std::mutex> ul(_writeLck);
+    const _container *old = _cur.load();
+    _container *elems = new _container(*old);
+    try {
+        modify(*elems);
+    } catch (...) {
+        delete elems;
+        throw;
+    }
+    _cur.store(elems);
+    waitReaders();
+    delete old;
+}
+
+template <class _container>
+void rcu_container<_container>::synchronize() noexcept{
+    std::unique_lock<std::mutex> ul(_writeLck);
+    waitReaders();
+}
+
+#endif /* rcu_container_h */
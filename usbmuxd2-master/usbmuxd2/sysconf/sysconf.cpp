@@ -18,6 +18,16 @@
 #include <map>
 #include <plist/plist.h>
 #include <vector>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <memory>
+#include <chrono>
+#include <algorithm>
+
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif //HAVE_SYS_INOTIFY_H
 
 #ifdef HAVE_FILESYSTEM
 #include <filesystem>
@@ -31,6 +41,8 @@
 #define CONFIG_SYSTEM_BUID_KEY "SystemBUID"
 #define CONFIG_HOST_ID_KEY "HostID"
 
+#define RECORD_RETRY_MAX_SEC 64
+
 
 #ifdef __APPLE__
 #   define BASE_CONFIG_DIR "/var/db"
@@ -81,9 +93,37 @@ diriter std::filesystem::directory_iterator(std::string dirpath){
 
 
 
-static std::map<std::string,std::string> gKnownMacAddrs;
-
-static void sysconf_load_known_macaddrs();
+/*
+ Pair records are cached parsed in memory, keyed by udid, along with the serialized ReadPairRecord response.
+ The cache is invalidated by inotify, so without inotify only records which are waiting to be written are served from memory.
+ Saved records are written to disk by a background thread (write and fsync a temporary file, then rename over the record).
+ A record which fails to be written stays pending and is retried with backoff.
+ */
+struct cachedRecord{
+    plist_t record; //NULL remembers that there is no record
+    std::shared_ptr<const SerializedPlist> response; //ReadPairRecord response, built on first use
+};
+struct pendingRecord{
+    plist_t record;
+    std::shared_ptr<const SerializedPlist> response;
+    uint64_t seq;
+    uint32_t failures; //failed attempts to write this record
+    std::chrono::steady_clock::time_point retryAt; //don't try writing it before that
+};
+//never destroyed, the detached record threads may still use these while exiting
+static std::map<std::string,cachedRecord> &gRecordCache = *new std::map<std::string,cachedRecord>;
+static std::map<std::string,pendingRecord> &gPendingRecords = *new std::map<std::string,pendingRecord>; //saved, but not yet written to disk
+static std::map<std::string,std::string> &gKnownMacAddrs = *new std::map<std::string,std::string>;
+static bool gKnownMacAddrsValid = false;
+static bool gRecordCacheEnabled = false; //only if we get notified about changes
+static uint64_t gRecordGen = 0; //incremented on every invalidation
+static uint64_t gPendingSeq = 0;
+static std::mutex &gRecordsLck = *new std::mutex; //guards everything above
+static std::mutex &gRecordWriteLck = *new std::mutex; //held while a record file is written or removed
+static std::condition_variable &gRecordsCond = *new std::condition_variable;
+static std::once_flag gRecordThreadsOnce;
+
+static void sysconf_load_known_macaddrs(); //needs gRecordsLck
 
 
 constexpr const char *sysconf_get_config_dir(){
@@ -127,7 +167,7 @@ static void mkdir_with_parents(const char *dir, int mode){
 
 
 
-plist_t readPlist(const char *filePath){
+plist_t readPlist(const char *filePath, std::string *bplist){
     int fd = 0;
     struct stat finfo{};
     char *fbuf = NULL;
@@ -146,8 +186,11 @@ plist_t readPlist(const char *filePath){
     
     assure(read(fd, fbuf, finfo.st_size) == finfo.st_size);
     
-    if (memcmp(fbuf, "bplist00", 8) == 0) {
+    if (finfo.st_size >= 8 && memcmp(fbuf, "bplist00", 8) == 0) {
         plist_from_bin(fbuf, (uint32_t)finfo.st_size, &pl);
+        if (bplist) {
+            *bplist = std::string(fbuf,finfo.st_size);
+        }
     } else {
         plist_from_xml(fbuf, (uint32_t)finfo.st_size, &pl);
     }
@@ -157,16 +200,37 @@ plist_t readPlist(const char *filePath){
 
 void writePlistToFile(plist_t plist, const char *dst){
     char *buf = NULL;
-    FILE * saveFile = NULL;
+    int fd = -1;
     cleanup([&]{
         safeFree(buf);
-        safeFreeCustom(saveFile, fclose);
+        if (fd != -1) {
+            close(fd);
+        }
     });
     uint32_t bufLen = 0;
+    int err = 0;
     plist_to_xml(plist, &buf, &bufLen);
     
-    retassure(saveFile = fopen(dst, "w"), "Failed to write plist file to=%s",dst);
-    assure(fwrite(buf, 1, bufLen, saveFile) == bufLen);
+    retassure((fd = open(dst, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)) != -1, "Failed to write plist file to=%s: %s",dst,strerror(errno));
+    for (uint32_t didWrite = 0; didWrite < bufLen;) {
+        ssize_t cnt = write(fd, buf+didWrite, bufLen-didWrite);
+        if (cnt < 0 && errno == EINTR) continue;
+        retassure(cnt > 0, "Failed to write plist file to=%s: %s",dst,strerror(errno));
+        didWrite += cnt;
+    }
+    //callers rename this over a good file, so it needs to be complete on disk first
+    retassure(!fsync(fd), "Failed to sync plist file %s: %s",dst,strerror(errno));
+    err = close(fd); fd = -1;
+    retassure(!err, "Failed to close plist file %s: %s",dst,strerror(errno));
+}
+
+static void sysconf_sync_config_dir(){
+    int fd = -1;
+    if ((fd = open(sysconf_get_config_dir(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) return;
+    if (fsync(fd)) {
+        warning("Failed to sync %s: %s",sysconf_get_config_dir(),strerror(errno));
+    }
+    close(fd);
 }
 
 static void sysconf_create_config_dir(void){
@@ -194,40 +258,382 @@ char *get_device_record_path(const char *udid){
     return filepath;
 }
 
+static bool record_get_macaddr(plist_t p_devrecord, std::string &macaddr){
+    plist_t p_macaddr = NULL;
+    const char *str = NULL;
+    uint64_t str_len = 0;
+    if (!(p_macaddr = plist_dict_get_item(p_devrecord, "WiFiMACAddress"))) return false;
+    if (!(str = plist_get_string_ptr(p_macaddr, &str_len))) return false;
+    macaddr = std::string(str,str_len);
+    return true;
+}
+
+static void record_cache_erase(const std::string &udid){ //needs gRecordsLck
+    auto c = gRecordCache.find(udid);
+    if (c != gRecordCache.end()) {
+        safeFreeCustom(c->second.record, plist_free);
+        gRecordCache.erase(c);
+    }
+}
+
+static void record_cache_clear(){ //needs gRecordsLck
+    for (auto &c : gRecordCache) {
+        safeFreeCustom(c.second.record, plist_free);
+    }
+    gRecordCache.clear();
+}
+
+#ifdef HAVE_SYS_INOTIFY_H
+static void sysconf_record_watcher(int ifd){
+    alignas(struct inotify_event) char buf[0x1000];
+    while (true) {
+        ssize_t len = read(ifd, buf, sizeof(buf));
+        if (len < 0 && errno == EINTR) continue;
+        if (len <= 0) {
+            error("Watching pair records failed, disabling pair record cache");
+            break;
+        }
+        std::unique_lock<std::mutex> ul(gRecordsLck);
+        for (char *ptr = buf; ptr < buf + len; ) {
+            struct inotify_event *ev = (struct inotify_event *)ptr;
+            ptr += sizeof(struct inotify_event) + ev->len;
+            if (ev->mask & IN_IGNORED) {
+                error("Pair record directory went away, disabling pair record cache");
+                goto stop;
+            } else if (ev->mask & IN_Q_OVERFLOW) {
+                record_cache_clear();
+            } else if (ev->len) {
+                std::string name = ev->name;
+                size_t dotPos = name.rfind(".plist");
+                if (dotPos == std::string::npos || dotPos + sizeof(".plist")-1 != name.size()) continue; //ignore temporary files
+                record_cache_erase(name.substr(0,dotPos));
+            }
+            gRecordGen++;
+            gKnownMacAddrsValid = false;
+        }
+    }
+stop:
+    std::unique_lock<std::mutex> ul(gRecordsLck);
+    gRecordCacheEnabled = false;
+    record_cache_clear();
+    gRecordGen++;
+    close(ifd);
+}
+#endif //HAVE_SYS_INOTIFY_H
+
+static std::map<std::string,pendingRecord>::iterator record_next_pending(){ //needs gRecordsLck
+    auto ret = gPendingRecords.end();
+    for (auto p = gPendingRecords.begin(); p != gPendingRecords.end(); p++) {
+        if (ret == gPendingRecords.end() || p->second.retryAt < ret->second.retryAt) ret = p;
+    }
+    return ret;
+}
+
+static void sysconf_record_writer(){
+    while (true) {
+        {
+            std::unique_lock<std::mutex> ul(gRecordsLck);
+            while (true) {
+                auto p = record_next_pending();
+                if (p == gPendingRecords.end()) {
+                    gRecordsCond.wait(ul);
+                } else if (p->second.retryAt > std::chrono::steady_clock::now()) {
+                    auto retryAt = p->second.retryAt; //p may be gone once we wait
+                    gRecordsCond.wait_until(ul, retryAt);
+                } else {
+                    break;
+                }
+            }
+        }
+        //don't let sysconf_remove_device_record() interleave with writing
+        std::unique_lock<std::mutex> wl(gRecordWriteLck);
+        std::string udid;
+        plist_t record = NULL;
+        uint64_t seq = 0;
+        char *filepath = NULL;
+        std::string tmppath;
+        cleanup([&]{
+            safeFreeCustom(record, plist_free);
+            safeFree(filepath);
+        });
+        {
+            std::unique_lock<std::mutex> ul(gRecordsLck);
+            auto p = record_next_pending();
+            if (p == gPendingRecords.end() || p->second.retryAt > std::chrono::steady_clock::now()) continue; //changed in the meantime
+            udid = p->first;
+            record = plist_copy(p->second.record);
+            seq = p->second.seq;
+        }
+
+        bool didWrite = false;
+        try {
+            filepath = get_device_record_path(udid.c_str());
+            tmppath = std::string(filepath) + ".tmp";
+            writePlistToFile(record, tmppath.c_str());
+            retassure(!rename(tmppath.c_str(), filepath), "Failed to rename %s: %s",tmppath.c_str(),strerror(errno));
+            didWrite = true;
+            sysconf_sync_config_dir();
+        } catch (tihmstar::exception &e) {
+            error("Failed to write pair record for %s with error=%d (%s)",udid.c_str(),e.code(),e.what());
+            if (tmppath.size()) unlink(tmppath.c_str());
+        }
+
+        {
+            std::unique_lock<std::mutex> ul(gRecordsLck);
+            auto p = gPendingRecords.find(udid);
+            if (p != gPendingRecords.end() && p->second.seq == seq) {
+                //not saved again in the meantime
+                if (didWrite) {
+                    record_cache_erase(udid);
+                    if (gRecordCacheEnabled) {
+                        gRecordCache[udid] = {p->second.record, p->second.response};
+                    } else {
+                        plist_free(p->second.record);
+                    }
+                    gPendingRecords.erase(p);
+                    gRecordGen++;
+                } else {
+                    //keep serving it from memory and try again later
+                    uint32_t delay = RECORD_RETRY_MAX_SEC;
+                    if (p->second.failures < 6) delay = std::min<uint32_t>(1u << p->second.failures, RECORD_RETRY_MAX_SEC);
+                    p->second.failures++;
+                    p->second.retryAt = std::chrono::steady_clock::now() + std::chrono::seconds(delay);
+                    error("Retrying to write pair record for %s in %u seconds",udid.c_str(),delay);
+                }
+            }
+        }
+        gRecordsCond.notify_all();
+    }
+}
+
+static void sysconf_start_record_threads(){
+    std::call_once(gRecordThreadsOnce, []{
+#ifdef HAVE_SYS_INOTIFY_H
+        int ifd = -1;
+        sysconf_create_config_dir();
+        if ((ifd = inotify_init1(IN_CLOEXEC)) < 0) {
+            error("Failed to init inotify, pair records won't be cached");
+        } else if (inotify_add_watch(ifd, sysconf_get_config_dir(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE) < 0) {
+            error("Failed to watch %s, pair records won't be cached",sysconf_get_config_dir());
+            close(ifd);
+        } else {
+            gRecordCacheEnabled = true;
+            std::thread watcher(sysconf_record_watcher, ifd);
+            watcher.detach();
+        }
+#endif //HAVE_SYS_INOTIFY_H
+        std::thread writer(sysconf_record_writer);
+        writer.detach();
+    });
+}
+
 plist_t sysconf_get_device_record(const char *udid){
     char *filepath = NULL;
+    plist_t p_devrecord = NULL;
     cleanup([&]{
         safeFree(filepath);
+        safeFreeCustom(p_devrecord, plist_free);
     });
+    uint64_t gen = 0;
+    assure(udid);
+    sysconf_start_record_threads();
+
+    {
+        std::unique_lock<std::mutex> ul(gRecordsLck);
+        auto p = gPendingRecords.find(udid);
+        if (p != gPendingRecords.end()) {
+            return plist_copy(p->second.record);
+        }
+        auto c = gRecordCache.find(udid);
+        if (c != gRecordCache.end()) {
+            retassure(c->second.record, "Failed to read plist at path '%s/%s.plist'",sysconf_get_config_dir(),udid);
+            return plist_copy(c->second.record);
+        }
+        gen = gRecordGen;
+    }
+
     filepath = get_device_record_path(udid);
-    
-    return readPlist(filepath);
+    try {
+        p_devrecord = readPlist(filepath, NULL);
+    } catch (tihmstar::exception &e) {
+        //remember that there is no record
+    }
+
+    {
+        std::unique_lock<std::mutex> ul(gRecordsLck);
+        if (gRecordCacheEnabled && gen == gRecordGen) {
+            //nothing changed while we were reading
+            record_cache_erase(udid);
+            gRecordCache[udid] = {p_devrecord ? plist_copy(p_devrecord) : NULL, nullptr};
+        }
+    }
+    retassure(p_devrecord, "Failed to read plist at path '%s'",filepath);
+    {
+        plist_t ret = p_devrecord; p_devrecord = NULL;
+        return ret;
+    }
 }
 
 
-void sysconf_set_device_record(const char *udid, const plist_t record){
+static std::shared_ptr<const SerializedPlist> record_build_response(plist_t record, const std::string &bplist){
+    plist_t p_rsp = NULL;
+    char *plistbin = NULL;
+    uint32_t plistbin_len = 0;
+    cleanup([&]{
+        safeFreeCustom(p_rsp, plist_free);
+        safeFreeCustom(plistbin, plist_to_bin_free);
+    });
+
+    p_rsp = plist_new_dict();
+    if (bplist.size()) {
+        //the record is stored as binary plist already, send it as is
+        plist_dict_set_item(p_rsp, "PairRecordData", plist_new_data(bplist.data(), bplist.size()));
+    } else {
+        plist_to_bin(record, &plistbin, &plistbin_len);
+        assure(plistbin);
+        plist_dict_set_item(p_rsp, "PairRecordData", plist_new_data(plistbin, plistbin_len));
+    }
+    {
+        plist_t rsp = p_rsp; p_rsp = NULL; //SerializedPlist takes ownership, even if it throws
+        return std::make_shared<const SerializedPlist>(rsp);
+    }
+}
+
+std::shared_ptr<const SerializedPlist> sysconf_get_device_record_response(const char *udid){
     char *filepath = NULL;
-    std::string xmlRecord;
+    plist_t p_devrecord = NULL;
     cleanup([&]{
         safeFree(filepath);
+        safeFreeCustom(p_devrecord, plist_free);
     });
+    std::shared_ptr<const SerializedPlist> response = nullptr;
+    std::string bplist;
+    uint64_t gen = 0;
+    assure(udid);
+    sysconf_start_record_threads();
+
+    {
+        std::unique_lock<std::mutex> ul(gRecordsLck);
+        auto p = gPendingRecords.find(udid);
+        if (p != gPendingRecords.end()) {
+            if (!p->second.response) {
+                p->second.response = record_build_response(p->second.record, bplist);
+            }
+            return p->second.response;
+        }
+        auto c = gRecordCache.find(udid);
+        if (c != gRecordCache.end()) {
+            retassure(c->second.record, "Failed to read plist at path '%s/%s.plist'",sysconf_get_config_dir(),udid);
+            if (c->second.response) {
+                return c->second.response;
+            }
+            p_devrecord = plist_copy(c->second.record);
+        }
+        gen = gRecordGen;
+    }
+
+    if (!p_devrecord) {
+        filepath = get_device_record_path(udid);
+        try {
+            p_devrecord = readPlist(filepath, &bplist);
+        } catch (tihmstar::exception &e) {
+            //remember that there is no record
+        }
+    }
+    if (p_devrecord) {
+        response = record_build_response(p_devrecord, bplist);
+    }
+
+    {
+        std::unique_lock<std::mutex> ul(gRecordsLck);
+        if (gRecordCacheEnabled && gen == gRecordGen) {
+            //nothing changed while we were reading
+            record_cache_erase(udid);
+            gRecordCache[udid] = {p_devrecord, response}; p_devrecord = NULL; //transfer ownership
+        }
+    }
+    retassure(response, "Failed to read pair record of %s",udid);
+    return response;
+}
+
+void sysconf_set_device_record(const char *udid, const plist_t record){
+    std::string macaddr;
     assure(udid);
     assure(record);
-    filepath = get_device_record_path(udid);
-    
-    writePlistToFile(record, filepath);
-    sysconf_load_known_macaddrs();
+    sysconf_start_record_threads();
+
+    {
+        std::unique_lock<std::mutex> ul(gRecordsLck);
+        auto p = gPendingRecords.find(udid);
+        if (p != gPendingRecords.end()) {
+            safeFreeCustom(p->second.record, plist_free);
+            gPendingRecords.erase(p);
+        }
+        gPendingRecords[udid] = {plist_copy(record), nullptr, ++gPendingSeq, 0, std::chrono::steady_clock::now()};
+        record_cache_erase(udid);
+        gRecordGen++;
+
+        if (gKnownMacAddrsValid) {
+            for (auto m = gKnownMacAddrs.begin(); m != gKnownMacAddrs.end();) {
+                if (m->second == udid) m = gKnownMacAddrs.erase(m);
+                else m++;
+            }
+            if (record_get_macaddr(record, macaddr)) {
+                gKnownMacAddrs[macaddr] = udid;
+            }
+        }
+    }
+    gRecordsCond.notify_all();
 }
 
 void sysconf_remove_device_record(const char *udid){
     char *filepath = NULL;
+    bool hadPending = false;
     cleanup([&]{
         safeFree(filepath);
     });
+    assure(udid);
     filepath = get_device_record_path(udid);
-    
-    retassure(!remove(filepath), "could not remove %s: %s", filepath, strerror(errno));
-    sysconf_load_known_macaddrs();
+
+    std::unique_lock<std::mutex> wl(gRecordWriteLck); //make sure the writer won't recreate the file
+    {
+        std::unique_lock<std::mutex> ul(gRecordsLck);
+        auto p = gPendingRecords.find(udid);
+        if ((hadPending = (p != gPendingRecords.end()))) {
+            safeFreeCustom(p->second.record, plist_free);
+            gPendingRecords.erase(p);
+        }
+        record_cache_erase(udid);
+        gRecordGen++;
+        for (auto m = gKnownMacAddrs.begin(); m != gKnownMacAddrs.end();) {
+            if (m->second == udid) m = gKnownMacAddrs.erase(m);
+            else m++;
+        }
+    }
+    gRecordsCond.notify_all();
+
+    retassure(!remove(filepath) || (hadPending && errno == ENOENT), "could not remove %s: %s", filepath, strerror(errno));
+}
+
+void sysconf_flush_device_records(){
+    std::unique_lock<std::mutex> ul(gRecordsLck);
+    std::map<std::string,uint32_t> failures;
+    //retry failed records right away, but give up on those which fail once more
+    for (auto &p : gPendingRecords) {
+        p.second.retryAt = std::chrono::steady_clock::now();
+        failures[p.first] = p.second.failures;
+    }
+    gRecordsCond.notify_all();
+    gRecordsCond.wait(ul, [&]{
+        for (auto &p : gPendingRecords) {
+            auto f = failures.find(p.first);
+            if (p.second.failures == (f != failures.end() ? f->second : 0)) return false;
+        }
+        return true;
+    });
+    for (auto &p : gPendingRecords) {
+        error("Failed to write pair record for %s, it is lost",p.first.c_str());
+    }
 }
 
 
@@ -242,7 +648,7 @@ plist_t sysconf_get_value(const std::string &key){
     plist_t p_val = NULL;
     filepath = get_device_record_path(CONFIG_FILE);
     
-    p_devrecord = readPlist(filepath);
+    p_devrecord = readPlist(filepath, NULL);
     
     retassure(p_val = plist_dict_get_item(p_devrecord, key.c_str()), "Failed to get value for key '%s'",key.c_str());
 
@@ -259,7 +665,7 @@ void sysconf_set_value(const std::string &key, plist_t val){
     filepath = get_device_record_path(CONFIG_FILE);
     
     try {
-        p_sysconf = readPlist(filepath);
+        p_sysconf = readPlist(filepath, NULL);
     } catch (tihmstar::exception &e) {
         warning("%s: Reading %s failed! Regenerating!",__func__,CONFIG_FILE);
         p_sysconf = plist_new_dict();
@@ -307,44 +713,55 @@ static void sysconf_load_known_macaddrs(){
     for(auto& p : std::filesystem::directory_iterator(config_path)){
         if (p.path() == sysconfigpath)
             continue; //ignore sysconfig file
-        debug("reading file=%s\n",p.path().c_str());
+        std::string path = p.path();
+        if (path.size() < sizeof(".plist") || path.compare(path.size()-sizeof(".plist")+1, std::string::npos, ".plist") != 0)
+            continue; //ignore temporary files
+        debug("reading file=%s\n",path.c_str());
         try{ //we ignore any error happening in here
             plist_t p_devrecord = NULL;
             cleanup([&]{
                 safeFreeCustom(p_devrecord, plist_free);
             });
-            plist_t p_macaddr = NULL;
             std::string macaddr;
 
-            p_devrecord = readPlist(p.path().c_str());
-            
-            retassure(p_macaddr = plist_dict_get_item(p_devrecord, "WiFiMACAddress"), "Failed to read macaddr from pairing record");
-            
-            {
-                const char *str = NULL;
-                uint64_t str_len = 0;
-                retassure(str = plist_get_string_ptr(p_macaddr, &str_len), "Faile to get str ptr from MacAddress");
-                macaddr = std::string(str,str_len);
-            }
-            
-            std::string path = p.path();
-
             size_t lastSlashPos = path.find_last_of("/")+1;
             size_t dotPos = path.find(".");
 
             std::string uuid = path.substr(lastSlashPos,dotPos-lastSlashPos);
+
+            if (gPendingRecords.find(uuid) != gPendingRecords.end())
+                continue; //pending records are added below
+
+            p_devrecord = readPlist(path.c_str(), NULL);
+            
+            retassure(record_get_macaddr(p_devrecord, macaddr), "Failed to read macaddr from pairing record");
+
             debug("adding macaddr=%s for uuid=%s",macaddr.c_str(),uuid.c_str());
             
             gKnownMacAddrs[macaddr] = uuid;
-            
+
+            if (gRecordCacheEnabled && gRecordCache.find(uuid) == gRecordCache.end()) {
+                //we parsed it anyways
+                gRecordCache[uuid] = {p_devrecord, nullptr}; p_devrecord = NULL; //transfer ownership
+            }
         } catch (tihmstar::exception &e){
             debug("failed to read record with error=%d (%s)",e.code(),e.what());
         }
     }
+
+    for (auto &p : gPendingRecords) {
+        std::string macaddr;
+        if (record_get_macaddr(p.second.record, macaddr)) {
+            gKnownMacAddrs[macaddr] = p.first;
+        }
+    }
+    gKnownMacAddrsValid = true;
 }
 
 std::string sysconf_udid_for_macaddr(std::string macaddr){
-    if (!gKnownMacAddrs.size()){
+    sysconf_start_record_threads();
+    std::unique_lock<std::mutex> ul(gRecordsLck);
+    if (!gKnownMacAddrsValid){
         sysconf_load_known_macaddrs();
     }
     try{
@@ -369,6 +786,41 @@ void sysconf_fix_permissions(int uid, int gid){
 
 #pragma mark config
 
+/*
+ Per device RX limits live in the config file:
+ USBRXLimits = { <udid> = { MaxTransfers = <int>; MaxTransferSize = <int>; }; }
+ */
+bool sysconf_get_device_rx_limits(const char *udid, unsigned &maxTransfers, unsigned &maxTransferSize) noexcept{
+    plist_t p_limits = NULL;
+    cleanup([&]{
+        safeFreeCustom(p_limits, plist_free);
+    });
+    plist_t p_dev = NULL;
+    plist_t p_val = NULL;
+    bool found = false;
+    uint64_t val = 0;
+
+    try {
+        p_limits = sysconf_get_value("USBRXLimits");
+    } catch (tihmstar::exception &e) {
+        return false;
+    }
+    if (plist_get_node_type(p_limits) != PLIST_DICT || !(p_dev = plist_dict_get_item(p_limits, udid)) || plist_get_node_type(p_dev) != PLIST_DICT) {
+        return false;
+    }
+    if ((p_val = plist_dict_get_item(p_dev, "MaxTransfers")) && plist_get_node_type(p_val) == PLIST_UINT) {
+        plist_get_uint_val(p_val, &val);
+        maxTransfers = (unsigned)val;
+        found = true;
+    }
+    if ((p_val = plist_dict_get_item(p_dev, "MaxTransferSize")) && plist_get_node_type(p_val) == PLIST_UINT) {
+        plist_get_uint_val(p_val, &val);
+        maxTransferSize = (unsigned)val;
+        found = true;
+    }
+    return found;
+}
+
 
 bool sysconf_try_getconfig_bool(std::string key, bool defaultValue){
     plist_t p_boolVal = NULL;
@@ -393,7 +845,13 @@ Config::Config() :
 enableExit(false),
 daemonize(false),
 useLogfile(false),
-debugLevel(0)
+debugLevel(0),
+reactorThreads(0),
+clientQueueKB(1024),
+bringupWorkers(8),
+rxMaxTransfers(0),
+simulateDevices(0),
+captureSnaplen(0)
 {
     //empty
 }
@@ -11,13 +11,17 @@
 
 #include <string>
 #include <plist/plist.h>
+#include <memory>
+#include <SerializedPlist.hpp>
 
 constexpr const char *sysconf_get_config_dir();
 
 plist_t sysconf_get_device_record(const char *udid);
+std::shared_ptr<const SerializedPlist> sysconf_get_device_record_response(const char *udid); //ReadPairRecord response, shared between clients
 
 void sysconf_set_device_record(const char *udid, const plist_t record);
 void sysconf_remove_device_record(const char *udid);
+void sysconf_flush_device_records(); //blocks until all saved records were written to disk, or failed to once more
 
 std::string sysconf_get_system_buid();
 
@@ -25,6 +29,8 @@ std::string sysconf_udid_for_macaddr(std::string macaddr);
 
 void sysconf_fix_permissions(int uid, int gid);
 
+bool sysconf_get_device_rx_limits(const char *udid, unsigned &maxTransfers, unsigned &maxTransferSize) noexcept; //overrides from the config file, only touches values which are set there
+
 class Config{
 public:
 	//config
@@ -37,7 +43,15 @@ public:
 	bool daemonize;
 	bool useLogfile;
     int debugLevel;
+    int reactorThreads;
+    int clientQueueKB;
+    int bringupWorkers;
+    int rxMaxTransfers;
+    int simulateDevices;
+    int captureSnaplen;
 	std::string dropUser;
+	std::string statsSocket;
+	std::string captureFile;
 	
 	Config();
 	void load();
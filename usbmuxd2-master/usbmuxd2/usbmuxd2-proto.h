@@ -15,6 +15,9 @@ extern "C"{
     
 #include <stdint.h>
     
+    //set in plist requests by clients which accept binary plists and plain result packets
+#define USBMUXD_BPLIST_CAPABILITY "kUSBMuxBinaryPlist"
+    
     enum usbmuxd_result {
         RESULT_OK = 0,
         RESULT_BADCOMMAND = 1,